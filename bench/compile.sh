@@ -0,0 +1,31 @@
+#!/bin/sh
+# compiling 200,000 generated statements in a single pass and through the
+# optimizing ir (the processor time of the whole run, which is mostly the
+# compile)
+#
+#   sh bench/compile.sh build/clox-bench [options]
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+awk 'BEGIN {
+  print "var x = 1;"
+  print "var y = 2;"
+  for (i = 0; i < 200000; i++) {
+    print "x = (x * 3 + y * 2 - 1) / (y + 1) + " i " * 0.5;"
+  }
+  print "print clock();"
+}' > "$script"
+
+for mode in "" --optimize; do
+  best=
+  for run in $(seq "${RUNS:-5}"); do
+    # shellcheck disable=SC2086
+    took=$("$@" $mode "$script" 2>&1 | tail -n 1)
+    case $took in
+      '' | *[!0-9.e+-]*) best=failed; break ;;
+    esac
+    best=$(printf '%s\n' $best "$took" | sort -g | head -n 1)
+  done
+  echo "compile 200k statements$(echo " $mode" | sed 's/ *$//') $best"
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+# the same work split over 8 isolates with a pool of 1, 2, 4 and 8 threads:
+# each isolate gets a frozen 500,000 element partition and adds up a
+# function of its elements in a loop. clock() counts every thread's
+# processor time, so this is the wall clock time of the whole run
+#
+#   sh bench/isolates.sh build/clox-bench [options]
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/worker.lox" <<'LOX'
+var values = receive(parent);
+var sum = 0;
+for (var i = 0; i < values.count(); i = i + 1) {
+  var x = values[i];
+  sum = sum + x * x - x / 2;
+}
+send(parent, sum);
+LOX
+
+cat > "$dir/main.lox" <<LOX
+var workers = map();
+for (var part = 0; part < 8; part = part + 1) {
+  workers[part] = isolate("$dir/worker.lox");
+  send(workers[part], array(500000, part).freeze());
+}
+var total = 0;
+for (var part = 0; part < 8; part = part + 1) total = total + receive(workers[part]);
+print total;
+LOX
+
+for threads in 1 2 4 8; do
+  best=
+  for run in $(seq "${RUNS:-5}"); do
+    start=$(date +%s%N)
+    if "$@" --isolate-threads=$threads "$dir/main.lox" > /dev/null 2>&1; then
+      took=$(echo "$start $(date +%s%N)" | awk '{ printf "%.3f", ($2 - $1) / 1e9 }')
+    else
+      best=failed
+      break
+    fi
+    best=$(printf '%s\n' $best "$took" | sort -g | head -n 1)
+  done
+  echo "isolates 8 parts threads=$threads $best"
+done
@@ -0,0 +1,237 @@
+// the swiss table maps (map.c) against a simple chained hash table with
+// the same keys, hash and allocator, on an insert-heavy and a lookup-heavy
+// workload, in nanoseconds per operation
+//
+//   build/map-bench [keys...]
+//
+// for each number of keys (default 1000, 16384 and 262144), with int and
+// with string keys:
+//
+// - insert: n new keys into an empty table, which grows as it goes
+// - lookup: 2n lookups into a table of n keys, half of them misses,
+//   repeated until about 16M lookups are done
+//
+// each is the best of three rounds.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// the map itself, for its hash and key rules
+#include "map.c"
+
+// lookups each lookup measurement does, about
+#define LOOKUPS (1 << 22)
+
+#define ROUNDS 3
+
+// a chained table: an array of buckets, each a linked list of nodes. it
+// doubles the buckets when it has as many keys
+typedef struct Node {
+  Value key;
+  Value value;
+  uint64_t hash;
+  struct Node* next;
+} Node;
+
+typedef struct {
+  Node** buckets;
+  int capacity;
+  int count;
+} ChainedTable;
+
+// the link pointing at key's node, or at the NULL ending its bucket
+static Node** chainedFind(ChainedTable* table, Value key, uint64_t hash) {
+  Node** link = &table->buckets[hash & (uint64_t) (table->capacity - 1)];
+  while (*link != NULL && ((*link)->hash != hash || !keysEqual((*link)->key, key))) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static void chainedGrow(ChainedTable* table) {
+  int capacity = GROW_CAPACITY(table->capacity);
+  Node** buckets = ALLOCATE(Node*, capacity);
+  for (int i = 0; i < capacity; i++) buckets[i] = NULL;
+
+  for (int i = 0; i < table->capacity; i++) {
+    Node* node = table->buckets[i];
+    while (node != NULL) {
+      Node* next = node->next;
+      Node** bucket = &buckets[node->hash & (uint64_t) (capacity - 1)];
+      node->next = *bucket;
+      *bucket = node;
+      node = next;
+    }
+  }
+  FREE_ARRAY(Node*, table->buckets, table->capacity);
+  table->buckets = buckets;
+  table->capacity = capacity;
+}
+
+static void chainedSet(VM* vm, ChainedTable* table, Value key, Value value) {
+  normalKey(vm, key, true, &key);
+  uint64_t hash = hashKey(key);
+  if (table->count >= table->capacity) chainedGrow(table);
+
+  Node** link = chainedFind(table, key, hash);
+  if (*link == NULL) {
+    Node* node = ALLOCATE(Node, 1);
+    node->key = key;
+    node->hash = hash;
+    node->next = NULL;
+    *link = node;
+    table->count++;
+  }
+  (*link)->value = value;
+}
+
+static bool chainedGet(VM* vm, ChainedTable* table, Value key, Value* value) {
+  if (table->count == 0 || !normalKey(vm, key, false, &key)) return false;
+  Node* node = *chainedFind(table, key, hashKey(key));
+  if (node == NULL) return false;
+  *value = node->value;
+  return true;
+}
+
+static void freeChained(ChainedTable* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Node* node = table->buckets[i];
+    while (node != NULL) {
+      Node* next = node->next;
+      FREE(Node, node);
+      node = next;
+    }
+  }
+  FREE_ARRAY(Node*, table->buckets, table->capacity);
+}
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+// a table of either kind
+typedef struct {
+  ObjMap* map; // NULL for the chained table
+  ChainedTable chained;
+} Subject;
+
+static void subjectSet(VM* vm, Subject* subject, Value key, Value value) {
+  if (subject->map != NULL) {
+    mapSet(vm, subject->map, key, value);
+  } else {
+    chainedSet(vm, &subject->chained, key, value);
+  }
+}
+
+static bool subjectGet(VM* vm, Subject* subject, Value key, Value* value) {
+  if (subject->map != NULL) return mapGet(vm, subject->map, key, value);
+  return chainedGet(vm, &subject->chained, key, value);
+}
+
+// a new empty table (a map is pushed so the gc keeps it)
+static Subject newSubject(VM* vm, bool swiss) {
+  Subject subject = {NULL, {NULL, 0, 0}};
+  if (swiss) {
+    subject.map = newMap(vm);
+    push(vm, OBJ_VAL(subject.map));
+  }
+  return subject;
+}
+
+static void freeSubject(VM* vm, Subject* subject) {
+  if (subject->map != NULL) {
+    pop(vm);
+  } else {
+    freeChained(&subject->chained);
+  }
+}
+
+// ns per insert and per lookup for one kind of table, keys holds 2n keys
+// (the second half are the misses). returns how many lookups hit
+static long measure(VM* vm, bool swiss, Value* keys, int count, double* insert, double* lookup) {
+  *insert = *lookup = 0;
+  int repeats = LOOKUPS / (2 * count) + 1;
+  long found = 0;
+
+  for (int round = 0; round < ROUNDS; round++) {
+    Subject subject = newSubject(vm, swiss);
+    double start = now();
+    for (int i = 0; i < count; i++) subjectSet(vm, &subject, keys[i], INT_VAL(i));
+    double inserted = now();
+
+    // hits and misses interleaved in an order unrelated to insertion
+    Value value;
+    for (int repeat = 0; repeat < repeats; repeat++) {
+      for (int i = 0; i < 2 * count; i++) {
+        found += subjectGet(vm, &subject, keys[(int) (((int64_t) i * 7919) % (2 * count))], &value);
+      }
+    }
+    double looked = now();
+    freeSubject(vm, &subject);
+
+    double insertTime = (inserted - start) / count * 1e9;
+    double lookupTime = (looked - inserted) / ((double) repeats * 2 * count) * 1e9;
+    if (round == 0 || insertTime < *insert) *insert = insertTime;
+    if (round == 0 || lookupTime < *lookup) *lookup = lookupTime;
+  }
+  return found;
+}
+
+// measure both tables on count int or string keys
+static void compare(VM* vm, int count, bool strings) {
+  // the keys are kept in a map of their own so the gc leaves them alone
+  ObjMap* keep = newMap(vm);
+  push(vm, OBJ_VAL(keep));
+  Value* keys = malloc(sizeof(Value) * 2 * (size_t) count);
+  for (int i = 0; i < 2 * count; i++) {
+    if (strings) {
+      char chars[32];
+      int length = snprintf(chars, sizeof(chars), "key %d", i);
+      keys[i] = OBJ_VAL(copyString(vm, chars, length));
+      mapSet(vm, keep, keys[i], NIL_VAL);
+    } else {
+      keys[i] = INT_VAL((int32_t) ((uint32_t) i * 2654435761u));
+    }
+  }
+
+  double swissInsert, swissLookup, chainedInsert, chainedLookup;
+  long swissFound = measure(vm, true, keys, count, &swissInsert, &swissLookup);
+  long chainedFound = measure(vm, false, keys, count, &chainedInsert, &chainedLookup);
+  if (swissFound != chainedFound) {
+    fprintf(stderr, "The tables found %ld and %ld keys.\n", swissFound, chainedFound);
+    exit(1);
+  }
+  printf("%-7s %8d   insert %7.1f %7.1f   lookup %7.1f %7.1f\n", strings ? "string" : "int",
+         count, swissInsert, chainedInsert, swissLookup, chainedLookup);
+
+  free(keys);
+  pop(vm);
+}
+
+int main(int argc, char* argv[]) {
+  VM vm;
+  initVM(&vm);
+
+  static const int defaults[] = {1000, 16384, 262144};
+  int sizeCount = argc > 1 ? argc - 1 : (int) (sizeof(defaults) / sizeof(defaults[0]));
+
+  printf("ns per operation, swiss table then chained table\n");
+  for (int strings = 0; strings <= 1; strings++) {
+    for (int i = 0; i < sizeCount; i++) {
+      int count = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+      if (count < 1) {
+        fprintf(stderr, "Number of keys must be positive.\n");
+        return 1;
+      }
+      compare(&vm, count, strings);
+    }
+  }
+
+  freeVM(&vm);
+  return 0;
+}
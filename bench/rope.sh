@@ -0,0 +1,30 @@
+#!/bin/sh
+# concatenating chains of 10^4, 10^5 and 10^6 string literals in one
+# expression, which takes time linear in their number
+#
+#   sh bench/rope.sh build/clox-bench [options]
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+for terms in 10000 100000 1000000; do
+  awk -v terms=$terms 'BEGIN {
+    print "var start = clock();"
+    printf "var s = \"abcdefgh\""
+    for (i = 1; i < terms; i++) printf " + \"abcdefgh\""
+    print ";"
+    print "var strings = map();"
+    print "strings[s] = true;"
+    print "print clock() - start;"
+  }' > "$script"
+
+  best=
+  for run in $(seq "${RUNS:-5}"); do
+    took=$("$@" "$script" 2>&1 | tail -n 1)
+    case $took in
+      '' | *[!0-9.e+-]*) best=failed; break ;;
+    esac
+    best=$(printf '%s\n' $best "$took" | sort -g | head -n 1)
+  done
+  echo "rope chain of $terms $best"
+done
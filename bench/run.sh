@@ -0,0 +1,65 @@
+#!/bin/sh
+# run the benchmarks with one or more interpreters built without the trace,
+# one column of seconds each (the best of $RUNS runs, 5 by default)
+#
+#   sh bench/run.sh build/clox-bench ["build/clox-bench --optimize" ...]
+#
+# an interpreter may be followed by options to run every benchmark with.
+#
+# a .lox benchmark prints the seconds it took (from clock()) as its last
+# line. every "// args: <options>" line in it is another way to run it
+# (without one it runs once, without options).
+#
+# a .sh benchmark is run with the interpreter and its options as its
+# arguments and prints a line of "<name> <seconds>" for every measurement
+# it makes.
+
+runs=${RUNS:-5}
+bench=$(dirname "$0")
+results=$(mktemp -d)
+trap 'rm -rf "$results"' EXIT
+
+# the interpreters, absolute so .sh benchmarks can run them from anywhere
+column=0
+for command in "$@"; do
+  clox=${command%% *}
+  common=${command#"$clox"}
+  case $clox in
+    /*) ;;
+    *) clox=$(pwd)/$clox ;;
+  esac
+  column=$((column + 1))
+
+  for script in "$bench"/*.lox; do
+    [ -f "$script" ] || continue
+    name=$(basename "$script" .lox)
+    args=$(sed -n 's|.*// args: *||p' "$script")
+    [ -n "$args" ] || args=" "
+    printf '%s\n' "$args" | while IFS= read -r options; do
+      best=
+      for run in $(seq "$runs"); do
+        # shellcheck disable=SC2086
+        took=$("$clox" $common $options "$script" 2>&1 | tail -n 1)
+        case $took in
+          '' | *[!0-9.e+-]*) best=failed; break ;;
+        esac
+        best=$(printf '%s\n' $best "$took" | sort -g | head -n 1)
+      done
+      echo "$name$(echo " $options" | sed 's/ *$//') $best"
+    done >> "$results/$column"
+  done
+
+  for script in "$bench"/*.sh; do
+    [ "$(basename "$script")" != run.sh ] || continue
+    # shellcheck disable=SC2086
+    RUNS=$runs sh "$script" "$clox" $common >> "$results/$column"
+  done
+done
+
+# a line per measurement, the name then each interpreter's seconds
+awk '
+  { name = $1; for (i = 2; i < NF; i++) name = name " " $i }
+  FNR == NR { order[++count] = name }
+  { times[name] = times[name] sprintf(" %10s", $NF) }
+  END { for (i = 1; i <= count; i++) printf "%-36s%s\n", order[i], times[order[i]] }
+' "$results"/*
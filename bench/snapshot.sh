@@ -0,0 +1,53 @@
+#!/bin/sh
+# startup with a generated prelude (16 classes, 25 functions, 20,000
+# instances and fib(25), about 35KB of source): the processor time when the
+# job's first instruction runs, after running the prelude and after loading
+# its snapshot instead, next to an empty script
+#
+#   sh bench/snapshot.sh build/clox-bench [options]
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+  for (c = 0; c < 16; c++) {
+    print "class C" c " {"
+    print "  init(a) { this.a = a; this.b = a * 2; }"
+    for (m = 0; m < 10; m++) {
+      print "  m" m "(x) { var t = x * " m + 1 " + this.a; if (t > 100) return t - this.b; return t + " m "; }"
+    }
+    print "}"
+  }
+  for (f = 0; f < 25; f++) {
+    printf "fun f" f "(a, b) { var s = 0; for (var i = 0; i < a; i = i + 1) {"
+    for (k = 0; k < 12; k++) {
+      printf " s = s + i * b + " f + k "; if (s > 1000) s = s - 1000; else s = s + " k ";"
+    }
+    print " } return s; }"
+  }
+  print "class Node { init(v, next) { this.v = v; this.next = next; } }"
+  print "var table = nil;"
+  print "for (var i = 0; i < 20000; i = i + 1) table = Node(C7(i).m1(i), table);"
+  print "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }"
+  print "var fib25 = fib(25);"
+}' > "$dir/prelude.lox"
+echo "print clock();" > "$dir/job.lox"
+cat "$dir/prelude.lox" "$dir/job.lox" > "$dir/both.lox"
+"$@" --write-snapshot="$dir/prelude.snap" "$dir/prelude.lox"
+
+# best of the runs of the interpreter with these arguments
+best() {
+  best=
+  for run in $(seq "${RUNS:-5}"); do
+    took=$("$@" 2>&1 | tail -n 1)
+    case $took in
+      '' | *[!0-9.e+-]*) best=failed; break ;;
+    esac
+    best=$(printf '%s\n' $best "$took" | sort -g | head -n 1)
+  done
+  echo "$best"
+}
+
+echo "startup empty script $(best "$@" "$dir/job.lox")"
+echo "startup running the prelude $(best "$@" "$dir/both.lox")"
+echo "startup from its snapshot $(best "$@" --snapshot="$dir/prelude.snap" "$dir/job.lox")"
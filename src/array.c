@@ -0,0 +1,393 @@
+#include <limits.h>
+#include <string.h>
+
+#include "array.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// a vector register's worth of doubles and the mask a comparison of two gives
+// (16 bytes is what every x86-64 and arm64 target has, gcc splits or widens
+// the operations as the target allows)
+typedef double Lanes __attribute__((vector_size(16)));
+typedef int64_t LaneMask __attribute__((vector_size(16)));
+#define LANES ((int) (sizeof(Lanes) / sizeof(double)))
+
+// unaligned loads and stores (the compiler turns these into single moves)
+static inline Lanes load(const double* values) {
+  Lanes lanes;
+  memcpy(&lanes, values, sizeof(lanes));
+  return lanes;
+}
+
+static inline void store(double* values, Lanes lanes) {
+  memcpy(values, &lanes, sizeof(lanes));
+}
+
+static inline Lanes splat(double value) {
+  Lanes lanes;
+  for (int i = 0; i < LANES; i++) lanes[i] = value;
+  return lanes;
+}
+
+// the lanes of a where mask is set, else those of b
+static inline Lanes blend(LaneMask mask, Lanes a, Lanes b) {
+  return (Lanes) ((mask & (LaneMask) a) | (~mask & (LaneMask) b));
+}
+
+static double sumKernel(const double* values, int count) {
+  // several accumulators so the additions don't wait on each other
+  Lanes sum0 = splat(0), sum1 = splat(0), sum2 = splat(0), sum3 = splat(0);
+  int i = 0;
+  for (; i + 4 * LANES <= count; i += 4 * LANES) {
+    sum0 += load(values + i);
+    sum1 += load(values + i + LANES);
+    sum2 += load(values + i + 2 * LANES);
+    sum3 += load(values + i + 3 * LANES);
+  }
+  for (; i + LANES <= count; i += LANES) sum0 += load(values + i);
+
+  Lanes lanes = (sum0 + sum1) + (sum2 + sum3);
+  double sum = 0;
+  for (int j = 0; j < LANES; j++) sum += lanes[j];
+  for (; i < count; i++) sum += values[i];
+  return sum;
+}
+
+// min and max keep the first of equal elements and skip nans after the first
+// element, just like the loop "if (x < m) m = x" (count must be at least 1)
+static double minKernel(const double* values, int count) {
+  Lanes lanes = splat(values[0]);
+  int i = 1;
+  for (; i + LANES <= count; i += LANES) {
+    Lanes next = load(values + i);
+    lanes = blend(next < lanes, next, lanes);
+  }
+
+  double min = lanes[0];
+  for (int j = 1; j < LANES; j++) {
+    if (lanes[j] < min) min = lanes[j];
+  }
+  for (; i < count; i++) {
+    if (values[i] < min) min = values[i];
+  }
+  return min;
+}
+
+static double maxKernel(const double* values, int count) {
+  Lanes lanes = splat(values[0]);
+  int i = 1;
+  for (; i + LANES <= count; i += LANES) {
+    Lanes next = load(values + i);
+    lanes = blend(next > lanes, next, lanes);
+  }
+
+  double max = lanes[0];
+  for (int j = 1; j < LANES; j++) {
+    if (lanes[j] > max) max = lanes[j];
+  }
+  for (; i < count; i++) {
+    if (values[i] > max) max = values[i];
+  }
+  return max;
+}
+
+static double dotKernel(const double* a, const double* b, int count) {
+  Lanes sum0 = splat(0), sum1 = splat(0);
+  int i = 0;
+  for (; i + 2 * LANES <= count; i += 2 * LANES) {
+    sum0 += load(a + i) * load(b + i);
+    sum1 += load(a + i + LANES) * load(b + i + LANES);
+  }
+  for (; i + LANES <= count; i += LANES) sum0 += load(a + i) * load(b + i);
+
+  Lanes lanes = sum0 + sum1;
+  double sum = 0;
+  for (int j = 0; j < LANES; j++) sum += lanes[j];
+  for (; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+static void addKernel(double* out, const double* a, const double* b, int count) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) store(out + i, load(a + i) + load(b + i));
+  for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static void mulKernel(double* out, const double* a, const double* b, int count) {
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) store(out + i, load(a + i) * load(b + i));
+  for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+static void scaleKernel(double* out, const double* a, double k, int count) {
+  Lanes lanes = splat(k);
+  int i = 0;
+  for (; i + LANES <= count; i += LANES) store(out + i, load(a + i) * lanes);
+  for (; i < count; i++) out[i] = a[i] * k;
+}
+
+// copy the elements e for which "e op limit" holds to out, returns how many
+// every element is written and the write position only moves past the kept
+// ones, so there is no branch on the data (out may not overlap values)
+#define FILTER(op) \
+  do { \
+    Lanes limits = splat(limit); \
+    for (; i + LANES <= count; i += LANES) { \
+      Lanes next = load(values + i); \
+      LaneMask mask = next op limits; \
+      for (int j = 0; j < LANES; j++) { \
+        out[kept] = next[j]; \
+        kept -= (int) mask[j]; \
+      } \
+    } \
+    for (; i < count; i++) { \
+      out[kept] = values[i]; \
+      kept += values[i] op limit; \
+    } \
+  } while (false)
+
+// comparison operators filter() takes
+typedef enum {
+  FILTER_LESS,
+  FILTER_LESS_EQUAL,
+  FILTER_GREATER,
+  FILTER_GREATER_EQUAL,
+  FILTER_EQUAL,
+  FILTER_NOT_EQUAL,
+} FilterOp;
+
+static int filterKernel(double* out, const double* values, int count,
+                        FilterOp op, double limit) {
+  int i = 0;
+  int kept = 0;
+  switch (op) {
+    case FILTER_LESS: FILTER(<); break;
+    case FILTER_LESS_EQUAL: FILTER(<=); break;
+    case FILTER_GREATER: FILTER(>); break;
+    case FILTER_GREATER_EQUAL: FILTER(>=); break;
+    case FILTER_EQUAL: FILTER(==); break;
+    case FILTER_NOT_EQUAL: FILTER(!=); break;
+  }
+  return kept;
+}
+
+#undef FILTER
+
+// the array a method was called on (the native's callee slot)
+#define RECEIVER(args) AS_ARRAY((args)[-1])
+
+// array(n) or array(n, x): a new array of n zeros (or n copies of x)
+static bool arrayNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 && argCount != 2) {
+    runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+    return false;
+  }
+
+  double length = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+  if (!(length >= 0 && length <= INT_MAX) || length != (double) (int) length) {
+    runtimeError(vm, "Array length must be a non-negative integer.");
+    return false;
+  }
+  if (argCount == 2 && !IS_NUMBER(args[1])) {
+    runtimeError(vm, "Array elements must be numbers.");
+    return false;
+  }
+
+  ObjArray* array = newArray(vm, (int) length);
+  if (argCount == 2) {
+    double fill = AS_NUMBER(args[1]);
+    for (int i = 0; i < array->count; i++) array->values[i] = fill;
+  }
+  args[-1] = OBJ_VAL(array);
+  return true;
+}
+
+// count(): number of elements
+static bool countMethod(VM* vm, int argCount, Value* args) {
+  args[-1] = INT_VAL(RECEIVER(args)->count);
+  return true;
+}
+
+// push(x): append x
+static bool pushMethod(VM* vm, int argCount, Value* args) {
+  if (!IS_NUMBER(args[0])) {
+    runtimeError(vm, "Array elements must be numbers.");
+    return false;
+  }
+
+  // the array stays on the stack while its values grow
+  ObjArray* array = RECEIVER(args);
+  if (array->shared != NULL) {
+    runtimeError(vm, "Array is frozen.");
+    return false;
+  }
+  if (array->count == array->capacity) {
+    if (array->capacity == INT_MAX) {
+      runtimeError(vm, "Array is too large.");
+      return false;
+    }
+    int capacity = array->capacity > INT_MAX / 2 ? INT_MAX : GROW_CAPACITY(array->capacity);
+    array->values = GROW_ARRAY(double, array->values, array->capacity, capacity);
+    array->capacity = capacity;
+  }
+  array->values[array->count++] = AS_NUMBER(args[0]);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+// freeze(): make the array immutable, returns the array
+static bool freezeMethod(VM* vm, int argCount, Value* args) {
+  freezeArray(RECEIVER(args));
+  return true;
+}
+
+// frozen(): whether the array was frozen
+static bool frozenMethod(VM* vm, int argCount, Value* args) {
+  args[-1] = BOOL_VAL(RECEIVER(args)->shared != NULL);
+  return true;
+}
+
+// sum(): total of the elements (0 for an empty array)
+static bool sumMethod(VM* vm, int argCount, Value* args) {
+  ObjArray* array = RECEIVER(args);
+  args[-1] = NUMBER_VAL(sumKernel(array->values, array->count));
+  return true;
+}
+
+// min(): smallest element
+static bool minMethod(VM* vm, int argCount, Value* args) {
+  ObjArray* array = RECEIVER(args);
+  if (array->count == 0) {
+    runtimeError(vm, "Can't take the min of an empty array.");
+    return false;
+  }
+  args[-1] = NUMBER_VAL(minKernel(array->values, array->count));
+  return true;
+}
+
+// max(): largest element
+static bool maxMethod(VM* vm, int argCount, Value* args) {
+  ObjArray* array = RECEIVER(args);
+  if (array->count == 0) {
+    runtimeError(vm, "Can't take the max of an empty array.");
+    return false;
+  }
+  args[-1] = NUMBER_VAL(maxKernel(array->values, array->count));
+  return true;
+}
+
+// check the argument of an element-wise method is an array as long as the receiver
+static bool sameLength(VM* vm, Value* args) {
+  if (!IS_ARRAY(args[0])) {
+    runtimeError(vm, "Argument must be an array.");
+    return false;
+  }
+  if (AS_ARRAY(args[0])->count != RECEIVER(args)->count) {
+    runtimeError(vm, "Arrays must have the same length.");
+    return false;
+  }
+  return true;
+}
+
+// dot(b): sum of the products of the elements of the array and b
+static bool dotMethod(VM* vm, int argCount, Value* args) {
+  if (!sameLength(vm, args)) return false;
+  ObjArray* array = RECEIVER(args);
+  args[-1] = NUMBER_VAL(dotKernel(array->values, AS_ARRAY(args[0])->values, array->count));
+  return true;
+}
+
+// add(b): a new array of the sums of the elements of the array and b
+static bool addMethod(VM* vm, int argCount, Value* args) {
+  if (!sameLength(vm, args)) return false;
+  // both operands are still on the stack while the result is allocated
+  ObjArray* array = RECEIVER(args);
+  ObjArray* result = newArray(vm, array->count);
+  addKernel(result->values, array->values, AS_ARRAY(args[0])->values, array->count);
+  args[-1] = OBJ_VAL(result);
+  return true;
+}
+
+// mul(b): a new array of the products of the elements of the array and b
+static bool mulMethod(VM* vm, int argCount, Value* args) {
+  if (!sameLength(vm, args)) return false;
+  ObjArray* array = RECEIVER(args);
+  ObjArray* result = newArray(vm, array->count);
+  mulKernel(result->values, array->values, AS_ARRAY(args[0])->values, array->count);
+  args[-1] = OBJ_VAL(result);
+  return true;
+}
+
+// scale(k): a new array of the elements times k
+static bool scaleMethod(VM* vm, int argCount, Value* args) {
+  if (!IS_NUMBER(args[0])) {
+    runtimeError(vm, "Scale must be a number.");
+    return false;
+  }
+  ObjArray* array = RECEIVER(args);
+  ObjArray* result = newArray(vm, array->count);
+  scaleKernel(result->values, array->values, AS_NUMBER(args[0]), array->count);
+  args[-1] = OBJ_VAL(result);
+  return true;
+}
+
+// the operator filter() was given, false if it isn't one
+static bool filterOp(Value value, FilterOp* op) {
+  if (!IS_STRING(value)) return false;
+  static const char* names[] = {
+    [FILTER_LESS] = "<",
+    [FILTER_LESS_EQUAL] = "<=",
+    [FILTER_GREATER] = ">",
+    [FILTER_GREATER_EQUAL] = ">=",
+    [FILTER_EQUAL] = "==",
+    [FILTER_NOT_EQUAL] = "!=",
+  };
+  for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+    if (strcmp(AS_CSTRING(value), names[i]) == 0) {
+      *op = (FilterOp) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// filter(op, x): a new array of the elements e for which e op x holds
+static bool filterMethod(VM* vm, int argCount, Value* args) {
+  FilterOp op;
+  if (!filterOp(args[0], &op)) {
+    runtimeError(vm, "Filter operator must be \"<\", \"<=\", \">\", \">=\", \"==\" or \"!=\".");
+    return false;
+  }
+  if (!IS_NUMBER(args[1])) {
+    runtimeError(vm, "Filter limit must be a number.");
+    return false;
+  }
+
+  // filter into room for every element, then give back what wasn't kept
+  ObjArray* array = RECEIVER(args);
+  ObjArray* result = newArray(vm, array->count);
+  int kept = filterKernel(result->values, array->values, array->count, op, AS_NUMBER(args[1]));
+  result->values = GROW_ARRAY(double, result->values, result->capacity, kept);
+  result->count = result->capacity = kept;
+  args[-1] = OBJ_VAL(result);
+  return true;
+}
+
+#undef RECEIVER
+
+void defineArrayNatives(VM* vm) {
+  defineNative(vm, "array", arrayNative, -1);
+  defineMethod(vm, &vm->arrayMethods, "count", countMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "push", pushMethod, 1);
+  defineMethod(vm, &vm->arrayMethods, "freeze", freezeMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "frozen", frozenMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "sum", sumMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "min", minMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "max", maxMethod, 0);
+  defineMethod(vm, &vm->arrayMethods, "dot", dotMethod, 1);
+  defineMethod(vm, &vm->arrayMethods, "add", addMethod, 1);
+  defineMethod(vm, &vm->arrayMethods, "mul", mulMethod, 1);
+  defineMethod(vm, &vm->arrayMethods, "scale", scaleMethod, 1);
+  defineMethod(vm, &vm->arrayMethods, "filter", filterMethod, 2);
+}
@@ -0,0 +1,32 @@
+#ifndef clox_array_h
+#define clox_array_h
+
+#include "common.h"
+
+// numeric arrays
+//
+// an array holds doubles unboxed and contiguously. array(n) makes one of
+// n zeros (array(n, x) fills it with x) and [1, 2, 3] one from literal
+// elements. a[i] and a[i] = x index it, and its methods do a whole
+// array's work in a single dispatch:
+//
+//   count(), push(x)
+//   freeze(), frozen()             see below
+//   sum(), min(), max(), dot(b)    reductions
+//   add(b), mul(b), scale(k)       element-wise, giving a new array
+//   filter(op, x)                  the elements e for which e op x holds
+//                                  (op is "<", "<=", ">", ">=", "==" or "!=")
+//
+// the bulk operations are simd kernels written with gcc's vector
+// extensions, so they use whatever vector instructions the target has.
+// reductions add in several lanes at once, so a sum can round differently
+// from adding the elements one by one.
+//
+// freeze() makes an array immutable for good (a[i] = x and push(x) are
+// runtime errors from then on) and returns it. sending a frozen array to
+// another isolate shares its values instead of copying them (see isolate.h).
+
+// define array() and the methods of arrays
+void defineArrayNatives(VM* vm);
+
+#endif
@@ -11,6 +11,9 @@ void initChunk(Chunk* chunk) {
   chunk->lineCount = 0;
   chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
   initValueArray(&chunk->constants);
 }
 
@@ -56,13 +59,25 @@ int addConstant(Chunk* chunk, Value value) {
 // write constant
 void writeConstant(Chunk* chunk, Value value, int line) {
   int index = addConstant(chunk, value);
+  writeConstantIndex(chunk, index, line);
+}
 
+// write instruction loading the constant at index
+void writeConstantIndex(Chunk* chunk, int index, int line) {
   // 1 byte can encode 256 different indices
   // if we have more than that in a code chunk we need to use a longer index size
   if (index <= UINT8_MAX) {
     // write a 1 byte constant
     writeChunk(chunk, OP_CONSTANT, line);
     writeChunk(chunk, (uint8_t)index, line); 
+  } else if (index > 0xffffff) {
+    // past 24 bits the index needs a wide operand
+    writeChunk(chunk, OP_WIDE, line);
+    writeChunk(chunk, OP_CONSTANT, line);
+    writeChunk(chunk, (uint8_t) ((index >> 24) & 0xff), line);
+    writeChunk(chunk, (uint8_t) ((index >> 16) & 0xff), line);
+    writeChunk(chunk, (uint8_t) ((index >> 8) & 0xff), line);
+    writeChunk(chunk, (uint8_t) (index & 0xff), line);
   } else {
     // write a longer byte constant
     writeChunk(chunk, OP_CONSTANT_LONG, line);
@@ -81,6 +96,190 @@ void writeConstant(Chunk* chunk, Value value, int line) {
   }
 }
 
+// add an empty inline cache, returns its index
+int addCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->count = 0;
+  cache->megamorphic = false;
+  return chunk->cacheCount++;
+}
+
+// 16 bit index operand, or 32 bit when wide
+static uint32_t readIndex(const uint8_t* code, bool wide) {
+  return wide ? readWideOperand(code) : readShortOperand(code);
+}
+
+// decode the instruction at offset
+bool decodeInstruction(Chunk* chunk, int offset, Instruction* instruction) {
+  const uint8_t* code = chunk->code + offset;
+  const uint8_t* end = chunk->code + chunk->count;
+  bool wide = code[0] == OP_WIDE;
+  if (wide && ++code == end) return false;
+
+  instruction->opcode = code[0];
+  instruction->wide = wide;
+  instruction->index = 0;
+  instruction->cache = 0;
+  instruction->byte = 0;
+  instruction->jump = 0;
+
+  // size of the operands, which are only read once they're known to fit
+  const uint8_t* operands = code + 1;
+  int indexSize = wide ? 4 : 2;
+  int size;
+  switch (code[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+    case OP_END_MODULE:
+    case OP_MEMO_RETURN:
+      size = 0;
+      break;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ARRAY:
+      size = 1;
+      break;
+    case OP_CONSTANT:
+      size = wide ? 4 : 1;
+      break;
+    case OP_CONSTANT_LONG:
+      size = 3;
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      size = indexSize;
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      size = 2 * indexSize;
+      break;
+    case OP_INVOKE:
+      size = 2 * indexSize + 1;
+      break;
+    case OP_SUPER_INVOKE:
+      size = indexSize + 1;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_LOOP:
+      size = 1;
+      break;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_JUMP_IF_TRUE_LONG:
+    case OP_POP_JUMP_IF_FALSE_LONG:
+    case OP_POP_JUMP_IF_TRUE_LONG:
+    case OP_LOOP_LONG:
+      size = wide ? 4 : 2;
+      break;
+    default:
+      return false;
+  }
+  if (end - operands < size) return false;
+
+  switch (code[0]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ARRAY:
+      if (wide) return false;
+      instruction->byte = operands[0];
+      break;
+    case OP_CONSTANT:
+      instruction->index = wide ? readWideOperand(operands) : operands[0];
+      break;
+    case OP_CONSTANT_LONG:
+      if (wide) return false;
+      instruction->index = readLongOperand(operands);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      instruction->index = readIndex(operands, wide);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      instruction->index = readIndex(operands, wide);
+      instruction->cache = readIndex(operands + indexSize, wide);
+      break;
+    case OP_INVOKE:
+      instruction->index = readIndex(operands, wide);
+      instruction->byte = operands[indexSize];
+      instruction->cache = readIndex(operands + indexSize + 1, wide);
+      break;
+    case OP_SUPER_INVOKE:
+      instruction->index = readIndex(operands, wide);
+      instruction->byte = operands[indexSize];
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_TRUE:
+      if (wide) return false;
+      instruction->jump = operands[0];
+      break;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_JUMP_IF_TRUE_LONG:
+    case OP_POP_JUMP_IF_FALSE_LONG:
+    case OP_POP_JUMP_IF_TRUE_LONG:
+      if (wide && readWideOperand(operands) > INT32_MAX) return false;
+      instruction->jump = wide ? (int32_t) readWideOperand(operands) : readShortOperand(operands);
+      break;
+    case OP_LOOP:
+      if (wide) return false;
+      instruction->jump = -operands[0];
+      break;
+    case OP_LOOP_LONG:
+      if (wide && readWideOperand(operands) > INT32_MAX) return false;
+      instruction->jump = -(wide ? (int32_t) readWideOperand(operands) : readShortOperand(operands));
+      break;
+    default:
+      // no operands, nothing to widen
+      if (wide) return false;
+      break;
+  }
+
+  instruction->length = (wide ? 2 : 1) + size;
+  return true;
+}
+
 // delete chunk and free memory
 void freeChunk(Chunk* chunk) {
   // free chunk
@@ -89,6 +288,9 @@ void freeChunk(Chunk* chunk) {
   // free lines array
   FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 
+  // free inline caches
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+
   // free value array
   freeValueArray(&chunk->constants);
 
@@ -10,6 +10,15 @@ typedef enum {
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
+  OP_POP,
+  OP_DEFINE_GLOBAL,
+  OP_GET_GLOBAL,
+  OP_SET_GLOBAL,
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  OP_GET_SUPER,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -19,9 +28,83 @@ typedef enum {
   OP_DIVIDE,
   OP_NOT,
   OP_NEGATE,
+  OP_PRINT,
+  OP_JUMP,
+  OP_JUMP_IF_FALSE, // leaves the condition on the stack (for and)
+  OP_LOOP,
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_INVOKE,
+  OP_SUPER_INVOKE,
   OP_RETURN,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  OP_ARRAY, // array of the count values on the stack (count is a byte operand)
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  // more jumps (kept after the others, which keeps their handlers where
+  // they were in run(), and the dispatch measured faster that way)
+  OP_JUMP_IF_TRUE, // leaves the condition on the stack (for or)
+  OP_POP_JUMP_IF_FALSE, // pops the condition (for if and loops)
+  OP_POP_JUMP_IF_TRUE,
+  OP_JUMP_LONG, // 16 bit offsets
+  OP_JUMP_IF_FALSE_LONG,
+  OP_JUMP_IF_TRUE_LONG,
+  OP_POP_JUMP_IF_FALSE_LONG,
+  OP_POP_JUMP_IF_TRUE_LONG,
+  OP_LOOP_LONG,
+  OP_END_MODULE, // end of a module's top level, which has no result
+  OP_MEMO_RETURN, // return of a memoized function, caching the result (see memo.h)
+  OP_WIDE, // prefix making the next instruction's index or jump operands 32 bits
 } OpCode;
 
+// operand encoding
+//
+// operands follow their opcode. name constants, global slots and inline
+// caches are 16 bits, big endian. OP_CONSTANT takes an 8 bit index and
+// OP_CONSTANT_LONG a 24 bit little endian one. jumps take an 8 bit offset
+// and their _LONG forms a 16 bit big endian one. an instruction whose index
+// operands (constants, names, globals, inline caches) don't fit is prefixed
+// with OP_WIDE, which makes each of them 32 bits, big endian. so is a _LONG
+// jump over more than 64KB of code, its offset becomes 32 bits (at most
+// INT32_MAX).
+//
+// these readers and decodeInstruction() are the only decoders of operands,
+// the vm, the disassembler and the verifier all go through them.
+
+static inline uint16_t readShortOperand(const uint8_t* code) {
+  return (uint16_t) ((code[0] << 8) | code[1]);
+}
+
+static inline uint32_t readLongOperand(const uint8_t* code) {
+  return (uint32_t) code[0] | ((uint32_t) code[1] << 8) | ((uint32_t) code[2] << 16);
+}
+
+static inline uint32_t readWideOperand(const uint8_t* code) {
+  return ((uint32_t) code[0] << 24) | ((uint32_t) code[1] << 16) |
+         ((uint32_t) code[2] << 8) | (uint32_t) code[3];
+}
+
+// shapes a single inline cache remembers before going megamorphic
+#define IC_ENTRIES 4
+
+// what an inline cache knows about one receiver shape
+typedef struct {
+  struct ObjShape* shape; // receiver shape this entry applies to
+  int slot; // field index, or -1 if the property is a method
+  struct ObjShape* transition; // shape after adding the field (set only), else NULL
+  struct ObjFunction* method; // method found in the class (get/invoke only)
+} CacheEntry;
+
+// inline cache for a property access site
+// entries are checked by shape pointer equality
+typedef struct {
+  int count;
+  bool megamorphic; // seen more than IC_ENTRIES shapes, always does a full lookup
+  CacheEntry entries[IC_ENTRIES];
+} InlineCache;
+
 // data structure for run-length line encoding
 typedef struct {
   int offset; // offset in Chunk
@@ -37,8 +120,22 @@ typedef struct {
   int lineCount;
   int lineCapacity;
   LineStart* lines; // array of lineStarts
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches; // inline caches used by property instructions
 } Chunk;
 
+// an instruction with its operands decoded
+typedef struct {
+  uint8_t opcode; // the instruction itself (never OP_WIDE)
+  bool wide; // had an OP_WIDE prefix
+  int length; // bytes taken, including any prefix
+  uint32_t index; // constant index, name constant or global slot
+  uint32_t cache; // inline cache index
+  uint8_t byte; // local slot, argument count or element count
+  int jump; // jump offset from the next instruction (negative for loops)
+} Instruction;
+
 // initialize an empty chunk
 void initChunk(Chunk* chunk);
 
@@ -52,6 +149,17 @@ int addConstant(Chunk* chunk, Value value);
 // write constant
 void writeConstant(Chunk* chunk, Value value, int line);
 
+// write instruction loading the constant at index
+void writeConstantIndex(Chunk* chunk, int index, int line);
+
+// add an empty inline cache, returns its index
+int addCache(Chunk* chunk);
+
+// decode the instruction at offset
+// returns false if it's unknown (or OP_WIDE is in front of an instruction
+// it doesn't widen) or its operands run past the end of the chunk
+bool decodeInstruction(Chunk* chunk, int offset, Instruction* instruction);
+
 // delete chunk and free memory
 void freeChunk(Chunk* chunk);
 
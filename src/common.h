@@ -5,6 +5,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// print every instruction as it runs (builds with -DNO_TRACE_EXECUTION don't)
+#ifndef NO_TRACE_EXECUTION
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// collect garbage as often as possible (to flush out gc bugs)
+// #define DEBUG_STRESS_GC
+
+// number of values a single byte operand can address
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// forward declaration so headers can take a VM* without including vm.h
+typedef struct VM VM;
 
 #endif
\ No newline at end of file
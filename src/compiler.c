@@ -1,17 +1,74 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "ir.h"
+#include "jumps.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
 #include "scanner.h"
+#include "table.h"
+#include "verify.h"
 
 typedef struct {
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  int depth; // levels of nesting being parsed (see enterNesting())
+  bool skipped; // the rest of the source was skipped, no more errors
+  Ir* ir; // optimizing ir for expressions (NULL to compile in a single pass)
 } Parser;
 
+// local variable
+typedef struct {
+  Token name;
+  int depth; // scope depth, -1 until initialized
+} Local;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_INITIALIZER, // init() method, returns this
+  TYPE_METHOD,
+  TYPE_SCRIPT, // top level code
+  TYPE_MODULE, // top level code of a module (see module.h)
+} FunctionType;
+
+// class whose body is being compiled
+typedef struct {
+  bool hasSuperclass;
+} ClassCompiler;
+
+// compilation state for a function
+typedef struct Compiler {
+  struct Compiler* enclosing; // compiler of the surrounding function
+  VM* vm;
+  ObjFunction* function; // function we are writing to
+  FunctionType type;
+
+  // locals in stack slot order (slot 0 holds the callee)
+  Local locals[UINT8_COUNT];
+  int localCount;
+  int scopeDepth; // 0 is global scope
+
+  int lastCall; // offset of the last OP_CALL emitted (-1 if none)
+
+  // purity (see memo.h): a call is only pure when its callee is a global
+  int globalRead; // offset just past the last OP_GET_GLOBAL emitted (-1 if none)
+  bool unknownCallee; // called something other than a global
+
+  // class of a method (this and super are only usable directly in methods
+  // since there are no closures to capture them in nested functions)
+  ClassCompiler* currentClass;
+
+  Table stringConstants; // interned string -> index in constants array
+
+  Ir* ir; // ir of the expression being built (NULL while emitting directly)
+} Compiler;
+
 typedef enum {
   PREC_NONE, // lowest precedence (evaluted last)
   PREC_ASSIGNMENT, // =
@@ -26,8 +83,16 @@ typedef enum {
   PREC_PRIMARY // highest precedence (evaluated first)
 } Precedence;
 
+// what a statement does with the value of its expression
+typedef enum {
+  USE_VALUE, // leave it on the stack
+  USE_DISCARD, // pop it
+  USE_RETURN, // return it (so the slots under it don't matter)
+  USE_CONDITION, // leave it on the stack unless it is a known constant
+} ExpressionUse;
+
 // function pointer type
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -40,11 +105,14 @@ typedef struct {
 void initParser(Parser* parser) {
   parser->hadError = false;
   parser->panicMode = false;
+  parser->depth = 0;
+  parser->skipped = false;
+  parser->ir = NULL;
 }
 
 static void errorAt(Parser* parser, Token* token, const char* message) {
   // if already in panic mode, just skip
-  if (parser->panicMode) return;
+  if (parser->panicMode || parser->skipped) return;
   
   // set parser to panic mode
   parser->panicMode = true;
@@ -90,6 +158,18 @@ static void advance(Scanner* scanner, Parser* parser) {
   }
 }
 
+// check if current token is type
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
+}
+
+// consume current token if it is type
+static bool match(Scanner* scanner, Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(scanner, parser);
+  return true;
+}
+
 static void consume(Scanner* scanner, Parser* parser, TokenType type, const char* message) {
   // if current token is type, consume and goto next token
   if (parser->current.type == type) {
@@ -101,99 +181,695 @@ static void consume(Scanner* scanner, Parser* parser, TokenType type, const char
   errorAtCurrent(parser, message);
 }
 
-// @param chunk pointer to chunk we are writing to [to]
+// start parsing a nested expression, statement or function
+// the parser recurses for each level, so past vm->maxNesting levels it
+// reports an error and skips the rest of the source (which would only
+// nest deeper) rather than run out of native stack. returns false then.
+static bool enterNesting(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  if (parser->depth >= compiler->vm->maxNesting) {
+    errorAtCurrent(parser, "Code nested too deeply.");
+    parser->skipped = true;
+    while (parser->current.type != TOKEN_EOF) advance(scanner, parser);
+    return false;
+  }
+  parser->depth++;
+  return true;
+}
+
+static void leaveNesting(Parser* parser) {
+  parser->depth--;
+}
+
+// initialize compiler and make it the vm's current compiler
+static void initCompiler(Compiler* compiler, Compiler* enclosing, VM* vm, Parser* parser, FunctionType type) {
+  compiler->enclosing = enclosing;
+  compiler->vm = vm;
+  compiler->function = NULL;
+  compiler->type = type;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->globalRead = -1;
+  compiler->unknownCallee = false;
+  compiler->currentClass = NULL;
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    compiler->currentClass = enclosing->currentClass;
+  }
+  initTable(&compiler->stringConstants);
+  compiler->ir = NULL;
+
+  // link in before allocating so the function is a gc root
+  vm->compiler = compiler;
+  compiler->function = newFunction(vm);
+  compiler->function->module = type == TYPE_MODULE;
+  if (type != TYPE_SCRIPT && type != TYPE_MODULE) {
+    // copying the name can promote the function so the store needs the barrier
+    compiler->function->name = copyString(vm, parser->previous.start, parser->previous.length);
+    writeBarrier(vm, (Obj*) compiler->function, OBJ_VAL(compiler->function->name));
+  }
+
+  // slot 0 holds the callee (or the receiver in methods)
+  Local* local = &compiler->locals[compiler->localCount++];
+  local->depth = 0;
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = "";
+    local->name.length = 0;
+  }
+}
+
+// chunk currently being compiled
+static Chunk* currentChunk(Compiler* compiler) {
+  return &compiler->function->chunk;
+}
+
+// @param compiler pointer to compiler holding the chunk we are writing to [to]
 // @param parser pointer to parser [from]
 // @param byte byte to write to chunk [what]
-static void emitByte(Chunk* chunk, Parser* parser, uint8_t byte) {
-  writeChunk(chunk, byte, parser->previous.line);
+static void emitByte(Compiler* compiler, Parser* parser, uint8_t byte) {
+  writeChunk(currentChunk(compiler), byte, parser->previous.line);
+}
+
+static void emitBytes(Compiler* compiler, Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(compiler, parser, byte1);
+  emitByte(compiler, parser, byte2);
+}
+
+// emit a 16 bit operand
+static void emitShort(Compiler* compiler, Parser* parser, uint16_t operand) {
+  emitByte(compiler, parser, (operand >> 8) & 0xff);
+  emitByte(compiler, parser, operand & 0xff);
+}
+
+// emit a backwards jump to loopStart
+static void emitLoop(Compiler* compiler, Parser* parser, int loopStart) {
+  emitByte(compiler, parser, OP_WIDE);
+  emitByte(compiler, parser, OP_LOOP_LONG);
+
+  // +4 skips over the operand itself
+  int offset = currentChunk(compiler)->count - loopStart + 4;
+  emitShort(compiler, parser, (uint16_t) (offset >> 16));
+  emitShort(compiler, parser, (uint16_t) (offset & 0xffff));
+}
+
+// emit a forward jump with a placeholder offset
+// jumps are emitted in their wide _LONG form, optimizeJumps() shortens them
+// returns the offset of the operand to patch
+static int emitJump(Compiler* compiler, Parser* parser, uint8_t instruction) {
+  emitByte(compiler, parser, OP_WIDE);
+  emitByte(compiler, parser, instruction);
+  emitShort(compiler, parser, 0xffff);
+  emitShort(compiler, parser, 0xffff);
+  return currentChunk(compiler)->count - 4;
+}
+
+// point a forward jump at the next instruction
+static void patchJump(Compiler* compiler, Parser* parser, int offset) {
+  // -4 skips over the operand itself
+  int jump = currentChunk(compiler)->count - offset - 4;
+
+  uint8_t* code = currentChunk(compiler)->code + offset;
+  code[0] = (jump >> 24) & 0xff;
+  code[1] = (jump >> 16) & 0xff;
+  code[2] = (jump >> 8) & 0xff;
+  code[3] = jump & 0xff;
 }
 
-static void emitBytes(Chunk* chunk, Parser* parser, uint8_t byte1, uint8_t byte2) {
-  emitByte(chunk, parser, byte1);
-  emitByte(chunk, parser, byte2);
+static void emitReturn(Compiler* compiler, Parser* parser) {
+  // a module's top level has nothing to return to
+  if (compiler->type == TYPE_MODULE) {
+    emitByte(compiler, parser, OP_END_MODULE);
+    return;
+  }
+
+  // initializers return this, other functions without a return statement return nil
+  if (compiler->type == TYPE_INITIALIZER) {
+    emitBytes(compiler, parser, OP_GET_LOCAL, 0);
+  } else {
+    emitByte(compiler, parser, OP_NIL);
+  }
+  emitByte(compiler, parser, OP_RETURN);
 }
 
-static void emitReturn(Chunk* chunk, Parser* parser) {
-  emitByte(chunk, parser, OP_RETURN);
+// add value to the function's constants
+// the function may already be in the old generation so stores go through the write barrier
+static int makeConstant(Compiler* compiler, Value value) {
+  // keep value on the stack in case growing the array starts a collection
+  push(compiler->vm, value);
+  int index = addConstant(currentChunk(compiler), value);
+  writeBarrier(compiler->vm, (Obj*) compiler->function, value);
+  pop(compiler->vm);
+  return index;
 }
 
-static void emitConstant(Chunk* chunk, Parser* parser, Value value) {
-  writeConstant(chunk, value, parser->previous.line);
+static void emitConstant(Compiler* compiler, Parser* parser, Value value) {
+  writeConstantIndex(currentChunk(compiler), makeConstant(compiler, value), parser->previous.line);
 }
 
-static void endCompiler(Chunk* chunk, Parser* parser) {
-  emitReturn(chunk, parser);
+// index of a string constant, reusing its slot if the chunk already has it
+static int stringConstant(Compiler* compiler, ObjString* string) {
+  Value index;
+  if (!tableGet(&compiler->stringConstants, string, &index)) {
+    // keep string on the stack in case growing the arrays starts a collection
+    push(compiler->vm, OBJ_VAL(string));
+    index = NUMBER_VAL(makeConstant(compiler, OBJ_VAL(string)));
+    tableSet(&compiler->stringConstants, string, index);
+    pop(compiler->vm);
+  }
+  return (int) AS_NUMBER(index);
+}
+
+// emit a string constant
+static void emitString(Compiler* compiler, Parser* parser, ObjString* string) {
+  writeConstantIndex(currentChunk(compiler), stringConstant(compiler, string), parser->previous.line);
+}
+
+// emit an index operand, 32 bits after an OP_WIDE prefix
+static void emitIndex(Compiler* compiler, Parser* parser, uint32_t index, bool wide) {
+  if (wide) {
+    emitShort(compiler, parser, (uint16_t) (index >> 16));
+    emitShort(compiler, parser, (uint16_t) (index & 0xffff));
+  } else {
+    emitShort(compiler, parser, (uint16_t) index);
+  }
+}
+
+// emit an instruction taking a name constant, then the argument count (if
+// argCount isn't -1) and a new inline cache (if cached). it's prefixed with
+// OP_WIDE when the name or cache index doesn't fit in 16 bits
+static void emitNamed(Compiler* compiler, Parser* parser, uint8_t instruction, ObjString* name,
+                      int argCount, bool cached) {
+  int index = stringConstant(compiler, name);
+  int cache = cached ? addCache(currentChunk(compiler)) : 0;
+  bool wide = index > UINT16_MAX || cache > UINT16_MAX;
+
+  if (wide) emitByte(compiler, parser, OP_WIDE);
+  emitByte(compiler, parser, instruction);
+  emitIndex(compiler, parser, (uint32_t) index, wide);
+  if (argCount != -1) emitByte(compiler, parser, (uint8_t) argCount);
+  if (cached) emitIndex(compiler, parser, (uint32_t) cache, wide);
 }
 
-static void expression(Chunk* chunk, Parser* parser, Scanner* scanner);
+// emitNamed() for an identifier (e.g. a property name)
+static void emitNamedToken(Compiler* compiler, Parser* parser, uint8_t instruction, Token* name,
+                           int argCount, bool cached) {
+  ObjString* string = copyString(compiler->vm, name->start, name->length);
+  emitNamed(compiler, parser, instruction, string, argCount, cached);
+}
+
+// emit an instruction on a global slot (wide when it doesn't fit in 16 bits)
+static void emitGlobal(Compiler* compiler, Parser* parser, uint8_t instruction, int slot) {
+  bool wide = slot > UINT16_MAX;
+  if (wide) emitByte(compiler, parser, OP_WIDE);
+  emitByte(compiler, parser, instruction);
+  emitIndex(compiler, parser, (uint32_t) slot, wide);
+}
+
+// emit the instruction loading a constant
+static void emitValue(Compiler* compiler, Parser* parser, Value value) {
+  if (IS_NIL(value)) {
+    emitByte(compiler, parser, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(compiler, parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else if (IS_STRING(value)) {
+    emitString(compiler, parser, AS_STRING(value));
+  } else {
+    emitConstant(compiler, parser, value);
+  }
+}
+
+// whether code only works on its parameters and locals, constants and what
+// the globals it calls return (see memo.h). the callee slot is left alone
+// since a memoized call keeps its cache entry there
+static bool pureCode(Chunk* chunk) {
+  Instruction instruction;
+  for (int offset = 0; offset < chunk->count; offset += instruction.length) {
+    decodeInstruction(chunk, offset, &instruction);
+    switch (instruction.opcode) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        if (instruction.byte == 0) return false;
+        break;
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_POP:
+      case OP_GET_GLOBAL:
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_NOT:
+      case OP_NEGATE:
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_LOOP:
+      case OP_CALL:
+      case OP_TAIL_CALL:
+      case OP_RETURN:
+      case OP_JUMP_IF_TRUE:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_TRUE:
+      case OP_JUMP_LONG:
+      case OP_JUMP_IF_FALSE_LONG:
+      case OP_JUMP_IF_TRUE_LONG:
+      case OP_POP_JUMP_IF_FALSE_LONG:
+      case OP_POP_JUMP_IF_TRUE_LONG:
+      case OP_LOOP_LONG:
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// finish the function and make the enclosing compiler current again
+static ObjFunction* endCompiler(Compiler* compiler, Parser* parser) {
+  emitReturn(compiler, parser);
+  freeTable(&compiler->stringConstants);
+
+  // bytecode the vm can't run safely means a compiler bug
+  ObjFunction* function = compiler->function;
+  if (!parser->hadError) {
+    optimizeJumps(&function->chunk);
+    const char* problem = verifyFunction(compiler->vm, function);
+    if (problem != NULL) error(parser, problem);
+    function->pure = compiler->type == TYPE_FUNCTION && !compiler->unknownCallee &&
+                     pureCode(&function->chunk);
+  }
+
+  compiler->vm->compiler = compiler->enclosing;
+  return function;
+}
+
+// drop the code emitted since start (a branch that can never run)
+static void discardCode(Compiler* compiler, int start) {
+  Chunk* chunk = currentChunk(compiler);
+  chunk->count = start;
+  while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= start) {
+    chunk->lineCount--;
+  }
+  if (compiler->lastCall >= start) compiler->lastCall = -1;
+  if (compiler->globalRead > start) compiler->globalRead = -1;
+}
+
+static void beginScope(Compiler* compiler) {
+  compiler->scopeDepth++;
+}
+
+// pop the locals declared in the scope
+static void endScope(Compiler* compiler, Parser* parser) {
+  compiler->scopeDepth--;
+
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth > compiler->scopeDepth) {
+    emitByte(compiler, parser, OP_POP);
+    compiler->localCount--;
+  }
+}
+
+static void expression(Compiler* compiler, Parser* parser, Scanner* scanner);
+static void statement(Compiler* compiler, Parser* parser, Scanner* scanner);
+static void declaration(Compiler* compiler, Parser* parser, Scanner* scanner);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Chunk* chunk, Parser* parser, Scanner* scanner, Precedence precedence);
+static void parsePrecedence(Compiler* compiler, Parser* parser, Scanner* scanner, Precedence precedence);
+
+// expressions are either emitted as they are parsed or, with the
+// optimizing pipeline, added to the ir of the statement's expression.
+// the helpers below do whichever applies.
 
-static void binary(Chunk* chunk, Parser* parser, Scanner* scanner) {
+// add an operation on the operandCount values before it to the ir
+static void addIr(Compiler* compiler, Parser* parser, IrOp op, int operandCount, int slot, Value value) {
+  // keep value on the stack in case growing the ir starts a collection
+  push(compiler->vm, value);
+  irNode(compiler->ir, op, operandCount, slot, value, parser->previous.line);
+  pop(compiler->vm);
+}
+
+// add an operation on a property or method name to the ir
+static void addNamedIr(Compiler* compiler, Parser* parser, IrOp op, int operandCount, Token* name) {
+  ObjString* string = copyString(compiler->vm, name->start, name->length);
+  addIr(compiler, parser, op, operandCount, 0, OBJ_VAL(string));
+}
+
+// instructions of the operators
+static const uint8_t operatorCodes[] = {
+  [IR_NEGATE] = OP_NEGATE,
+  [IR_NOT] = OP_NOT,
+  [IR_ADD] = OP_ADD,
+  [IR_SUBTRACT] = OP_SUBTRACT,
+  [IR_MULTIPLY] = OP_MULTIPLY,
+  [IR_DIVIDE] = OP_DIVIDE,
+  [IR_EQUAL] = OP_EQUAL,
+  [IR_GREATER] = OP_GREATER,
+  [IR_LESS] = OP_LESS,
+  [IR_GET_INDEX] = OP_GET_INDEX,
+  [IR_SET_INDEX] = OP_SET_INDEX,
+};
+
+// unary or binary operator (or indexing, which is ternary when assigning)
+static void emitOperator(Compiler* compiler, Parser* parser, IrOp op) {
+  if (compiler->ir != NULL) {
+    int operandCount = op == IR_NEGATE || op == IR_NOT ? 1 : op == IR_SET_INDEX ? 3 : 2;
+    addIr(compiler, parser, op, operandCount, 0, NIL_VAL);
+    return;
+  }
+  emitByte(compiler, parser, operatorCodes[op]);
+}
+
+// constant value
+static void constant(Compiler* compiler, Parser* parser, Value value) {
+  if (compiler->ir != NULL) {
+    addIr(compiler, parser, IR_CONSTANT, 0, 0, value);
+    return;
+  }
+  emitValue(compiler, parser, value);
+}
+
+static void binary(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
   TokenType operatorType = parser->previous.type;
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence(chunk, parser, scanner, (Precedence) (rule->precedence + 1));
+  parsePrecedence(compiler, parser, scanner, (Precedence) (rule->precedence + 1));
 
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL: emitBytes(chunk, parser, OP_EQUAL, OP_NOT);  break;
-    case TOKEN_EQUAL_EQUAL: emitByte(chunk, parser, OP_EQUAL);  break;
-    case TOKEN_GREATER: emitByte(chunk, parser, OP_GREATER);  break;
-    case TOKEN_GREATER_EQUAL: emitBytes(chunk, parser, OP_LESS, OP_NOT);  break;
-    case TOKEN_LESS: emitByte(chunk, parser, OP_LESS);  break;
-    case TOKEN_LESS_EQUAL: emitBytes(chunk, parser, OP_GREATER, OP_NOT);  break;
-    case TOKEN_PLUS:  emitByte(chunk, parser, OP_ADD); break;
-    case TOKEN_MINUS: emitByte(chunk, parser, OP_SUBTRACT); break;
-    case TOKEN_STAR:  emitByte(chunk, parser, OP_MULTIPLY); break;
-    case TOKEN_SLASH: emitByte(chunk, parser, OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL:
+      emitOperator(compiler, parser, IR_EQUAL);
+      emitOperator(compiler, parser, IR_NOT);
+      break;
+    case TOKEN_EQUAL_EQUAL: emitOperator(compiler, parser, IR_EQUAL); break;
+    case TOKEN_GREATER: emitOperator(compiler, parser, IR_GREATER); break;
+    case TOKEN_GREATER_EQUAL:
+      emitOperator(compiler, parser, IR_LESS);
+      emitOperator(compiler, parser, IR_NOT);
+      break;
+    case TOKEN_LESS: emitOperator(compiler, parser, IR_LESS); break;
+    case TOKEN_LESS_EQUAL:
+      emitOperator(compiler, parser, IR_GREATER);
+      emitOperator(compiler, parser, IR_NOT);
+      break;
+    case TOKEN_PLUS:  emitOperator(compiler, parser, IR_ADD); break;
+    case TOKEN_MINUS: emitOperator(compiler, parser, IR_SUBTRACT); break;
+    case TOKEN_STAR:  emitOperator(compiler, parser, IR_MULTIPLY); break;
+    case TOKEN_SLASH: emitOperator(compiler, parser, IR_DIVIDE); break;
     default: return;
   }
 }
 
-static void literal(Chunk* chunk, Parser* parser, Scanner* scanner) {
+// argument list of a call, returns the number of arguments
+static uint8_t argumentList(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  uint8_t argCount = 0;
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      expression(compiler, parser, scanner);
+      if (argCount == 255) {
+        error(parser, "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  // the callee was emitted last (or is on top of the ir's stack)
+  bool global = compiler->ir != NULL
+      ? compiler->ir->nodes[compiler->ir->stack[compiler->ir->stackCount - 1]].op == IR_GET_GLOBAL
+      : compiler->globalRead == currentChunk(compiler)->count;
+  if (!global) compiler->unknownCallee = true;
+
+  uint8_t argCount = argumentList(compiler, parser, scanner);
+  if (compiler->ir != NULL) {
+    addIr(compiler, parser, IR_CALL, argCount + 1, 0, NIL_VAL);
+    return;
+  }
+
+  // remember where the call is so a return statement can turn it into a tail call
+  compiler->lastCall = currentChunk(compiler)->count;
+  emitBytes(compiler, parser, OP_CALL, argCount);
+}
+
+// array literal
+static void arrayLiteral(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  int count = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(compiler, parser, scanner);
+      if (count == 255) {
+        error(parser, "Can't have more than 255 elements in an array literal.");
+      }
+      count++;
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+
+  if (compiler->ir != NULL) {
+    addIr(compiler, parser, IR_ARRAY, count, 0, NIL_VAL);
+    return;
+  }
+  emitBytes(compiler, parser, OP_ARRAY, (uint8_t) count);
+}
+
+static void index_(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  expression(compiler, parser, scanner);
+  consume(scanner, parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(scanner, parser, TOKEN_EQUAL)) {
+    expression(compiler, parser, scanner);
+    emitOperator(compiler, parser, IR_SET_INDEX);
+  } else {
+    emitOperator(compiler, parser, IR_GET_INDEX);
+  }
+}
+
+static void dot(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  consume(scanner, parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  Token name = parser->previous;
+
+  if (canAssign && match(scanner, parser, TOKEN_EQUAL)) {
+    expression(compiler, parser, scanner);
+    if (compiler->ir != NULL) {
+      addNamedIr(compiler, parser, IR_SET_PROPERTY, 2, &name);
+      return;
+    }
+    emitNamedToken(compiler, parser, OP_SET_PROPERTY, &name, -1, true);
+  } else if (match(scanner, parser, TOKEN_LEFT_PAREN)) {
+    // method call without creating a bound method
+    uint8_t argCount = argumentList(compiler, parser, scanner);
+    if (compiler->ir != NULL) {
+      addNamedIr(compiler, parser, IR_INVOKE, argCount + 1, &name);
+      return;
+    }
+    emitNamedToken(compiler, parser, OP_INVOKE, &name, argCount, true);
+  } else if (compiler->ir != NULL) {
+    addNamedIr(compiler, parser, IR_GET_PROPERTY, 1, &name);
+  } else {
+    emitNamedToken(compiler, parser, OP_GET_PROPERTY, &name, -1, true);
+  }
+}
+
+static void and_(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  if (compiler->ir != NULL) {
+    parsePrecedence(compiler, parser, scanner, PREC_AND);
+    addIr(compiler, parser, IR_AND, 2, 0, NIL_VAL);
+    return;
+  }
+
+  // left operand is on the stack, if it's false it is the result
+  int endJump = emitJump(compiler, parser, OP_JUMP_IF_FALSE_LONG);
+  emitByte(compiler, parser, OP_POP);
+  parsePrecedence(compiler, parser, scanner, PREC_AND);
+  patchJump(compiler, parser, endJump);
+
+  // either operand can be the result, a call can't count on the right one
+  compiler->globalRead = -1;
+}
+
+static void or_(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  if (compiler->ir != NULL) {
+    parsePrecedence(compiler, parser, scanner, PREC_OR);
+    addIr(compiler, parser, IR_OR, 2, 0, NIL_VAL);
+    return;
+  }
+
+  // left operand is on the stack, if it's true it is the result
+  int endJump = emitJump(compiler, parser, OP_JUMP_IF_TRUE_LONG);
+  emitByte(compiler, parser, OP_POP);
+  parsePrecedence(compiler, parser, scanner, PREC_OR);
+  patchJump(compiler, parser, endJump);
+
+  // either operand can be the result, a call can't count on the right one
+  compiler->globalRead = -1;
+}
+
+static void literal(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
   switch (parser->previous.type) {
-    case TOKEN_FALSE: emitByte(chunk, parser, OP_FALSE); break;
-    case TOKEN_NIL: emitByte(chunk, parser, OP_NIL); break;
-    case TOKEN_TRUE: emitByte(chunk, parser, OP_TRUE); break;
+    case TOKEN_FALSE: constant(compiler, parser, BOOL_VAL(false)); break;
+    case TOKEN_NIL: constant(compiler, parser, NIL_VAL); break;
+    case TOKEN_TRUE: constant(compiler, parser, BOOL_VAL(true)); break;
     default: return;
   }
 }
  
-static void grouping(Chunk* chunk, Parser* parser, Scanner* scanner) {
-  expression(chunk, parser, scanner);
+static void grouping(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  expression(compiler, parser, scanner);
   consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(Chunk* chunk, Parser* parser, Scanner* scanner) {
-  // convert previous token to decimal value
-  double value = strtod(parser->previous.start, NULL);
+static void number(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  NumberLiteral* literal = &parser->previous.number;
+
+  // literals without a fraction that fit in 32 bits are ints
+  if (literal->exponent == 0 && !literal->truncated && literal->mantissa <= INT32_MAX) {
+    constant(compiler, parser, INT_VAL((int32_t) literal->mantissa));
+    return;
+  }
+
+  // convert the scanned digits, only rescanning them when they're too hard
+  double value;
+  if (literal->truncated || !decimalToDouble(literal->mantissa, literal->exponent, &value)) {
+    value = strtod(parser->previous.start, NULL);
+  }
+
+  constant(compiler, parser, NUMBER_VAL(value));
+}
+
+static void string(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  // copy string without the surrounding quotes (interned so duplicates share storage)
+  ObjString* string = copyString(compiler->vm, parser->previous.start + 1, parser->previous.length - 2);
+  constant(compiler, parser, OBJ_VAL(string));
+}
+
+// resolve a global variable name to its slot
+static int globalSlot(Compiler* compiler, Token* name) {
+  ObjString* string = copyString(compiler->vm, name->start, name->length);
+  return resolveGlobal(compiler->vm, string);
+}
+
+static bool identifiersEqual(Token* a, Token* b) {
+  if (a->length != b->length) return false;
+  return memcmp(a->start, b->start, a->length) == 0;
+}
+
+// find the stack slot of a local variable, -1 if name isn't a local
+static int resolveLocal(Compiler* compiler, Parser* parser, Token* name) {
+  // search backwards so inner scopes shadow outer ones
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1) {
+        error(parser, "Can't read local variable in its own initializer.");
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void namedVariable(Compiler* compiler, Parser* parser, Scanner* scanner, Token name, bool canAssign) {
+  int local = resolveLocal(compiler, parser, &name);
+  int slot = local != -1 ? local : globalSlot(compiler, &name);
+
+  // assignment
+  bool assign = canAssign && match(scanner, parser, TOKEN_EQUAL);
+  if (assign) expression(compiler, parser, scanner);
+
+  if (compiler->ir != NULL) {
+    if (local != -1) {
+      addIr(compiler, parser, assign ? IR_SET_LOCAL : IR_GET_LOCAL, assign ? 1 : 0, slot, NIL_VAL);
+    } else {
+      addIr(compiler, parser, assign ? IR_SET_GLOBAL : IR_GET_GLOBAL, assign ? 1 : 0, slot, NIL_VAL);
+    }
+  } else if (local != -1) {
+    emitBytes(compiler, parser, assign ? OP_SET_LOCAL : OP_GET_LOCAL, (uint8_t) slot);
+  } else {
+    emitGlobal(compiler, parser, assign ? OP_SET_GLOBAL : OP_GET_GLOBAL, slot);
+    if (!assign) compiler->globalRead = currentChunk(compiler)->count;
+  }
+}
+
+static void variable(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  namedVariable(compiler, parser, scanner, parser->previous, canAssign);
+}
 
-  // emit op code
-  emitConstant(chunk, parser, NUMBER_VAL(value));
+// token that doesn't come from the source
+static Token syntheticToken(const char* text) {
+  Token token;
+  token.start = text;
+  token.length = (int) strlen(text);
+  return token;
 }
 
-static void unary(Chunk* chunk, Parser* parser, Scanner* scanner) {
+static void super_(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  if (compiler->currentClass == NULL) {
+    error(parser, "Can't use 'super' outside of a class.");
+  } else if (!compiler->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(scanner, parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(scanner, parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  Token name = parser->previous;
+
+  // the superclass is found at runtime through the method's class
+  namedVariable(compiler, parser, scanner, syntheticToken("this"), false);
+  if (match(scanner, parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(compiler, parser, scanner);
+    if (compiler->ir != NULL) {
+      addNamedIr(compiler, parser, IR_SUPER_INVOKE, argCount + 1, &name);
+      return;
+    }
+    emitNamedToken(compiler, parser, OP_SUPER_INVOKE, &name, argCount, false);
+  } else if (compiler->ir != NULL) {
+    addNamedIr(compiler, parser, IR_GET_SUPER, 1, &name);
+  } else {
+    emitNamedToken(compiler, parser, OP_GET_SUPER, &name, -1, false);
+  }
+}
+
+static void this_(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
+  if (compiler->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+
+  // this is local slot 0 of a method
+  variable(compiler, parser, scanner, false);
+}
+
+static void unary(Compiler* compiler, Parser* parser, Scanner* scanner, bool canAssign) {
   // get operator type
   TokenType operatorType = parser->previous.type;
 
   // compile the operand
-  parsePrecedence(chunk, parser, scanner, PREC_UNARY);
+  parsePrecedence(compiler, parser, scanner, PREC_UNARY);
 
   // emit the operator instruction
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(chunk, parser, OP_NOT); break;
-    case TOKEN_MINUS: emitByte(chunk, parser, OP_NEGATE); break;
+    case TOKEN_BANG: emitOperator(compiler, parser, IR_NOT); break;
+    case TOKEN_MINUS: emitOperator(compiler, parser, IR_NEGATE); break;
     default: return;
   }
 }
 
 // rule = [unary function, binary function, precedence]
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {arrayLiteral, index_, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
@@ -207,10 +883,10 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-  [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_STRING]        = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
+  [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
@@ -218,11 +894,11 @@ ParseRule rules[] = {
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
@@ -230,7 +906,10 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-static void parsePrecedence(Chunk* chunk, Parser* parser, Scanner* scanner, Precedence precedence) {
+static void parsePrecedence(Compiler* compiler, Parser* parser, Scanner* scanner, Precedence precedence) {
+  // every nested expression (grouping, operand, argument...) comes through here
+  if (!enterNesting(compiler, parser, scanner)) return;
+
   // read next token
   advance(scanner, parser);
 
@@ -239,11 +918,14 @@ static void parsePrecedence(Chunk* chunk, Parser* parser, Scanner* scanner, Prec
   ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
     error(parser, "Expect expression.");
+    leaveNesting(parser);
     return;
   }
 
   // call prefix rule
-  prefixRule(chunk, parser, scanner);
+  // only allow assignment if we are parsing a low precedence expression
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(compiler, parser, scanner, canAssign);
 
   while (precedence <= getRule(parser->current.type)->precedence) {
     // load next token into parser
@@ -253,39 +935,599 @@ static void parsePrecedence(Chunk* chunk, Parser* parser, Scanner* scanner, Prec
     ParseFn infixRule =  getRule(parser->previous.type)->infix;
     
     // call infix rule
-    infixRule(chunk, parser, scanner);
+    infixRule(compiler, parser, scanner, canAssign);
   }
+
+  // an '=' left over means the left hand side wasn't assignable
+  if (canAssign && match(scanner, parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
+  }
+  leaveNesting(parser);
 }
 
 static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-static void expression(Chunk* chunk, Parser* parser, Scanner* scanner) {
-  parsePrecedence(chunk, parser, scanner, PREC_ASSIGNMENT);
+static void expression(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  parsePrecedence(compiler, parser, scanner, PREC_ASSIGNMENT);
+}
+
+// a node being emitted by emitNode()
+typedef struct {
+  int index;
+  int next; // operand to emit next
+  int jump; // operand of the jump over the right side of and/or
+} EmitFrame;
+
+// emit the instruction of a node whose operands have been emitted
+static void emitNodeOp(Compiler* compiler, Parser* parser, IrNode* node) {
+  // instructions are on the line of the node they come from
+  parser->previous.line = node->line;
+  uint8_t argCount = (uint8_t) (node->operandCount - 1);
+  switch (node->op) {
+    case IR_CONSTANT: emitValue(compiler, parser, node->value); break;
+    case IR_GET_LOCAL: emitBytes(compiler, parser, OP_GET_LOCAL, (uint8_t) node->slot); break;
+    case IR_SET_LOCAL: emitBytes(compiler, parser, OP_SET_LOCAL, (uint8_t) node->slot); break;
+    case IR_GET_GLOBAL:
+    case IR_SET_GLOBAL:
+      emitGlobal(compiler, parser, node->op == IR_GET_GLOBAL ? OP_GET_GLOBAL : OP_SET_GLOBAL, node->slot);
+      break;
+    case IR_GET_PROPERTY:
+    case IR_SET_PROPERTY:
+      emitNamed(compiler, parser, node->op == IR_GET_PROPERTY ? OP_GET_PROPERTY : OP_SET_PROPERTY,
+                AS_STRING(node->value), -1, true);
+      break;
+    case IR_GET_SUPER:
+      emitNamed(compiler, parser, OP_GET_SUPER, AS_STRING(node->value), -1, false);
+      break;
+    case IR_CALL:
+      compiler->lastCall = currentChunk(compiler)->count;
+      emitBytes(compiler, parser, OP_CALL, argCount);
+      break;
+    case IR_INVOKE:
+      emitNamed(compiler, parser, OP_INVOKE, AS_STRING(node->value), argCount, true);
+      break;
+    case IR_SUPER_INVOKE:
+      emitNamed(compiler, parser, OP_SUPER_INVOKE, AS_STRING(node->value), argCount, false);
+      break;
+    case IR_ARRAY: emitBytes(compiler, parser, OP_ARRAY, (uint8_t) node->operandCount); break;
+    default: emitByte(compiler, parser, operatorCodes[node->op]); break;
+  }
+}
+
+// emit an ir node and its operands
+// temporaries are the slots from base up. the nodes being emitted are kept
+// on an explicit stack since ir from a long chain like a + b + c + ... is
+// as deep as the chain is long, which recursing could run out of stack on
+static void emitNode(Compiler* compiler, Parser* parser, Ir* ir, int root, int base) {
+  EmitFrame* frames = NULL;
+  int frameCount = 0;
+  int frameCapacity = 0;
+  int index = root;
+
+  for (;;) {
+    // start on node index
+    if (index != -1) {
+      IrNode* node = &ir->nodes[index];
+      if (node->emitted) {
+        // a shared node already evaluated
+        emitBytes(compiler, parser, OP_GET_LOCAL, (uint8_t) (base + node->temp));
+      } else {
+        if (frameCapacity < frameCount + 1) {
+          int oldCapacity = frameCapacity;
+          frameCapacity = GROW_CAPACITY(oldCapacity);
+          frames = GROW_ARRAY(EmitFrame, frames, oldCapacity, frameCapacity);
+        }
+        frames[frameCount++] = (EmitFrame) {index, 0, -1};
+      }
+      index = -1;
+    }
+    if (frameCount == 0) break;
+
+    // carry on with the innermost unfinished node
+    EmitFrame* frame = &frames[frameCount - 1];
+    IrNode* node = &ir->nodes[frame->index];
+    if (frame->next < node->operandCount) {
+      if ((node->op == IR_AND || node->op == IR_OR) && frame->next == 1) {
+        // same jumps as and_() and or_()
+        parser->previous.line = node->line;
+        frame->jump = emitJump(compiler, parser,
+                               node->op == IR_AND ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_TRUE_LONG);
+        emitByte(compiler, parser, OP_POP);
+      }
+      index = irOperand(ir, node, frame->next++);
+      continue;
+    }
+
+    // all its operands are done
+    if (node->op == IR_AND || node->op == IR_OR) {
+      patchJump(compiler, parser, frame->jump);
+    } else {
+      emitNodeOp(compiler, parser, node);
+    }
+
+    // keep the value for the node's other uses
+    if (node->temp != -1) {
+      emitBytes(compiler, parser, OP_SET_LOCAL, (uint8_t) (base + node->temp));
+      node->emitted = true;
+    }
+    frameCount--;
+  }
+
+  FREE_ARRAY(EmitFrame, frames, frameCapacity);
+}
+
+// compile the expression of a statement
+//
+// without the optimizing pipeline this is just expression(). with it the
+// whole expression is built as ir, optimized and then emitted, keeping
+// values of common subexpressions in temporaries above the locals.
+//
+// returns true if a USE_CONDITION expression is always the constant
+// *value, in which case nothing is emitted for it
+static bool statementExpression(Compiler* compiler, Parser* parser, Scanner* scanner,
+                                ExpressionUse use, Value* value) {
+  if (parser->ir == NULL) {
+    expression(compiler, parser, scanner);
+    if (use == USE_DISCARD) emitByte(compiler, parser, OP_POP);
+    return false;
+  }
+
+  Ir* ir = parser->ir;
+  compiler->ir = ir;
+  beginIr(ir);
+  expression(compiler, parser, scanner);
+  int root = irRoot(ir);
+
+  // a local being declared doesn't have its slot yet (its value is
+  // what this expression leaves on the stack)
+  int base = compiler->localCount;
+  if (base > 0 && compiler->locals[base - 1].depth == -1) base--;
+  optimizeIr(ir, root, base < UINT8_COUNT ? UINT8_COUNT - base : 0);
+
+  bool known = use == USE_CONDITION && irConstant(ir, root, value);
+
+  // nothing to do for a value nobody sees that can't fail
+  bool dead = use == USE_DISCARD && ir->nodes[root].safe;
+
+  if (!known && !dead) {
+    int line = parser->previous.line;
+    for (int i = 0; i < ir->temps; i++) emitByte(compiler, parser, OP_NIL);
+    emitNode(compiler, parser, ir, root, base);
+    parser->previous.line = line;
+
+    if (use == USE_DISCARD) {
+      for (int i = 0; i <= ir->temps; i++) emitByte(compiler, parser, OP_POP);
+    } else if (use != USE_RETURN && ir->temps > 0) {
+      // move the value down into the first temporary's slot
+      emitBytes(compiler, parser, OP_SET_LOCAL, (uint8_t) base);
+      for (int i = 0; i < ir->temps; i++) emitByte(compiler, parser, OP_POP);
+    }
+  }
+
+  compiler->ir = NULL;
+  return known;
+}
+
+// add a local variable to the current scope (uninitialized)
+static void addLocal(Compiler* compiler, Parser* parser, Token name) {
+  if (compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
+    return;
+  }
+
+  Local* local = &compiler->locals[compiler->localCount++];
+  local->name = name;
+  local->depth = -1;
+}
+
+// declare the variable named by the previous token
+// globals are resolved to a slot, locals are added to the current scope
+// returns the global slot (unused for locals)
+static int parseVariable(Compiler* compiler, Parser* parser, Scanner* scanner, const char* errorMessage) {
+  consume(scanner, parser, TOKEN_IDENTIFIER, errorMessage);
+  Token* name = &parser->previous;
+
+  if (compiler->scopeDepth == 0) return globalSlot(compiler, name);
+
+  // redeclaring a variable in the same scope is an error
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &compiler->locals[i];
+    if (local->depth != -1 && local->depth < compiler->scopeDepth) break;
+    if (identifiersEqual(name, &local->name)) {
+      error(parser, "Already a variable with this name in this scope.");
+    }
+  }
+  addLocal(compiler, parser, *name);
+  return 0;
+}
+
+// mark the newest local as usable
+static void markInitialized(Compiler* compiler) {
+  if (compiler->scopeDepth == 0) return;
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+}
+
+// define a declared variable with the value on top of the stack
+static void defineVariable(Compiler* compiler, Parser* parser, int slot) {
+  // locals simply stay in their stack slot
+  if (compiler->scopeDepth > 0) {
+    markInitialized(compiler);
+    return;
+  }
+
+  emitGlobal(compiler, parser, OP_DEFINE_GLOBAL, slot);
+}
+
+static void block(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(compiler, parser, scanner);
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// compile a function's parameters and body and emit it as a constant
+static void function(Compiler* enclosing, Parser* parser, Scanner* scanner, FunctionType type) {
+  if (!enterNesting(enclosing, parser, scanner)) return;
+
+  Compiler compiler;
+  initCompiler(&compiler, enclosing, enclosing->vm, parser, type);
+  beginScope(&compiler);
+
+  // parameters are the first locals
+  consume(scanner, parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      compiler.function->arity++;
+      if (compiler.function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
+      }
+      int slot = parseVariable(&compiler, parser, scanner, "Expect parameter name.");
+      defineVariable(&compiler, parser, slot);
+    } while (match(scanner, parser, TOKEN_COMMA));
+  }
+  consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+
+  consume(scanner, parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(&compiler, parser, scanner);
+
+  // no endScope() since the whole window is discarded on return
+  ObjFunction* function = endCompiler(&compiler, parser);
+  emitConstant(enclosing, parser, OBJ_VAL(function));
+  leaveNesting(parser);
+}
+
+static void method(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  consume(scanner, parser, TOKEN_IDENTIFIER, "Expect method name.");
+  Token name = parser->previous;
+
+  FunctionType type = TYPE_METHOD;
+  if (name.length == 4 && memcmp(name.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+  function(compiler, parser, scanner, type);
+
+  emitNamedToken(compiler, parser, OP_METHOD, &name, -1, false);
+}
+
+static void classDeclaration(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  int slot = parseVariable(compiler, parser, scanner, "Expect class name.");
+  Token className = parser->previous;
+
+  emitNamedToken(compiler, parser, OP_CLASS, &className, -1, false);
+  defineVariable(compiler, parser, slot);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  ClassCompiler* enclosingClass = compiler->currentClass;
+  compiler->currentClass = &classCompiler;
+
+  if (match(scanner, parser, TOKEN_LESS)) {
+    consume(scanner, parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(compiler, parser, scanner, false);
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
+    }
+
+    // superclass and subclass are both popped by OP_INHERIT
+    namedVariable(compiler, parser, scanner, className, false);
+    emitByte(compiler, parser, OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  // class stays on the stack while its methods are added
+  namedVariable(compiler, parser, scanner, className, false);
+  consume(scanner, parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(compiler, parser, scanner);
+  }
+  consume(scanner, parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(compiler, parser, OP_POP);
+
+  compiler->currentClass = enclosingClass;
+}
+
+static void funDeclaration(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  int slot = parseVariable(compiler, parser, scanner, "Expect function name.");
+
+  // a function can refer to itself (for recursion) so it is usable straight away
+  markInitialized(compiler);
+  function(compiler, parser, scanner, TYPE_FUNCTION);
+  defineVariable(compiler, parser, slot);
 }
 
-// returns true if no error, false is error
-bool compile(VM* vm, const char* source, Chunk* chunk) {
+static void varDeclaration(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  int slot = parseVariable(compiler, parser, scanner, "Expect variable name.");
+
+  // initializer defaults to nil
+  if (match(scanner, parser, TOKEN_EQUAL)) {
+    statementExpression(compiler, parser, scanner, USE_VALUE, NULL);
+  } else {
+    emitByte(compiler, parser, OP_NIL);
+  }
+  consume(scanner, parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  defineVariable(compiler, parser, slot);
+}
+
+static void expressionStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  statementExpression(compiler, parser, scanner, USE_DISCARD, NULL);
+  consume(scanner, parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+static void forStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  // variables declared in the initializer are scoped to the loop
+  beginScope(compiler);
+  consume(scanner, parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+
+  // initializer
+  if (match(scanner, parser, TOKEN_SEMICOLON)) {
+    // no initializer
+  } else if (match(scanner, parser, TOKEN_VAR)) {
+    varDeclaration(compiler, parser, scanner);
+  } else {
+    expressionStatement(compiler, parser, scanner);
+  }
+
+  // condition (a constant one needs no test, or no loop if it is false)
+  int conditionStart = currentChunk(compiler)->count;
+  int loopStart = conditionStart;
+  int exitJump = -1;
+  bool never = false;
+  if (!match(scanner, parser, TOKEN_SEMICOLON)) {
+    Value condition;
+    if (statementExpression(compiler, parser, scanner, USE_CONDITION, &condition)) {
+      never = isFalsey(condition);
+    } else {
+      exitJump = emitJump(compiler, parser, OP_POP_JUMP_IF_FALSE_LONG);
+    }
+    consume(scanner, parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  }
+
+  // increment runs after the body, so jump over it and loop back to it
+  if (!match(scanner, parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(compiler, parser, OP_JUMP_LONG);
+    int incrementStart = currentChunk(compiler)->count;
+    statementExpression(compiler, parser, scanner, USE_DISCARD, NULL);
+    consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(compiler, parser, loopStart);
+    loopStart = incrementStart;
+    patchJump(compiler, parser, bodyJump);
+  }
+
+  statement(compiler, parser, scanner);
+  emitLoop(compiler, parser, loopStart);
+
+  if (exitJump != -1) patchJump(compiler, parser, exitJump);
+  if (never) discardCode(compiler, conditionStart);
+
+  endScope(compiler, parser);
+}
+
+static void ifStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  consume(scanner, parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  Value condition;
+  bool known = statementExpression(compiler, parser, scanner, USE_CONDITION, &condition);
+  consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  // a constant condition keeps only the branch that runs
+  if (known) {
+    int start = currentChunk(compiler)->count;
+    statement(compiler, parser, scanner);
+    if (isFalsey(condition)) discardCode(compiler, start);
+
+    if (match(scanner, parser, TOKEN_ELSE)) {
+      start = currentChunk(compiler)->count;
+      statement(compiler, parser, scanner);
+      if (!isFalsey(condition)) discardCode(compiler, start);
+    }
+    return;
+  }
+
+  // the jump pops the condition on both branches
+  int thenJump = emitJump(compiler, parser, OP_POP_JUMP_IF_FALSE_LONG);
+  statement(compiler, parser, scanner);
+  if (!check(parser, TOKEN_ELSE)) {
+    patchJump(compiler, parser, thenJump);
+    return;
+  }
+
+  int elseJump = emitJump(compiler, parser, OP_JUMP_LONG);
+  patchJump(compiler, parser, thenJump);
+  advance(scanner, parser);
+  statement(compiler, parser, scanner);
+  patchJump(compiler, parser, elseJump);
+}
+
+static void printStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  statementExpression(compiler, parser, scanner, USE_VALUE, NULL);
+  consume(scanner, parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(compiler, parser, OP_PRINT);
+}
+
+static void returnStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  if (compiler->type == TYPE_SCRIPT || compiler->type == TYPE_MODULE) {
+    error(parser, "Can't return from top-level code.");
+  }
+
+  if (match(scanner, parser, TOKEN_SEMICOLON)) {
+    emitReturn(compiler, parser);
+    return;
+  }
+
+  if (compiler->type == TYPE_INITIALIZER) {
+    error(parser, "Can't return a value from an initializer.");
+  }
+
+  statementExpression(compiler, parser, scanner, USE_RETURN, NULL);
+  consume(scanner, parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+  // a call that is the last thing the expression does is a tail call.
+  // rewriting it in place is safe even if a jump lands on or after it,
+  // since the OP_RETURN that follows returns whatever is on top.
+  Chunk* chunk = currentChunk(compiler);
+  if (compiler->lastCall != -1 && compiler->lastCall == chunk->count - 2) {
+    chunk->code[compiler->lastCall] = OP_TAIL_CALL;
+  }
+  emitByte(compiler, parser, OP_RETURN);
+}
+
+static void whileStatement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  int loopStart = currentChunk(compiler)->count;
+  consume(scanner, parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  Value condition;
+  bool known = statementExpression(compiler, parser, scanner, USE_CONDITION, &condition);
+  consume(scanner, parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  // a constant condition needs no test (or no loop at all)
+  if (known) {
+    statement(compiler, parser, scanner);
+    if (isFalsey(condition)) {
+      discardCode(compiler, loopStart);
+    } else {
+      emitLoop(compiler, parser, loopStart);
+    }
+    return;
+  }
+
+  int exitJump = emitJump(compiler, parser, OP_POP_JUMP_IF_FALSE_LONG);
+  statement(compiler, parser, scanner);
+  emitLoop(compiler, parser, loopStart);
+  patchJump(compiler, parser, exitJump);
+}
+
+// skip tokens until we reach a statement boundary
+static void synchronize(Scanner* scanner, Parser* parser) {
+  parser->panicMode = false;
+
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
+      case TOKEN_CLASS:
+      case TOKEN_FUN:
+      case TOKEN_VAR:
+      case TOKEN_FOR:
+      case TOKEN_IF:
+      case TOKEN_WHILE:
+      case TOKEN_PRINT:
+      case TOKEN_RETURN:
+        return;
+      default:
+        ; // do nothing
+    }
+    advance(scanner, parser);
+  }
+}
+
+static void declaration(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  if (match(scanner, parser, TOKEN_CLASS)) {
+    classDeclaration(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_FUN)) {
+    funDeclaration(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_VAR)) {
+    varDeclaration(compiler, parser, scanner);
+  } else {
+    statement(compiler, parser, scanner);
+  }
+
+  if (parser->panicMode) synchronize(scanner, parser);
+}
+
+static void statement(Compiler* compiler, Parser* parser, Scanner* scanner) {
+  // blocks and the bodies of ifs and loops nest through here
+  if (!enterNesting(compiler, parser, scanner)) return;
+
+  if (match(scanner, parser, TOKEN_PRINT)) {
+    printStatement(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_FOR)) {
+    forStatement(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_IF)) {
+    ifStatement(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_RETURN)) {
+    returnStatement(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_WHILE)) {
+    whileStatement(compiler, parser, scanner);
+  } else if (match(scanner, parser, TOKEN_LEFT_BRACE)) {
+    beginScope(compiler);
+    block(compiler, parser, scanner);
+    endScope(compiler, parser);
+  } else {
+    expressionStatement(compiler, parser, scanner);
+  }
+  leaveNesting(parser);
+}
+
+// compile top level code, returns NULL if there was a compile error
+static ObjFunction* compileTopLevel(VM* vm, const char* source, FunctionType type) {
   Scanner scanner;
   Parser parser;
-  Chunk* compilingChunk;
+  Compiler compiler;
+  Ir ir;
 
   initScanner(&scanner, source);
   initParser(&parser);
-  compilingChunk = chunk;
+  initIr(&ir);
+  if (vm->optimize) parser.ir = &ir;
+  initCompiler(&compiler, NULL, vm, &parser, type);
 
   // load next token into parser
   advance(&scanner, &parser);
 
-  // parse expression
-  expression(compilingChunk, &parser, &scanner);
-
-  // consume EOF token
-  consume(&scanner, &parser, TOKEN_EOF, "Expect end of expression");
+  // parse declarations until end of file
+  while (!match(&scanner, &parser, TOKEN_EOF)) {
+    declaration(&compiler, &parser, &scanner);
+  }
 
   // end
-  endCompiler(compilingChunk, &parser);
+  ObjFunction* function = endCompiler(&compiler, &parser);
+  freeIr(&ir);
+  return parser.hadError ? NULL : function;
+}
+
+// returns NULL if there was a compile error
+ObjFunction* compile(VM* vm, const char* source) {
+  return compileTopLevel(vm, source, TYPE_SCRIPT);
+}
 
-  return !parser.hadError;
+ObjFunction* compileModule(VM* vm, const char* source) {
+  return compileTopLevel(vm, source, TYPE_MODULE);
+}
+
+// mark objects held by the running compiler
+void markCompilerRoots(VM* vm) {
+  // every function being compiled, innermost first
+  for (Compiler* compiler = vm->compiler; compiler != NULL; compiler = compiler->enclosing) {
+    markObject(vm, (Obj*) compiler->function);
+
+    // constants and names of the expression being built
+    if (compiler->ir != NULL) markIr(vm, compiler->ir);
+
+    // constant strings not yet in the chunk
+    Table* table = &compiler->stringConstants;
+    for (int i = 0; i < table->capacity; i++) {
+      markObject(vm, (Obj*) table->entries[i].key);
+    }
+  }
 }
\ No newline at end of file
@@ -3,6 +3,15 @@
 
 #include "vm.h"
 
-bool compile(VM* vm, const char* source, Chunk* chunk);
+// compile source to the function for the top level script
+// returns NULL if there was a compile error
+ObjFunction* compile(VM* vm, const char* source);
+
+// compile source to the function for a module's top level (see module.h)
+// returns NULL if there was a compile error
+ObjFunction* compileModule(VM* vm, const char* source);
+
+// mark objects held by the running compiler
+void markCompilerRoots(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "counters.h"
+#include "vm.h"
+
+// names used in the report
+static const char* eventNames[COUNTER_COUNT] = {
+  [COUNTER_INSTRUCTIONS] = "instructions",
+  [COUNTER_CYCLES] = "cycles",
+  [COUNTER_BRANCH_MISSES] = "branch misses",
+  [COUNTER_L1D_MISSES] = "l1d misses",
+};
+
+// monotonic time in nanoseconds
+static uint64_t nanoTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// set the type and config of an event
+static void describeEvent(CounterEvent event, struct perf_event_attr* attr) {
+  attr->type = PERF_TYPE_HARDWARE;
+  switch (event) {
+    case COUNTER_INSTRUCTIONS: attr->config = PERF_COUNT_HW_INSTRUCTIONS; break;
+    case COUNTER_CYCLES: attr->config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case COUNTER_BRANCH_MISSES: attr->config = PERF_COUNT_HW_BRANCH_MISSES; break;
+    case COUNTER_L1D_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D |
+                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    default: break;
+  }
+}
+
+// open one event of this thread's group (the leader when groupFd is -1)
+// returns the file descriptor, -1 on failure
+static int openEvent(CounterEvent event, int groupFd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  describeEvent(event, &attr);
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                     PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  // the leader starts disabled and the group only counts inside run().
+  // user space only, which is all an unprivileged process may count.
+  attr.disabled = groupFd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// start measuring vm's runs
+void startPerfCounters(VM* vm) {
+  if (vm->perf != NULL) return;
+
+  PerfCounters* counters = (PerfCounters*) malloc(sizeof(PerfCounters));
+  if (counters == NULL) exit(1);
+  memset(counters, 0, sizeof(PerfCounters));
+  for (int i = 0; i < COUNTER_COUNT; i++) counters->fds[i] = -1;
+  vm->perf = counters;
+
+  // without the leader there is no group, so only time is measured
+  counters->groupFd = openEvent(COUNTER_INSTRUCTIONS, -1);
+  if (counters->groupFd == -1) {
+    counters->error = errno;
+    return;
+  }
+  counters->fds[COUNTER_INSTRUCTIONS] = counters->groupFd;
+  if (ioctl(counters->groupFd, PERF_EVENT_IOC_ID, &counters->ids[COUNTER_INSTRUCTIONS]) != 0) {
+    counters->error = errno;
+    close(counters->groupFd);
+    counters->groupFd = -1;
+    return;
+  }
+
+  // the other events are optional (not every cpu has every event)
+  for (int i = COUNTER_INSTRUCTIONS + 1; i < COUNTER_COUNT; i++) {
+    int fd = openEvent((CounterEvent) i, counters->groupFd);
+    if (fd == -1) continue;
+    if (ioctl(fd, PERF_EVENT_IOC_ID, &counters->ids[i]) != 0) {
+      close(fd);
+      continue;
+    }
+    counters->fds[i] = fd;
+  }
+  ioctl(counters->groupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+}
+
+// start counting a call to run()
+void beginCounting(VM* vm) {
+  PerfCounters* counters = vm->perf;
+  counters->startNs = nanoTime();
+  if (counters->groupFd != -1) {
+    ioctl(counters->groupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+// stop counting once run() returns
+void endCounting(VM* vm) {
+  PerfCounters* counters = vm->perf;
+  if (counters->groupFd != -1) {
+    ioctl(counters->groupFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+  counters->runNs += nanoTime() - counters->startNs;
+}
+
+// read the group's totals into counters->values
+// (the counts accumulate across enables, so this reads totals directly)
+static void readCounters(PerfCounters* counters) {
+  if (counters->groupFd == -1) return;
+
+  // nr, time enabled, time running, then a value and id per event
+  uint64_t data[3 + 2 * COUNTER_COUNT];
+  ssize_t size = read(counters->groupFd, data, sizeof(data));
+  if (size < (ssize_t) (3 * sizeof(uint64_t))) return;
+
+  uint64_t count = data[0];
+  uint64_t enabled = data[1];
+  uint64_t running = data[2];
+  counters->scaled = running > 0 && running < enabled;
+
+  for (uint64_t i = 0; i < count && i < COUNTER_COUNT; i++) {
+    uint64_t value = data[3 + 2 * i];
+    uint64_t id = data[4 + 2 * i];
+
+    // when the kernel had to multiplex the counters, extrapolate
+    if (counters->scaled) value = (uint64_t) ((double) value * enabled / running);
+
+    for (int event = 0; event < COUNTER_COUNT; event++) {
+      if (counters->fds[event] != -1 && counters->ids[event] == id) counters->values[event] = value;
+    }
+  }
+}
+
+// report the totals, per bytecode instruction where possible
+void printPerfCounters(PerfCounters* counters, FILE* out) {
+  readCounters(counters);
+  uint64_t bytecodes = counters->bytecodes;
+
+  fprintf(out, "== perf counters ==\n");
+  fprintf(out, "run time          %.3f ms\n", counters->runNs / 1e6);
+  fprintf(out, "bytecodes         %llu", (unsigned long long) bytecodes);
+  if (bytecodes > 0) fprintf(out, " (%.2f ns each)", (double) counters->runNs / bytecodes);
+  fprintf(out, "\n");
+
+  if (counters->groupFd == -1) {
+    fprintf(out, "hardware counters unavailable (%s), time only\n", strerror(counters->error));
+    return;
+  }
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    if (counters->fds[i] == -1) {
+      fprintf(out, "%-17s not supported\n", eventNames[i]);
+      continue;
+    }
+    fprintf(out, "%-17s %llu", eventNames[i], (unsigned long long) counters->values[i]);
+    if (bytecodes > 0) fprintf(out, " (%.2f per bytecode)", (double) counters->values[i] / bytecodes);
+    fprintf(out, "\n");
+  }
+
+  uint64_t cycles = counters->values[COUNTER_CYCLES];
+  if (counters->fds[COUNTER_CYCLES] != -1 && cycles > 0) {
+    fprintf(out, "ipc               %.2f\n", (double) counters->values[COUNTER_INSTRUCTIONS] / cycles);
+  }
+  if (counters->scaled) fprintf(out, "(counters were multiplexed, values are estimates)\n");
+}
+
+// close the counters
+void freePerfCounters(VM* vm) {
+  PerfCounters* counters = vm->perf;
+  if (counters == NULL) return;
+
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    if (counters->fds[i] != -1) close(counters->fds[i]);
+  }
+  free(counters);
+  vm->perf = NULL;
+}
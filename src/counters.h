@@ -0,0 +1,52 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// hardware events counted around run()
+typedef enum {
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CYCLES,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES, // l1 data cache read misses
+  COUNTER_COUNT,
+} CounterEvent;
+
+// hardware performance counters for script runs (--perf-counters)
+//
+// the events are opened as one perf_event group that only counts while
+// run() is executing bytecode, and run() counts the bytecode instructions
+// it executes so the events can be reported per instruction. where perf
+// events aren't permitted (containers, perf_event_paranoid) only the time
+// spent in run() is measured.
+typedef struct PerfCounters {
+  int groupFd; // group leader, -1 when hardware counters aren't available
+  int fds[COUNTER_COUNT]; // -1 for an event the cpu doesn't support
+  uint64_t ids[COUNTER_COUNT];
+  int error; // errno from opening the counters when they're unavailable
+
+  uint64_t values[COUNTER_COUNT]; // totals across every run()
+  bool scaled; // the kernel multiplexed the counters, so values are estimates
+  uint64_t runNs; // wall time spent in run()
+  uint64_t bytecodes; // bytecode instructions executed (counted by run())
+
+  uint64_t startNs; // start of the run() being measured
+} PerfCounters;
+
+// start measuring vm's runs, falling back to time only when hardware
+// counters can't be opened (see counters->error)
+void startPerfCounters(VM* vm);
+
+// bracket a call to run()
+void beginCounting(VM* vm);
+void endCounting(VM* vm);
+
+// report the totals, per bytecode instruction where possible
+void printPerfCounters(PerfCounters* counters, FILE* out);
+
+// close the counters
+void freePerfCounters(VM* vm);
+
+#endif
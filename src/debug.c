@@ -11,38 +11,66 @@ void disassembleChunk(Chunk* chunk, const char* name) {
   }
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-  // constant value is located 1 after chunk offset
-  uint8_t constant_idx = chunk->code[offset + 1];
-
+static int constantInstruction(const char* name, Chunk* chunk, Instruction* instruction, int offset) {
   // print info
-  printf("%-16s %d '", name, constant_idx);
-  printValue(chunk->constants.values[constant_idx]);
+  printf("%-16s %4u '", name, instruction->index);
+  printValue(chunk->constants.values[instruction->index]);
   printf("'\n");
 
   // return new offset
-  return offset + 2;
+  return offset + instruction->length;
 }
 
-static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
-  // constant value is located 1 after chunk offset
-  uint8_t byte1 = chunk->code[offset + 1];
-  uint8_t byte2 = chunk->code[offset + 2] << 8;
-  uint8_t byte3 = chunk->code[offset + 3] << 16;
-  uint32_t index = byte1 | byte2 | byte3;
+static int indexInstruction(const char* name, Instruction* instruction, int offset) {
+  // index operand (e.g. global slot)
+  printf("%-16s %4u\n", name, instruction->index);
+  return offset + instruction->length;
+}
 
-  // print info
-  printf("%-16s %4d '", name, index);
-  printValue(chunk->constants.values[index]);
+static int byteInstruction(const char* name, Instruction* instruction, int offset) {
+  // 1 byte operand (e.g. local slot or argument count)
+  printf("%-16s %4d\n", name, instruction->byte);
+  return offset + instruction->length;
+}
+
+static int jumpInstruction(const char* name, Instruction* instruction, int offset) {
+  // offset relative to the next instruction
+  int next = offset + instruction->length;
+  printf("%-16s %4d -> %d\n", name, offset, next + instruction->jump);
+  return next;
+}
+
+static int nameInstruction(const char* name, Chunk* chunk, Instruction* instruction, int offset) {
+  printf("%-16s %4u '", name, instruction->index);
+  printValue(chunk->constants.values[instruction->index]);
   printf("'\n");
+  return offset + instruction->length;
+}
 
-  // return new offset
-  return offset + 4;
+static int propertyInstruction(const char* name, Chunk* chunk, Instruction* instruction, int offset) {
+  // name constant then inline cache index
+  printf("%-16s %4u '", name, instruction->index);
+  printValue(chunk->constants.values[instruction->index]);
+  printf("' ic %u\n", instruction->cache);
+  return offset + instruction->length;
 }
 
-static int simpleInstruction(const char* name, int offset) {
+static int invokeInstruction(const char* name, Chunk* chunk, Instruction* instruction, int offset,
+                             bool cached) {
+  // name constant, argument count, then inline cache index (if cached)
+  printf("%-16s (%d args) %4u '", name, instruction->byte, instruction->index);
+  printValue(chunk->constants.values[instruction->index]);
+  if (cached) {
+    printf("' ic %u\n", instruction->cache);
+  } else {
+    printf("'\n");
+  }
+  return offset + instruction->length;
+}
+
+static int simpleInstruction(const char* name, Instruction* instruction, int offset) {
   printf("%s\n", name);
-  return offset + 1;
+  return offset + instruction->length;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
@@ -57,41 +85,116 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%4d ", line);
   }
 
-  uint8_t instruction = chunk->code[offset];
-  switch (instruction) {
+  Instruction decoded;
+  Instruction* instruction = &decoded;
+  if (!decodeInstruction(chunk, offset, instruction)) {
+    printf("Unknown opcode %d\n", chunk->code[offset]);
+    return offset + 1;
+  }
+  if (instruction->wide) printf("OP_WIDE ");
+
+  switch (instruction->opcode) {
     case OP_CONSTANT:
-      return constantInstruction("OP_CONSTANT", chunk, offset);
+      return constantInstruction("OP_CONSTANT", chunk, instruction, offset);
     case OP_CONSTANT_LONG:
-      return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+      return constantInstruction("OP_CONSTANT_LONG", chunk, instruction, offset);
     case OP_NIL:
-      return simpleInstruction("OP_NIL", offset);
+      return simpleInstruction("OP_NIL", instruction, offset);
     case OP_TRUE:
-      return simpleInstruction("OP_TRUE", offset);
+      return simpleInstruction("OP_TRUE", instruction, offset);
     case OP_FALSE:
-      return simpleInstruction("OP_FALSE", offset);
+      return simpleInstruction("OP_FALSE", instruction, offset);
+    case OP_POP:
+      return simpleInstruction("OP_POP", instruction, offset);
+    case OP_DEFINE_GLOBAL:
+      return indexInstruction("OP_DEFINE_GLOBAL", instruction, offset);
+    case OP_GET_GLOBAL:
+      return indexInstruction("OP_GET_GLOBAL", instruction, offset);
+    case OP_SET_GLOBAL:
+      return indexInstruction("OP_SET_GLOBAL", instruction, offset);
+    case OP_GET_LOCAL:
+      return byteInstruction("OP_GET_LOCAL", instruction, offset);
+    case OP_SET_LOCAL:
+      return byteInstruction("OP_SET_LOCAL", instruction, offset);
+    case OP_GET_PROPERTY:
+      return propertyInstruction("OP_GET_PROPERTY", chunk, instruction, offset);
+    case OP_SET_PROPERTY:
+      return propertyInstruction("OP_SET_PROPERTY", chunk, instruction, offset);
+    case OP_GET_SUPER:
+      return nameInstruction("OP_GET_SUPER", chunk, instruction, offset);
     case OP_EQUAL:
-      return simpleInstruction("OP_EQUAL", offset);
+      return simpleInstruction("OP_EQUAL", instruction, offset);
     case OP_GREATER:
-      return simpleInstruction("OP_GREATER", offset);
+      return simpleInstruction("OP_GREATER", instruction, offset);
     case OP_LESS:
-      return simpleInstruction("OP_LESS", offset);
+      return simpleInstruction("OP_LESS", instruction, offset);
     case OP_ADD:
-      return simpleInstruction("OP_ADD", offset);
+      return simpleInstruction("OP_ADD", instruction, offset);
     case OP_SUBTRACT:
-      return simpleInstruction("OP_SUBTRACT", offset);
+      return simpleInstruction("OP_SUBTRACT", instruction, offset);
     case OP_MULTIPLY:
-      return simpleInstruction("OP_MULTIPLY", offset);
+      return simpleInstruction("OP_MULTIPLY", instruction, offset);
     case OP_DIVIDE:
-      return simpleInstruction("OP_DIVIDE", offset);
+      return simpleInstruction("OP_DIVIDE", instruction, offset);
     case OP_NOT:
-      return simpleInstruction("OP_NOT", offset);
+      return simpleInstruction("OP_NOT", instruction, offset);
     case OP_NEGATE:
-      return simpleInstruction("OP_NEGATE", offset);
+      return simpleInstruction("OP_NEGATE", instruction, offset);
+    case OP_PRINT:
+      return simpleInstruction("OP_PRINT", instruction, offset);
+    case OP_JUMP:
+      return jumpInstruction("OP_JUMP", instruction, offset);
+    case OP_JUMP_LONG:
+      return jumpInstruction("OP_JUMP_LONG", instruction, offset);
+    case OP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_JUMP_IF_FALSE", instruction, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return jumpInstruction("OP_JUMP_IF_FALSE_LONG", instruction, offset);
+    case OP_JUMP_IF_TRUE:
+      return jumpInstruction("OP_JUMP_IF_TRUE", instruction, offset);
+    case OP_JUMP_IF_TRUE_LONG:
+      return jumpInstruction("OP_JUMP_IF_TRUE_LONG", instruction, offset);
+    case OP_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", instruction, offset);
+    case OP_POP_JUMP_IF_FALSE_LONG:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE_LONG", instruction, offset);
+    case OP_POP_JUMP_IF_TRUE:
+      return jumpInstruction("OP_POP_JUMP_IF_TRUE", instruction, offset);
+    case OP_POP_JUMP_IF_TRUE_LONG:
+      return jumpInstruction("OP_POP_JUMP_IF_TRUE_LONG", instruction, offset);
+    case OP_LOOP:
+      return jumpInstruction("OP_LOOP", instruction, offset);
+    case OP_LOOP_LONG:
+      return jumpInstruction("OP_LOOP_LONG", instruction, offset);
+    case OP_CALL:
+      return byteInstruction("OP_CALL", instruction, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", instruction, offset);
+    case OP_INVOKE:
+      return invokeInstruction("OP_INVOKE", chunk, instruction, offset, true);
+    case OP_SUPER_INVOKE:
+      return invokeInstruction("OP_SUPER_INVOKE", chunk, instruction, offset, false);
     case OP_RETURN:
-      return simpleInstruction("OP_RETURN", offset);
+      return simpleInstruction("OP_RETURN", instruction, offset);
+    case OP_CLASS:
+      return nameInstruction("OP_CLASS", chunk, instruction, offset);
+    case OP_INHERIT:
+      return simpleInstruction("OP_INHERIT", instruction, offset);
+    case OP_METHOD:
+      return nameInstruction("OP_METHOD", chunk, instruction, offset);
+    case OP_ARRAY:
+      return byteInstruction("OP_ARRAY", instruction, offset);
+    case OP_GET_INDEX:
+      return simpleInstruction("OP_GET_INDEX", instruction, offset);
+    case OP_SET_INDEX:
+      return simpleInstruction("OP_SET_INDEX", instruction, offset);
+    case OP_END_MODULE:
+      return simpleInstruction("OP_END_MODULE", instruction, offset);
+    case OP_MEMO_RETURN:
+      return simpleInstruction("OP_MEMO_RETURN", instruction, offset);
     default:
-      printf("Unknown opcode %d\n", instruction);
-      return offset + 1;
+      // decodeInstruction() only accepts known opcodes
+      return offset + instruction->length;
   }
 }
 
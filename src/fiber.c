@@ -0,0 +1,491 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "memory.h"
+#include "vm.h"
+
+// stack slots a new fiber starts with (it grows as calls need more)
+#define FIBER_STACK_SIZE (2 * UINT8_COUNT)
+
+// most bytes a single read() returns
+#define READ_SIZE (64 * 1024)
+
+// most completed reads handled per epoll_wait()
+#define POLL_EVENTS 64
+
+// save the vm's view of the running fiber's stack into the fiber
+static void saveFiber(VM* vm) {
+  vm->fiber->frameCount = vm->frameCount;
+  vm->fiber->stackTop = vm->stackTop;
+}
+
+// make fiber the running fiber
+static void loadFiber(VM* vm, ObjFiber* fiber) {
+  fiber->state = FIBER_RUNNING;
+  vm->fiber = fiber;
+
+  // the profiler's signal handler must never see one fiber's frames with
+  // another's frame count
+  vm->frameCount = 0;
+  SIGNAL_FENCE();
+  vm->frames = fiber->frames;
+  SIGNAL_FENCE();
+  vm->frameCount = fiber->frameCount;
+  vm->frameCapacity = fiber->frameCapacity;
+  vm->stack = fiber->stack;
+  vm->stackTop = fiber->stackTop;
+  vm->stackLimit = fiber->stack + fiber->stackCapacity;
+}
+
+// create a fiber with room for at least slots values
+static ObjFiber* createFiber(VM* vm, int slots) {
+  ObjFiber* fiber = newFiber(vm);
+
+  // link it in first so it is a root while its stack is allocated
+  fiber->nextLive = vm->scheduler.fibers;
+  if (fiber->nextLive != NULL) fiber->nextLive->prevLive = fiber;
+  vm->scheduler.fibers = fiber;
+  vm->scheduler.fiberCount++;
+
+  fiber->frames = ALLOCATE(CallFrame, GROW_CAPACITY(0));
+  fiber->frameCapacity = GROW_CAPACITY(0);
+  int capacity = FIBER_STACK_SIZE;
+  while (capacity < slots) capacity *= 2;
+  fiber->stack = ALLOCATE(Value, capacity);
+  fiber->stackCapacity = capacity;
+  fiber->stackTop = fiber->stack;
+  return fiber;
+}
+
+// drop a finished fiber from the live list
+static void unlinkFiber(VM* vm, ObjFiber* fiber) {
+  if (fiber->prevLive != NULL) {
+    fiber->prevLive->nextLive = fiber->nextLive;
+  } else {
+    vm->scheduler.fibers = fiber->nextLive;
+  }
+  if (fiber->nextLive != NULL) fiber->nextLive->prevLive = fiber->prevLive;
+  fiber->prevLive = NULL;
+  fiber->nextLive = NULL;
+  vm->scheduler.fiberCount--;
+}
+
+// put fiber at the back of the run queue
+static void makeReady(VM* vm, ObjFiber* fiber) {
+  fiber->state = FIBER_READY;
+  fiber->nextWaiting = NULL;
+  if (vm->scheduler.readyTail == NULL) {
+    vm->scheduler.readyHead = fiber;
+  } else {
+    vm->scheduler.readyTail->nextWaiting = fiber;
+  }
+  vm->scheduler.readyTail = fiber;
+}
+
+// create the main fiber and start running on it
+void initScheduler(VM* vm) {
+  vm->scheduler.fibers = NULL;
+  vm->scheduler.fiberCount = 0;
+  vm->scheduler.readyHead = NULL;
+  vm->scheduler.readyTail = NULL;
+  vm->scheduler.readers = 0;
+  vm->scheduler.pollFd = -1;
+
+  vm->mainFiber = createFiber(vm, FIBER_STACK_SIZE);
+  loadFiber(vm, vm->mainFiber);
+}
+
+// abandon every fiber but the main one, which is left with an empty stack
+void resetScheduler(VM* vm) {
+  // abandoned fibers look finished to anything still holding them
+  ObjFiber* fiber = vm->scheduler.fibers;
+  while (fiber != NULL) {
+    ObjFiber* next = fiber->nextLive;
+    fiber->nextWaiting = NULL;
+    fiber->joiners = NULL;
+    fiber->waitChannel = NULL;
+    if (fiber != vm->mainFiber) {
+      fiber->state = FIBER_DONE;
+      unlinkFiber(vm, fiber);
+    }
+    fiber = next;
+  }
+
+  vm->scheduler.readyHead = NULL;
+  vm->scheduler.readyTail = NULL;
+  vm->scheduler.readers = 0;
+  freeScheduler(vm);
+
+  vm->mainFiber->frameCount = 0;
+  vm->mainFiber->stackTop = vm->mainFiber->stack;
+  loadFiber(vm, vm->mainFiber);
+}
+
+// release the scheduler's resources (the fibers belong to the gc)
+void freeScheduler(VM* vm) {
+  if (vm->scheduler.pollFd != -1) {
+    close(vm->scheduler.pollFd);
+    vm->scheduler.pollFd = -1;
+  }
+}
+
+// make room on the running fiber for another call frame
+// (kept out of line, like the rest of the fiber slow paths run() reaches)
+__attribute__((noinline)) bool growFrames(VM* vm) {
+  ObjFiber* fiber = vm->fiber;
+  if (vm->frameCount == FRAMES_MAX) {
+    runtimeError(vm, "Stack overflow.");
+    return false;
+  }
+
+  // copy to a new array rather than reallocating so the frames the
+  // profiler's signal handler can see are never freed under it
+  int capacity = GROW_CAPACITY(fiber->frameCapacity);
+  if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+  CallFrame* frames = ALLOCATE(CallFrame, capacity);
+  memcpy(frames, fiber->frames, sizeof(CallFrame) * vm->frameCount);
+  vm->frames = frames;
+  SIGNAL_FENCE();
+  FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+
+  fiber->frames = frames;
+  fiber->frameCapacity = capacity;
+  vm->frameCapacity = capacity;
+  return true;
+}
+
+// make room for at least slots more values on the running fiber's stack
+__attribute__((noinline)) void growStack(VM* vm, int slots) {
+  ObjFiber* fiber = vm->fiber;
+  int used = (int) (vm->stackTop - vm->stack);
+  int capacity = fiber->stackCapacity * 2;
+  while (capacity - used < slots) capacity *= 2;
+
+  // move to a bigger stack (copying rather than reallocating so the
+  // frames can be pointed at the new stack while the old one is valid)
+  Value* stack = ALLOCATE(Value, capacity);
+  memcpy(stack, vm->stack, sizeof(Value) * used);
+  for (int i = 0; i < vm->frameCount; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+
+  fiber->stack = stack;
+  fiber->stackCapacity = capacity;
+  vm->stack = stack;
+  vm->stackTop = stack + used;
+  vm->stackLimit = stack + capacity;
+}
+
+// finish a read (or receive) that had to wait, the result goes where the
+// call's result belongs. returns false if there still isn't anything to read.
+static bool completeRead(VM* vm, ObjFiber* fiber) {
+  if (fiber->waitChannel != NULL) {
+    Value message;
+    if (!takeMessage(vm, fiber->waitChannel, &message)) return false;
+    fiber->stackTop[-1] = message;
+    fiber->waitChannel = NULL;
+    fiber->waitFd = -1;
+    vm->scheduler.readers--;
+    makeReady(vm, fiber);
+    return true;
+  }
+
+  char buffer[READ_SIZE];
+  ssize_t count = read(fiber->waitFd, buffer, sizeof(buffer));
+  if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+
+  fiber->stackTop[-1] = count > 0 ? OBJ_VAL(copyString(vm, buffer, (int) count)) : NIL_VAL;
+  fiber->waitFd = -1;
+  vm->scheduler.readers--;
+  makeReady(vm, fiber);
+  return true;
+}
+
+// have epoll wake fiber when fd can be read (returns false on failure)
+static bool watchRead(VM* vm, ObjFiber* fiber, int fd) {
+  if (vm->scheduler.pollFd == -1) {
+    vm->scheduler.pollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (vm->scheduler.pollFd == -1) return false;
+  }
+
+  // one shot so a readable fd doesn't wake anyone until it is read again
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = fiber;
+  if (epoll_ctl(vm->scheduler.pollFd, EPOLL_CTL_MOD, fd, &event) == 0) return true;
+  return errno == ENOENT && epoll_ctl(vm->scheduler.pollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+// whether a fiber is waiting for fd to be readable (epoll wakes one fiber
+// per descriptor, so a second would never be woken)
+static bool isWatched(VM* vm, int fd) {
+  for (ObjFiber* fiber = vm->scheduler.fibers; fiber != NULL; fiber = fiber->nextLive) {
+    if (fiber->state == FIBER_WAITING && fiber->waitFd == fd) return true;
+  }
+  return false;
+}
+
+// complete the reads epoll says are ready, waiting at most timeout ms
+// (-1 waits for one). returns false if epoll failed.
+static bool pollReads(VM* vm, int timeout) {
+  struct epoll_event events[POLL_EVENTS];
+  int count = epoll_wait(vm->scheduler.pollFd, events, POLL_EVENTS, timeout);
+  if (count < 0) return errno == EINTR;
+
+  for (int i = 0; i < count; i++) {
+    ObjFiber* fiber = (ObjFiber*) events[i].data.ptr;
+    if (!completeRead(vm, fiber) && !watchRead(vm, fiber, fiber->waitFd)) return false;
+  }
+  return true;
+}
+
+// switch to the next fiber that can run, waiting for reads if necessary
+// (the running fiber must have been saved). returns false after reporting
+// an error.
+static bool runNext(VM* vm) {
+  Scheduler* scheduler = &vm->scheduler;
+  while (scheduler->readyHead == NULL && scheduler->readers > 0) {
+    if (!pollReads(vm, -1)) {
+      runtimeError(vm, "Could not wait for reads: %s.", strerror(errno));
+      return false;
+    }
+  }
+
+  if (scheduler->readyHead != NULL) {
+    ObjFiber* fiber = scheduler->readyHead;
+    scheduler->readyHead = fiber->nextWaiting;
+    if (scheduler->readyHead == NULL) scheduler->readyTail = NULL;
+    fiber->nextWaiting = NULL;
+    loadFiber(vm, fiber);
+    return true;
+  }
+
+  // nothing can run, which is fine once the main script is the only one left
+  if (vm->mainFiber->state == FIBER_DONE && scheduler->fiberCount == 1) {
+    loadFiber(vm, vm->mainFiber);
+    return true;
+  }
+
+  runtimeError(vm, "Deadlock: every fiber is waiting for another to finish.");
+  return false;
+}
+
+// the running fiber's function returned result, switch to the next fiber
+// (kept out of line so run() doesn't pay for it)
+__attribute__((noinline)) bool finishFiber(VM* vm, Value result) {
+  ObjFiber* fiber = vm->fiber;
+  saveFiber(vm);
+  fiber->state = FIBER_DONE;
+
+  // the main fiber stays around to run the next script
+  if (fiber != vm->mainFiber) {
+    fiber->result = result;
+    writeBarrier(vm, (Obj*) fiber, result);
+    unlinkFiber(vm, fiber);
+
+    // hand the result to the join() calls waiting for it
+    ObjFiber* joiner = fiber->joiners;
+    while (joiner != NULL) {
+      ObjFiber* next = joiner->nextWaiting;
+      joiner->stackTop[-1] = result;
+      makeReady(vm, joiner);
+      joiner = next;
+    }
+    fiber->joiners = NULL;
+  }
+
+  return runNext(vm);
+}
+
+// stop running the current fiber in the middle of a native call
+// the call returns nil unless its result is stored before the fiber resumes
+static void suspendCall(VM* vm, Value* args, FiberState state) {
+  args[-1] = NIL_VAL;
+  vm->stackTop = args;
+  saveFiber(vm);
+  vm->fiber->state = state;
+}
+
+// spawn(fn): run fn (taking no arguments) on a new fiber
+static bool spawnNative(VM* vm, int argCount, Value* args) {
+  ObjFunction* function;
+  Value receiver = args[0];
+  if (IS_FUNCTION(args[0])) {
+    function = AS_FUNCTION(args[0]);
+  } else if (IS_BOUND_METHOD(args[0])) {
+    function = AS_BOUND_METHOD(args[0])->method;
+    receiver = AS_BOUND_METHOD(args[0])->receiver;
+  } else {
+    runtimeError(vm, "Can only spawn functions.");
+    return false;
+  }
+
+  if (function->arity != 0) {
+    runtimeError(vm, "Spawned functions can't take arguments.");
+    return false;
+  }
+
+  // set the fiber up as though the function had just been called
+  ObjFiber* fiber = createFiber(vm, function->maxSlots + STACK_RESERVE);
+  *fiber->stackTop++ = receiver;
+  CallFrame* frame = &fiber->frames[fiber->frameCount++];
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  frame->slots = fiber->stack;
+
+  makeReady(vm, fiber);
+  args[-1] = OBJ_VAL(fiber);
+  return true;
+}
+
+// yield(): let the other fibers that are ready run first
+static bool yieldNative(VM* vm, int argCount, Value* args) {
+  // give reads that have finished meanwhile a chance to join the queue
+  if (vm->scheduler.readers > 0 && !pollReads(vm, 0)) {
+    runtimeError(vm, "Could not wait for reads: %s.", strerror(errno));
+    return false;
+  }
+
+  if (vm->scheduler.readyHead == NULL) {
+    args[-1] = NIL_VAL;
+    return true;
+  }
+
+  suspendCall(vm, args, FIBER_READY);
+  makeReady(vm, vm->fiber);
+  return runNext(vm);
+}
+
+// join(fiber): wait for fiber to finish, returns its function's result
+static bool joinNative(VM* vm, int argCount, Value* args) {
+  if (!IS_FIBER(args[0])) {
+    runtimeError(vm, "Can only join fibers.");
+    return false;
+  }
+
+  ObjFiber* fiber = AS_FIBER(args[0]);
+  if (fiber->state == FIBER_DONE) {
+    args[-1] = fiber->result;
+    return true;
+  }
+  if (fiber == vm->fiber) {
+    runtimeError(vm, "A fiber can't join itself.");
+    return false;
+  }
+
+  ObjFiber* current = vm->fiber;
+  suspendCall(vm, args, FIBER_WAITING);
+  current->nextWaiting = fiber->joiners;
+  fiber->joiners = current;
+  return runNext(vm);
+}
+
+// open(path): open a file (or fifo) for reading, returns nil on failure
+static bool openNative(VM* vm, int argCount, Value* args) {
+  if (!IS_ANY_STRING(args[0])) {
+    runtimeError(vm, "Path must be a string.");
+    return false;
+  }
+
+  const char* path;
+  if (IS_ROPE(args[0])) {
+    flattenRope(AS_ROPE(args[0]));
+    path = AS_ROPE(args[0])->chars;
+  } else {
+    path = AS_CSTRING(args[0]);
+  }
+
+  // non-blocking so a read with nothing to read suspends only its fiber
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  args[-1] = fd == -1 ? NIL_VAL : INT_VAL(fd);
+  return true;
+}
+
+// whether fd is a pipe or fifo
+static bool isFifo(int fd) {
+  struct stat info;
+  return fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode);
+}
+
+// read(fd): next chunk of data, nil at the end (or on an error)
+static bool readNative(VM* vm, int argCount, Value* args) {
+  if (!IS_NUMBER(args[0])) {
+    runtimeError(vm, "File descriptor must be a number.");
+    return false;
+  }
+
+  int fd = (int) AS_NUMBER(args[0]);
+  char buffer[READ_SIZE];
+  ssize_t count = read(fd, buffer, sizeof(buffer));
+
+  // a fifo opened without blocking reads as empty until a writer opens it,
+  // so it's only at the end once epoll says the writer hung up (which it
+  // does straight away if one already has)
+  bool ready = count < 0 ? errno != EAGAIN && errno != EWOULDBLOCK : count > 0 || !isFifo(fd);
+  if (ready) {
+    args[-1] = count > 0 ? OBJ_VAL(copyString(vm, buffer, (int) count)) : NIL_VAL;
+    return true;
+  }
+
+  // nothing to read yet, run other fibers until there is
+  if (isWatched(vm, fd)) {
+    runtimeError(vm, "Another fiber is already reading file descriptor %d.", fd);
+    return false;
+  }
+  if (!watchRead(vm, vm->fiber, fd)) {
+    runtimeError(vm, "Could not wait for file descriptor %d: %s.", fd, strerror(errno));
+    return false;
+  }
+  vm->fiber->waitFd = fd;
+  vm->scheduler.readers++;
+  suspendCall(vm, args, FIBER_WAITING);
+  return runNext(vm);
+}
+
+// suspend the running fiber until channel has a message for it
+bool waitForMessage(VM* vm, Value* args, Channel* channel, int fd) {
+  if (isWatched(vm, fd)) {
+    runtimeError(vm, "Another fiber is already receiving from this isolate.");
+    return false;
+  }
+
+  if (!watchRead(vm, vm->fiber, fd)) {
+    runtimeError(vm, "Could not wait for a message: %s.", strerror(errno));
+    return false;
+  }
+  vm->fiber->waitFd = fd;
+  vm->fiber->waitChannel = channel;
+  vm->scheduler.readers++;
+  suspendCall(vm, args, FIBER_WAITING);
+  return runNext(vm);
+}
+
+// close(fd)
+static bool closeNative(VM* vm, int argCount, Value* args) {
+  if (!IS_NUMBER(args[0])) {
+    runtimeError(vm, "File descriptor must be a number.");
+    return false;
+  }
+
+  close((int) AS_NUMBER(args[0]));
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+// define spawn(), yield(), join(), open(), read() and close()
+void defineFiberNatives(VM* vm) {
+  defineNative(vm, "spawn", spawnNative, 1);
+  defineNative(vm, "yield", yieldNative, 0);
+  defineNative(vm, "join", joinNative, 1);
+  defineNative(vm, "open", openNative, 1);
+  defineNative(vm, "read", readNative, 1);
+  defineNative(vm, "close", closeNative, 1);
+}
@@ -0,0 +1,58 @@
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include "common.h"
+#include "isolate.h"
+#include "object.h"
+
+// cooperative scheduler for fibers
+//
+// the top level script runs on the main fiber. spawn() queues a new fiber
+// and the running one keeps going until it yields, joins an unfinished
+// fiber, reads from a file descriptor with no data yet or finishes. reads
+// that have to wait are handed to epoll (as are receives from isolates,
+// see isolate.h), and when nothing else can run the scheduler sleeps in
+// epoll_wait() until one completes. only one fiber at a time can wait on a
+// descriptor (or an isolate), a second one is a runtime error.
+typedef struct {
+  ObjFiber* fibers; // every unfinished fiber (including the main one)
+  int fiberCount;
+
+  // fibers waiting for their turn
+  ObjFiber* readyHead;
+  ObjFiber* readyTail;
+
+  int readers; // fibers waiting on a read or a message
+  int pollFd; // epoll instance (-1 until a read first has to wait)
+} Scheduler;
+
+// create the main fiber and start running on it
+void initScheduler(VM* vm);
+
+// abandon every fiber but the main one, which is left with an empty stack
+void resetScheduler(VM* vm);
+
+// release the scheduler's resources (the fibers belong to the gc)
+void freeScheduler(VM* vm);
+
+// define spawn(), yield(), join(), open(), read() and close()
+void defineFiberNatives(VM* vm);
+
+// make room on the running fiber for another call frame
+// returns false after reporting a stack overflow
+bool growFrames(VM* vm);
+
+// make room for at least slots more values on the running fiber's stack
+void growStack(VM* vm, int slots);
+
+// suspend the running fiber in the middle of the native call with args
+// until channel has a message (fd becomes readable when it might), which
+// the call then returns. returns false after reporting an error
+bool waitForMessage(VM* vm, Value* args, Channel* channel, int fd);
+
+// the running fiber's function returned result, switch to the next fiber
+// (back on the main fiber with an empty stack once every fiber is done)
+// returns false after reporting a deadlock
+bool finishFiber(VM* vm, Value result);
+
+#endif
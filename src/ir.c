@@ -0,0 +1,464 @@
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+
+// sizes stop counting here (sharing can make a dag's tree exponential)
+#define SIZE_LIMIT (1 << 20)
+
+void initIr(Ir* ir) {
+  ir->nodes = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+  ir->operands = NULL;
+  ir->operandCount = 0;
+  ir->operandCapacity = 0;
+  ir->stack = NULL;
+  ir->stackCount = 0;
+  ir->stackCapacity = 0;
+  ir->table = NULL;
+  ir->tableCapacity = 0;
+  ir->tableUsed = 0;
+  ir->epoch = 0;
+  ir->temps = 0;
+}
+
+void freeIr(Ir* ir) {
+  FREE_ARRAY(IrNode, ir->nodes, ir->capacity);
+  FREE_ARRAY(int, ir->operands, ir->operandCapacity);
+  FREE_ARRAY(int, ir->stack, ir->stackCapacity);
+  FREE_ARRAY(int, ir->table, ir->tableCapacity);
+  initIr(ir);
+}
+
+// start a new expression
+// (the new epoch makes the table's entries for the last one stale)
+void beginIr(Ir* ir) {
+  ir->count = 0;
+  ir->operandCount = 0;
+  ir->stackCount = 0;
+  ir->temps = 0;
+  ir->epoch++;
+}
+
+static void pushNode(Ir* ir, int node) {
+  if (ir->stackCapacity < ir->stackCount + 1) {
+    int oldCapacity = ir->stackCapacity;
+    ir->stackCapacity = GROW_CAPACITY(oldCapacity);
+    ir->stack = GROW_ARRAY(int, ir->stack, oldCapacity, ir->stackCapacity);
+  }
+  ir->stack[ir->stackCount++] = node;
+}
+
+// same constant (ints and doubles of equal value are different constants)
+static bool sameValue(Value a, Value b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
+    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    default: return true;
+  }
+}
+
+static uint32_t mix(uint32_t hash, uint64_t bits) {
+  for (int i = 0; i < 8; i++) {
+    hash ^= (uint8_t) (bits >> (i * 8));
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// FNV-1a over everything that makes a node what it is
+static uint32_t hashNode(IrOp op, int* operands, int operandCount, int slot, Value value) {
+  uint32_t hash = mix(2166136261u, (uint64_t) op | ((uint64_t) (uint32_t) slot << 32));
+  for (int i = 0; i < operandCount; i++) hash = mix(hash, (uint64_t) operands[i]);
+
+  uint64_t bits = 0;
+  switch (value.type) {
+    case VAL_BOOL: bits = AS_BOOL(value); break;
+    case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+    case VAL_INT: bits = (uint64_t) AS_INT(value); break;
+    case VAL_OBJ: bits = (uint64_t) (uintptr_t) AS_OBJ(value); break;
+    default: break;
+  }
+  return mix(hash, bits ^ value.type);
+}
+
+static bool matchesNode(Ir* ir, IrNode* node, IrOp op, int* operands, int operandCount, int slot, Value value) {
+  if (node->op != op || node->operandCount != operandCount || node->slot != slot) return false;
+  if (!sameValue(node->value, value)) return false;
+  for (int i = 0; i < operandCount; i++) {
+    if (irOperand(ir, node, i) != operands[i]) return false;
+  }
+  return true;
+}
+
+// entries that refer to nodes of an earlier epoch (or expression) are stale
+static bool staleEntry(Ir* ir, int node) {
+  return node >= ir->count || ir->nodes[node].epoch != ir->epoch;
+}
+
+// find a shared node identical to the one described, -1 if there is none
+// *entry is set to where a new node should go in the table
+static int findNode(Ir* ir, IrOp op, int* operands, int operandCount, int slot, Value value, int* entry) {
+  uint32_t index = hashNode(op, operands, operandCount, slot, value) & (ir->tableCapacity - 1);
+  int reusable = -1;
+  for (;;) {
+    int node = ir->table[index];
+    if (node == -1) {
+      *entry = reusable != -1 ? reusable : (int) index;
+      return -1;
+    }
+    if (staleEntry(ir, node)) {
+      if (reusable == -1) reusable = (int) index;
+    } else if (matchesNode(ir, &ir->nodes[node], op, operands, operandCount, slot, value)) {
+      return node;
+    }
+    index = (index + 1) & (ir->tableCapacity - 1);
+  }
+}
+
+// make room in the table, dropping its stale entries
+static void rebuildTable(Ir* ir) {
+  int capacity = ir->tableCapacity < 16 ? 16 : ir->tableCapacity;
+  while (capacity < ir->count * 4) capacity *= 2;
+
+  ir->table = GROW_ARRAY(int, ir->table, ir->tableCapacity, capacity);
+  ir->tableCapacity = capacity;
+  for (int i = 0; i < capacity; i++) ir->table[i] = -1;
+  ir->tableUsed = 0;
+
+  for (int i = 0; i < ir->count; i++) {
+    IrNode* node = &ir->nodes[i];
+    if (!node->pure || node->epoch != ir->epoch) continue;
+
+    int entry;
+    findNode(ir, node->op, &ir->operands[node->operands], node->operandCount, node->slot, node->value, &entry);
+    ir->table[entry] = i;
+    ir->tableUsed++;
+  }
+}
+
+// add a node, or find the identical shared node
+static int addNode(Ir* ir, IrOp op, int* operands, int operandCount, int slot, Value value, int line) {
+  IrNode* a = operandCount > 0 ? &ir->nodes[operands[0]] : NULL;
+  IrNode* b = operandCount > 1 ? &ir->nodes[operands[1]] : NULL;
+
+  bool pure = false;
+  bool safe = false;
+  bool number = false;
+  bool boolean = false;
+  switch (op) {
+    case IR_CONSTANT:
+      pure = safe = true;
+      number = IS_NUMBER(value);
+      boolean = IS_BOOL(value);
+      break;
+    case IR_GET_LOCAL:
+      pure = safe = true;
+      break;
+    case IR_NEGATE:
+      pure = a->pure;
+      safe = a->safe && a->number;
+      number = true;
+      break;
+    case IR_NOT:
+      pure = a->pure;
+      safe = a->safe;
+      boolean = true;
+      break;
+    case IR_ADD:
+      pure = a->pure && b->pure;
+      number = a->number && b->number;
+      safe = a->safe && b->safe && number;
+      break;
+    case IR_SUBTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE:
+      pure = a->pure && b->pure;
+      safe = a->safe && b->safe && a->number && b->number;
+      number = true;
+      break;
+    case IR_EQUAL:
+      pure = a->pure && b->pure;
+      safe = a->safe && b->safe;
+      boolean = true;
+      break;
+    case IR_GREATER:
+    case IR_LESS:
+      pure = a->pure && b->pure;
+      safe = a->safe && b->safe && a->number && b->number;
+      boolean = true;
+      break;
+    case IR_AND:
+    case IR_OR:
+      pure = a->pure && b->pure;
+      safe = a->safe && b->safe;
+      break;
+    default:
+      break;
+  }
+
+  // identical pure nodes evaluate to the same value
+  int entry = -1;
+  if (pure) {
+    if ((ir->tableUsed + 1) * 2 > ir->tableCapacity) rebuildTable(ir);
+    int existing = findNode(ir, op, operands, operandCount, slot, value, &entry);
+    if (existing != -1) return existing;
+  }
+
+  if (ir->capacity < ir->count + 1) {
+    int oldCapacity = ir->capacity;
+    ir->capacity = GROW_CAPACITY(oldCapacity);
+    ir->nodes = GROW_ARRAY(IrNode, ir->nodes, oldCapacity, ir->capacity);
+  }
+  if (ir->operandCapacity < ir->operandCount + operandCount) {
+    int oldCapacity = ir->operandCapacity;
+    while (ir->operandCapacity < ir->operandCount + operandCount) {
+      ir->operandCapacity = GROW_CAPACITY(ir->operandCapacity);
+    }
+    ir->operands = GROW_ARRAY(int, ir->operands, oldCapacity, ir->operandCapacity);
+  }
+
+  int index = ir->count;
+  IrNode* node = &ir->nodes[index];
+  node->op = op;
+  node->line = line;
+  node->operands = ir->operandCount;
+  node->operandCount = operandCount;
+  node->slot = slot;
+  node->value = value;
+  node->epoch = ir->epoch;
+  node->pure = pure;
+  node->safe = safe;
+  node->number = number;
+  node->boolean = boolean;
+  node->uses = 0;
+  node->size = 0;
+  node->temp = -1;
+  node->emitted = false;
+  for (int i = 0; i < operandCount; i++) ir->operands[ir->operandCount++] = operands[i];
+  ir->count++;
+
+  if (entry != -1) {
+    if (ir->table[entry] == -1) ir->tableUsed++;
+    ir->table[entry] = index;
+  }
+  return index;
+}
+
+static int constantNode(Ir* ir, Value value, int line) {
+  return addNode(ir, IR_CONSTANT, NULL, 0, 0, value, line);
+}
+
+// whether a node is a constant (and its value)
+bool irConstant(Ir* ir, int node, Value* value) {
+  if (ir->nodes[node].op != IR_CONSTANT) return false;
+  *value = ir->nodes[node].value;
+  return true;
+}
+
+// a constant equal to 1 (either representation)
+static bool isOne(Ir* ir, int node) {
+  Value value;
+  return irConstant(ir, node, &value) && IS_NUMBER(value) && AS_NUMBER(value) == 1;
+}
+
+// a constant equal to 0 (either representation)
+static bool isZero(Ir* ir, int node) {
+  Value value;
+  return irConstant(ir, node, &value) && IS_NUMBER(value) && AS_NUMBER(value) == 0;
+}
+
+// evaluate an arithmetic or comparison operator the way the vm does
+// returns false if it would be a runtime error
+static bool foldBinary(IrOp op, Value a, Value b, Value* result) {
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  // ints stay ints unless the result doesn't fit (or is -0)
+  if (IS_INT(a) && IS_INT(b)) {
+    int32_t x = AS_INT(a);
+    int32_t y = AS_INT(b);
+    int32_t r = 0;
+    bool overflow = true;
+    switch (op) {
+      case IR_ADD: overflow = __builtin_add_overflow(x, y, &r); break;
+      case IR_SUBTRACT: overflow = __builtin_sub_overflow(x, y, &r); break;
+      case IR_MULTIPLY:
+        overflow = __builtin_mul_overflow(x, y, &r) || (r == 0 && (x < 0 || y < 0));
+        break;
+      case IR_GREATER: *result = BOOL_VAL(x > y); return true;
+      case IR_LESS: *result = BOOL_VAL(x < y); return true;
+      default: break;
+    }
+    if (!overflow) {
+      *result = INT_VAL(r);
+      return true;
+    }
+  }
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    case IR_ADD: *result = NUMBER_VAL(x + y); return true;
+    case IR_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+    case IR_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+    case IR_DIVIDE: *result = NUMBER_VAL(x / y); return true;
+    case IR_GREATER: *result = BOOL_VAL(x > y); return true;
+    case IR_LESS: *result = BOOL_VAL(x < y); return true;
+    default: return false;
+  }
+}
+
+// algebraic simplification of a node about to be added
+// returns the node to use instead, -1 to add it as it is
+static int simplify(Ir* ir, IrOp op, int* operands, int line) {
+  Value a;
+  Value b;
+  Value result;
+  switch (op) {
+    case IR_NEGATE: {
+      if (irConstant(ir, operands[0], &a) && IS_NUMBER(a)) {
+        // -0 and -INT32_MIN are only representable as doubles
+        if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN) {
+          return constantNode(ir, INT_VAL(-AS_INT(a)), line);
+        }
+        return constantNode(ir, NUMBER_VAL(-AS_NUMBER(a)), line);
+      }
+
+      // - -x is x for numbers
+      IrNode* inner = &ir->nodes[operands[0]];
+      if (inner->op == IR_NEGATE && ir->nodes[irOperand(ir, inner, 0)].number) {
+        return irOperand(ir, inner, 0);
+      }
+      return -1;
+    }
+
+    case IR_NOT: {
+      if (irConstant(ir, operands[0], &a)) return constantNode(ir, BOOL_VAL(isFalsey(a)), line);
+
+      // !!x is x for booleans
+      IrNode* inner = &ir->nodes[operands[0]];
+      if (inner->op == IR_NOT && ir->nodes[irOperand(ir, inner, 0)].boolean) {
+        return irOperand(ir, inner, 0);
+      }
+      return -1;
+    }
+
+    case IR_ADD:
+    case IR_SUBTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE:
+    case IR_GREATER:
+    case IR_LESS: {
+      if (irConstant(ir, operands[0], &a) && irConstant(ir, operands[1], &b) &&
+          foldBinary(op, a, b, &result)) {
+        return constantNode(ir, result, line);
+      }
+
+      // identities that hold for every number (x + 0 isn't one, -0 + 0 is 0)
+      bool leftNumber = ir->nodes[operands[0]].number;
+      bool rightNumber = ir->nodes[operands[1]].number;
+      if (op == IR_MULTIPLY && leftNumber && isOne(ir, operands[1])) return operands[0];
+      if (op == IR_MULTIPLY && rightNumber && isOne(ir, operands[0])) return operands[1];
+      if (op == IR_DIVIDE && leftNumber && isOne(ir, operands[1])) return operands[0];
+      if (op == IR_SUBTRACT && leftNumber && isZero(ir, operands[1])) return operands[0];
+      return -1;
+    }
+
+    case IR_EQUAL:
+      if (irConstant(ir, operands[0], &a) && irConstant(ir, operands[1], &b)) {
+        return constantNode(ir, BOOL_VAL(valuesEqual(a, b)), line);
+      }
+      return -1;
+
+    // a known left operand decides which operand is the result
+    case IR_AND:
+      if (irConstant(ir, operands[0], &a)) return isFalsey(a) ? operands[0] : operands[1];
+      return -1;
+    case IR_OR:
+      if (irConstant(ir, operands[0], &a)) return isFalsey(a) ? operands[1] : operands[0];
+      return -1;
+
+    default:
+      return -1;
+  }
+}
+
+// add an operation taking operandCount operands off the stack
+void irNode(Ir* ir, IrOp op, int operandCount, int slot, Value value, int line) {
+  // a parse error can leave operands missing, nil stands in for them
+  // (the code never runs)
+  while (ir->stackCount < operandCount) pushNode(ir, constantNode(ir, NIL_VAL, line));
+
+  int* operands = &ir->stack[ir->stackCount - operandCount];
+  int node = simplify(ir, op, operands, line);
+  if (node == -1) {
+    node = addNode(ir, op, operands, operandCount, slot, value, line);
+
+    // locals read before an assignment can change value after it, and
+    // nodes evaluated on only one side of a branch can't be reused after
+    // it, so sharing starts over
+    if (op == IR_SET_LOCAL || op == IR_AND || op == IR_OR) ir->epoch++;
+  }
+
+  ir->stackCount -= operandCount;
+  pushNode(ir, node);
+}
+
+// take the finished expression off the stack
+int irRoot(Ir* ir) {
+  if (ir->stackCount == 0) pushNode(ir, constantNode(ir, NIL_VAL, 0));
+  int root = ir->stack[ir->stackCount - 1];
+  ir->stackCount = 0;
+  return root;
+}
+
+// count the uses of the nodes reachable from root and their sizes
+// operands always come before the nodes using them, so a pass down from
+// the root reaches every node after all of its users (and without
+// recursing, since a chain like a + b + c + ... can be arbitrarily deep)
+static void countUses(Ir* ir, int root) {
+  for (int index = root; index >= 0; index--) {
+    IrNode* node = &ir->nodes[index];
+    if (index != root && node->uses == 0) continue;
+    for (int i = 0; i < node->operandCount; i++) ir->nodes[irOperand(ir, node, i)].uses++;
+  }
+
+  // and a pass back up has the sizes of a node's operands ready for it
+  for (int index = 0; index <= root; index++) {
+    IrNode* node = &ir->nodes[index];
+    if (index != root && node->uses == 0) continue;
+
+    // the jumps around the right operand
+    int size = 1;
+    if (node->op == IR_AND) size = 3;
+    if (node->op == IR_OR) size = 5;
+
+    for (int i = 0; i < node->operandCount; i++) size += ir->nodes[irOperand(ir, node, i)].size;
+    node->size = size < SIZE_LIMIT ? size : SIZE_LIMIT;
+  }
+}
+
+// count uses and pick shared nodes to keep in temporaries
+void optimizeIr(Ir* ir, int root, int maxTemps) {
+  countUses(ir, root);
+
+  // a temporary costs three instructions (reserving its slot, setting it
+  // and popping it) and saves size - 1 on each extra use. parents come
+  // after their operands, so bigger subexpressions get the first pick.
+  ir->temps = 0;
+  for (int i = ir->count - 1; i >= 0 && ir->temps < maxTemps; i--) {
+    IrNode* node = &ir->nodes[i];
+    if (!node->pure || node->uses < 2) continue;
+    if ((node->uses - 1) * (node->size - 1) > 3) node->temp = ir->temps++;
+  }
+}
+
+// mark the constants and names held by the nodes
+void markIr(VM* vm, Ir* ir) {
+  for (int i = 0; i < ir->count; i++) markValue(vm, ir->nodes[i].value);
+}
@@ -0,0 +1,119 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "common.h"
+#include "value.h"
+
+// expression ir operations
+typedef enum {
+  IR_CONSTANT, // value (nil, booleans, numbers and strings)
+  IR_GET_LOCAL, // slot
+  IR_SET_LOCAL, // slot = operand 0
+  IR_GET_GLOBAL, // slot
+  IR_SET_GLOBAL, // slot = operand 0
+  IR_GET_PROPERTY, // operand 0 . value
+  IR_SET_PROPERTY, // operand 0 . value = operand 1
+  IR_GET_SUPER, // value looked up from the superclass, operand 0 is this
+  IR_CALL, // operand 0 (the rest are arguments)
+  IR_INVOKE, // operand 0 . value (the rest are arguments)
+  IR_SUPER_INVOKE, // super . value with this as operand 0 (the rest are arguments)
+  IR_ARRAY, // array of the operands
+  IR_GET_INDEX, // operand 0 [operand 1]
+  IR_SET_INDEX, // operand 0 [operand 1] = operand 2
+  IR_NEGATE,
+  IR_NOT,
+  IR_ADD,
+  IR_SUBTRACT,
+  IR_MULTIPLY,
+  IR_DIVIDE,
+  IR_EQUAL,
+  IR_GREATER,
+  IR_LESS,
+  IR_AND, // operand 1 only runs when operand 0 is truthy
+  IR_OR, // operand 1 only runs when operand 0 is falsey
+} IrOp;
+
+// one operation of an expression, operands are other nodes
+typedef struct {
+  IrOp op;
+  int line;
+  int operands; // first of the node's operands in the ir's operand list
+  int operandCount;
+  int slot; // local or global slot
+  Value value; // constant, or the property or method name
+  int epoch; // identical pure nodes of the same epoch are shared
+
+  // what evaluating the node can do
+  bool pure; // only reads constants and locals and has no side effects
+  bool safe; // pure and can't raise a runtime error
+  bool number; // always produces a number
+  bool boolean; // always produces true or false
+
+  // filled in by optimizeIr()
+  int uses; // references from other nodes reachable from the root
+  int size; // instructions evaluating it takes (without sharing)
+  int temp; // slot offset of the temporary holding its value, -1 if none
+  bool emitted; // the temporary has been set
+} IrNode;
+
+// optimizing ir for one expression at a time
+//
+// the parser builds each statement's expression as a dag instead of
+// emitting it straight away. nodes are built bottom up from a stack of
+// operands (mirroring the vm) and simplified as they are added: constant
+// operands are folded and identities like x * 1 are removed. identical
+// pure nodes are shared, which is what finds common subexpressions, and
+// optimizeIr() then decides which shared nodes are worth keeping in a
+// temporary stack slot rather than evaluating again.
+//
+// nodes live in one array reused for every expression (the arena) and
+// refer to each other by index.
+typedef struct {
+  IrNode* nodes;
+  int count;
+  int capacity;
+
+  int* operands; // operand lists of the nodes
+  int operandCount;
+  int operandCapacity;
+
+  int* stack; // nodes whose values haven't been used yet
+  int stackCount;
+  int stackCapacity;
+
+  int* table; // pure nodes by hash (-1 for empty entries)
+  int tableCapacity;
+  int tableUsed; // entries that aren't empty (some may be stale)
+
+  int epoch; // bumped when shared nodes could go out of date
+  int temps; // temporaries the expression uses (set by optimizeIr())
+} Ir;
+
+void initIr(Ir* ir);
+void freeIr(Ir* ir);
+
+// start a new expression
+void beginIr(Ir* ir);
+
+// add an operation taking operandCount operands off the stack and push
+// its result (which may be an existing node after simplification)
+void irNode(Ir* ir, IrOp op, int operandCount, int slot, Value value, int line);
+
+// take the finished expression off the stack, returns its root
+int irRoot(Ir* ir);
+
+// count uses and pick shared nodes to keep in temporaries (at most maxTemps)
+void optimizeIr(Ir* ir, int root, int maxTemps);
+
+// whether a node is a constant (and its value)
+bool irConstant(Ir* ir, int node, Value* value);
+
+// operand i of a node
+static inline int irOperand(Ir* ir, IrNode* node, int i) {
+  return ir->operands[node->operands + i];
+}
+
+// mark the constants and names held by the nodes
+void markIr(VM* vm, Ir* ir);
+
+#endif
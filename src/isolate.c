@@ -0,0 +1,683 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "isolate.h"
+#include "map.h"
+#include "memory.h"
+#include "module.h"
+#include "vm.h"
+
+// deepest nesting of maps in a message
+#define MESSAGE_DEPTH_MAX 256
+
+// what the next value in a message is
+typedef enum {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_INT, // int32_t
+  TAG_NUMBER, // double
+  TAG_STRING, // int32_t length, characters
+  TAG_ARRAY, // int32_t count, doubles
+  TAG_FROZEN, // SharedValues* (holding a reference), int32_t count
+  TAG_MAP, // int32_t count, then count keys and values
+  TAG_REF, // int32_t index of a map earlier in the message
+} Tag;
+
+// a value encoded so it doesn't point into any heap
+typedef struct Message {
+  struct Message* next;
+  size_t size;
+  uint8_t bytes[];
+} Message;
+
+struct Channel {
+  pthread_mutex_t lock;
+  Message* head;
+  Message* tail;
+  bool closed; // no more messages will be queued
+
+  // counts what was queued since the receiver last looked (an epoll
+  // instance can wait on it alongside reads)
+  int eventFd;
+};
+
+struct Isolate {
+  Channel toChild;
+  Channel toParent;
+  char* source;
+
+  // settings it inherits from the vm that started it
+  bool optimize;
+  int maxNesting;
+  uint64_t pauseBudgetNs;
+  FlushPolicy policy;
+  int threads;
+
+  // set once its vm is freed
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  bool finished;
+
+  Isolate* next; // in the pool's queue
+};
+
+// threads that run isolates, kept around for the next ones
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  Isolate* head; // isolates waiting for a thread
+  Isolate* tail;
+  int queued;
+  int threads;
+  int idle; // threads waiting for an isolate
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0, 0};
+
+// message being built by send()
+typedef struct {
+  Message* message;
+  size_t capacity;
+  ObjMap* seen; // maps already in the message -> their index (NULL until the first)
+  int maps;
+  const char* error;
+  uint64_t sharedBytes;
+} Encoder;
+
+// message being taken apart by receive()
+typedef struct {
+  const uint8_t* bytes;
+  const uint8_t* end;
+  ObjMap* refs; // index -> map (NULL until the first)
+  int maps;
+} Decoder;
+
+static void put(Encoder* encoder, const void* bytes, size_t size) {
+  Message* message = encoder->message;
+  if (message->size + size > encoder->capacity) {
+    size_t capacity = encoder->capacity * 2;
+    if (capacity < message->size + size) capacity = message->size + size;
+    message = (Message*) realloc(message, sizeof(Message) + capacity);
+    if (message == NULL) exit(1);
+    encoder->message = message;
+    encoder->capacity = capacity;
+  }
+  memcpy(message->bytes + message->size, bytes, size);
+  message->size += size;
+}
+
+static void putTag(Encoder* encoder, Tag tag) {
+  uint8_t byte = (uint8_t) tag;
+  put(encoder, &byte, 1);
+}
+
+static void putInt(Encoder* encoder, int32_t value) {
+  put(encoder, &value, sizeof(value));
+}
+
+static void encodeValue(VM* vm, Encoder* encoder, Value value, int depth);
+
+static void encodeMap(VM* vm, Encoder* encoder, ObjMap* map, int depth) {
+  // a map met again (shared or in a cycle) refers back to its first copy
+  if (encoder->seen == NULL) {
+    encoder->seen = newMap(vm);
+    push(vm, OBJ_VAL(encoder->seen));
+  }
+  Value index;
+  if (mapGet(vm, encoder->seen, OBJ_VAL(map), &index)) {
+    putTag(encoder, TAG_REF);
+    putInt(encoder, AS_INT(index));
+    return;
+  }
+  if (depth == MESSAGE_DEPTH_MAX) {
+    encoder->error = "Message nests too deeply.";
+    return;
+  }
+  mapSet(vm, encoder->seen, OBJ_VAL(map), INT_VAL(encoder->maps++));
+
+  putTag(encoder, TAG_MAP);
+  putInt(encoder, map->count);
+  for (int i = 0; i < map->capacity && encoder->error == NULL; i++) {
+    if (map->control[i] < 0) continue;
+    encodeValue(vm, encoder, map->entries[i].key, depth + 1);
+    encodeValue(vm, encoder, map->entries[i].value, depth + 1);
+  }
+}
+
+static void encodeValue(VM* vm, Encoder* encoder, Value value, int depth) {
+  switch (value.type) {
+    case VAL_NIL:
+      putTag(encoder, TAG_NIL);
+      return;
+    case VAL_BOOL:
+      putTag(encoder, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+      return;
+    case VAL_INT:
+      putTag(encoder, TAG_INT);
+      putInt(encoder, AS_INT(value));
+      return;
+    case VAL_NUMBER: {
+      double number = AS_DOUBLE(value);
+      putTag(encoder, TAG_NUMBER);
+      put(encoder, &number, sizeof(number));
+      return;
+    }
+    case VAL_OBJ:
+      break;
+    default:
+      encoder->error = "Only numbers, strings, arrays and maps can be sent.";
+      return;
+  }
+
+  if (IS_ANY_STRING(value)) {
+    int length;
+    const char* chars;
+    if (IS_ROPE(value)) {
+      ObjRope* rope = AS_ROPE(value);
+      flattenRope(rope);
+      length = rope->length;
+      chars = rope->chars;
+    } else {
+      ObjString* string = AS_STRING(value);
+      length = string->length;
+      chars = string->chars;
+    }
+    putTag(encoder, TAG_STRING);
+    putInt(encoder, length);
+    put(encoder, chars, length);
+  } else if (IS_ARRAY(value)) {
+    ObjArray* array = AS_ARRAY(value);
+    if (array->shared != NULL) {
+      // the message holds a reference until it's received
+      __atomic_add_fetch(&array->shared->refs, 1, __ATOMIC_RELAXED);
+      putTag(encoder, TAG_FROZEN);
+      put(encoder, &array->shared, sizeof(array->shared));
+      putInt(encoder, array->count);
+      encoder->sharedBytes += sizeof(double) * array->count;
+    } else {
+      putTag(encoder, TAG_ARRAY);
+      putInt(encoder, array->count);
+      put(encoder, array->values, sizeof(double) * array->count);
+    }
+  } else if (IS_MAP(value)) {
+    encodeMap(vm, encoder, AS_MAP(value), depth);
+  } else {
+    encoder->error = "Only numbers, strings, arrays and maps can be sent.";
+  }
+}
+
+static const void* get(Decoder* decoder, size_t size) {
+  const uint8_t* bytes = decoder->bytes;
+  decoder->bytes += size;
+  return bytes;
+}
+
+static int32_t getInt(Decoder* decoder) {
+  int32_t value;
+  memcpy(&value, get(decoder, sizeof(value)), sizeof(value));
+  return value;
+}
+
+// the value next in a message, any object it creates is either returned
+// (and unreachable) or reachable from decoder->refs
+static Value decodeValue(VM* vm, Decoder* decoder) {
+  Tag tag = (Tag) *(const uint8_t*) get(decoder, 1);
+  switch (tag) {
+    case TAG_NIL: return NIL_VAL;
+    case TAG_FALSE: return BOOL_VAL(false);
+    case TAG_TRUE: return BOOL_VAL(true);
+    case TAG_INT: return INT_VAL(getInt(decoder));
+    case TAG_NUMBER: {
+      double number;
+      memcpy(&number, get(decoder, sizeof(number)), sizeof(number));
+      return NUMBER_VAL(number);
+    }
+    case TAG_STRING: {
+      // copyString() reuses a string the receiver already has
+      int length = getInt(decoder);
+      return OBJ_VAL(copyString(vm, (const char*) get(decoder, length), length));
+    }
+    case TAG_ARRAY: {
+      int count = getInt(decoder);
+      ObjArray* array = newArray(vm, count);
+      if (count > 0) memcpy(array->values, get(decoder, sizeof(double) * count), sizeof(double) * count);
+      return OBJ_VAL(array);
+    }
+    case TAG_FROZEN: {
+      // the message's reference becomes the array's
+      SharedValues* shared;
+      memcpy(&shared, get(decoder, sizeof(shared)), sizeof(shared));
+      return OBJ_VAL(newSharedArray(vm, shared, getInt(decoder)));
+    }
+    case TAG_MAP: {
+      int count = getInt(decoder);
+      if (decoder->refs == NULL) {
+        decoder->refs = newMap(vm);
+        push(vm, OBJ_VAL(decoder->refs));
+      }
+      ObjMap* map = newMap(vm);
+      push(vm, OBJ_VAL(map));
+      mapSet(vm, decoder->refs, INT_VAL(decoder->maps++), OBJ_VAL(map));
+      pop(vm);
+
+      // each key goes in first so it's reachable while its value is decoded
+      // (setting its value then doesn't allocate)
+      for (int i = 0; i < count; i++) {
+        Value key = decodeValue(vm, decoder);
+        mapSet(vm, map, key, NIL_VAL);
+        Value value = decodeValue(vm, decoder);
+        mapSet(vm, map, key, value);
+      }
+      return OBJ_VAL(map);
+    }
+    case TAG_REF: {
+      Value map;
+      mapGet(vm, decoder->refs, INT_VAL(getInt(decoder)), &map);
+      return map;
+    }
+  }
+  return NIL_VAL;
+}
+
+// free a message that won't be received, dropping its references to frozen values
+static void discardMessage(Message* message) {
+  Decoder decoder = {message->bytes, message->bytes + message->size, NULL, 0};
+  while (decoder.bytes < decoder.end) {
+    Tag tag = (Tag) *(const uint8_t*) get(&decoder, 1);
+    switch (tag) {
+      case TAG_INT:
+      case TAG_MAP:
+      case TAG_REF:
+        get(&decoder, sizeof(int32_t));
+        break;
+      case TAG_NUMBER:
+        get(&decoder, sizeof(double));
+        break;
+      case TAG_STRING:
+        get(&decoder, getInt(&decoder));
+        break;
+      case TAG_ARRAY:
+        get(&decoder, sizeof(double) * getInt(&decoder));
+        break;
+      case TAG_FROZEN: {
+        SharedValues* shared;
+        memcpy(&shared, get(&decoder, sizeof(shared)), sizeof(shared));
+        get(&decoder, sizeof(int32_t));
+        releaseSharedValues(shared);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  free(message);
+}
+
+static bool initChannel(Channel* channel) {
+  channel->head = NULL;
+  channel->tail = NULL;
+  channel->closed = false;
+  channel->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (channel->eventFd == -1) return false;
+  pthread_mutex_init(&channel->lock, NULL);
+  return true;
+}
+
+static void freeChannel(Channel* channel) {
+  Message* message = channel->head;
+  while (message != NULL) {
+    Message* next = message->next;
+    discardMessage(message);
+    message = next;
+  }
+  close(channel->eventFd);
+  pthread_mutex_destroy(&channel->lock);
+}
+
+// wake the receiver (a failed write means the count is already huge)
+static void signalChannel(Channel* channel) {
+  uint64_t one = 1;
+  ssize_t written = write(channel->eventFd, &one, sizeof(one));
+  (void) written;
+}
+
+// queue message, false (and the message is discarded) if the channel is closed
+static bool postMessage(Channel* channel, Message* message) {
+  message->next = NULL;
+  pthread_mutex_lock(&channel->lock);
+  bool closed = channel->closed;
+  if (!closed) {
+    if (channel->tail == NULL) {
+      channel->head = message;
+    } else {
+      channel->tail->next = message;
+    }
+    channel->tail = message;
+  }
+  pthread_mutex_unlock(&channel->lock);
+
+  if (closed) {
+    discardMessage(message);
+    return false;
+  }
+  signalChannel(channel);
+  return true;
+}
+
+static void closeChannel(Channel* channel) {
+  pthread_mutex_lock(&channel->lock);
+  channel->closed = true;
+  pthread_mutex_unlock(&channel->lock);
+  signalChannel(channel);
+}
+
+// take the next message on channel (nil once it's closed and empty)
+bool takeMessage(VM* vm, Channel* channel, Value* message) {
+  // the count only wakes the receiver, the queue says what there is
+  uint64_t count;
+  ssize_t bytesRead = read(channel->eventFd, &count, sizeof(count));
+  (void) bytesRead;
+
+  pthread_mutex_lock(&channel->lock);
+  Message* taken = channel->head;
+  if (taken != NULL) {
+    channel->head = taken->next;
+    if (channel->head == NULL) channel->tail = NULL;
+  }
+  bool closed = channel->closed;
+  pthread_mutex_unlock(&channel->lock);
+
+  if (taken == NULL) {
+    *message = NIL_VAL;
+    return closed;
+  }
+
+  Decoder decoder = {taken->bytes, taken->bytes + taken->size, NULL, 0};
+  *message = decodeValue(vm, &decoder);
+  if (decoder.refs != NULL) pop(vm);
+  free(taken);
+  vm->isolates.stats.received++;
+  return true;
+}
+
+static void freeIsolate(Isolate* isolate) {
+  freeChannel(&isolate->toChild);
+  freeChannel(&isolate->toParent);
+  pthread_mutex_destroy(&isolate->lock);
+  pthread_cond_destroy(&isolate->done);
+  free(isolate->source);
+  free(isolate);
+}
+
+// run an isolate's script to the end in a vm of its own
+static void runIsolate(Isolate* isolate) {
+  VM vm;
+  initVM(&vm);
+  vm.optimize = isolate->optimize;
+  vm.maxNesting = isolate->maxNesting;
+  vm.gc.pauseBudgetNs = isolate->pauseBudgetNs;
+  vm.output.policy = isolate->policy;
+  vm.isolateThreads = isolate->threads;
+  vm.isolates.handles[0] = isolate;
+
+  // parent is the handle back to the vm that started it
+  push(&vm, OBJ_VAL(copyString(&vm, "parent", 6)));
+  int slot = resolveGlobal(&vm, AS_STRING(vm.stackTop[-1]));
+  vm.globals.values[slot] = INT_VAL(0);
+  pop(&vm);
+
+  InterpretResult result = interpret(&vm, isolate->source);
+  while (result == INTERPRET_YIELD) result = resume(&vm);
+  freeVM(&vm);
+
+  // nothing more will be sent either way (once the parent's receive()
+  // returns nil its send() returns false)
+  closeChannel(&isolate->toChild);
+  closeChannel(&isolate->toParent);
+
+  pthread_mutex_lock(&isolate->lock);
+  isolate->finished = true;
+  pthread_cond_broadcast(&isolate->done);
+  pthread_mutex_unlock(&isolate->lock);
+}
+
+// a pool thread runs the queued isolates, one at a time
+static void* poolThread(void* unused) {
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.head == NULL) {
+      pool.idle++;
+      pthread_cond_wait(&pool.work, &pool.lock);
+      pool.idle--;
+    }
+
+    Isolate* isolate = pool.head;
+    pool.head = isolate->next;
+    if (pool.head == NULL) pool.tail = NULL;
+    pool.queued--;
+
+    pthread_mutex_unlock(&pool.lock);
+    runIsolate(isolate);
+    pthread_mutex_lock(&pool.lock);
+  }
+  return NULL;
+}
+
+// queue isolate for a pool thread, starting one if none is free and the
+// pool can grow. returns false (with errno set) if a thread was needed but
+// couldn't be started
+static bool startIsolate(Isolate* isolate, int threads) {
+  pthread_mutex_lock(&pool.lock);
+  if (pool.queued + 1 > pool.idle && (threads <= 0 || pool.threads < threads)) {
+    // pool threads leave signals (like the profiler's) to the main thread
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int error = pthread_create(&thread, &attributes, poolThread, NULL);
+    pthread_attr_destroy(&attributes);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0) {
+      pthread_mutex_unlock(&pool.lock);
+      errno = error;
+      return false;
+    }
+    pool.threads++;
+  }
+
+  isolate->next = NULL;
+  if (pool.tail == NULL) {
+    pool.head = isolate;
+  } else {
+    pool.tail->next = isolate;
+  }
+  pool.tail = isolate;
+  pool.queued++;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  return true;
+}
+
+// isolate a handle stands for, reports a runtime error for anything else
+static bool getIsolate(VM* vm, Value handle, Isolate** isolate) {
+  if (!IS_NUMBER(handle)) {
+    runtimeError(vm, "Isolate handle must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(handle);
+  if (!(number >= 0 && number < vm->isolates.count) || number != (int) number ||
+      vm->isolates.handles[(int) number] == NULL) {
+    runtimeError(vm, "Unknown isolate.");
+    return false;
+  }
+  *isolate = vm->isolates.handles[(int) number];
+  return true;
+}
+
+// isolate(path): start the script at path in an isolate, returns its handle
+static bool isolateNative(VM* vm, int argCount, Value* args) {
+  if (!IS_ANY_STRING(args[0])) {
+    runtimeError(vm, "Path must be a string.");
+    return false;
+  }
+
+  const char* path;
+  if (IS_ROPE(args[0])) {
+    flattenRope(AS_ROPE(args[0]));
+    path = AS_ROPE(args[0])->chars;
+  } else {
+    path = AS_CSTRING(args[0]);
+  }
+
+  int length;
+  char* source = readSource(path, &length);
+  if (source == NULL) {
+    runtimeError(vm, "Could not read script \"%s\".", path);
+    return false;
+  }
+
+  // room for the handle first, growing it can start a collection
+  Isolates* isolates = &vm->isolates;
+  if (isolates->count == isolates->capacity) {
+    int capacity = GROW_CAPACITY(isolates->capacity);
+    isolates->handles = GROW_ARRAY(Isolate*, isolates->handles, isolates->capacity, capacity);
+    isolates->capacity = capacity;
+  }
+
+  Isolate* isolate = (Isolate*) malloc(sizeof(Isolate));
+  if (isolate == NULL) exit(1);
+  if (!initChannel(&isolate->toChild)) {
+    free(isolate);
+    free(source);
+    runtimeError(vm, "Could not start an isolate: %s.", strerror(errno));
+    return false;
+  }
+  if (!initChannel(&isolate->toParent)) {
+    freeChannel(&isolate->toChild);
+    free(isolate);
+    free(source);
+    runtimeError(vm, "Could not start an isolate: %s.", strerror(errno));
+    return false;
+  }
+  isolate->source = source;
+  isolate->optimize = vm->optimize;
+  isolate->maxNesting = vm->maxNesting;
+  isolate->pauseBudgetNs = vm->gc.pauseBudgetNs;
+  isolate->policy = vm->output.policy;
+  isolate->threads = vm->isolateThreads;
+  pthread_mutex_init(&isolate->lock, NULL);
+  pthread_cond_init(&isolate->done, NULL);
+  isolate->finished = false;
+
+  // output printed so far comes before the isolate's
+  flushOutput(&vm->output);
+  if (!startIsolate(isolate, vm->isolateThreads)) {
+    int error = errno;
+    freeIsolate(isolate);
+    runtimeError(vm, "Could not start an isolate: %s.", strerror(error));
+    return false;
+  }
+
+  isolates->handles[isolates->count] = isolate;
+  args[-1] = INT_VAL(isolates->count++);
+  isolates->stats.spawned++;
+  return true;
+}
+
+// send(handle, value): queue a copy of value for an isolate, false if it
+// has finished (or stopped listening)
+static bool sendNative(VM* vm, int argCount, Value* args) {
+  Isolate* isolate;
+  if (!getIsolate(vm, args[0], &isolate)) return false;
+
+  Encoder encoder;
+  encoder.capacity = 64;
+  encoder.message = (Message*) malloc(sizeof(Message) + encoder.capacity);
+  if (encoder.message == NULL) exit(1);
+  encoder.message->size = 0;
+  encoder.seen = NULL;
+  encoder.maps = 0;
+  encoder.error = NULL;
+  encoder.sharedBytes = 0;
+
+  encodeValue(vm, &encoder, args[1], 0);
+  if (encoder.seen != NULL) pop(vm);
+  if (encoder.error != NULL) {
+    discardMessage(encoder.message);
+    runtimeError(vm, "%s", encoder.error);
+    return false;
+  }
+
+  // handle 0 is the way back to the parent
+  IsolateStats* stats = &vm->isolates.stats;
+  stats->messageBytes += encoder.message->size;
+  stats->sharedBytes += encoder.sharedBytes;
+  Channel* channel = isolate == vm->isolates.handles[0] ? &isolate->toParent : &isolate->toChild;
+  bool sent = postMessage(channel, encoder.message);
+  if (sent) stats->sent++;
+  args[-1] = BOOL_VAL(sent);
+  return true;
+}
+
+// receive(handle): next message from an isolate, nil once it has finished
+// and every message was received
+static bool receiveNative(VM* vm, int argCount, Value* args) {
+  Isolate* isolate;
+  if (!getIsolate(vm, args[0], &isolate)) return false;
+
+  Channel* channel = isolate == vm->isolates.handles[0] ? &isolate->toChild : &isolate->toParent;
+  Value message;
+  if (takeMessage(vm, channel, &message)) {
+    args[-1] = message;
+    return true;
+  }
+
+  // nothing yet, run other fibers until there is
+  return waitForMessage(vm, args, channel, channel->eventFd);
+}
+
+// set up a vm's handles and define isolate(), send() and receive()
+void initIsolates(VM* vm) {
+  Isolates* isolates = &vm->isolates;
+  isolates->capacity = GROW_CAPACITY(0);
+  isolates->handles = ALLOCATE(Isolate*, isolates->capacity);
+  isolates->handles[0] = NULL;
+  isolates->count = 1;
+  IsolateStats noStats = {0};
+  isolates->stats = noStats;
+
+  defineNative(vm, "isolate", isolateNative, 1);
+  defineNative(vm, "send", sendNative, 2);
+  defineNative(vm, "receive", receiveNative, 1);
+}
+
+// tell the vm's isolates no more messages are coming, wait for them to
+// finish and release them
+void freeIsolates(VM* vm) {
+  Isolates* isolates = &vm->isolates;
+  for (int i = 1; i < isolates->count; i++) {
+    Isolate* isolate = isolates->handles[i];
+    closeChannel(&isolate->toChild);
+    closeChannel(&isolate->toParent);
+
+    pthread_mutex_lock(&isolate->lock);
+    while (!isolate->finished) pthread_cond_wait(&isolate->done, &isolate->lock);
+    pthread_mutex_unlock(&isolate->lock);
+    freeIsolate(isolate);
+  }
+  FREE_ARRAY(Isolate*, isolates->handles, isolates->capacity);
+  isolates->handles = NULL;
+  isolates->count = 0;
+  isolates->capacity = 0;
+}
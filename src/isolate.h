@@ -0,0 +1,67 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "value.h"
+
+// isolates: vms running in parallel that share nothing but messages
+//
+// isolate(path) starts the script at path in a vm of its own on another
+// thread and returns a handle to it. send(handle, value) queues a message
+// for it and receive(handle) takes the next one it sent back, waiting
+// (only the calling fiber, others keep running) until there is one. once
+// the other side has finished and every message has been taken receive()
+// returns nil. in an isolate the global parent is the handle to the vm
+// that started it.
+//
+// each isolate has its own heap and collector, so a message can't hold
+// the sender's objects. numbers, booleans and nil are part of the message,
+// strings are copied (or found in the receiver's intern table), mutable
+// arrays and maps are copied (maps deeply, keeping shared and cyclic
+// references). a frozen array (see array.h) isn't copied at all: the
+// receiver gets an array of its own over the same values. nothing else
+// can be sent.
+//
+// isolates run on a pool of threads, a new one is started only when every
+// thread is busy running an isolate. vm->isolateThreads caps the pool, the
+// isolates past it wait for a thread to finish the one it is running (so
+// with a cap, isolates waiting on messages from queued ones deadlock). a
+// vm waits for the isolates it started when it's freed, after telling
+// them no more messages are coming.
+
+// an isolate and the channels to it (defined in isolate.c)
+typedef struct Isolate Isolate;
+
+// messages going one way between two isolates (defined in isolate.c)
+typedef struct Channel Channel;
+
+// message counters (for monitoring)
+typedef struct {
+  uint64_t spawned;
+  uint64_t sent;
+  uint64_t received;
+  uint64_t messageBytes; // bytes of the messages sent (copies of what they hold)
+  uint64_t sharedBytes; // bytes of frozen arrays sent without copying them
+} IsolateStats;
+
+// the isolates a vm can send to, handles index them
+// (handle 0 is the vm's own isolate, NULL in the main vm)
+typedef struct {
+  Isolate** handles;
+  int count;
+  int capacity;
+  IsolateStats stats;
+} Isolates;
+
+// set up a vm's handles and define isolate(), send() and receive()
+void initIsolates(VM* vm);
+
+// tell the vm's isolates no more messages are coming, wait for them to
+// finish and release them
+void freeIsolates(VM* vm);
+
+// take the next message on channel (nil once it's closed and empty)
+// returns false when there is nothing to take yet
+bool takeMessage(VM* vm, Channel* channel, Value* message);
+
+#endif
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jumps.h"
+#include "memory.h"
+
+// rounds of threading and folding (each can enable more of the other)
+#define MAX_ROUNDS 8
+
+// largest offset of the 8 bit forms
+#define NEAR_MAX UINT8_MAX
+
+// what a jump does with its condition
+typedef enum {
+  BRANCH_NONE, // not a jump
+  BRANCH_ALWAYS, // OP_JUMP and OP_LOOP
+  BRANCH_IF_FALSE, // keep the condition
+  BRANCH_IF_TRUE,
+  BRANCH_POP_IF_FALSE, // pop the condition
+  BRANCH_POP_IF_TRUE,
+} Branch;
+
+// an instruction of the chunk being rewritten
+typedef struct {
+  int offset; // in the original code
+  int length; // in the original code
+  uint8_t opcode;
+  Branch branch;
+  int target; // instruction a jump lands on
+  int incoming; // jumps landing on this instruction
+  bool removed;
+  int operandSize; // of a jump: 1, 2, or 4 behind an OP_WIDE prefix
+  int newOffset;
+} Slot;
+
+// forward jumps, indexed by Branch
+static const uint8_t nearCodes[] = {
+  [BRANCH_ALWAYS] = OP_JUMP,
+  [BRANCH_IF_FALSE] = OP_JUMP_IF_FALSE,
+  [BRANCH_IF_TRUE] = OP_JUMP_IF_TRUE,
+  [BRANCH_POP_IF_FALSE] = OP_POP_JUMP_IF_FALSE,
+  [BRANCH_POP_IF_TRUE] = OP_POP_JUMP_IF_TRUE,
+};
+
+static const uint8_t longCodes[] = {
+  [BRANCH_ALWAYS] = OP_JUMP_LONG,
+  [BRANCH_IF_FALSE] = OP_JUMP_IF_FALSE_LONG,
+  [BRANCH_IF_TRUE] = OP_JUMP_IF_TRUE_LONG,
+  [BRANCH_POP_IF_FALSE] = OP_POP_JUMP_IF_FALSE_LONG,
+  [BRANCH_POP_IF_TRUE] = OP_POP_JUMP_IF_TRUE_LONG,
+};
+
+static Branch branchOf(uint8_t opcode) {
+  switch (opcode) {
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+      return BRANCH_ALWAYS;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+      return BRANCH_IF_FALSE;
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_TRUE_LONG:
+      return BRANCH_IF_TRUE;
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE_LONG:
+      return BRANCH_POP_IF_FALSE;
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_TRUE_LONG:
+      return BRANCH_POP_IF_TRUE;
+    default:
+      return BRANCH_NONE;
+  }
+}
+
+// whether a conditional jump leaves its condition on the stack
+static bool keeps(Branch branch) {
+  return branch == BRANCH_IF_FALSE || branch == BRANCH_IF_TRUE;
+}
+
+// whether a conditional jump is taken for truthy values
+static bool whenTrue(Branch branch) {
+  return branch == BRANCH_IF_TRUE || branch == BRANCH_POP_IF_TRUE;
+}
+
+// the same jump, popping its condition
+static Branch popping(Branch branch) {
+  return branch == BRANCH_IF_FALSE ? BRANCH_POP_IF_FALSE : BRANCH_POP_IF_TRUE;
+}
+
+// the first instruction after index that is still there
+static int nextLive(Slot* slots, int count, int index) {
+  do {
+    index++;
+  } while (index < count && slots[index].removed);
+  return index;
+}
+
+// the instruction execution actually reaches at index
+static int live(Slot* slots, int count, int index) {
+  return slots[index].removed ? nextLive(slots, count, index) : index;
+}
+
+// whether the jump at index may land on target. conditional jumps only
+// have forward forms (a wide offset reaches anywhere in a chunk)
+static bool canReach(Slot* slots, int index, int target) {
+  return slots[index].branch == BRANCH_ALWAYS || target > index;
+}
+
+// where the jump at index ends up once jumps at its target are followed.
+// a jump that keeps its condition knows whether it's truthy where it lands,
+// so it can also follow conditional jumps on it. if a popping jump or
+// OP_POP then drops the condition *afterPop is where execution carries on
+// after it (the result is the last place the value was still there),
+// otherwise it's -1
+static int threadTarget(Slot* slots, int count, int index, int* afterPop) {
+  Slot* jump = &slots[index];
+  bool known = keeps(jump->branch);
+  bool truthy = whenTrue(jump->branch);
+  int target = jump->target;
+  *afterPop = -1;
+
+  // a cycle of jumps never gets anywhere, give up on it
+  for (int steps = 0; steps < count; steps++) {
+    target = live(slots, count, target);
+    Slot* at = &slots[target];
+    if (at->branch == BRANCH_ALWAYS) {
+      target = at->target;
+    } else if (!known) {
+      break;
+    } else if (keeps(at->branch)) {
+      target = whenTrue(at->branch) == truthy ? at->target : nextLive(slots, count, target);
+    } else if (at->branch != BRANCH_NONE) {
+      *afterPop = whenTrue(at->branch) == truthy ? at->target : nextLive(slots, count, target);
+      *afterPop = live(slots, count, *afterPop);
+      break;
+    } else {
+      if (at->opcode == OP_POP) *afterPop = nextLive(slots, count, target);
+      break;
+    }
+  }
+  return live(slots, count, target);
+}
+
+// point the jump at index somewhere else
+static void retarget(Slot* slots, int index, int target) {
+  slots[slots[index].target].incoming--;
+  slots[index].target = target;
+  slots[target].incoming++;
+}
+
+// one round of folding and threading, returns false if nothing changed
+static bool rewrite(Slot* slots, int count) {
+  bool changed = false;
+  for (int i = 0; i < count; i++) {
+    Slot* slot = &slots[i];
+    if (slot->removed) continue;
+    int next = nextLive(slots, count, i);
+
+    // OP_NOT then a popping jump nothing else lands on: invert the jump
+    if (slot->opcode == OP_NOT && next < count && slots[next].incoming == 0 &&
+        slots[next].branch != BRANCH_NONE && !keeps(slots[next].branch) &&
+        slots[next].branch != BRANCH_ALWAYS) {
+      slot->branch = whenTrue(slots[next].branch) ? BRANCH_POP_IF_FALSE : BRANCH_POP_IF_TRUE;
+      slot->opcode = nearCodes[slot->branch];
+      slot->target = slots[next].target;
+      slots[next].removed = true;
+      changed = true;
+      continue;
+    }
+    if (slot->branch == BRANCH_NONE) continue;
+
+    int afterPop;
+    int target = threadTarget(slots, count, i, &afterPop);
+    if (afterPop != -1 && afterPop < count && next < count && slots[next].opcode == OP_POP &&
+        slots[next].incoming == 0 && canReach(slots, i, afterPop)) {
+      // the jump and the OP_POP after it pop the condition on both paths
+      slot->branch = popping(slot->branch);
+      slot->opcode = nearCodes[slot->branch];
+      retarget(slots, i, afterPop);
+      slots[next].removed = true;
+      changed = true;
+    } else if (target != slot->target && target < count && canReach(slots, i, target)) {
+      retarget(slots, i, target);
+      changed = true;
+    }
+
+    // a jump to the next instruction that leaves the stack alone does nothing
+    if ((slot->branch == BRANCH_ALWAYS || keeps(slot->branch)) &&
+        live(slots, count, slot->target) == next) {
+      slots[slot->target].incoming--;
+      slot->removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// bytes an instruction takes in the rewritten code
+static int newLength(Slot* slot) {
+  if (slot->removed) return 0;
+  if (slot->branch == BRANCH_NONE) return slot->length;
+  return slot->operandSize == 4 ? 6 : 1 + slot->operandSize;
+}
+
+// offset of a jump from the end of its instruction in the rewritten code
+static int jumpOffset(Slot* slots, int index) {
+  Slot* slot = &slots[index];
+  return slots[slot->target].newOffset - (slot->newOffset + newLength(slot));
+}
+
+// give every instruction its new offset, starting from 8 bit jumps and
+// making the ones that don't reach 16 bits, then the ones that don't reach
+// wide, until none change. jumps only ever get longer so this stops.
+// returns the size of the new code
+static int layout(Slot* slots, int count) {
+  for (;;) {
+    int size = 0;
+    for (int i = 0; i < count; i++) {
+      slots[i].newOffset = size;
+      size += newLength(&slots[i]);
+    }
+
+    bool grew = false;
+    for (int i = 0; i < count; i++) {
+      Slot* slot = &slots[i];
+      if (slot->removed || slot->branch == BRANCH_NONE || slot->operandSize == 4) continue;
+      int offset = abs(jumpOffset(slots, i));
+      if (offset > (slot->operandSize == 1 ? NEAR_MAX : UINT16_MAX)) {
+        slot->operandSize *= 2;
+        grew = true;
+      }
+    }
+    if (!grew) return size;
+  }
+}
+
+void optimizeJumps(Chunk* chunk) {
+  // decode the chunk
+  int count = 0;
+  for (int offset = 0; offset < chunk->count; count++) {
+    Instruction instruction;
+    if (!decodeInstruction(chunk, offset, &instruction)) return;
+    offset += instruction.length;
+  }
+
+  Slot* slots = ALLOCATE(Slot, count);
+  int* indexAt = ALLOCATE(int, chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) indexAt[offset] = -1;
+  for (int i = 0, offset = 0; i < count; i++) {
+    Instruction instruction;
+    decodeInstruction(chunk, offset, &instruction);
+    indexAt[offset] = i;
+    slots[i] = (Slot) {
+      .offset = offset,
+      .length = instruction.length,
+      .opcode = instruction.wide ? OP_WIDE : instruction.opcode,
+      .branch = branchOf(instruction.opcode),
+      .target = offset + instruction.length + instruction.jump,
+      .operandSize = 1,
+    };
+    offset += instruction.length;
+  }
+
+  // find what the jumps land on
+  bool valid = true;
+  for (int i = 0; i < count; i++) {
+    Slot* slot = &slots[i];
+    if (slot->branch == BRANCH_NONE) {
+      slot->target = 0;
+      continue;
+    }
+    if (slot->target < 0 || slot->target >= chunk->count || indexAt[slot->target] == -1) {
+      valid = false;
+      break;
+    }
+    slot->target = indexAt[slot->target];
+    slots[slot->target].incoming++;
+  }
+  FREE_ARRAY(int, indexAt, chunk->count);
+  if (!valid) {
+    FREE_ARRAY(Slot, slots, count);
+    return;
+  }
+
+  for (int round = 0; round < MAX_ROUNDS && rewrite(slots, count); round++);
+  int size = layout(slots, count);
+
+  // the new code and its line runs
+  uint8_t* code = ALLOCATE(uint8_t, size);
+  int lineCount = 0;
+  int lastLine = -1;
+  for (int i = 0; i < count; i++) {
+    if (slots[i].removed) continue;
+    int line = getLine(chunk, slots[i].offset);
+    if (lineCount == 0 || line != lastLine) lineCount++;
+    lastLine = line;
+  }
+  LineStart* lines = ALLOCATE(LineStart, lineCount);
+
+  lineCount = 0;
+  for (int i = 0; i < count; i++) {
+    Slot* slot = &slots[i];
+    if (slot->removed) continue;
+    int line = getLine(chunk, slot->offset);
+    if (lineCount == 0 || line != lines[lineCount - 1].line) {
+      lines[lineCount++] = (LineStart) {slot->newOffset, line};
+    }
+
+    uint8_t* at = code + slot->newOffset;
+    if (slot->branch == BRANCH_NONE) {
+      memcpy(at, chunk->code + slot->offset, slot->length);
+      continue;
+    }
+
+    // backward jumps are loops
+    int offset = jumpOffset(slots, i);
+    bool near = slot->operandSize == 1;
+    if (slot->operandSize == 4) *at++ = OP_WIDE;
+    if (offset < 0) {
+      at[0] = near ? OP_LOOP : OP_LOOP_LONG;
+      offset = -offset;
+    } else {
+      at[0] = near ? nearCodes[slot->branch] : longCodes[slot->branch];
+    }
+    if (slot->operandSize == 4) {
+      at[1] = (offset >> 24) & 0xff;
+      at[2] = (offset >> 16) & 0xff;
+      at[3] = (offset >> 8) & 0xff;
+      at[4] = offset & 0xff;
+    } else if (slot->operandSize == 2) {
+      at[1] = (offset >> 8) & 0xff;
+      at[2] = offset & 0xff;
+    } else {
+      at[1] = (uint8_t) offset;
+    }
+  }
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  chunk->code = code;
+  chunk->count = size;
+  chunk->capacity = size;
+  chunk->lines = lines;
+  chunk->lineCount = lineCount;
+  chunk->lineCapacity = lineCount;
+  FREE_ARRAY(Slot, slots, count);
+}
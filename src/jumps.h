@@ -0,0 +1,31 @@
+#ifndef clox_jumps_h
+#define clox_jumps_h
+
+#include "chunk.h"
+
+// tidy up the jumps of a finished chunk
+//
+// the compiler emits every jump in its wide _LONG form (a 32 bit offset
+// behind OP_WIDE), since how far a forward jump goes isn't known until its
+// target has been compiled. this pass then
+// rewrites the chunk:
+//
+// - jumps to jumps are threaded. an unconditional jump goes straight to
+//   the end of the chain, and a conditional jump that keeps its condition
+//   follows any jumps its target decides with that same value. so in
+//   if (a and b) a false a branches straight to the else branch, and a
+//   conditional jump followed by OP_POP that ends at a popping jump
+//   becomes a single popping jump.
+// - OP_NOT in front of a popping conditional jump is folded into the
+//   inverted jump.
+// - jumps to the next instruction are dropped.
+// - jumps are relaxed: each one takes the 8 bit form unless its offset
+//   doesn't fit, then the 16 bit _LONG form, then the wide one. backward
+//   jumps are always OP_LOOP, so every cycle still goes through an
+//   instruction that spends the time slice.
+//
+// conditional jumps only ever go forward. a chunk that doesn't decode is
+// left for the verifier to reject.
+void optimizeJumps(Chunk* chunk);
+
+#endif
@@ -1,10 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "vm.h"
 
 static void repl(VM* vm) {
@@ -20,7 +25,8 @@ static void repl(VM* vm) {
     }
 
     // otherwise interpret line
-    interpret(vm, line);
+    InterpretResult result = interpret(vm, line);
+    while (result == INTERPRET_YIELD) result = resume(vm);
   }
 }
 
@@ -63,18 +69,29 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
-static void runFile(VM* vm, const char* path) {
+// returns process exit code
+static int runFile(VM* vm, const char* path) {
   // read source from file
   char* source = readFile(path);
 
-  // interpret result
+  // interpret result (a host with more to do would run it between slices)
   InterpretResult result = interpret(vm, source);
+  while (result == INTERPRET_YIELD) result = resume(vm);
 
   // free source from memory
   free(source);
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [--stats] [--optimize] [--gc-pause=<us>] [--time-slice=<ticks>]\n"
+                  "            [--max-nesting=<levels>] [--isolate-threads=<n>]\n"
+                  "            [--profile=<out>] [--profile-hz=<hz>] [--perf-counters]\n"
+                  "            [--snapshot=<in>] [--write-snapshot=<out>] [path]\n");
+  exit(64);
 }
 
 int main(int argc, const char* argv[]) {
@@ -82,18 +99,108 @@ int main(int argc, const char* argv[]) {
   VM vm;
   initVM(&vm);
 
-  // repl
-  if (argc == 1) {
+  // someone is watching, so show each line as soon as it is printed
+  if (isatty(fileno(stdout))) vm.output.policy = FLUSH_LINE;
+
+  // parse options
+  bool stats = false;
+  bool perfCounters = false;
+  const char* profilePath = NULL;
+  const char* snapshotPath = NULL;
+  const char* writeSnapshotPath = NULL;
+  int profileHz = PROFILE_DEFAULT_HZ;
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--optimize") == 0) {
+      // compile through the optimizing ir (slower to compile, faster to run)
+      vm.optimize = true;
+    } else if (strncmp(argv[i], "--gc-pause=", 11) == 0) {
+      // incremental collection pause budget in microseconds
+      vm.gc.pauseBudgetNs = (uint64_t) (strtod(argv[i] + 11, NULL) * 1000);
+    } else if (strncmp(argv[i], "--time-slice=", 13) == 0) {
+      // loop iterations and calls between yields
+      vm.timeSlice = strtoull(argv[i] + 13, NULL, 10);
+    } else if (strncmp(argv[i], "--max-nesting=", 14) == 0) {
+      // how deeply code may nest before it's a compile error
+      vm.maxNesting = atoi(argv[i] + 14);
+    } else if (strncmp(argv[i], "--isolate-threads=", 18) == 0) {
+      // most isolates running in parallel (0 for one thread each)
+      vm.isolateThreads = atoi(argv[i] + 18);
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      // hardware counters per bytecode instruction (or just time where
+      // perf events aren't allowed)
+      perfCounters = true;
+    } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      // file to write sampled call stacks to (collapsed stack format)
+      profilePath = argv[i] + 10;
+    } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+      profileHz = atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+      // start from a snapshot instead of running a prelude
+      snapshotPath = argv[i] + 11;
+    } else if (strncmp(argv[i], "--write-snapshot=", 17) == 0) {
+      // snapshot the globals once the script (e.g. a prelude) has run
+      writeSnapshotPath = argv[i] + 17;
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (snapshotPath != NULL) {
+    const char* problem = loadSnapshot(&vm, snapshotPath);
+    if (problem != NULL) {
+      fprintf(stderr, "Could not load snapshot \"%s\": %s\n", snapshotPath, problem);
+      exit(74);
+    }
+  }
+
+  if (perfCounters) startPerfCounters(&vm);
+  if (profilePath != NULL && !startProfiler(&vm, profileHz)) {
+    fprintf(stderr, "Could not start the profiler.\n");
+    exit(64);
+  }
+
+  // repl or file
+  int status = 0;
+  if (path == NULL) {
     repl(&vm);
-  } else if (argc == 2) {
-    runFile(&vm, argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    status = runFile(&vm, path);
+  }
+
+  if (writeSnapshotPath != NULL && status == 0) {
+    const char* problem = writeSnapshot(&vm, writeSnapshotPath);
+    if (problem != NULL) {
+      fprintf(stderr, "Could not write snapshot \"%s\": %s\n", writeSnapshotPath, problem);
+      status = 74;
+    }
+  }
+
+  if (profilePath != NULL) {
+    stopProfiler(&vm);
+    FILE* out = fopen(profilePath, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", profilePath);
+      status = 74;
+    } else {
+      writeProfile(&vm, out);
+      fclose(out);
+    }
+  }
+
+  // --stats reports the counters along with everything else
+  if (stats) {
+    printStats(&vm, stderr);
+  } else if (perfCounters) {
+    printPerfCounters(vm.perf, stderr);
   }
 
   // destroy VM
   freeVM(&vm);
 
-  return 0;
+  return status;
 }
\ No newline at end of file
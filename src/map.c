@@ -0,0 +1,285 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// entries whose control bytes are compared at once
+#define GROUP_SIZE 16
+
+// control bytes of free entries (used ones hold 7 bits of the key's hash)
+#define CONTROL_EMPTY ((int8_t) -128)
+#define CONTROL_DELETED ((int8_t) -2)
+
+// the control bytes of a group
+typedef int8_t Group __attribute__((vector_size(GROUP_SIZE)));
+
+static inline Group loadGroup(const int8_t* control) {
+  Group group;
+  memcpy(&group, control, sizeof(group));
+  return group;
+}
+
+// bit i set when byte i of a comparison's result is set
+static inline uint32_t groupMask(Group matches) {
+#ifdef __SSE2__
+  return (uint32_t) _mm_movemask_epi8((__m128i) matches);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) mask |= (uint32_t) (matches[i] & 1) << i;
+  return mask;
+#endif
+}
+
+// entries of a group that may hold a key with these hash bits
+static inline uint32_t matchBits(Group group, int8_t bits) {
+  return groupMask(group == bits);
+}
+
+static inline uint32_t matchEmpty(Group group) {
+  return groupMask(group == CONTROL_EMPTY);
+}
+
+// empty and deleted entries
+static inline uint32_t matchFree(Group group) {
+  return groupMask(group < 0);
+}
+
+// entries that can be used before the map grows (7/8 of them)
+static int maxLoad(int capacity) {
+  return capacity - capacity / 8;
+}
+
+// the key a value is stored under: numbers with an int value as ints (so
+// 1 and 1.0 are the same key) and ropes as the interned string of their
+// characters. returns false when the key can't be in any map (a rope
+// whose string isn't interned) unless intern is set, then it interns it
+static bool normalKey(VM* vm, Value key, bool intern, Value* normal) {
+  if (IS_DOUBLE(key)) {
+    double number = AS_DOUBLE(key);
+    if (number >= INT32_MIN && number <= INT32_MAX && number == (double) (int32_t) number) {
+      *normal = INT_VAL((int32_t) number);
+      return true;
+    }
+  } else if (IS_ROPE(key)) {
+    ObjRope* rope = AS_ROPE(key);
+    flattenRope(rope);
+    ObjString* string = tableFindString(&vm->strings, rope->chars, rope->length, rope->hash);
+    if (string == NULL) {
+      if (!intern) return false;
+      string = copyString(vm, rope->chars, rope->length);
+    } else if (intern && vm->gc.phase == GC_SWEEP) {
+      // like copyString(), keep a string found mid-sweep from being freed
+      // while the map holds it
+      string->obj.mark = vm->gc.epoch;
+    }
+    *normal = OBJ_VAL(string);
+    return true;
+  }
+  *normal = key;
+  return true;
+}
+
+// hash of a normalized key
+static uint64_t hashKey(Value key) {
+  uint64_t bits;
+  switch (key.type) {
+    case VAL_BOOL: bits = AS_BOOL(key); break;
+    case VAL_INT: bits = (uint32_t) AS_INT(key); break;
+    case VAL_NUMBER: memcpy(&bits, &key.as.number, sizeof(bits)); break;
+    case VAL_OBJ:
+      bits = IS_STRING(key) ? AS_STRING(key)->hash : (uint64_t) (uintptr_t) AS_OBJ(key);
+      break;
+    default: bits = 0; break;
+  }
+
+  // mix every bit into both the group (high bits) and the control byte (low bits)
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ULL;
+  bits ^= bits >> 33;
+  return bits;
+}
+
+// equality of normalized keys (doubles compare by bits so nan can be a key)
+static inline bool keysEqual(Value a, Value b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
+    case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    default: return true;
+  }
+}
+
+// control byte of a used entry
+static inline int8_t hashBits(uint64_t hash) {
+  return (int8_t) (hash & 0x7f);
+}
+
+// index of key's entry, -1 if map doesn't have key
+// (and then, when free isn't NULL, *free is the first free entry on the
+// key's probe sequence, -1 if it has none, so setting a new key probes once)
+static inline int findEntry(ObjMap* map, Value key, uint64_t hash, int* free) {
+  if (free != NULL) *free = -1;
+  if (map->capacity == 0) return -1;
+
+  // groups are probed triangularly, which visits every group of a power of two
+  uint32_t groupMaskBits = (uint32_t) (map->capacity / GROUP_SIZE - 1);
+  uint32_t group = (uint32_t) (hash >> 7) & groupMaskBits;
+  int8_t bits = hashBits(hash);
+  for (uint32_t step = 1;; step++) {
+    int8_t* control = map->control + group * GROUP_SIZE;
+    Group controls = loadGroup(control);
+    for (uint32_t match = matchBits(controls, bits); match != 0; match &= match - 1) {
+      int index = (int) (group * GROUP_SIZE) + __builtin_ctz(match);
+      if (keysEqual(map->entries[index].key, key)) return index;
+    }
+    if (free != NULL && *free == -1) {
+      uint32_t match = matchFree(controls);
+      if (match != 0) *free = (int) (group * GROUP_SIZE) + __builtin_ctz(match);
+    }
+
+    // a key is never stored past a group with an empty entry
+    if (matchEmpty(controls) != 0) return -1;
+    group = (group + step) & groupMaskBits;
+  }
+}
+
+// index of the first free entry on hash's probe sequence
+static int findFree(int8_t* control, int capacity, uint64_t hash) {
+  uint32_t groupMaskBits = (uint32_t) (capacity / GROUP_SIZE - 1);
+  uint32_t group = (uint32_t) (hash >> 7) & groupMaskBits;
+  for (uint32_t step = 1;; step++) {
+    uint32_t match = matchFree(loadGroup(control + group * GROUP_SIZE));
+    if (match != 0) return (int) (group * GROUP_SIZE) + __builtin_ctz(match);
+    group = (group + step) & groupMaskBits;
+  }
+}
+
+// make room for another entry: double the capacity or, when tombstones
+// take up most of the used entries, rehash at the same size to clear them
+static void growMap(ObjMap* map) {
+  int capacity = map->capacity;
+  if (capacity == 0) {
+    capacity = GROUP_SIZE;
+  } else if (map->count >= maxLoad(capacity) / 2) {
+    capacity *= 2;
+  }
+
+  int8_t* control = ALLOCATE(int8_t, capacity);
+  MapEntry* entries = ALLOCATE(MapEntry, capacity);
+  memset(control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < map->capacity; i++) {
+    if (map->control[i] < 0) continue;
+    int index = findFree(control, capacity, hashKey(map->entries[i].key));
+    control[index] = map->control[i];
+    entries[index] = map->entries[i];
+  }
+
+  FREE_ARRAY(int8_t, map->control, map->capacity);
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->control = control;
+  map->entries = entries;
+  map->capacity = capacity;
+  map->growthLeft = maxLoad(capacity) - map->count;
+}
+
+bool mapGet(VM* vm, ObjMap* map, Value key, Value* value) {
+  if (!normalKey(vm, key, false, &key)) return false;
+  int index = findEntry(map, key, hashKey(key), NULL);
+  if (index == -1) return false;
+  *value = map->entries[index].value;
+  return true;
+}
+
+void mapSet(VM* vm, ObjMap* map, Value key, Value value) {
+  normalKey(vm, key, true, &key);
+  uint64_t hash = hashKey(key);
+  int free;
+  int index = findEntry(map, key, hash, &free);
+  if (index == -1) {
+    // an empty entry can only be used while there's growth left, deleted
+    // ones are reused without using any up
+    if (free == -1 || (map->growthLeft == 0 && map->control[free] == CONTROL_EMPTY)) {
+      // a string interned for a rope key is only reachable from here
+      push(vm, key);
+      growMap(map);
+      pop(vm);
+      free = findFree(map->control, map->capacity, hash);
+    }
+    index = free;
+    if (map->control[index] == CONTROL_EMPTY) map->growthLeft--;
+    map->control[index] = hashBits(hash);
+    map->entries[index].key = key;
+    map->count++;
+    writeBarrier(vm, (Obj*) map, key);
+  }
+  map->entries[index].value = value;
+  writeBarrier(vm, (Obj*) map, value);
+}
+
+bool mapDelete(VM* vm, ObjMap* map, Value key) {
+  if (!normalKey(vm, key, false, &key)) return false;
+  int index = findEntry(map, key, hashKey(key), NULL);
+  if (index == -1) return false;
+
+  // lookups stop at a group with an empty entry, so no key was ever stored
+  // past this one's group and its entry can just become empty again
+  int8_t* group = map->control + (index & ~(GROUP_SIZE - 1));
+  if (matchEmpty(loadGroup(group)) != 0) {
+    map->control[index] = CONTROL_EMPTY;
+    map->growthLeft++;
+  } else {
+    map->control[index] = CONTROL_DELETED;
+  }
+  map->entries[index].key = NIL_VAL;
+  map->entries[index].value = NIL_VAL;
+  map->count--;
+  return true;
+}
+
+// the map a method was called on (the native's callee slot)
+#define RECEIVER(args) AS_MAP((args)[-1])
+
+// map(): a new empty map
+static bool mapNative(VM* vm, int argCount, Value* args) {
+  args[-1] = OBJ_VAL(newMap(vm));
+  return true;
+}
+
+// has(k): whether the map has key k
+static bool hasMethod(VM* vm, int argCount, Value* args) {
+  Value value;
+  args[-1] = BOOL_VAL(mapGet(vm, RECEIVER(args), args[0], &value));
+  return true;
+}
+
+// remove(k): remove key k, true if the map had it
+static bool removeMethod(VM* vm, int argCount, Value* args) {
+  args[-1] = BOOL_VAL(mapDelete(vm, RECEIVER(args), args[0]));
+  return true;
+}
+
+// count(): number of keys
+static bool countMethod(VM* vm, int argCount, Value* args) {
+  args[-1] = INT_VAL(RECEIVER(args)->count);
+  return true;
+}
+
+#undef RECEIVER
+
+void defineMapNatives(VM* vm) {
+  defineNative(vm, "map", mapNative, 0);
+  defineMethod(vm, &vm->mapMethods, "has", hasMethod, 1);
+  defineMethod(vm, &vm->mapMethods, "remove", removeMethod, 1);
+  defineMethod(vm, &vm->mapMethods, "count", countMethod, 0);
+}
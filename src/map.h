@@ -0,0 +1,36 @@
+#ifndef clox_map_h
+#define clox_map_h
+
+#include "common.h"
+#include "object.h"
+
+// hash maps
+//
+// map() makes an empty map. m[k] is the value of key k (nil if there is
+// none) and m[k] = v sets it. its methods are has(k), remove(k) (true if k
+// was there) and count(). any value can be a key: strings and numbers by
+// value (1 and 1.0 are the same key), other objects by identity.
+//
+// maps are swiss tables: open addressing where every entry has a control
+// byte, either free or seven bits of its key's hash. a lookup loads the
+// control bytes of a group of 16 entries at once, compares them all with
+// the key's bits in one simd comparison and only looks at the keys of the
+// entries that match. probing stops at the first group with an empty entry.
+// removing an entry from a group that has an empty entry leaves it empty
+// (no probe ever went past that group), only entries of full groups become
+// tombstones. string keys use the hash strings already cache.
+
+// value of key in map, false if map doesn't have key
+bool mapGet(VM* vm, ObjMap* map, Value key, Value* value);
+
+// set key to value in map
+// map, key and value must be reachable since this allocates
+void mapSet(VM* vm, ObjMap* map, Value key, Value value);
+
+// remove key from map, false if map didn't have key
+bool mapDelete(VM* vm, ObjMap* map, Value key);
+
+// define map() and the methods of maps
+void defineMapNatives(VM* vm);
+
+#endif
@@ -0,0 +1,292 @@
+#include <string.h>
+
+#include "memo.h"
+#include "memory.h"
+#include "vm.h"
+
+// keys compare by bits, whatever is left of the union past the type's
+// member doesn't count
+static inline bool sameBits(Value a, Value b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
+    case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    default: return true;
+  }
+}
+
+// hash of the arguments
+static uint64_t hashArguments(Value* args, int argCount) {
+  uint64_t hash = 0;
+  for (int i = 0; i < argCount; i++) {
+    uint64_t bits;
+    switch (args[i].type) {
+      case VAL_BOOL: bits = AS_BOOL(args[i]); break;
+      case VAL_INT: bits = (uint32_t) AS_INT(args[i]); break;
+      case VAL_NUMBER: memcpy(&bits, &args[i].as.number, sizeof(bits)); break;
+      case VAL_OBJ: bits = (uint64_t) (uintptr_t) AS_OBJ(args[i]); break;
+      default: bits = 0; break;
+    }
+    hash = (hash ^ bits ^ args[i].type) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  // mix every bit into the low bits that pick the set
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// the keys of entry (NULL for a function without parameters)
+static inline Value* entryKeys(MemoCache* memo, int entry) {
+  return memo->arity == 0 ? NULL : &memo->keys[entry * memo->arity];
+}
+
+// empty the cache. the calls still running keep their entries (nothing
+// else could take them over while they return) but their results are dropped
+static void clearMemo(VM* vm, MemoCache* memo) {
+  for (int i = 0; i < MEMO_ENTRIES; i++) {
+    MemoEntry* entry = &memo->entries[i];
+    entry->used = false;
+    entry->result = NIL_VAL;
+    if (entry->pending == vm->memoEpoch) {
+      entry->stale = true;
+      continue;
+    }
+    entry->pending = 0;
+    Value* keys = entryKeys(memo, i);
+    for (int j = 0; j < memo->arity; j++) keys[j] = NIL_VAL;
+  }
+}
+
+// note that function depends on the global in slot, which holds value
+static void addDependency(VM* vm, ObjFunction* function, MemoCache* memo, int slot, Value value) {
+  if (memo->dependencyCount == memo->dependencyCapacity) {
+    int oldCapacity = memo->dependencyCapacity;
+    memo->dependencyCapacity = GROW_CAPACITY(oldCapacity);
+    memo->slots = GROW_ARRAY(int, memo->slots, oldCapacity, memo->dependencyCapacity);
+    memo->values = GROW_ARRAY(Value, memo->values, oldCapacity, memo->dependencyCapacity);
+  }
+  memo->slots[memo->dependencyCount] = slot;
+  memo->values[memo->dependencyCount] = value;
+  memo->dependencyCount++;
+  writeBarrier(vm, (Obj*) function, value);
+}
+
+// collect the globals function reads, the globals the functions they hold
+// read and so on. returns the slot of one that doesn't hold a pure
+// function, -1 when they all do
+static int collectDependencies(VM* vm, ObjFunction* function, MemoCache* memo) {
+  memo->dependencyCount = 0;
+
+  // the functions found are read in turn, after function itself
+  for (int next = 0; next <= memo->dependencyCount; next++) {
+    ObjFunction* reader = next == 0 ? function : AS_FUNCTION(memo->values[next - 1]);
+    Chunk* chunk = &reader->chunk;
+    Instruction instruction;
+    for (int offset = 0; offset < chunk->count; offset += instruction.length) {
+      decodeInstruction(chunk, offset, &instruction);
+      if (instruction.opcode != OP_GET_GLOBAL) continue;
+
+      int slot = (int) instruction.index;
+      Value value = vm->globals.values[slot];
+      if (!IS_FUNCTION(value) || !AS_FUNCTION(value)->pure) return slot;
+
+      bool known = false;
+      for (int i = 0; i < memo->dependencyCount && !known; i++) {
+        known = memo->slots[i] == slot;
+      }
+      if (!known) addDependency(vm, function, memo, slot, value);
+    }
+  }
+  return -1;
+}
+
+// whether the globals function depends on still hold what they did
+static inline bool dependenciesHold(VM* vm, MemoCache* memo) {
+  for (int i = 0; i < memo->dependencyCount; i++) {
+    if (!sameBits(vm->globals.values[memo->slots[i]], memo->values[i])) return false;
+  }
+  return true;
+}
+
+static MemoCache* newMemo(int arity) {
+  MemoCache* memo = ALLOCATE(MemoCache, 1);
+  memo->arity = arity;
+  memo->stopped = false;
+  memo->entries = NULL;
+  memo->keys = NULL;
+  memo->slots = NULL;
+  memo->values = NULL;
+  memo->dependencyCount = 0;
+  memo->dependencyCapacity = 0;
+  memo->hits = 0;
+  memo->misses = 0;
+  memset(memo->next, 0, sizeof(memo->next));
+
+  memo->entries = ALLOCATE(MemoEntry, MEMO_ENTRIES);
+  for (int i = 0; i < MEMO_ENTRIES; i++) {
+    memo->entries[i].result = NIL_VAL;
+    memo->entries[i].pending = 0;
+    memo->entries[i].used = false;
+    memo->entries[i].stale = false;
+  }
+  if (arity > 0) {
+    memo->keys = ALLOCATE(Value, MEMO_ENTRIES * arity);
+    for (int i = 0; i < MEMO_ENTRIES * arity; i++) memo->keys[i] = NIL_VAL;
+  }
+  return memo;
+}
+
+void freeMemo(MemoCache* memo) {
+  if (memo == NULL) return;
+  FREE_ARRAY(MemoEntry, memo->entries, MEMO_ENTRIES);
+  FREE_ARRAY(Value, memo->keys, MEMO_ENTRIES * memo->arity);
+  FREE_ARRAY(int, memo->slots, memo->dependencyCapacity);
+  FREE_ARRAY(Value, memo->values, memo->dependencyCapacity);
+  FREE(MemoCache, memo);
+}
+
+void markMemo(VM* vm, MemoCache* memo) {
+  for (int i = 0; i < MEMO_ENTRIES; i++) {
+    if (memo->entries[i].used) markValue(vm, memo->entries[i].result);
+  }
+  for (int i = 0; i < MEMO_ENTRIES * memo->arity; i++) {
+    markValue(vm, memo->keys[i]);
+  }
+  for (int i = 0; i < memo->dependencyCount; i++) {
+    markValue(vm, memo->values[i]);
+  }
+}
+
+// look up the arguments on top of the stack in a memoized function's cache
+bool memoLookup(VM* vm, ObjFunction* function, int argCount, bool reserve) {
+  MemoCache* memo = function->memo;
+  if (!memo->stopped && !dependenciesHold(vm, memo)) {
+    memo->stopped = collectDependencies(vm, function, memo) >= 0;
+    clearMemo(vm, memo);
+  }
+  if (memo->stopped) return false;
+
+  Value* args = vm->stackTop - argCount;
+  int set = (int) (hashArguments(args, argCount) & (MEMO_SETS - 1));
+  for (int way = 0; way < MEMO_WAYS; way++) {
+    int index = set * MEMO_WAYS + way;
+    MemoEntry* entry = &memo->entries[index];
+    if (!entry->used) continue;
+
+    Value* keys = entryKeys(memo, index);
+    bool same = true;
+    for (int i = 0; i < argCount && same; i++) same = sameBits(keys[i], args[i]);
+    if (same) {
+      memo->hits++;
+      args[-1] = entry->result;
+      vm->stackTop = args;
+      return true;
+    }
+  }
+  memo->misses++;
+  if (!reserve) return false;
+
+  // reserve an entry no running call has for the arguments
+  for (int tries = 0; tries < MEMO_WAYS; tries++) {
+    int way = memo->next[set];
+    memo->next[set] = (uint8_t) ((way + 1) % MEMO_WAYS);
+    int index = set * MEMO_WAYS + way;
+    MemoEntry* entry = &memo->entries[index];
+    if (entry->pending == vm->memoEpoch) continue;
+
+    entry->used = false;
+    entry->result = NIL_VAL;
+    entry->pending = vm->memoEpoch;
+    entry->stale = false;
+    Value* keys = entryKeys(memo, index);
+    for (int i = 0; i < argCount; i++) {
+      keys[i] = args[i];
+      writeBarrier(vm, (Obj*) function, args[i]);
+    }
+    args[-1] = INT_VAL(index);
+    break;
+  }
+  return false;
+}
+
+// store the result of a call that reserved entry
+void memoStore(VM* vm, ObjFunction* function, int index, Value result) {
+  // (a snapshot could claim any function is pure, so the index is checked)
+  if (index < 0 || index >= MEMO_ENTRIES) return;
+  MemoEntry* entry = &function->memo->entries[index];
+  if (entry->pending != vm->memoEpoch) return;
+
+  entry->pending = 0;
+  if (entry->stale) {
+    entry->stale = false;
+    return;
+  }
+  entry->result = result;
+  entry->used = true;
+  writeBarrier(vm, (Obj*) function, result);
+}
+
+// give up an entry a call reserved without storing a result
+void memoRelease(VM* vm, ObjFunction* function, int index) {
+  if (index < 0 || index >= MEMO_ENTRIES) return;
+  MemoEntry* entry = &function->memo->entries[index];
+  if (entry->pending != vm->memoEpoch) return;
+  entry->pending = 0;
+  entry->stale = false;
+}
+
+// memoize(fn): cache fn's results from now on, returns fn
+static bool memoizeNative(VM* vm, int argCount, Value* args) {
+  (void) argCount;
+  if (!IS_FUNCTION(args[0])) {
+    runtimeError(vm, "Only functions can be memoized.");
+    return false;
+  }
+
+  ObjFunction* function = AS_FUNCTION(args[0]);
+  const char* name = function->name == NULL ? "script" : function->name->chars;
+  if (!function->pure) {
+    runtimeError(vm, "Can't memoize '%s', it isn't pure.", name);
+    return false;
+  }
+
+  // memoizing again empties the cache and starts it over if it had stopped
+  MemoCache* memo = function->memo != NULL ? function->memo : newMemo(function->arity);
+  int slot = collectDependencies(vm, function, memo);
+  if (slot >= 0) {
+    if (memo != function->memo) freeMemo(memo);
+    runtimeError(vm, "Can't memoize '%s', it depends on '%s', which isn't a pure function.",
+                 name, AS_STRING(vm->globalNames.values[slot])->chars);
+    return false;
+  }
+  if (memo == function->memo) {
+    memo->stopped = false;
+    clearMemo(vm, memo);
+    args[-1] = args[0];
+    return true;
+  }
+
+  // returns store the result of the call (tail calls are followed by a
+  // return as well, which is where a hit in tail position is stored)
+  Chunk* chunk = &function->chunk;
+  Instruction instruction;
+  for (int offset = 0; offset < chunk->count; offset += instruction.length) {
+    decodeInstruction(chunk, offset, &instruction);
+    if (instruction.opcode == OP_RETURN) chunk->code[offset] = OP_MEMO_RETURN;
+  }
+
+  function->memo = memo;
+  writeValueArray(&vm->memoized, args[0]);
+  args[-1] = args[0];
+  return true;
+}
+
+void defineMemoNatives(VM* vm) {
+  defineNative(vm, "memoize", memoizeNative, 1);
+}
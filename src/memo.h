@@ -0,0 +1,89 @@
+#ifndef clox_memo_h
+#define clox_memo_h
+
+#include "common.h"
+#include "object.h"
+
+// memoization of pure functions
+//
+// the compiler marks a function pure when its code only reads and writes
+// its parameters and locals, loads constants, does arithmetic and
+// comparisons, branches, and calls globals (see endCompiler). what it calls
+// can't be known until it runs, so memoize(fn) checks that every global fn
+// reads holds a pure function, and every global those read, and so on.
+// from then on calls to fn look their arguments up in a cache of earlier
+// results before running it.
+//
+// the cache is keyed on the bits of the arguments (strings are interned so
+// equal strings match, an int and a double never do, nor 0 and -0) and is
+// bounded: MEMO_SETS sets of MEMO_WAYS entries, replaced round robin. a
+// call that misses reserves an entry for its arguments and leaves its index
+// in its callee slot (which pure code never reads), and the function's
+// returns (OP_MEMO_RETURN) store the result there. entries whose calls are
+// still running aren't replaced, when a whole set is taken the call just
+// isn't cached.
+//
+// the globals fn depends on are checked on every call. when one changed
+// the cache is emptied, or memoization stops if what it holds now isn't a
+// pure function (memoize() again to start it over).
+//
+// tail calls still reuse the frame, so memoized recursion runs in constant
+// stack. a tail call of the same function carries the entry of the call it
+// replaces on to the new one, so the result is stored for the outermost
+// arguments (the ones in between aren't cached). a tail call of anything
+// else gives the entry up, and a memoized callee reserves one of its own.
+// a hit in tail position is returned straight away.
+//
+// a snapshot keeps the code but not the caches.
+
+#define MEMO_SETS 256
+#define MEMO_WAYS 4
+#define MEMO_ENTRIES (MEMO_SETS * MEMO_WAYS)
+
+// one cached result
+typedef struct {
+  Value result;
+  uint64_t pending; // vm->memoEpoch of the call computing it, 0 when there is none
+  bool used; // result is the function's result for the entry's keys
+  bool stale; // the cache was emptied while it was pending, its result isn't kept
+} MemoEntry;
+
+// results of a memoized function
+typedef struct MemoCache {
+  int arity;
+  bool stopped; // a global it depends on isn't a pure function anymore
+  MemoEntry* entries; // MEMO_ENTRIES, set by set
+  Value* keys; // arity arguments per entry
+  uint8_t next[MEMO_SETS]; // way each set replaces next
+
+  // globals the function depends on and what they held when checked
+  int* slots;
+  Value* values;
+  int dependencyCount;
+  int dependencyCapacity;
+
+  uint64_t hits;
+  uint64_t misses;
+} MemoCache;
+
+// the memoize() native
+void defineMemoNatives(VM* vm);
+
+// look up the arguments on top of the stack in a memoized function's cache
+// on a hit the result replaces the callee and arguments, and it returns true.
+// on a miss, when reserve is set, the callee slot gets an entry to store into
+bool memoLookup(VM* vm, ObjFunction* function, int argCount, bool reserve);
+
+// store the result of a call that reserved entry
+void memoStore(VM* vm, ObjFunction* function, int entry, Value result);
+
+// give up the entry a call reserved without storing a result
+void memoRelease(VM* vm, ObjFunction* function, int entry);
+
+// mark the values a cache holds on to
+void markMemo(VM* vm, MemoCache* memo);
+
+// free a cache (NULL is fine)
+void freeMemo(MemoCache* memo);
+
+#endif
@@ -1,8 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "compiler.h"
+#include "memo.h"
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// initial collector tuning
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_FIRST_MAJOR (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_STEP_BYTES (64 * 1024)
+#define GC_PAUSE_BUDGET_NS 1000000
+
+// objects traced or swept between checks of the pause budget
+#define GC_WORK_UNIT 128
+
+// heap that reallocate() accounts to (per thread, see isolate.h)
+static __thread VM* heap = NULL;
+
+static void incrementalStep(VM* vm);
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  VM* vm = heap;
+  if (vm != NULL) {
+    vm->gc.bytesAllocated += newSize - oldSize;
+
+    // only collect when growing (freeing memory can't trigger a collection)
+    if (newSize > oldSize) {
+      if (vm->gc.bytesAllocated > vm->gc.stats.peakBytes) {
+        vm->gc.stats.peakBytes = vm->gc.bytesAllocated;
+      }
+
+#ifdef DEBUG_STRESS_GC
+      if (vm->gc.phase == GC_IDLE) {
+        minorCollection(vm);
+        if (vm->gc.stats.minorCollections % 16 == 0) vm->gc.nextMajor = 0;
+      }
+      vm->gc.stepDebt = GC_STEP_BYTES;
+#endif
+
+      vm->gc.stepDebt += newSize - oldSize;
+      if (vm->gc.phase != GC_IDLE) {
+        // pay for the allocation with a slice of the major collection
+        if (vm->gc.stepDebt >= GC_STEP_BYTES) incrementalStep(vm);
+      } else if (vm->gc.nurseryBytes > vm->gc.nurserySize) {
+        minorCollection(vm);
+      } else if (vm->gc.bytesAllocated > vm->gc.nextMajor) {
+        incrementalStep(vm);
+      }
+    }
+  }
+
   // delete pointer if newSize is zero
   if (newSize == 0) {
     free(pointer);
@@ -17,4 +70,464 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 
   // return result
   return result;
-}
\ No newline at end of file
+}
+
+// make vm the heap that reallocate() accounts to and collects
+void useHeap(VM* vm) {
+  heap = vm;
+}
+
+// count memory the heap holds on to without having allocated it
+void accountBytes(ptrdiff_t bytes) {
+  if (heap != NULL) heap->gc.bytesAllocated += bytes;
+}
+
+// initialize collector state
+void initGC(GC* gc) {
+  gc->phase = GC_IDLE;
+  gc->nursery = NULL;
+  gc->objects = NULL;
+  gc->epoch = 1;
+  gc->bytesAllocated = 0;
+  gc->nurseryBytes = 0;
+  gc->nurserySize = GC_NURSERY_SIZE;
+  gc->nextMajor = GC_FIRST_MAJOR;
+  gc->stepDebt = 0;
+  gc->pauseBudgetNs = GC_PAUSE_BUDGET_NS;
+#ifdef DEBUG_STRESS_GC
+  // smallest possible slices
+  gc->pauseBudgetNs = 0;
+#endif
+  gc->grayCount = 0;
+  gc->grayCapacity = 0;
+  gc->grayStack = NULL;
+  gc->rememberedCount = 0;
+  gc->rememberedCapacity = 0;
+  gc->remembered = NULL;
+  gc->sweep = NULL;
+
+  GCStats empty = {0};
+  gc->stats = empty;
+}
+
+// monotonic time in nanoseconds
+static uint64_t nanoTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// record the length of a pause
+static void recordPause(GC* gc, uint64_t ns) {
+  gc->stats.totalPauseNs += ns;
+  if (ns > gc->stats.maxPauseNs) gc->stats.maxPauseNs = ns;
+
+  // find power of 2 bucket for pause in microseconds
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && us >= ((uint64_t) 1 << bucket)) bucket++;
+  gc->stats.pauseHistogram[bucket]++;
+}
+
+// push object onto a growable array of objects
+// (these use the system allocator so growing them can't start a collection)
+static void pushObject(Obj*** array, int* count, int* capacity, Obj* object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *array = (Obj**) realloc(*array, sizeof(Obj*) * *capacity);
+    if (*array == NULL) exit(1);
+  }
+  (*array)[(*count)++] = object;
+}
+
+// mark an object as reachable and add it to the gray stack
+void markObject(VM* vm, Obj* object) {
+  if (object == NULL) return;
+
+  // a minor collection never looks past the nursery
+  if (vm->gc.phase == GC_IDLE && object->isOld) return;
+
+  if (object->mark == vm->gc.epoch) return;
+  object->mark = vm->gc.epoch;
+  pushObject(&vm->gc.grayStack, &vm->gc.grayCount, &vm->gc.grayCapacity, object);
+}
+
+// mark a value as reachable
+void markValue(VM* vm, Value value) {
+  if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
+
+// mark every value in a value array
+static void markArray(VM* vm, ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+// mark every key and value in a table
+static void markTable(VM* vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    markObject(vm, (Obj*) entry->key);
+    markValue(vm, entry->value);
+  }
+}
+
+// trace the references held by an object
+static void blackenObject(VM* vm, Obj* object) {
+  switch (object->type) {
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*) object;
+      markObject(vm, rope->left);
+      markObject(vm, rope->right);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      markObject(vm, (Obj*) function->name);
+      markObject(vm, (Obj*) function->owner);
+      markArray(vm, &function->chunk.constants);
+
+      // inline caches hold on to their shapes so a freed shape's
+      // address can't be reused by a new shape and cause a false hit
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        for (int j = 0; j < cache->count; j++) {
+          markObject(vm, (Obj*) cache->entries[j].shape);
+          markObject(vm, (Obj*) cache->entries[j].transition);
+          markObject(vm, (Obj*) cache->entries[j].method);
+        }
+      }
+      if (function->memo != NULL) markMemo(vm, function->memo);
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*) object;
+      markObject(vm, (Obj*) shape->parent);
+      markObject(vm, (Obj*) shape->name);
+      markTable(vm, &shape->slots);
+      markTable(vm, &shape->transitions);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*) object;
+      markObject(vm, (Obj*) klass->name);
+      markObject(vm, (Obj*) klass->shape);
+      markObject(vm, (Obj*) klass->superclass);
+      markTable(vm, &klass->methods);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*) object;
+      markObject(vm, (Obj*) instance->klass);
+      markObject(vm, (Obj*) instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(vm, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*) object;
+      markValue(vm, bound->receiver);
+      markObject(vm, (Obj*) bound->method);
+      break;
+    }
+    case OBJ_NATIVE:
+      markObject(vm, (Obj*) ((ObjNative*) object)->name);
+      break;
+    case OBJ_FIBER:
+      // the stacks of unfinished fibers are roots (see markRoots)
+      markValue(vm, ((ObjFiber*) object)->result);
+      break;
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*) object;
+      for (int i = 0; i < map->capacity; i++) {
+        if (map->control[i] < 0) continue;
+        markValue(vm, map->entries[i].key);
+        markValue(vm, map->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_STRING:
+    case OBJ_ARRAY:
+      break;
+  }
+}
+
+// record a store of value into owner
+void writeBarrier(VM* vm, Obj* owner, Value value) {
+  if (!IS_OBJ(value)) return;
+  Obj* child = AS_OBJ(value);
+
+  // incremental marking: a marked object must never point at an unmarked
+  // one, otherwise the child would be missed when the owner isn't revisited
+  if (vm->gc.phase == GC_MARK && owner->mark == vm->gc.epoch) {
+    markObject(vm, child);
+  }
+
+  // generational: remember old objects pointing into the nursery
+  if (owner->isOld && !child->isOld && !owner->isRemembered) {
+    owner->isRemembered = true;
+    pushObject(&vm->gc.remembered, &vm->gc.rememberedCount, &vm->gc.rememberedCapacity, owner);
+  }
+}
+
+// mark everything directly reachable by the vm
+static void markRoots(VM* vm) {
+  // stack of the running fiber
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
+  }
+
+  // unfinished fibers may run again, so everything on their stacks is live
+  // (their stacks are written without barriers, like the vm's own)
+  for (ObjFiber* fiber = vm->scheduler.fibers; fiber != NULL; fiber = fiber->nextLive) {
+    markObject(vm, (Obj*) fiber);
+    if (fiber == vm->fiber) continue; // its stack is the vm's
+    for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+      markValue(vm, *slot);
+    }
+    for (int i = 0; i < fiber->frameCount; i++) {
+      markObject(vm, (Obj*) fiber->frames[i].function);
+    }
+  }
+
+  // global variables
+  markArray(vm, &vm->globals);
+  markArray(vm, &vm->globalNames);
+  markTable(vm, &vm->modules);
+  markTable(vm, &vm->imports);
+  markArray(vm, &vm->memoized);
+
+  markObject(vm, (Obj*) vm->initString);
+  markTable(vm, &vm->arrayMethods);
+  markTable(vm, &vm->mapMethods);
+
+  // functions being run
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*) vm->frames[i].function);
+  }
+
+  markCompilerRoots(vm);
+  markProfilerRoots(vm);
+}
+
+// trace gray objects until none are left (or we run out of work)
+// returns true if the gray stack is empty
+static bool traceReferences(VM* vm, int work) {
+  while (vm->gc.grayCount > 0 && work-- > 0) {
+    Obj* object = vm->gc.grayStack[--vm->gc.grayCount];
+    blackenObject(vm, object);
+  }
+  return vm->gc.grayCount == 0;
+}
+
+// size of an object (for statistics)
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: return sizeof(ObjString) + ((ObjString*) object)->length + 1;
+    case OBJ_ROPE: return sizeof(ObjRope);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_SHAPE: return sizeof(ObjShape);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_INSTANCE: return sizeof(ObjInstance);
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_FIBER: return sizeof(ObjFiber);
+    case OBJ_ARRAY: return sizeof(ObjArray);
+    case OBJ_MAP: return sizeof(ObjMap);
+  }
+  return 0;
+}
+
+// free an unreachable object
+static void sweepObject(VM* vm, Obj* object) {
+  // the intern table doesn't keep strings alive
+  if (object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString*) object);
+
+  vm->gc.stats.bytesFreed += objectSize(object);
+  freeObject(object);
+}
+
+// free unmarked nursery objects and promote the rest to the old generation
+static void sweepNursery(VM* vm) {
+  Obj* object = vm->gc.nursery;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->mark == vm->gc.epoch) {
+      object->isOld = true;
+      object->next = vm->gc.objects;
+      vm->gc.objects = object;
+      vm->gc.stats.bytesPromoted += objectSize(object);
+    } else {
+      sweepObject(vm, object);
+    }
+    object = next;
+  }
+
+  vm->gc.nursery = NULL;
+  vm->gc.nurseryBytes = 0;
+}
+
+// forget the remembered set (the nursery is empty so nothing needs remembering)
+static void clearRemembered(VM* vm) {
+  for (int i = 0; i < vm->gc.rememberedCount; i++) {
+    vm->gc.remembered[i]->isRemembered = false;
+  }
+  vm->gc.rememberedCount = 0;
+}
+
+// collect the nursery
+void minorCollection(VM* vm) {
+  if (vm->gc.phase != GC_IDLE) return;
+  uint64_t start = nanoTime();
+
+  markRoots(vm);
+
+  // old objects that were written to may hold the only reference to a young object
+  for (int i = 0; i < vm->gc.rememberedCount; i++) {
+    blackenObject(vm, vm->gc.remembered[i]);
+  }
+  clearRemembered(vm);
+
+  traceReferences(vm, INT32_MAX);
+  sweepNursery(vm);
+
+  vm->gc.stats.minorCollections++;
+  recordPause(&vm->gc, nanoTime() - start);
+}
+
+// start a major cycle
+static void beginMajor(VM* vm) {
+  // advancing the epoch unmarks every object
+  vm->gc.epoch++;
+  if (vm->gc.epoch == 0) vm->gc.epoch = 1;
+
+  vm->gc.phase = GC_MARK;
+  markRoots(vm);
+}
+
+// finish marking (the roots aren't protected by the write barrier so rescan them)
+static void finishMark(VM* vm) {
+  markRoots(vm);
+  traceReferences(vm, INT32_MAX);
+
+  // an unmarked remembered object is about to be freed, stop remembering it
+  // (nothing can reach it to write to it again)
+  int kept = 0;
+  for (int i = 0; i < vm->gc.rememberedCount; i++) {
+    Obj* object = vm->gc.remembered[i];
+    if (object->mark == vm->gc.epoch) vm->gc.remembered[kept++] = object;
+  }
+  vm->gc.rememberedCount = kept;
+
+  vm->gc.phase = GC_SWEEP;
+  vm->gc.sweep = &vm->gc.objects;
+}
+
+// sweep some old objects, returns true when the old generation is done
+static bool sweepOld(VM* vm, int work) {
+  while (*vm->gc.sweep != NULL && work-- > 0) {
+    Obj* object = *vm->gc.sweep;
+    if (object->mark == vm->gc.epoch) {
+      vm->gc.sweep = &object->next;
+    } else {
+      *vm->gc.sweep = object->next;
+      sweepObject(vm, object);
+    }
+  }
+  return *vm->gc.sweep == NULL;
+}
+
+// finish a major cycle
+static void finishMajor(VM* vm) {
+  // the nursery was traced too, so survivors are promoted and the
+  // remembered set has nothing left to remember
+  sweepNursery(vm);
+  clearRemembered(vm);
+
+  vm->gc.phase = GC_IDLE;
+  vm->gc.sweep = NULL;
+  vm->gc.nextMajor = vm->gc.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if (vm->gc.nextMajor < GC_FIRST_MAJOR) vm->gc.nextMajor = GC_FIRST_MAJOR;
+  vm->gc.stats.majorCollections++;
+}
+
+// do one slice of work on a major collection (starting one if needed)
+// runs until the pause budget is spent, checking the clock every work unit
+static void incrementalStep(VM* vm) {
+  uint64_t start = nanoTime();
+  vm->gc.stepDebt = 0;
+
+  if (vm->gc.phase == GC_IDLE) beginMajor(vm);
+
+  for (;;) {
+    if (vm->gc.phase == GC_MARK) {
+      if (traceReferences(vm, GC_WORK_UNIT)) finishMark(vm);
+    } else if (vm->gc.phase == GC_SWEEP) {
+      if (sweepOld(vm, GC_WORK_UNIT)) {
+        finishMajor(vm);
+        break;
+      }
+    }
+    if (nanoTime() - start >= vm->gc.pauseBudgetNs) break;
+  }
+
+  vm->gc.stats.majorSteps++;
+  recordPause(&vm->gc, nanoTime() - start);
+}
+
+// run a full major collection to completion
+void collectGarbage(VM* vm) {
+  uint64_t budget = vm->gc.pauseBudgetNs;
+  vm->gc.pauseBudgetNs = UINT64_MAX;
+  incrementalStep(vm);
+  vm->gc.pauseBudgetNs = budget;
+}
+
+// move the nursery to the old generation without tracing it
+void promoteNursery(VM* vm) {
+  if (vm->gc.phase != GC_IDLE) return;
+
+  Obj* object = vm->gc.nursery;
+  while (object != NULL) {
+    Obj* next = object->next;
+    object->isOld = true;
+    object->next = vm->gc.objects;
+    vm->gc.objects = object;
+    vm->gc.stats.bytesPromoted += objectSize(object);
+    object = next;
+  }
+  vm->gc.nursery = NULL;
+  vm->gc.nurseryBytes = 0;
+
+  // nothing is young so nothing needs remembering
+  clearRemembered(vm);
+
+  vm->gc.nextMajor = vm->gc.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if (vm->gc.nextMajor < GC_FIRST_MAJOR) vm->gc.nextMajor = GC_FIRST_MAJOR;
+}
+
+// free a list of objects
+static void freeList(Obj* object) {
+  while (object != NULL) {
+    Obj* next = object->next;
+    freeObject(object);
+    object = next;
+  }
+}
+
+// free every object owned by the vm
+void freeObjects(VM* vm) {
+  freeList(vm->gc.nursery);
+  freeList(vm->gc.objects);
+  vm->gc.nursery = NULL;
+  vm->gc.objects = NULL;
+
+  free(vm->gc.grayStack);
+  free(vm->gc.remembered);
+  vm->gc.grayStack = NULL;
+  vm->gc.remembered = NULL;
+  vm->gc.grayCount = vm->gc.grayCapacity = 0;
+  vm->gc.rememberedCount = vm->gc.rememberedCapacity = 0;
+}
@@ -2,6 +2,12 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "value.h"
+
+#define ALLOCATE(type, count) \
+  (type*) reallocate(NULL, 0, sizeof(type) * (count))
+
+#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
   ((capacity) < 8 ? 8 : (capacity) * 2)
@@ -13,6 +19,102 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// pause histogram buckets, bucket i counts pauses shorter than 2^i microseconds
+// (the last bucket also counts everything longer)
+#define GC_PAUSE_BUCKETS 16
+
+// phases of an incremental major collection
+typedef enum {
+  GC_IDLE, // no major collection in progress (minor collections allowed)
+  GC_MARK, // tracing the whole heap a slice at a time
+  GC_SWEEP, // freeing unmarked old objects a slice at a time
+} GCPhase;
+
+// collector statistics (for monitoring)
+typedef struct {
+  uint64_t minorCollections;
+  uint64_t majorCollections; // completed major cycles
+  uint64_t majorSteps; // incremental slices of major cycles
+  uint64_t bytesPromoted; // bytes moved from the nursery to the old generation
+  uint64_t bytesFreed;
+  uint64_t totalPauseNs;
+  uint64_t maxPauseNs;
+  size_t peakBytes;
+  uint64_t pauseHistogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
+// generational, incremental garbage collector state
+//
+// new objects are allocated into the nursery. a minor collection traces
+// only the nursery (using the remembered set for old -> young pointers)
+// and promotes every survivor. a major collection marks and sweeps the
+// whole heap in slices bounded by pauseBudgetNs, relying on writeBarrier()
+// to keep the marking consistent while the program keeps running.
+typedef struct {
+  GCPhase phase;
+
+  Obj* nursery; // young objects
+  Obj* objects; // old objects
+
+  // objects are marked when obj->mark == epoch, so starting a new major
+  // cycle unmarks everything without touching the heap
+  uint32_t epoch;
+
+  size_t bytesAllocated; // total bytes allocated through reallocate()
+  size_t nurseryBytes; // bytes of objects allocated since the last minor collection
+  size_t nurserySize; // nursery bytes that trigger a minor collection
+  size_t nextMajor; // heap size that starts a major collection
+  size_t stepDebt; // bytes allocated since the last incremental slice
+  uint64_t pauseBudgetNs; // maximum length of an incremental slice
+
+  // worklist of marked objects whose children still need tracing
+  int grayCount;
+  int grayCapacity;
+  Obj** grayStack;
+
+  // old objects that may point at young objects
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  // link to the next old object to sweep
+  Obj** sweep;
+
+  GCStats stats;
+} GC;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
-#endif
\ No newline at end of file
+// make vm the heap that reallocate() accounts to and collects
+// (each thread has its own, so isolates on other threads keep theirs)
+void useHeap(VM* vm);
+
+// count memory the heap holds on to without having allocated it (values
+// shared with other isolates), negative when letting go of it
+void accountBytes(ptrdiff_t bytes);
+
+// initialize collector state
+void initGC(GC* gc);
+
+// mark a value or object as reachable
+void markValue(VM* vm, Value value);
+void markObject(VM* vm, Obj* object);
+
+// record a store of value into owner (call after every store into a heap object)
+void writeBarrier(VM* vm, Obj* owner, Value value);
+
+// collect the nursery
+void minorCollection(VM* vm);
+
+// run a full major collection to completion
+void collectGarbage(VM* vm);
+
+// move the nursery to the old generation without tracing it, for objects
+// known to be live (e.g. a restored snapshot), and pace the next major
+// collection from the heap's size (does nothing during a major cycle)
+void promoteNursery(VM* vm);
+
+// free every object owned by the vm
+void freeObjects(VM* vm);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+#include "scanner.h"
+#include "vm.h"
+
+// read a whole file, NULL if it can't be read
+// (the caller frees the characters)
+char* readSource(const char* path, int* length) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = fileSize < 0 || fileSize > INT32_MAX ? NULL : (char*) malloc(fileSize + 1);
+  size_t bytesRead = buffer == NULL ? 0 : fread(buffer, sizeof(char), fileSize, file);
+  fclose(file);
+  if (buffer == NULL || bytesRead < (size_t) fileSize) {
+    free(buffer);
+    return NULL;
+  }
+
+  buffer[bytesRead] = '\0';
+  *length = (int) bytesRead;
+  return buffer;
+}
+
+// note the names declared outside any block, function or class body (and
+// outside the parentheses of a for loop) as exports of the module with
+// source. the source is on the stack
+static void scanExports(VM* vm, ObjString* source) {
+  Scanner scanner;
+  initScanner(&scanner, source->chars);
+
+  int depth = 0;
+  TokenType previous = TOKEN_EOF;
+  for (;;) {
+    Token token = scanToken(&scanner);
+    if (token.type == TOKEN_EOF) break;
+
+    switch (token.type) {
+      case TOKEN_LEFT_PAREN:
+      case TOKEN_LEFT_BRACE:
+        depth++;
+        break;
+      case TOKEN_RIGHT_PAREN:
+      case TOKEN_RIGHT_BRACE:
+        if (depth > 0) depth--;
+        break;
+      case TOKEN_IDENTIFIER:
+        if (depth == 0 && (previous == TOKEN_VAR || previous == TOKEN_FUN || previous == TOKEN_CLASS)) {
+          // keep the name on the stack in case growing the table starts a collection
+          push(vm, OBJ_VAL(copyString(vm, token.start, token.length)));
+          tableSet(&vm->imports, AS_STRING(vm->stackTop[-1]), OBJ_VAL(source));
+          pop(vm);
+        }
+        break;
+      default:
+        break;
+    }
+    previous = token.type;
+  }
+}
+
+// import(path): make the globals a module declares load it when first used
+static bool importNative(VM* vm, int argCount, Value* args) {
+  if (!IS_ANY_STRING(args[0])) {
+    runtimeError(vm, "Path must be a string.");
+    return false;
+  }
+
+  const char* path;
+  if (IS_ROPE(args[0])) {
+    flattenRope(AS_ROPE(args[0]));
+    path = AS_ROPE(args[0])->chars;
+  } else {
+    path = AS_CSTRING(args[0]);
+  }
+
+  int length;
+  char* chars = readSource(path, &length);
+  if (chars == NULL) {
+    runtimeError(vm, "Could not read module \"%s\".", path);
+    return false;
+  }
+
+  // interning the source finds a module with the same source
+  push(vm, OBJ_VAL(copyString(vm, chars, length)));
+  free(chars);
+  ObjString* source = AS_STRING(vm->stackTop[-1]);
+  Value module;
+  if (!tableGet(&vm->modules, source, &module)) {
+    // the module is named after the path it was first imported from
+    push(vm, OBJ_VAL(copyString(vm, path, (int) strlen(path))));
+    tableSet(&vm->modules, source, vm->stackTop[-1]);
+    pop(vm);
+    scanExports(vm, source);
+  }
+  pop(vm);
+
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+// compile the module an undefined global was imported from
+bool loadModule(VM* vm, ObjString* name, ObjFunction** module) {
+  *module = NULL;
+
+  // a module that was loaded maps to its function (nil if it didn't
+  // compile), one that hasn't been to its path
+  Value source, state;
+  if (!tableGet(&vm->imports, name, &source)) return true;
+  if (!tableGet(&vm->modules, AS_STRING(source), &state) || !IS_STRING(state)) return true;
+
+  // marked as loaded up front, an export it uses before defining it is undefined
+  ObjString* path = AS_STRING(state);
+  push(vm, OBJ_VAL(path));
+  tableSet(&vm->modules, AS_STRING(source), NIL_VAL);
+
+  ObjFunction* function = compileModule(vm, AS_CSTRING(source));
+  if (function == NULL) {
+    pop(vm);
+    runtimeError(vm, "Could not compile module \"%s\".", path->chars);
+    return false;
+  }
+
+  // compiling can promote the function so the store needs the barrier
+  function->name = path;
+  writeBarrier(vm, (Obj*) function, OBJ_VAL(path));
+  push(vm, OBJ_VAL(function));
+  tableSet(&vm->modules, AS_STRING(source), OBJ_VAL(function));
+  pop(vm);
+  pop(vm);
+
+  *module = function;
+  return true;
+}
+
+void defineModuleNatives(VM* vm) {
+  defineNative(vm, "import", importNative, 1);
+}
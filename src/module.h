@@ -0,0 +1,39 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "common.h"
+#include "object.h"
+
+// lazily loaded modules
+//
+// import(path) reads a module's source and notes the names it declares at
+// its top level (its exports) without compiling anything. the first time
+// one of those globals is read or assigned while it's still undefined, the
+// module is compiled to a function of its own and its top level runs in a
+// frame on top of the code that needed it. when it ends (OP_END_MODULE)
+// that code runs the global's instruction again, which now finds it
+// defined. a module nothing uses costs a read and a scan of its tokens.
+//
+// modules are known by their source, which is interned: importing the same
+// source again, under any path, is the same module and it's compiled at
+// most once. a module is loaded at most once as well, globals it doesn't
+// get around to defining stay undefined. a name more than one module
+// declares loads the one imported last, and a module's top level defines
+// its globals like any script, replacing whatever they held.
+//
+// paths are relative to the working directory. imports that haven't been
+// loaded yet aren't part of a snapshot.
+
+// the import() native
+void defineModuleNatives(VM* vm);
+
+// read a whole file, NULL if it can't be read
+// (the caller frees the characters)
+char* readSource(const char* path, int* length);
+
+// compile the module an undefined global was imported from, which the
+// caller then runs. *module is NULL when no module that hasn't been loaded
+// yet declares name. returns false once an error has been reported
+bool loadModule(VM* vm, ObjString* name, ObjFunction** module);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// big enough for any formatted number (plus a NULL byte)
+#define NUMBER_BUFFER_SIZE 32
+
+// format a number exactly as printf("%g") does, returns the length
+// (buffer must hold NUMBER_BUFFER_SIZE chars, it is not NULL terminated)
+int formatNumber(double value, char* buffer);
+int formatInt(int32_t value, char* buffer);
+
+// convert mantissa * 10^exponent to the nearest double, returns false
+// for the rare cases it can't decide (the caller falls back to strtod)
+bool decimalToDouble(uint64_t mantissa, int exponent, double* value);
+
+#endif
@@ -0,0 +1,555 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// allocate an object of a given size and link it into the nursery
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  Obj* object = (Obj*) reallocate(NULL, 0, size);
+  object->type = type;
+  object->isOld = false;
+  object->isRemembered = false;
+
+  // objects created while sweeping are live, otherwise they start unmarked
+  object->mark = vm->gc.phase == GC_SWEEP ? vm->gc.epoch : 0;
+
+  // push object onto head of nursery list
+  object->next = vm->gc.nursery;
+  vm->gc.nursery = object;
+  vm->gc.nurseryBytes += size;
+  return object;
+}
+
+// create a new empty function
+ObjFunction* newFunction(VM* vm) {
+  ObjFunction* function = (ObjFunction*) allocateObject(vm, sizeof(ObjFunction), OBJ_FUNCTION);
+  function->arity = 0;
+  function->maxSlots = 0;
+  function->name = NULL;
+  function->owner = NULL;
+  function->module = false;
+  function->pure = false;
+  function->memo = NULL;
+  initChunk(&function->chunk);
+  return function;
+}
+
+// wrap a C function
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name) {
+  ObjNative* native = (ObjNative*) allocateObject(vm, sizeof(ObjNative), OBJ_NATIVE);
+  native->function = function;
+  native->arity = arity;
+  native->name = name;
+  return native;
+}
+
+// create a shape, adding field name to parent's fields
+// parent and name must be reachable since this allocates
+ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+  ObjShape* shape = (ObjShape*) allocateObject(vm, sizeof(ObjShape), OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  if (parent == NULL) return shape;
+
+  // each shape has the full name -> slot map so lookups don't walk the chain
+  push(vm, OBJ_VAL(shape));
+  tableAddAll(&parent->slots, &shape->slots);
+  tableSet(&shape->slots, name, NUMBER_VAL(parent->fieldCount));
+  shape->fieldCount = parent->fieldCount + 1;
+  writeBarrier(vm, (Obj*) shape, OBJ_VAL(parent));
+  writeBarrier(vm, (Obj*) shape, OBJ_VAL(name));
+  pop(vm);
+  return shape;
+}
+
+// index of field name in shape, -1 if the shape has no such field
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int) AS_NUMBER(slot);
+}
+
+// shape reached by adding field name to shape (created on first use)
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return (ObjShape*) AS_OBJ(next);
+
+  ObjShape* child = newShape(vm, shape, name);
+  push(vm, OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier(vm, (Obj*) shape, OBJ_VAL(child));
+  pop(vm);
+  return child;
+}
+
+// create a class (and its root shape)
+ObjClass* newClass(VM* vm, ObjString* name) {
+  ObjClass* klass = (ObjClass*) allocateObject(vm, sizeof(ObjClass), OBJ_CLASS);
+  klass->name = name;
+  klass->shape = NULL;
+  klass->superclass = NULL;
+  initTable(&klass->methods);
+
+  // every class gets its own shape tree so a shape also identifies the class
+  push(vm, OBJ_VAL(klass));
+  klass->shape = newShape(vm, NULL, NULL);
+  writeBarrier(vm, (Obj*) klass, OBJ_VAL(klass->shape));
+  pop(vm);
+  return klass;
+}
+
+// create an instance with no fields
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+  ObjInstance* instance = (ObjInstance*) allocateObject(vm, sizeof(ObjInstance), OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = klass->shape;
+  instance->capacity = 0;
+  instance->fields = NULL;
+  return instance;
+}
+
+// make room for count fields in instance
+void reserveFields(ObjInstance* instance, int count) {
+  if (instance->capacity >= count) return;
+  int oldCapacity = instance->capacity;
+  int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+  while (capacity < count) capacity *= 2;
+  instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+  instance->capacity = capacity;
+}
+
+// bind method to receiver
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjFunction* method) {
+  ObjBoundMethod* bound = (ObjBoundMethod*) allocateObject(vm, sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+// create a fiber with an empty call stack
+ObjFiber* newFiber(VM* vm) {
+  ObjFiber* fiber = (ObjFiber*) allocateObject(vm, sizeof(ObjFiber), OBJ_FIBER);
+  fiber->state = FIBER_READY;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->stackCapacity = 0;
+  fiber->result = NIL_VAL;
+  fiber->waitFd = -1;
+  fiber->waitChannel = NULL;
+  fiber->prevLive = NULL;
+  fiber->nextLive = NULL;
+  fiber->nextWaiting = NULL;
+  fiber->joiners = NULL;
+  return fiber;
+}
+
+// create an array of count zeros
+ObjArray* newArray(VM* vm, int count) {
+  ObjArray* array = (ObjArray*) allocateObject(vm, sizeof(ObjArray), OBJ_ARRAY);
+  array->count = 0;
+  array->capacity = 0;
+  array->values = NULL;
+  array->shared = NULL;
+
+  // keep the array on the stack in case allocating its values starts a collection
+  push(vm, OBJ_VAL(array));
+  array->values = ALLOCATE(double, count);
+  if (count > 0) memset(array->values, 0, sizeof(double) * count);
+  array->count = array->capacity = count;
+  pop(vm);
+  return array;
+}
+
+// make array immutable, after which its values can be shared between isolates
+void freezeArray(ObjArray* array) {
+  if (array->shared != NULL) return;
+
+  // every array holding the values counts count of them
+  array->values = GROW_ARRAY(double, array->values, array->capacity, array->count);
+  array->capacity = array->count;
+
+  // the record isn't the gc's, it outlives the heap it was frozen in
+  SharedValues* shared = (SharedValues*) malloc(sizeof(SharedValues));
+  if (shared == NULL) exit(1);
+  shared->refs = 1;
+  shared->values = array->values;
+  array->shared = shared;
+}
+
+// create a frozen array of count values holding a reference to shared
+ObjArray* newSharedArray(VM* vm, SharedValues* shared, int count) {
+  ObjArray* array = (ObjArray*) allocateObject(vm, sizeof(ObjArray), OBJ_ARRAY);
+  array->count = array->capacity = count;
+  array->values = shared->values;
+  array->shared = shared;
+  accountBytes((ptrdiff_t) (sizeof(double) * count));
+  return array;
+}
+
+// drop a reference to frozen values, freeing them with the last one
+void releaseSharedValues(SharedValues* shared) {
+  if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(shared->values);
+  free(shared);
+}
+
+// create an empty map
+ObjMap* newMap(VM* vm) {
+  ObjMap* map = (ObjMap*) allocateObject(vm, sizeof(ObjMap), OBJ_MAP);
+  map->count = 0;
+  map->capacity = 0;
+  map->growthLeft = 0;
+  map->printing = false;
+  map->control = NULL;
+  map->entries = NULL;
+  return map;
+}
+
+// FNV-1a hash
+static uint32_t hashString(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t) key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// allocate a new string and add it to the intern table
+static ObjString* allocateString(VM* vm, const char* chars, int length, uint32_t hash) {
+  ObjString* string = (ObjString*) allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = hash;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+
+  // intern string (we only care about the keys so value is nil)
+  // keep it on the stack in case growing the table starts a collection
+  push(vm, OBJ_VAL(string));
+  tableSet(&vm->strings, string, NIL_VAL);
+  pop(vm);
+  return string;
+}
+
+// copy characters into a new (or existing interned) string
+ObjString* copyString(VM* vm, const char* chars, int length) {
+  uint32_t hash = hashString(chars, length);
+
+  // return interned string if we already have one
+  ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+  if (interned != NULL) {
+    // an unmarked string found mid-sweep is about to be freed, keep it alive
+    if (vm->gc.phase == GC_SWEEP) interned->obj.mark = vm->gc.epoch;
+    return interned;
+  }
+
+  return allocateString(vm, chars, length, hash);
+}
+
+// take ownership of heap allocated characters
+ObjString* takeString(VM* vm, char* chars, int length) {
+  ObjString* string = copyString(vm, chars, length);
+  FREE_ARRAY(char, chars, length + 1);
+  return string;
+}
+
+// ropes shorter than this are built flat straight away
+#define ROPE_MIN_LENGTH 32
+
+// length of a string or rope
+static int stringLength(Obj* string) {
+  if (string->type == OBJ_STRING) return ((ObjString*) string)->length;
+  return ((ObjRope*) string)->length;
+}
+
+// copy characters of a string or rope into dest
+static void copyChars(char* dest, Obj* string) {
+  if (string->type == OBJ_STRING) {
+    ObjString* flat = (ObjString*) string;
+    memcpy(dest, flat->chars, flat->length);
+  } else {
+    ObjRope* rope = (ObjRope*) string;
+    flattenRope(rope);
+    memcpy(dest, rope->chars, rope->length);
+  }
+}
+
+// concatenate two strings (either may be a rope)
+// both strings must be reachable (e.g. on the stack) since this allocates
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b) {
+  int length = stringLength(a) + stringLength(b);
+
+  // concatenating an empty string is a no-op
+  if (stringLength(a) == 0) return b;
+  if (stringLength(b) == 0) return a;
+
+  // short strings are cheaper to copy than to keep as a tree
+  if (length < ROPE_MIN_LENGTH) {
+    char chars[ROPE_MIN_LENGTH];
+    copyChars(chars, a);
+    copyChars(chars + stringLength(a), b);
+    return (Obj*) copyString(vm, chars, length);
+  }
+
+  // otherwise just link the two strings together in O(1)
+  ObjRope* rope = (ObjRope*) allocateObject(vm, sizeof(ObjRope), OBJ_ROPE);
+  rope->length = length;
+  rope->hash = 0;
+  rope->chars = NULL;
+  rope->left = a;
+  rope->right = b;
+  return (Obj*) rope;
+}
+
+// build the characters of a rope (no-op if already flattened)
+// the rope must be reachable since this allocates
+void flattenRope(ObjRope* rope) {
+  if (rope->chars != NULL) return;
+
+  char* chars = ALLOCATE(char, rope->length + 1);
+  chars[rope->length] = '\0';
+
+  // walk the tree with an explicit stack since repeated concatenation
+  // in a loop builds ropes far deeper than the C stack allows.
+  // leaves are copied right to left so the right child is popped first.
+  int end = rope->length;
+  int count = 0;
+  int capacity = 8;
+  Obj** stack = ALLOCATE(Obj*, capacity);
+  stack[count++] = rope->left;
+  stack[count++] = rope->right;
+
+  while (count > 0) {
+    Obj* node = stack[--count];
+    if (node->type == OBJ_STRING) {
+      ObjString* leaf = (ObjString*) node;
+      end -= leaf->length;
+      memcpy(chars + end, leaf->chars, leaf->length);
+    } else if (((ObjRope*) node)->chars != NULL) {
+      // already flattened ropes are leaves too
+      ObjRope* leaf = (ObjRope*) node;
+      end -= leaf->length;
+      memcpy(chars + end, leaf->chars, leaf->length);
+    } else {
+      // grow stack if needed
+      if (capacity < count + 2) {
+        int oldCapacity = capacity;
+        capacity = GROW_CAPACITY(oldCapacity);
+        stack = GROW_ARRAY(Obj*, stack, oldCapacity, capacity);
+      }
+      stack[count++] = ((ObjRope*) node)->left;
+      stack[count++] = ((ObjRope*) node)->right;
+    }
+  }
+
+  FREE_ARRAY(Obj*, stack, capacity);
+
+  rope->chars = chars;
+  rope->hash = hashString(chars, rope->length);
+
+  // children are no longer needed
+  rope->left = NULL;
+  rope->right = NULL;
+}
+
+// compare two strings (either may be a rope) by contents
+bool stringsEqual(Obj* a, Obj* b) {
+  if (a == b) return true;
+
+  // flat strings are interned so different objects are different strings
+  if (a->type == OBJ_STRING && b->type == OBJ_STRING) return false;
+  if (stringLength(a) != stringLength(b)) return false;
+
+  // get characters and hashes (flattening ropes if needed)
+  const char* aChars;
+  const char* bChars;
+  uint32_t aHash, bHash;
+  if (a->type == OBJ_STRING) {
+    aChars = ((ObjString*) a)->chars;
+    aHash = ((ObjString*) a)->hash;
+  } else {
+    flattenRope((ObjRope*) a);
+    aChars = ((ObjRope*) a)->chars;
+    aHash = ((ObjRope*) a)->hash;
+  }
+  if (b->type == OBJ_STRING) {
+    bChars = ((ObjString*) b)->chars;
+    bHash = ((ObjString*) b)->hash;
+  } else {
+    flattenRope((ObjRope*) b);
+    bChars = ((ObjRope*) b)->chars;
+    bHash = ((ObjRope*) b)->hash;
+  }
+
+  return aHash == bHash && memcmp(aChars, bChars, stringLength(a)) == 0;
+}
+
+// write a string as program output
+static void writeString(Output* output, const char* chars) {
+  writeOutput(output, chars, strlen(chars));
+}
+
+// write a function as program output
+static void writeFunction(Output* output, ObjFunction* function) {
+  if (function->name == NULL) {
+    writeString(output, "<script>");
+    return;
+  }
+  writeString(output, "<fn ");
+  writeOutput(output, function->name->chars, function->name->length);
+  writeString(output, ">");
+}
+
+// write object as program output
+void writeObject(Output* output, Value value) {
+  switch (OBJ_TYPE(value)) {
+    case OBJ_STRING:
+      writeOutput(output, AS_CSTRING(value), AS_STRING(value)->length);
+      break;
+    case OBJ_ROPE:
+      flattenRope(AS_ROPE(value));
+      writeOutput(output, AS_ROPE(value)->chars, AS_ROPE(value)->length);
+      break;
+    case OBJ_FUNCTION:
+      writeFunction(output, AS_FUNCTION(value));
+      break;
+    case OBJ_NATIVE:
+      writeString(output, "<native fn>");
+      break;
+    case OBJ_SHAPE:
+      writeString(output, "<shape>");
+      break;
+    case OBJ_CLASS:
+      writeOutput(output, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
+      break;
+    case OBJ_INSTANCE:
+      writeOutput(output, AS_INSTANCE(value)->klass->name->chars,
+                  AS_INSTANCE(value)->klass->name->length);
+      writeString(output, " instance");
+      break;
+    case OBJ_BOUND_METHOD:
+      writeFunction(output, AS_BOUND_METHOD(value)->method);
+      break;
+    case OBJ_FIBER:
+      writeString(output, "<fiber>");
+      break;
+    case OBJ_ARRAY: {
+      ObjArray* array = AS_ARRAY(value);
+      writeString(output, "[");
+      for (int i = 0; i < array->count; i++) {
+        if (i > 0) writeString(output, ", ");
+        writeValue(output, NUMBER_VAL(array->values[i]));
+      }
+      writeString(output, "]");
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = AS_MAP(value);
+      if (map->printing) {
+        writeString(output, "{...}");
+        break;
+      }
+      map->printing = true;
+      writeString(output, "{");
+      bool first = true;
+      for (int i = 0; i < map->capacity; i++) {
+        if (map->control[i] < 0) continue;
+        if (!first) writeString(output, ", ");
+        first = false;
+        writeValue(output, map->entries[i].key);
+        writeString(output, ": ");
+        writeValue(output, map->entries[i].value);
+      }
+      writeString(output, "}");
+      map->printing = false;
+      break;
+    }
+  }
+}
+
+// free a single object
+void freeObject(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*) object;
+      reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*) object;
+      if (rope->chars != NULL) FREE_ARRAY(char, rope->chars, rope->length + 1);
+      FREE(ObjRope, object);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      freeChunk(&function->chunk);
+      freeMemo(function->memo);
+      FREE(ObjFunction, object);
+      break;
+    }
+    case OBJ_NATIVE:
+      FREE(ObjNative, object);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*) object;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
+      FREE(ObjShape, object);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*) object;
+      freeTable(&klass->methods);
+      FREE(ObjClass, object);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*) object;
+      FREE_ARRAY(Value, instance->fields, instance->capacity);
+      FREE(ObjInstance, object);
+      break;
+    }
+    case OBJ_BOUND_METHOD:
+      FREE(ObjBoundMethod, object);
+      break;
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*) object;
+      FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+      FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+      FREE(ObjFiber, object);
+      break;
+    }
+    case OBJ_ARRAY: {
+      ObjArray* array = (ObjArray*) object;
+      if (array->shared != NULL) {
+        // the values can still be in use in other isolates
+        accountBytes(-(ptrdiff_t) (sizeof(double) * array->capacity));
+        releaseSharedValues(array->shared);
+      } else {
+        FREE_ARRAY(double, array->values, array->capacity);
+      }
+      FREE(ObjArray, object);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*) object;
+      FREE_ARRAY(int8_t, map->control, map->capacity);
+      FREE_ARRAY(MapEntry, map->entries, map->capacity);
+      FREE(ObjMap, object);
+      break;
+    }
+  }
+}
@@ -0,0 +1,302 @@
+#ifndef clox_object_h
+#define clox_object_h
+
+#include "chunk.h"
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+// get object type of a Value (must be an object)
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+// macros to check if Value is an object type
+#define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+
+// true for both flat strings and ropes (both are strings to Lox)
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
+
+// macros to create C-type from Lox Value
+#define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+#define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_ARRAY(value) ((ObjArray*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+
+// types of heap allocated objects
+typedef enum {
+  OBJ_STRING,
+  OBJ_ROPE,
+  OBJ_FUNCTION,
+  OBJ_NATIVE,
+  OBJ_SHAPE,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+  OBJ_FIBER,
+  OBJ_ARRAY,
+  OBJ_MAP,
+} ObjType;
+
+// header shared by every heap allocated object
+struct Obj {
+  uint8_t type; // ObjType
+  bool isOld; // survived a collection (lives in the old generation)
+  bool isRemembered; // old object in the remembered set
+  uint32_t mark; // marked when equal to the collector epoch
+  struct Obj* next; // intrusive list of objects in the same generation
+};
+
+// immutable, interned string
+// equal strings share the same ObjString so equality is a pointer compare
+struct ObjString {
+  Obj obj;
+  int length;
+  uint32_t hash; // computed once at creation
+  char chars[]; // null terminated characters stored inline
+};
+
+// lazy concatenation of two strings (each an ObjString or ObjRope)
+// the characters are only built when they are needed (printing, comparing)
+typedef struct {
+  Obj obj;
+  int length;
+  uint32_t hash; // valid once flattened
+  char* chars; // NULL until flattened
+  Obj* left; // children are released once flattened
+  Obj* right;
+} ObjRope;
+
+// compiled function
+typedef struct ObjFunction {
+  Obj obj;
+  int arity; // number of parameters
+  int maxSlots; // deepest the stack gets in a call, counting the callee (set by the verifier)
+  Chunk chunk; // bytecode of the function body
+  ObjString* name; // NULL for the top level script (a module's path for a module's)
+  struct ObjClass* owner; // class a method was declared in (for super), else NULL
+  bool module; // top level of a module, which ends in OP_END_MODULE (see module.h)
+  bool pure; // only touches its parameters, constants and (what should be) pure functions
+  struct MemoCache* memo; // results of earlier calls once memoize()d, else NULL (see memo.h)
+} ObjFunction;
+
+// function implemented in C
+// arguments are args[0..argCount-1] and the result is stored in args[-1]
+// (the slot holding the callee). returns false after reporting a runtime error.
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+typedef struct {
+  Obj obj;
+  NativeFn function;
+  int arity; // -1 accepts any number of arguments
+  ObjString* name;
+} ObjNative;
+
+// hidden class describing the layout of an instance's fields
+// instances of a class start at the class's root shape and move to a child
+// shape each time a field is added. instances that had the same fields
+// added in the same order share a shape.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent; // NULL for a root shape
+  ObjString* name; // field added by this shape (NULL for a root shape)
+  int fieldCount;
+  Table slots; // field name -> index in the fields array
+  Table transitions; // field name -> child shape
+} ObjShape;
+
+typedef struct ObjClass {
+  Obj obj;
+  ObjString* name;
+  ObjShape* shape; // root shape for new instances
+  Table methods; // name -> ObjFunction
+  struct ObjClass* superclass; // NULL if the class doesn't inherit
+} ObjClass;
+
+typedef struct {
+  Obj obj;
+  ObjClass* klass;
+  ObjShape* shape;
+  int capacity;
+  Value* fields; // shape->fieldCount values laid out as the shape says
+} ObjInstance;
+
+// method bound to the instance it was accessed on
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjFunction* method;
+} ObjBoundMethod;
+
+// a function call in progress
+// slots is a window onto the fiber's stack starting at the callee, so the
+// arguments pushed by the caller become the callee's first locals in place
+typedef struct {
+  ObjFunction* function;
+  uint8_t* ip; // next instruction (return address once another frame is on top)
+  Value* slots; // first stack slot the function can use
+} CallFrame;
+
+typedef enum {
+  FIBER_READY, // waiting for its turn to run
+  FIBER_RUNNING,
+  FIBER_WAITING, // on a read, a message or another fiber to finish
+  FIBER_DONE,
+} FiberState;
+
+// coroutine with its own value stack and call frames
+// the running fiber's stack lives in the vm, so switching fibers only
+// saves and loads a few pointers
+typedef struct ObjFiber {
+  Obj obj;
+  FiberState state;
+
+  // call stack (stale while the fiber is running)
+  CallFrame* frames;
+  int frameCount;
+  int frameCapacity;
+  Value* stack;
+  Value* stackTop;
+  int stackCapacity;
+
+  Value result; // return value of the fiber's function once done
+  int waitFd; // file descriptor being read while waiting on a read
+  struct Channel* waitChannel; // channel being received from while waiting on a receive (see isolate.h)
+
+  // unfinished fibers are linked together (their stacks are gc roots)
+  struct ObjFiber* prevLive;
+  struct ObjFiber* nextLive;
+
+  struct ObjFiber* nextWaiting; // in the run queue or another fiber's joiners
+  struct ObjFiber* joiners; // fibers waiting for this one to finish
+} ObjFiber;
+
+// values of a frozen array, shared by the arrays of every isolate it was
+// sent to and freed when the last of them is
+typedef struct {
+  int refs; // updated atomically
+  double* values;
+} SharedValues;
+
+// numbers stored unboxed and contiguously (see array.h)
+typedef struct {
+  Obj obj;
+  int count;
+  int capacity;
+  double* values;
+  SharedValues* shared; // NULL unless the array is frozen
+} ObjArray;
+
+// key and value of a map entry
+typedef struct {
+  Value key;
+  Value value;
+} MapEntry;
+
+// hash map from any value to any value (see map.h)
+// control[i] is the state of entries[i]: negative for a free entry, else
+// seven bits of its key's hash
+typedef struct {
+  Obj obj;
+  int count; // entries in use
+  int capacity; // a multiple of the probing group size (or 0)
+  int growthLeft; // empty entries that can still be used before growing
+  bool printing; // being written (so a map holding itself isn't written forever)
+  int8_t* control;
+  MapEntry* entries;
+} ObjMap;
+
+// create a new empty function
+ObjFunction* newFunction(VM* vm);
+
+// wrap a C function
+// name must be reachable since this allocates
+ObjNative* newNative(VM* vm, NativeFn function, int arity, ObjString* name);
+
+// create a class (and its root shape)
+// name must be reachable since this allocates
+ObjClass* newClass(VM* vm, ObjString* name);
+
+// create an instance with no fields
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+
+// bind method to receiver
+// receiver and method must be reachable since this allocates
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjFunction* method);
+
+// create a fiber with an empty call stack
+ObjFiber* newFiber(VM* vm);
+
+// create an array of count zeros
+ObjArray* newArray(VM* vm, int count);
+
+// make array immutable, after which its values can be shared between isolates
+void freezeArray(ObjArray* array);
+
+// create a frozen array of count values holding a reference to shared
+ObjArray* newSharedArray(VM* vm, SharedValues* shared, int count);
+
+// drop a reference to frozen values, freeing them with the last one
+void releaseSharedValues(SharedValues* shared);
+
+// create an empty map
+ObjMap* newMap(VM* vm);
+
+// create a shape adding field name to parent's fields (a root shape
+// without fields when parent is NULL)
+// parent and name must be reachable since this allocates
+ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name);
+
+// index of field name in shape, -1 if the shape has no such field
+int shapeSlot(ObjShape* shape, ObjString* name);
+
+// shape reached by adding field name to shape (created on first use)
+// shape and name must be reachable since this allocates
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name);
+
+// make room for count fields in instance
+// instance must be reachable since this allocates
+void reserveFields(ObjInstance* instance, int count);
+
+// copy characters into a new (or existing interned) string
+ObjString* copyString(VM* vm, const char* chars, int length);
+
+// take ownership of heap allocated characters
+// the buffer is freed if the string was already interned
+ObjString* takeString(VM* vm, char* chars, int length);
+
+// concatenate two strings (either may be a rope)
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b);
+
+// build the characters of a rope (no-op if already flattened)
+void flattenRope(ObjRope* rope);
+
+// compare two strings (either may be a rope) by contents
+bool stringsEqual(Obj* a, Obj* b);
+
+// write object as program output
+void writeObject(Output* output, Value value);
+
+// free a single object
+void freeObject(Obj* object);
+
+// check if value is an object of a given type
+static inline bool isObjType(Value value, ObjType type) {
+  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+#endif
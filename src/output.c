@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "output.h"
+
+// default sink
+static void stdoutSink(void* data, const char* chars, size_t length) {
+  fwrite(chars, 1, length, stdout);
+  fflush(stdout);
+}
+
+// create fully buffered output going to stdout
+void initOutput(Output* output) {
+  output->sink = stdoutSink;
+  output->sinkData = NULL;
+  output->policy = FLUSH_FULL;
+  output->count = 0;
+}
+
+// send output somewhere else (flushing what is already buffered first)
+void setOutputSink(Output* output, OutputSink sink, void* data, FlushPolicy policy) {
+  flushOutput(output);
+  output->sink = sink;
+  output->sinkData = data;
+  output->policy = policy;
+}
+
+// append characters to the buffer
+void writeOutput(Output* output, const char* chars, size_t length) {
+  if (length > (size_t) (OUTPUT_BUFFER_SIZE - output->count)) {
+    flushOutput(output);
+
+    // too big to buffer at all, so pass it straight through
+    if (length > OUTPUT_BUFFER_SIZE) {
+      output->sink(output->sinkData, chars, length);
+      return;
+    }
+  }
+
+  memcpy(output->buffer + output->count, chars, length);
+  output->count += (int) length;
+}
+
+// end a line, flushing it under FLUSH_LINE
+void writeLine(Output* output) {
+  if (output->count == OUTPUT_BUFFER_SIZE) flushOutput(output);
+  output->buffer[output->count++] = '\n';
+  if (output->policy == FLUSH_LINE) flushOutput(output);
+}
+
+// hand everything buffered to the sink
+void flushOutput(Output* output) {
+  if (output->count == 0) return;
+  output->sink(output->sinkData, output->buffer, output->count);
+  output->count = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+// where buffered output ends up (data is whatever the embedder registered)
+typedef void (*OutputSink)(void* data, const char* chars, size_t length);
+
+// when buffered output is handed to the sink
+typedef enum {
+  FLUSH_FULL, // only when the buffer fills up or on an explicit flush
+  FLUSH_LINE, // also after every printed line (interactive use)
+} FlushPolicy;
+
+// program output buffered on its way to a sink
+typedef struct {
+  OutputSink sink;
+  void* sinkData;
+  FlushPolicy policy;
+  int count;
+  char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+// create fully buffered output going to stdout
+void initOutput(Output* output);
+
+// send output somewhere else (flushing what is already buffered first)
+void setOutputSink(Output* output, OutputSink sink, void* data, FlushPolicy policy);
+
+// append characters to the buffer
+void writeOutput(Output* output, const char* chars, size_t length);
+
+// end a line, flushing it under FLUSH_LINE
+void writeLine(Output* output);
+
+// hand everything buffered to the sink
+void flushOutput(Output* output);
+
+#endif
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+
+// profiler the signal handler records into (NULL while none is running)
+static Profiler* volatile active = NULL;
+
+// signal disposition to put back when profiling stops
+static struct sigaction previousAction;
+
+// timer delivering the samples
+static timer_t timer;
+
+// older c libraries only have the kernel's name for the thread to signal
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// line of the instruction a frame is running, 0 if ip is unusable
+// (a tail call replaces a frame's function and ip one at a time)
+static int frameLine(CallFrame* frame) {
+  Chunk* chunk = &frame->function->chunk;
+
+  // ip has moved past the opcode (or past the whole call for callers)
+  int offset = (int) (frame->ip - chunk->code) - 1;
+  if (offset < 0 || offset >= chunk->count) return 0;
+  return getLine(chunk, offset);
+}
+
+// FNV-1a over a frame's function pointer and line
+static uint32_t hashFrame(uint32_t hash, ProfileFrame* frame) {
+  uint64_t bits = (uint64_t) (uintptr_t) frame->function ^ ((uint64_t) frame->line << 48);
+  for (int i = 0; i < 8; i++) {
+    hash ^= (uint8_t) (bits >> (i * 8));
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// compare two stacks of depth frames
+static bool stacksEqual(ProfileFrame* a, ProfileFrame* b, int depth) {
+  for (int i = 0; i < depth; i++) {
+    if (a[i].function != b[i].function || a[i].line != b[i].line) return false;
+  }
+  return true;
+}
+
+// add one sample of stack (depth frames, outermost first) to the table
+static void recordStack(Profiler* profiler, ProfileFrame* stack, int depth) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < depth; i++) hash = hashFrame(hash, &stack[i]);
+
+  uint32_t index = hash & (PROFILE_STACKS - 1);
+  for (int probes = 0; probes < PROFILE_STACKS / 4; probes++) {
+    ProfileStack* entry = &profiler->stacks[index];
+
+    // first sample of this stack, copy its frames into the pool
+    if (entry->samples == 0) {
+      if (profiler->frameCount + depth > PROFILE_FRAMES) break;
+      for (int i = 0; i < depth; i++) profiler->frames[profiler->frameCount + i] = stack[i];
+      entry->hash = hash;
+      entry->depth = depth;
+      entry->start = profiler->frameCount;
+      profiler->frameCount += depth;
+      entry->samples = 1;
+      profiler->samples++;
+      return;
+    }
+
+    if (entry->hash == hash && entry->depth == depth &&
+        stacksEqual(&profiler->frames[entry->start], stack, depth)) {
+      entry->samples++;
+      profiler->samples++;
+      return;
+    }
+
+    index = (index + 1) & (PROFILE_STACKS - 1);
+  }
+
+  profiler->dropped++;
+}
+
+// SIGPROF handler: record the running fiber's call stack
+//
+// the vm may be anywhere in the middle of an instruction, so this only
+// relies on what the vm keeps consistent for it: frames[0..frameCount-1]
+// are always initialized frames of live functions (frames are filled in
+// before frameCount is raised, and the array is swapped, never realloc'd
+// in place). the functions recorded become gc roots.
+static void sampleHandler(int signal) {
+  Profiler* profiler = active;
+  if (profiler == NULL) return;
+
+  VM* vm = profiler->vm;
+  ProfileFrame stack[FRAMES_MAX];
+  int depth = vm->frameCount;
+  CallFrame* frames = vm->frames;
+  for (int i = 0; i < depth; i++) {
+    stack[i].function = frames[i].function;
+    stack[i].line = frameLine(&frames[i]);
+  }
+
+  int saved = errno;
+  recordStack(profiler, stack, depth);
+  errno = saved;
+}
+
+// start sampling vm's call stack hz times a second
+bool startProfiler(VM* vm, int hz) {
+  if (hz <= 0 || hz > 1000000) return false;
+
+  // the samples use the system allocator so they don't count as heap
+  // (or start collections)
+  if (vm->profiler == NULL) {
+    Profiler* profiler = (Profiler*) malloc(sizeof(Profiler));
+    if (profiler == NULL) exit(1);
+    profiler->vm = vm;
+    profiler->running = false;
+    profiler->stacks = (ProfileStack*) calloc(PROFILE_STACKS, sizeof(ProfileStack));
+    profiler->frames = (ProfileFrame*) malloc(sizeof(ProfileFrame) * PROFILE_FRAMES);
+    if (profiler->stacks == NULL || profiler->frames == NULL) exit(1);
+    profiler->frameCount = 0;
+    profiler->samples = 0;
+    profiler->dropped = 0;
+    vm->profiler = profiler;
+  }
+
+  // only one profiler can own the signal
+  if (active != NULL) return active == vm->profiler;
+
+  // restart interrupted system calls (reads shouldn't fail because of a sample)
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = sampleHandler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previousAction) != 0) return false;
+
+  // sample on a wall clock timer rather than setitimer(ITIMER_PROF):
+  // cpu time timers only fire on scheduler ticks (a few hundred hz at
+  // best), and time spent waiting on reads is worth seeing too. the signal
+  // goes to this thread, the one running vm, since on any other (an
+  // isolate's, say) the handler would race with vm's frames
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+  if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0) {
+    sigaction(SIGPROF, &previousAction, NULL);
+    return false;
+  }
+
+  active = vm->profiler;
+  struct itimerspec interval;
+  interval.it_interval.tv_sec = 0;
+  interval.it_interval.tv_nsec = 1000000000L / hz;
+  interval.it_value = interval.it_interval;
+  if (timer_settime(timer, 0, &interval, NULL) != 0) {
+    active = NULL;
+    timer_delete(timer);
+    sigaction(SIGPROF, &previousAction, NULL);
+    return false;
+  }
+
+  vm->profiler->running = true;
+  return true;
+}
+
+// stop sampling (the samples are kept until freeProfiler())
+void stopProfiler(VM* vm) {
+  if (vm->profiler == NULL || !vm->profiler->running) return;
+
+  timer_delete(timer);
+  active = NULL;
+  sigaction(SIGPROF, &previousAction, NULL);
+  vm->profiler->running = false;
+}
+
+// write the samples in the collapsed stack format flame graph tools read
+void writeProfile(VM* vm, FILE* out) {
+  Profiler* profiler = vm->profiler;
+  if (profiler == NULL) return;
+
+  for (int i = 0; i < PROFILE_STACKS; i++) {
+    ProfileStack* entry = &profiler->stacks[i];
+    if (entry->samples == 0) continue;
+
+    // samples taken while no script was running (compiling, mostly)
+    if (entry->depth == 0) fprintf(out, "(compile)");
+
+    for (int j = 0; j < entry->depth; j++) {
+      ProfileFrame* frame = &profiler->frames[entry->start + j];
+      ObjString* name = frame->function->name;
+      fprintf(out, "%s%s:%d", j == 0 ? "" : ";", name == NULL ? "script" : name->chars, frame->line);
+    }
+    fprintf(out, " %llu\n", (unsigned long long) entry->samples);
+  }
+}
+
+// stop profiling and free the samples
+void freeProfiler(VM* vm) {
+  Profiler* profiler = vm->profiler;
+  if (profiler == NULL) return;
+
+  stopProfiler(vm);
+  free(profiler->stacks);
+  free(profiler->frames);
+  free(profiler);
+  vm->profiler = NULL;
+}
+
+// mark the functions the samples refer to
+void markProfilerRoots(VM* vm) {
+  Profiler* profiler = vm->profiler;
+  if (profiler == NULL) return;
+
+  for (int i = 0; i < profiler->frameCount; i++) {
+    markObject(vm, (Obj*) profiler->frames[i].function);
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// distinct call stacks a profile can hold (a power of 2)
+#define PROFILE_STACKS 8192
+
+// frames stored across all of a profile's distinct stacks
+#define PROFILE_FRAMES (64 * 1024)
+
+// sample rate when none is given
+#define PROFILE_DEFAULT_HZ 1000
+
+// order the stores before it ahead of the ones after it as far as a
+// signal handler on the same thread can tell (costs no instructions)
+#define SIGNAL_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+// one level of a sampled call stack
+typedef struct {
+  ObjFunction* function;
+  int line;
+} ProfileFrame;
+
+// a distinct call stack and how many samples landed on it
+typedef struct {
+  uint32_t hash;
+  int depth;
+  int start; // first frame in the profiler's frame pool (outermost call first)
+  uint64_t samples; // 0 for an unused entry
+} ProfileStack;
+
+// SIGPROF sampling profiler
+//
+// a timer interrupts the process every so often and the signal handler
+// records the running fiber's call stack, counting identical stacks
+// together. the handler can't allocate, so the table and frame pool are
+// allocated up front and samples that don't fit are dropped. functions in
+// the table are gc roots until the profiler is freed.
+typedef struct Profiler {
+  VM* vm;
+  bool running;
+  ProfileStack* stacks;
+  ProfileFrame* frames;
+  int frameCount;
+  uint64_t samples; // recorded
+  uint64_t dropped; // lost because the table or frame pool was full
+} Profiler;
+
+// start sampling vm's call stack hz times a second (of wall clock time)
+// returns false if the timer couldn't be set up
+bool startProfiler(VM* vm, int hz);
+
+// stop sampling (the samples are kept until freeProfiler())
+void stopProfiler(VM* vm);
+
+// write the samples in the collapsed stack format flame graph tools read,
+// one "script:12;fib:3;fib:3 57" line per distinct stack
+void writeProfile(VM* vm, FILE* out);
+
+// stop profiling and free the samples
+void freeProfiler(VM* vm);
+
+// mark the functions the samples refer to
+void markProfilerRoots(VM* vm);
+
+#endif
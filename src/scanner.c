@@ -161,9 +161,29 @@ static Token identifier(Scanner* scanner) {
   return makeToken(scanner, identifierType(scanner));
 }
 
+// add a digit to a number literal (fraction digits also move the point)
+static void addDigit(NumberLiteral* number, int* digits, char c, bool fraction) {
+  // 19 digits always fit in 64 bits
+  if (*digits < 19) {
+    number->mantissa = number->mantissa * 10 + (uint64_t) (c - '0');
+    if (number->mantissa != 0) (*digits)++; // leading zeros don't count
+    if (fraction) number->exponent--;
+  } else {
+    if (c != '0') number->truncated = true;
+    if (!fraction) number->exponent++;
+  }
+}
+
 static Token number(Scanner* scanner) {
+  // collect the value while scanning so the compiler doesn't rescan it
+  NumberLiteral number = {0, 0, false};
+  int digits = 0;
+
+  // the first digit has already been consumed
+  addDigit(&number, &digits, scanner->start[0], false);
+
   // advance scanner while current char is a digit
-  while (isDigit(peek(scanner))) advance(scanner);
+  while (isDigit(peek(scanner))) addDigit(&number, &digits, advance(scanner), false);
 
   // look for a fractional part
   if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
@@ -171,11 +191,13 @@ static Token number(Scanner* scanner) {
     advance(scanner);
 
     // consume the fraction
-    while (isDigit(peek(scanner))) advance(scanner);
+    while (isDigit(peek(scanner))) addDigit(&number, &digits, advance(scanner), true);
   }
 
   // make token
-  return makeToken(scanner, TOKEN_NUMBER);
+  Token token = makeToken(scanner, TOKEN_NUMBER);
+  token.number = number;
+  return token;
 }
 
 static Token string(Scanner* scanner) {
@@ -219,6 +241,8 @@ Token scanToken(Scanner* scanner) {
     case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(scanner, TOKEN_SEMICOLON);
     case ',': return makeToken(scanner, TOKEN_COMMA);
     case '.': return makeToken(scanner, TOKEN_DOT);
@@ -13,6 +13,7 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   
@@ -35,11 +36,19 @@ typedef enum {
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
 
+// digits of a number literal as mantissa * 10^exponent
+typedef struct {
+  uint64_t mantissa; // first 19 significant digits
+  int exponent;
+  bool truncated; // non-zero digits past the first 19 were dropped
+} NumberLiteral;
+
 typedef struct {
   TokenType type;
   const char* start;
   int length;
   int line;
+  NumberLiteral number; // only set for TOKEN_NUMBER
 } Token;
 
 // initialize scanner
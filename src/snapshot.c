@@ -0,0 +1,918 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "verify.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "CLOXSNAP"
+#define SNAPSHOT_MAGIC_LENGTH 8
+#define SNAPSHOT_VERSION 5
+
+// index standing for a NULL reference
+#define NO_OBJECT UINT32_MAX
+
+// object being written and its index in the snapshot
+typedef struct {
+  Obj* object; // NULL for an empty entry
+  uint32_t index;
+} IndexEntry;
+
+// state of writing a snapshot
+// (everything here uses the system allocator so writing can't start a collection)
+typedef struct {
+  // objects to write (in the order they are written once ordered)
+  Obj** objects;
+  uint32_t count;
+  uint32_t capacity;
+
+  // object -> index (open addressing on the object's address)
+  IndexEntry* entries;
+  uint32_t entryCapacity; // power of 2
+
+  // the file's contents
+  uint8_t* bytes;
+  size_t size;
+  size_t byteCapacity;
+
+  const char* error;
+} Writer;
+
+// hash of an object's address
+static uint32_t hashObject(Obj* object) {
+  uint64_t address = (uint64_t) (uintptr_t) object;
+  return (uint32_t) ((address >> 3) * 0x9e3779b97f4a7c15u >> 32);
+}
+
+// entry for object (an empty one if the object hasn't been added)
+static IndexEntry* findEntry(IndexEntry* entries, uint32_t capacity, Obj* object) {
+  uint32_t index = hashObject(object) & (capacity - 1);
+  for (;;) {
+    IndexEntry* entry = &entries[index];
+    if (entry->object == object || entry->object == NULL) return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+// add object (and later everything it references) to the snapshot
+static void addObject(Writer* writer, Obj* object) {
+  if (object == NULL) return;
+
+  // keep the table at most half full
+  if (writer->entryCapacity < (writer->count + 1) * 2) {
+    uint32_t capacity = writer->entryCapacity < 256 ? 256 : writer->entryCapacity * 2;
+    IndexEntry* entries = (IndexEntry*) calloc(capacity, sizeof(IndexEntry));
+    if (entries == NULL) exit(1);
+    for (uint32_t i = 0; i < writer->count; i++) {
+      IndexEntry* entry = findEntry(entries, capacity, writer->objects[i]);
+      entry->object = writer->objects[i];
+      entry->index = i;
+    }
+    free(writer->entries);
+    writer->entries = entries;
+    writer->entryCapacity = capacity;
+  }
+
+  IndexEntry* entry = findEntry(writer->entries, writer->entryCapacity, object);
+  if (entry->object != NULL) return;
+  entry->object = object;
+  entry->index = writer->count;
+
+  if (writer->capacity < writer->count + 1) {
+    writer->capacity = GROW_CAPACITY(writer->capacity);
+    writer->objects = (Obj**) realloc(writer->objects, sizeof(Obj*) * writer->capacity);
+    if (writer->objects == NULL) exit(1);
+  }
+  writer->objects[writer->count++] = object;
+}
+
+static void addValue(Writer* writer, Value value) {
+  if (IS_OBJ(value)) addObject(writer, AS_OBJ(value));
+}
+
+static void addTable(Writer* writer, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    addObject(writer, (Obj*) entry->key);
+    addValue(writer, entry->value);
+  }
+}
+
+// add the objects object references
+static void addReferences(Writer* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_ARRAY:
+      break;
+    case OBJ_ROPE:
+      // written as the flat string it stands for
+      flattenRope((ObjRope*) object);
+      break;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      addObject(writer, (Obj*) function->name);
+      addObject(writer, (Obj*) function->owner);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        addValue(writer, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+    case OBJ_NATIVE:
+      addObject(writer, (Obj*) ((ObjNative*) object)->name);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*) object;
+      addObject(writer, (Obj*) shape->parent);
+      addObject(writer, (Obj*) shape->name);
+      addTable(writer, &shape->slots);
+      addTable(writer, &shape->transitions);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*) object;
+      addObject(writer, (Obj*) klass->name);
+      addObject(writer, (Obj*) klass->shape);
+      addObject(writer, (Obj*) klass->superclass);
+      addTable(writer, &klass->methods);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*) object;
+      addObject(writer, (Obj*) instance->klass);
+      addObject(writer, (Obj*) instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        addValue(writer, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*) object;
+      addValue(writer, bound->receiver);
+      addObject(writer, (Obj*) bound->method);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*) object;
+      for (int i = 0; i < map->capacity; i++) {
+        if (map->control[i] < 0) continue;
+        addValue(writer, map->entries[i].key);
+        addValue(writer, map->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_FIBER: {
+      // a finished fiber is only its result, an unfinished one has a
+      // call stack that can't be moved to another process
+      ObjFiber* fiber = (ObjFiber*) object;
+      if (fiber->state != FIBER_DONE) {
+        writer->error = "Can't snapshot an unfinished fiber.";
+        return;
+      }
+      addValue(writer, fiber->result);
+      break;
+    }
+  }
+}
+
+// position of a type in the snapshot, objects are restored in this order
+// so an instance's class and shape exist (with their field count) before it
+static int typeOrder(ObjType type) {
+  switch (type) {
+    case OBJ_STRING:
+    case OBJ_ROPE: return 0;
+    case OBJ_NATIVE: return 1; // found by name
+    case OBJ_FUNCTION: return 2;
+    case OBJ_SHAPE: return 3;
+    case OBJ_CLASS: return 4;
+    case OBJ_INSTANCE: return 5;
+    case OBJ_BOUND_METHOD: return 6;
+    case OBJ_FIBER: return 7;
+    case OBJ_ARRAY: return 8;
+    case OBJ_MAP: return 9;
+  }
+  return 0;
+}
+
+#define TYPE_ORDERS 10
+
+// sort the objects by type order (keeping them in the order they were found)
+static void orderObjects(Writer* writer) {
+  uint32_t starts[TYPE_ORDERS + 1] = {0};
+  for (uint32_t i = 0; i < writer->count; i++) {
+    starts[typeOrder(writer->objects[i]->type) + 1]++;
+  }
+  for (int i = 1; i <= TYPE_ORDERS; i++) starts[i] += starts[i - 1];
+
+  Obj** ordered = (Obj**) malloc(sizeof(Obj*) * (writer->count + 1));
+  if (ordered == NULL) exit(1);
+  for (uint32_t i = 0; i < writer->count; i++) {
+    Obj* object = writer->objects[i];
+    uint32_t index = starts[typeOrder(object->type)]++;
+    ordered[index] = object;
+    findEntry(writer->entries, writer->entryCapacity, object)->index = index;
+  }
+
+  free(writer->objects);
+  writer->objects = ordered;
+}
+
+// append bytes to the file
+static void putBytes(Writer* writer, const void* bytes, size_t size) {
+  if (writer->byteCapacity < writer->size + size) {
+    size_t capacity = writer->byteCapacity < 4096 ? 4096 : writer->byteCapacity;
+    while (capacity < writer->size + size) capacity *= 2;
+    writer->bytes = (uint8_t*) realloc(writer->bytes, capacity);
+    if (writer->bytes == NULL) exit(1);
+    writer->byteCapacity = capacity;
+  }
+  memcpy(writer->bytes + writer->size, bytes, size);
+  writer->size += size;
+}
+
+static void putByte(Writer* writer, uint8_t byte) {
+  putBytes(writer, &byte, 1);
+}
+
+static void putInt(Writer* writer, uint32_t value) {
+  putBytes(writer, &value, sizeof(value));
+}
+
+// index of object in the snapshot
+static void putObject(Writer* writer, Obj* object) {
+  if (object == NULL) {
+    putInt(writer, NO_OBJECT);
+    return;
+  }
+  putInt(writer, findEntry(writer->entries, writer->entryCapacity, object)->index);
+}
+
+// type, then the payload
+static void putValue(Writer* writer, Value value) {
+  putByte(writer, (uint8_t) value.type);
+  switch (value.type) {
+    case VAL_BOOL: putByte(writer, AS_BOOL(value)); break;
+    case VAL_NUMBER: putBytes(writer, &value.as.number, sizeof(double)); break;
+    case VAL_INT: putInt(writer, (uint32_t) AS_INT(value)); break;
+    case VAL_OBJ: putObject(writer, AS_OBJ(value)); break;
+    case VAL_NIL:
+    case VAL_UNDEFINED: break;
+  }
+}
+
+// entry count, then each key and value
+static void putTable(Writer* writer, Table* table) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) count++;
+  }
+
+  putInt(writer, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    putObject(writer, (Obj*) entry->key);
+    putValue(writer, entry->value);
+  }
+}
+
+// first section: an object without its references
+static void putShell(Writer* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*) object;
+      putByte(writer, OBJ_STRING);
+      putInt(writer, (uint32_t) string->length);
+      putBytes(writer, string->chars, string->length);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*) object;
+      putByte(writer, OBJ_STRING);
+      putInt(writer, (uint32_t) rope->length);
+      putBytes(writer, rope->chars, rope->length);
+      break;
+    }
+    case OBJ_NATIVE:
+      putByte(writer, OBJ_NATIVE);
+      putObject(writer, (Obj*) ((ObjNative*) object)->name);
+      break;
+    case OBJ_FUNCTION: {
+      // inline caches are written as their count, they start empty
+      Chunk* chunk = &((ObjFunction*) object)->chunk;
+      putByte(writer, OBJ_FUNCTION);
+      putInt(writer, (uint32_t) ((ObjFunction*) object)->arity);
+      putByte(writer, ((ObjFunction*) object)->pure);
+      putInt(writer, (uint32_t) chunk->count);
+      putBytes(writer, chunk->code, chunk->count);
+      putInt(writer, (uint32_t) chunk->lineCount);
+      putBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+      putInt(writer, (uint32_t) chunk->cacheCount);
+      break;
+    }
+    case OBJ_SHAPE:
+      putByte(writer, OBJ_SHAPE);
+      putInt(writer, (uint32_t) ((ObjShape*) object)->fieldCount);
+      break;
+    case OBJ_CLASS:
+      putByte(writer, OBJ_CLASS);
+      break;
+    case OBJ_INSTANCE:
+      putByte(writer, OBJ_INSTANCE);
+      putObject(writer, (Obj*) ((ObjInstance*) object)->klass);
+      putObject(writer, (Obj*) ((ObjInstance*) object)->shape);
+      break;
+    case OBJ_BOUND_METHOD:
+      putByte(writer, OBJ_BOUND_METHOD);
+      break;
+    case OBJ_FIBER:
+      putByte(writer, OBJ_FIBER);
+      break;
+    case OBJ_ARRAY: {
+      ObjArray* array = (ObjArray*) object;
+      putByte(writer, OBJ_ARRAY);
+      putByte(writer, array->shared != NULL);
+      putInt(writer, (uint32_t) array->count);
+      putBytes(writer, array->values, sizeof(double) * array->count);
+      break;
+    }
+    case OBJ_MAP:
+      putByte(writer, OBJ_MAP);
+      break;
+  }
+}
+
+// second section: an object's references
+static void putReferences(Writer* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_ROPE:
+    case OBJ_NATIVE:
+      break;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      putObject(writer, (Obj*) function->name);
+      putObject(writer, (Obj*) function->owner);
+      putInt(writer, (uint32_t) function->chunk.constants.count);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        putValue(writer, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*) object;
+      putObject(writer, (Obj*) shape->parent);
+      putObject(writer, (Obj*) shape->name);
+      putTable(writer, &shape->slots);
+      putTable(writer, &shape->transitions);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*) object;
+      putObject(writer, (Obj*) klass->name);
+      putObject(writer, (Obj*) klass->shape);
+      putObject(writer, (Obj*) klass->superclass);
+      putTable(writer, &klass->methods);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*) object;
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        putValue(writer, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*) object;
+      putValue(writer, bound->receiver);
+      putObject(writer, (Obj*) bound->method);
+      break;
+    }
+    case OBJ_FIBER:
+      putValue(writer, ((ObjFiber*) object)->result);
+      break;
+    case OBJ_ARRAY:
+      break;
+    case OBJ_MAP: {
+      // entries are written as pairs and set again when loaded (their
+      // positions depend on where objects end up)
+      ObjMap* map = (ObjMap*) object;
+      putInt(writer, (uint32_t) map->count);
+      for (int i = 0; i < map->capacity; i++) {
+        if (map->control[i] < 0) continue;
+        putValue(writer, map->entries[i].key);
+        putValue(writer, map->entries[i].value);
+      }
+      break;
+    }
+  }
+}
+
+static void freeWriter(Writer* writer) {
+  free(writer->objects);
+  free(writer->entries);
+  free(writer->bytes);
+}
+
+// write vm's globals and the objects they reach to path
+const char* writeSnapshot(VM* vm, const char* path) {
+  if (vm->scheduler.fiberCount > 1) return "Can't snapshot while fibers are unfinished.";
+
+  Writer writer;
+  memset(&writer, 0, sizeof(Writer));
+
+  // find everything reachable from the globals
+  for (int i = 0; i < vm->globals.count; i++) {
+    addObject(&writer, AS_OBJ(vm->globalNames.values[i]));
+    addValue(&writer, vm->globals.values[i]);
+  }
+  for (uint32_t i = 0; i < writer.count && writer.error == NULL; i++) {
+    addReferences(&writer, writer.objects[i]);
+  }
+  if (writer.error != NULL) {
+    freeWriter(&writer);
+    return writer.error;
+  }
+  orderObjects(&writer);
+
+  putBytes(&writer, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+  putInt(&writer, SNAPSHOT_VERSION);
+  putInt(&writer, writer.count);
+  for (uint32_t i = 0; i < writer.count; i++) putShell(&writer, writer.objects[i]);
+  for (uint32_t i = 0; i < writer.count; i++) putReferences(&writer, writer.objects[i]);
+
+  putInt(&writer, (uint32_t) vm->globals.count);
+  for (int i = 0; i < vm->globals.count; i++) {
+    putObject(&writer, AS_OBJ(vm->globalNames.values[i]));
+    putValue(&writer, vm->globals.values[i]);
+  }
+
+  FILE* file = fopen(path, "wb");
+  const char* error = NULL;
+  if (file == NULL) {
+    error = strerror(errno);
+  } else {
+    if (fwrite(writer.bytes, 1, writer.size, file) < writer.size) error = strerror(errno);
+    if (fclose(file) != 0 && error == NULL) error = strerror(errno);
+  }
+
+  freeWriter(&writer);
+  return error;
+}
+
+// state of loading a snapshot
+typedef struct {
+  VM* vm;
+  const uint8_t* bytes; // the mapped file
+  size_t size;
+  size_t offset;
+
+  // the restored objects are kept on the vm's stack (which makes them
+  // roots until every reference is in place) from this slot on
+  int base;
+  uint32_t count; // objects restored so far
+
+  const char* error;
+} Reader;
+
+// next size bytes of the file, NULL if it is too short
+static const uint8_t* getBytes(Reader* reader, size_t size) {
+  if (reader->error != NULL) return NULL;
+  if (reader->size - reader->offset < size) {
+    reader->error = "Snapshot is truncated.";
+    return NULL;
+  }
+  const uint8_t* bytes = reader->bytes + reader->offset;
+  reader->offset += size;
+  return bytes;
+}
+
+static uint8_t getByte(Reader* reader) {
+  const uint8_t* bytes = getBytes(reader, 1);
+  return bytes == NULL ? 0 : *bytes;
+}
+
+static uint32_t getInt(Reader* reader) {
+  uint32_t value = 0;
+  const uint8_t* bytes = getBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// number of elements taking at least size bytes each that follow
+// (checked against what is left of the file so a bad count can't run away)
+static int getCount(Reader* reader, size_t size) {
+  uint32_t count = getInt(reader);
+  if (count > INT32_MAX || (size > 0 && count > (reader->size - reader->offset) / size)) {
+    if (reader->error == NULL) reader->error = "Snapshot is truncated.";
+    return 0;
+  }
+  return (int) count;
+}
+
+// object restored at index
+static Obj* restored(Reader* reader, uint32_t index) {
+  return AS_OBJ(reader->vm->stack[reader->base + index]);
+}
+
+// reference to an already restored object of a type (may be NULL)
+static Obj* getObject(Reader* reader, ObjType type) {
+  uint32_t index = getInt(reader);
+  if (reader->error != NULL || index == NO_OBJECT) return NULL;
+  if (index >= reader->count || restored(reader, index)->type != type) {
+    reader->error = "Snapshot has a bad reference.";
+    return NULL;
+  }
+  return restored(reader, index);
+}
+
+// reference that can't be NULL
+static Obj* needObject(Reader* reader, ObjType type) {
+  Obj* object = getObject(reader, type);
+  if (object == NULL && reader->error == NULL) reader->error = "Snapshot has a bad reference.";
+  return object;
+}
+
+static Value getValue(Reader* reader) {
+  uint8_t type = getByte(reader);
+  switch (type) {
+    case VAL_BOOL: return BOOL_VAL(getByte(reader) != 0);
+    case VAL_NIL: return NIL_VAL;
+    case VAL_NUMBER: {
+      double number = 0;
+      const uint8_t* bytes = getBytes(reader, sizeof(double));
+      if (bytes != NULL) memcpy(&number, bytes, sizeof(double));
+      return NUMBER_VAL(number);
+    }
+    case VAL_INT: return INT_VAL((int32_t) getInt(reader));
+    case VAL_OBJ: {
+      uint32_t index = getInt(reader);
+      if (reader->error != NULL) return NIL_VAL;
+      if (index >= reader->count) {
+        reader->error = "Snapshot has a bad reference.";
+        return NIL_VAL;
+      }
+      return OBJ_VAL(restored(reader, index));
+    }
+    case VAL_UNDEFINED: return UNDEFINED_VAL;
+  }
+  if (reader->error == NULL) reader->error = "Snapshot has a bad value.";
+  return NIL_VAL;
+}
+
+// record that owner now references object (which may be NULL)
+static void linkObject(Reader* reader, Obj* owner, Obj* object) {
+  if (object != NULL) writeBarrier(reader->vm, owner, OBJ_VAL(object));
+}
+
+// fill table (held by owner) with the entries that follow
+static void getTable(Reader* reader, Obj* owner, Table* table) {
+  int count = getCount(reader, sizeof(uint32_t) + 1);
+  for (int i = 0; i < count && reader->error == NULL; i++) {
+    ObjString* key = (ObjString*) needObject(reader, OBJ_STRING);
+    Value value = getValue(reader);
+    if (reader->error != NULL) return;
+    tableSet(table, key, value);
+    writeBarrier(reader->vm, owner, OBJ_VAL(key));
+    writeBarrier(reader->vm, owner, value);
+  }
+}
+
+// check every value in table is an object of a type
+static bool tableHolds(Table* table, ObjType type) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL && !isObjType(entry->value, type)) return false;
+  }
+  return true;
+}
+
+// store a restored object (on the stack, where it stays until loading is done)
+static void keep(Reader* reader, Obj* object) {
+  push(reader->vm, OBJ_VAL(object));
+  reader->count++;
+}
+
+// first section: create an object without its references
+static void getShell(Reader* reader) {
+  VM* vm = reader->vm;
+  uint8_t type = getByte(reader);
+  if (reader->error != NULL) return;
+
+  switch (type) {
+    case OBJ_STRING: {
+      int length = getCount(reader, 1);
+      const uint8_t* chars = getBytes(reader, length);
+      if (chars == NULL) return;
+      keep(reader, (Obj*) copyString(vm, (const char*) chars, length));
+      return;
+    }
+    case OBJ_NATIVE: {
+      // natives can't be moved between processes, use this vm's
+      ObjString* name = (ObjString*) needObject(reader, OBJ_STRING);
+      if (name == NULL) return;
+      Value slot;
+      if (!tableGet(&vm->globalSlots, name, &slot) ||
+          !IS_NATIVE(vm->globals.values[(int) AS_NUMBER(slot)]) ||
+          AS_NATIVE(vm->globals.values[(int) AS_NUMBER(slot)])->name != name) {
+        reader->error = "Snapshot uses a native function this vm doesn't define.";
+        return;
+      }
+      keep(reader, AS_OBJ(vm->globals.values[(int) AS_NUMBER(slot)]));
+      return;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = newFunction(vm);
+      keep(reader, (Obj*) function);
+      function->arity = (int) getInt(reader);
+      function->pure = getByte(reader) != 0;
+
+      // compiled code always has at least a return and its line
+      Chunk* chunk = &function->chunk;
+      int count = getCount(reader, 1);
+      const uint8_t* code = getBytes(reader, count);
+      if (code == NULL) return;
+      if (count == 0) {
+        reader->error = "Snapshot has a bad function.";
+        return;
+      }
+      chunk->code = ALLOCATE(uint8_t, count);
+      chunk->capacity = chunk->count = count;
+      memcpy(chunk->code, code, count);
+
+      int lineCount = getCount(reader, sizeof(LineStart));
+      const uint8_t* lines = getBytes(reader, sizeof(LineStart) * lineCount);
+      if (lines == NULL) return;
+      if (lineCount == 0) {
+        reader->error = "Snapshot has a bad function.";
+        return;
+      }
+      chunk->lines = ALLOCATE(LineStart, lineCount);
+      chunk->lineCapacity = chunk->lineCount = lineCount;
+      memcpy(chunk->lines, lines, sizeof(LineStart) * lineCount);
+
+      // every cache belongs to an instruction
+      int cacheCount = getCount(reader, 0);
+      if (cacheCount > count) {
+        if (reader->error == NULL) reader->error = "Snapshot has a bad function.";
+        return;
+      }
+      while (chunk->cacheCount < cacheCount) addCache(chunk);
+      return;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = newShape(vm, NULL, NULL);
+      keep(reader, (Obj*) shape);
+      // every field has an entry in the shape's slots (which come later)
+      shape->fieldCount = getCount(reader, sizeof(uint32_t) + 1);
+      return;
+    }
+    case OBJ_CLASS:
+      // the class's own root shape is replaced by the restored one
+      keep(reader, (Obj*) newClass(vm, NULL));
+      return;
+    case OBJ_INSTANCE: {
+      ObjClass* klass = (ObjClass*) needObject(reader, OBJ_CLASS);
+      ObjShape* shape = (ObjShape*) needObject(reader, OBJ_SHAPE);
+      if (reader->error != NULL) return;
+
+      // nil fields until the references are restored
+      ObjInstance* instance = newInstance(vm, klass);
+      keep(reader, (Obj*) instance);
+      reserveFields(instance, shape->fieldCount);
+      for (int i = 0; i < shape->fieldCount; i++) instance->fields[i] = NIL_VAL;
+      instance->shape = shape;
+      linkObject(reader, (Obj*) instance, (Obj*) shape);
+      return;
+    }
+    case OBJ_BOUND_METHOD:
+      keep(reader, (Obj*) newBoundMethod(vm, NIL_VAL, NULL));
+      return;
+    case OBJ_FIBER: {
+      ObjFiber* fiber = newFiber(vm);
+      fiber->state = FIBER_DONE;
+      keep(reader, (Obj*) fiber);
+      return;
+    }
+    case OBJ_ARRAY: {
+      bool frozen = getByte(reader) != 0;
+      int count = getCount(reader, sizeof(double));
+      const uint8_t* values = getBytes(reader, sizeof(double) * count);
+      if (values == NULL) return;
+      ObjArray* array = newArray(vm, count);
+      if (count > 0) memcpy(array->values, values, sizeof(double) * count);
+      if (frozen) freezeArray(array);
+      keep(reader, (Obj*) array);
+      return;
+    }
+    case OBJ_MAP:
+      keep(reader, (Obj*) newMap(vm));
+      return;
+  }
+  reader->error = "Snapshot has a bad object.";
+}
+
+// second section: restore an object's references
+static void getReferences(Reader* reader, Obj* object) {
+  VM* vm = reader->vm;
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+      break;
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*) object;
+      function->name = (ObjString*) getObject(reader, OBJ_STRING);
+      function->owner = (ObjClass*) getObject(reader, OBJ_CLASS);
+      linkObject(reader, object, (Obj*) function->name);
+      linkObject(reader, object, (Obj*) function->owner);
+
+      int count = getCount(reader, 1);
+      for (int i = 0; i < count && reader->error == NULL; i++) {
+        Value constant = getValue(reader);
+        writeValueArray(&function->chunk.constants, constant);
+        writeBarrier(vm, object, constant);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*) object;
+      shape->parent = (ObjShape*) getObject(reader, OBJ_SHAPE);
+      shape->name = (ObjString*) getObject(reader, OBJ_STRING);
+      linkObject(reader, object, (Obj*) shape->parent);
+      linkObject(reader, object, (Obj*) shape->name);
+      getTable(reader, object, &shape->slots);
+      getTable(reader, object, &shape->transitions);
+      if (reader->error != NULL) break;
+
+      // field slots index the fields of the shape's instances
+      for (int i = 0; i < shape->slots.capacity; i++) {
+        Entry* entry = &shape->slots.entries[i];
+        if (entry->key == NULL) continue;
+        if (!IS_NUMBER(entry->value) || AS_NUMBER(entry->value) < 0 ||
+            AS_NUMBER(entry->value) >= shape->fieldCount) {
+          reader->error = "Snapshot has a bad shape.";
+        }
+      }
+      if (!tableHolds(&shape->transitions, OBJ_SHAPE)) reader->error = "Snapshot has a bad shape.";
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*) object;
+      klass->name = (ObjString*) needObject(reader, OBJ_STRING);
+      ObjShape* shape = (ObjShape*) needObject(reader, OBJ_SHAPE);
+      klass->superclass = (ObjClass*) getObject(reader, OBJ_CLASS);
+      if (shape != NULL) klass->shape = shape;
+      linkObject(reader, object, (Obj*) klass->name);
+      linkObject(reader, object, (Obj*) klass->shape);
+      linkObject(reader, object, (Obj*) klass->superclass);
+      getTable(reader, object, &klass->methods);
+      if (reader->error == NULL && !tableHolds(&klass->methods, OBJ_FUNCTION)) {
+        reader->error = "Snapshot has a bad class.";
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*) object;
+      for (int i = 0; i < instance->shape->fieldCount && reader->error == NULL; i++) {
+        instance->fields[i] = getValue(reader);
+        writeBarrier(vm, object, instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*) object;
+      bound->receiver = getValue(reader);
+      bound->method = (ObjFunction*) needObject(reader, OBJ_FUNCTION);
+      writeBarrier(vm, object, bound->receiver);
+      linkObject(reader, object, (Obj*) bound->method);
+      break;
+    }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*) object;
+      fiber->result = getValue(reader);
+      writeBarrier(vm, object, fiber->result);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*) object;
+      int count = getCount(reader, 2);
+      for (int i = 0; i < count && reader->error == NULL; i++) {
+        Value key = getValue(reader);
+        Value value = getValue(reader);
+        if (reader->error == NULL) mapSet(vm, map, key, value);
+      }
+      break;
+    }
+    case OBJ_ROPE:
+    case OBJ_ARRAY:
+      break;
+  }
+}
+
+// restore the objects and globals of a mapped snapshot
+static void restore(Reader* reader) {
+  VM* vm = reader->vm;
+  const uint8_t* magic = getBytes(reader, SNAPSHOT_MAGIC_LENGTH);
+  if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) != 0) {
+    reader->error = "Not a snapshot.";
+    return;
+  }
+  if (getInt(reader) != SNAPSHOT_VERSION) {
+    if (reader->error == NULL) reader->error = "Snapshot is from another version of clox.";
+    return;
+  }
+
+  // room on the stack for every object (and what allocating pushes)
+  int count = getCount(reader, 1);
+  if (reader->error != NULL) return;
+  if (vm->stackLimit - vm->stackTop < count + STACK_RESERVE) growStack(vm, count + STACK_RESERVE);
+  reader->base = (int) (vm->stackTop - vm->stack);
+
+  for (int i = 0; i < count && reader->error == NULL; i++) getShell(reader);
+  for (int i = 0; i < count && reader->error == NULL; i++) {
+    getReferences(reader, restored(reader, i));
+  }
+
+  // globals have to land in the slots the snapshot's bytecode uses
+  int globalCount = getCount(reader, sizeof(uint32_t) + 1);
+  if (reader->error == NULL && globalCount < vm->globals.count) {
+    reader->error = "Snapshot doesn't match this vm's globals.";
+  }
+  for (int i = 0; i < globalCount && reader->error == NULL; i++) {
+    ObjString* name = (ObjString*) needObject(reader, OBJ_STRING);
+    Value value = getValue(reader);
+    if (reader->error != NULL) break;
+    if (resolveGlobal(vm, name) != i) {
+      reader->error = "Snapshot doesn't match this vm's globals.";
+      break;
+    }
+    vm->globals.values[i] = value;
+  }
+
+  // the bytecode runs unchecked, so it has to pass the verifier like
+  // freshly compiled code (and gets its stack depth from it)
+  for (uint32_t i = 0; i < reader->count && reader->error == NULL; i++) {
+    Obj* object = restored(reader, i);
+    if (object->type == OBJ_FUNCTION) {
+      reader->error = verifyFunction(vm, (ObjFunction*) object);
+    }
+  }
+}
+
+// restore a snapshot into a new vm
+const char* loadSnapshot(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return strerror(errno);
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    int error = errno;
+    close(fd);
+    return strerror(error);
+  }
+  if (info.st_size == 0) {
+    close(fd);
+    return "Not a snapshot.";
+  }
+
+  // the objects are rebuilt straight from the mapping, which is dropped
+  // once they have been
+  void* bytes = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) return strerror(errno);
+
+  Reader reader;
+  reader.vm = vm;
+  reader.bytes = (const uint8_t*) bytes;
+  reader.size = (size_t) info.st_size;
+  reader.offset = 0;
+  reader.base = (int) (vm->stackTop - vm->stack);
+  reader.count = 0;
+  reader.error = NULL;
+
+  // everything restored is live, so collecting while loading would only
+  // trace it. it goes straight to the old generation instead.
+  size_t nurserySize = vm->gc.nurserySize;
+  size_t nextMajor = vm->gc.nextMajor;
+  vm->gc.nurserySize = SIZE_MAX;
+  vm->gc.nextMajor = SIZE_MAX;
+  restore(&reader);
+  vm->gc.nurserySize = nurserySize;
+  vm->gc.nextMajor = nextMajor;
+  if (reader.error == NULL) promoteNursery(vm);
+
+  vm->stackTop = vm->stack + reader.base;
+  munmap(bytes, (size_t) info.st_size);
+  return reader.error;
+}
@@ -0,0 +1,33 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+
+// heap snapshots for skipping a prelude at startup
+//
+// a snapshot holds the global variables and every object reachable from
+// them (strings, compiled functions with their constants and bytecode,
+// classes, shapes, instances...). pointers are stored as indices into the
+// snapshot's object list and relocated when it is loaded, natives are
+// stored by name and bound to the loading vm's own natives, and inline
+// caches start out empty.
+//
+// the file is written in two sections so it can be restored in one pass
+// over each: first every object without its references (in an order where
+// the classes and shapes an instance needs come before it), then the
+// references. loading maps the file and rebuilds the objects straight from
+// the mapping, nothing is parsed, compiled or run. the loaded bytecode is
+// verified just like freshly compiled code.
+//
+// snapshots are only meant for the build of clox that wrote them.
+
+// write vm's globals and the objects they reach to path
+// (between scripts, when no fiber but the main one is unfinished)
+// returns NULL on success, else what went wrong
+const char* writeSnapshot(VM* vm, const char* path);
+
+// restore a snapshot into a new vm (one that hasn't run anything yet)
+// returns NULL on success, else what went wrong (the vm should then be freed)
+const char* loadSnapshot(VM* vm, const char* path);
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdio.h>
+
+#include "memo.h"
+#include "memory.h"
+#include "stats.h"
+
+// print garbage collector statistics
+static void printGCStats(GC* gc, FILE* out) {
+  GCStats* stats = &gc->stats;
+  uint64_t pauses = stats->minorCollections + stats->majorSteps;
+
+  fprintf(out, "== gc ==\n");
+  fprintf(out, "heap bytes        %zu (peak %zu)\n", gc->bytesAllocated, stats->peakBytes);
+  fprintf(out, "minor collections %llu\n", (unsigned long long) stats->minorCollections);
+  fprintf(out, "major collections %llu (%llu slices)\n",
+      (unsigned long long) stats->majorCollections, (unsigned long long) stats->majorSteps);
+  fprintf(out, "bytes promoted    %llu\n", (unsigned long long) stats->bytesPromoted);
+  fprintf(out, "bytes freed       %llu\n", (unsigned long long) stats->bytesFreed);
+  fprintf(out, "total pause       %.3f ms\n", stats->totalPauseNs / 1e6);
+  fprintf(out, "max pause         %.3f ms\n", stats->maxPauseNs / 1e6);
+  if (pauses > 0) {
+    fprintf(out, "mean pause        %.3f ms\n", stats->totalPauseNs / 1e6 / pauses);
+  }
+
+  // pause histogram (skipping empty buckets)
+  fprintf(out, "pause histogram\n");
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (stats->pauseHistogram[i] == 0) continue;
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(out, "  >= %6d us  %llu\n", 1 << (i - 1), (unsigned long long) stats->pauseHistogram[i]);
+    } else {
+      fprintf(out, "  <  %6d us  %llu\n", 1 << i, (unsigned long long) stats->pauseHistogram[i]);
+    }
+  }
+}
+
+// print inline cache statistics
+static void printCacheStats(CacheStats* stats, FILE* out) {
+  uint64_t lookups = stats->hits + stats->misses + stats->megamorphic;
+
+  fprintf(out, "== inline caches ==\n");
+  fprintf(out, "lookups           %llu\n", (unsigned long long) lookups);
+  fprintf(out, "hits              %llu\n", (unsigned long long) stats->hits);
+  fprintf(out, "misses            %llu\n", (unsigned long long) stats->misses);
+  fprintf(out, "megamorphic       %llu\n", (unsigned long long) stats->megamorphic);
+  if (lookups > 0) {
+    fprintf(out, "hit rate          %.2f%%\n", 100.0 * stats->hits / lookups);
+  }
+}
+
+// print how many imported modules were loaded
+static void printModuleStats(VM* vm, FILE* out) {
+  int imported = 0;
+  int loaded = 0;
+  for (int i = 0; i < vm->modules.capacity; i++) {
+    Entry* entry = &vm->modules.entries[i];
+    if (entry->key == NULL) continue;
+    imported++;
+    if (!IS_STRING(entry->value)) loaded++;
+  }
+
+  fprintf(out, "== modules ==\n");
+  fprintf(out, "imported          %d\n", imported);
+  fprintf(out, "loaded            %d\n", loaded);
+  fprintf(out, "not loaded        %d\n", imported - loaded);
+}
+
+// print how much isolates sent and received
+static void printIsolateStats(IsolateStats* stats, FILE* out) {
+  fprintf(out, "== isolates ==\n");
+  fprintf(out, "spawned           %llu\n", (unsigned long long) stats->spawned);
+  fprintf(out, "messages sent     %llu\n", (unsigned long long) stats->sent);
+  fprintf(out, "messages received %llu\n", (unsigned long long) stats->received);
+  fprintf(out, "bytes copied      %llu\n", (unsigned long long) stats->messageBytes);
+  fprintf(out, "bytes shared      %llu\n", (unsigned long long) stats->sharedBytes);
+}
+
+// print how often memoized functions found their results cached
+static void printMemoStats(VM* vm, FILE* out) {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  for (int i = 0; i < vm->memoized.count; i++) {
+    MemoCache* memo = AS_FUNCTION(vm->memoized.values[i])->memo;
+    hits += memo->hits;
+    misses += memo->misses;
+  }
+
+  fprintf(out, "== memoization ==\n");
+  fprintf(out, "hits              %llu\n", (unsigned long long) hits);
+  fprintf(out, "misses            %llu\n", (unsigned long long) misses);
+  for (int i = 0; i < vm->memoized.count; i++) {
+    ObjFunction* function = AS_FUNCTION(vm->memoized.values[i]);
+    fprintf(out, "  %-15s %llu hits, %llu misses%s\n", function->name->chars,
+            (unsigned long long) function->memo->hits, (unsigned long long) function->memo->misses,
+            function->memo->stopped ? " (stopped)" : "");
+  }
+}
+
+// print sampling profiler statistics
+static void printProfilerStats(Profiler* profiler, FILE* out) {
+  int stacks = 0;
+  for (int i = 0; i < PROFILE_STACKS; i++) {
+    if (profiler->stacks[i].samples > 0) stacks++;
+  }
+
+  fprintf(out, "== profiler ==\n");
+  fprintf(out, "samples           %llu\n", (unsigned long long) profiler->samples);
+  fprintf(out, "distinct stacks   %d\n", stacks);
+  fprintf(out, "dropped           %llu\n", (unsigned long long) profiler->dropped);
+}
+
+// print runtime statistics for monitoring
+void printStats(VM* vm, FILE* out) {
+  printGCStats(&vm->gc, out);
+  printCacheStats(&vm->cacheStats, out);
+  if (vm->modules.count > 0) printModuleStats(vm, out);
+  if (vm->isolates.stats.spawned > 0) printIsolateStats(&vm->isolates.stats, out);
+  if (vm->memoized.count > 0) printMemoStats(vm, out);
+  if (vm->profiler != NULL) printProfilerStats(vm->profiler, out);
+  if (vm->perf != NULL) printPerfCounters(vm->perf, out);
+}
@@ -0,0 +1,11 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// print runtime statistics for monitoring
+void printStats(VM* vm, FILE* out);
+
+#endif
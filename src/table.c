@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+// grow table when it is 75% full
+#define TABLE_MAX_LOAD 0.75
+
+// initialize an empty table
+void initTable(Table* table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+// destroy table and free memory
+void freeTable(Table* table) {
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  initTable(table);
+}
+
+// find entry for key (or the empty bucket it belongs in)
+static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
+  // capacity is always a power of 2 so we can mask instead of mod
+  uint32_t index = key->hash & (capacity - 1);
+  Entry* tombstone = NULL;
+
+  // linear probing
+  for (;;) {
+    Entry* entry = &entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value)) {
+        // empty entry, reuse a tombstone if we passed one
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        // found a tombstone
+        if (tombstone == NULL) tombstone = entry;
+      }
+    } else if (entry->key == key) {
+      // keys are interned so we can compare pointers
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+// resize entries array and re-insert all entries
+static void adjustCapacity(Table* table, int capacity) {
+  Entry* entries = ALLOCATE(Entry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NULL;
+    entries[i].value = NIL_VAL;
+  }
+
+  // re-insert entries (dropping tombstones)
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+
+    Entry* dest = findEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+// get value for key, returns false if key not in table
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  if (table->count == 0) return false;
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key == NULL) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+// set value for key, returns true if key is new
+bool tableSet(Table* table, ObjString* key, Value value) {
+  // grow table if needed
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    adjustCapacity(table, capacity);
+  }
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  bool isNewKey = entry->key == NULL;
+
+  // only increase count if we are not reusing a tombstone
+  if (isNewKey && IS_NIL(entry->value)) table->count++;
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+// delete key from table, returns true if key was in table
+bool tableDelete(Table* table, ObjString* key) {
+  if (table->count == 0) return false;
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key == NULL) return false;
+
+  // place a tombstone in the entry so probing continues past it
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+  return true;
+}
+
+// copy all entries from one table to another
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry* entry = &from->entries[i];
+    if (entry->key != NULL) {
+      tableSet(to, entry->key, entry->value);
+    }
+  }
+}
+
+// find an interned string by its characters
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
+  if (table->count == 0) return NULL;
+
+  uint32_t index = hash & (table->capacity - 1);
+  for (;;) {
+    Entry* entry = &table->entries[index];
+    if (entry->key == NULL) {
+      // stop if we find an empty non-tombstone entry
+      if (IS_NIL(entry->value)) return NULL;
+    } else if (entry->key->length == length &&
+        entry->key->hash == hash &&
+        memcmp(entry->key->chars, chars, length) == 0) {
+      // found it
+      return entry->key;
+    }
+
+    index = (index + 1) & (table->capacity - 1);
+  }
+}
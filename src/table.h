@@ -0,0 +1,41 @@
+#ifndef clox_table_h
+#define clox_table_h
+
+#include "common.h"
+#include "value.h"
+
+// hash table entry
+typedef struct {
+  ObjString* key; // NULL for empty and tombstone entries
+  Value value;
+} Entry;
+
+// open addressing hash table keyed on interned strings
+typedef struct {
+  int count; // number of entries (including tombstones)
+  int capacity; // size of entries array
+  Entry* entries;
+} Table;
+
+// initialize an empty table
+void initTable(Table* table);
+
+// destroy table and free memory
+void freeTable(Table* table);
+
+// get value for key, returns false if key not in table
+bool tableGet(Table* table, ObjString* key, Value* value);
+
+// set value for key, returns true if key is new
+bool tableSet(Table* table, ObjString* key, Value value);
+
+// delete key from table, returns true if key was in table
+bool tableDelete(Table* table, ObjString* key);
+
+// copy all entries from one table to another
+void tableAddAll(Table* from, Table* to);
+
+// find an interned string by its characters
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+
+#endif
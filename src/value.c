@@ -1,6 +1,8 @@
 #include <stdio.h>
 
 #include "memory.h"
+#include "number.h"
+#include "object.h"
 #include "value.h"
 
 // initialize an empty array of Values
@@ -30,28 +32,65 @@ void freeValueArray(ValueArray* array) {
   initValueArray(array);
 }
 
-// print value
-void printValue(Value value) {
+// write value as program output
+// (kept out of line: inlined into run() it costs the hot arithmetic paths registers)
+__attribute__((noinline)) void writeValue(Output* output, Value value) {
+  char number[NUMBER_BUFFER_SIZE];
   switch (value.type) {
     case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
+      if (AS_BOOL(value)) {
+        writeOutput(output, "true", 4);
+      } else {
+        writeOutput(output, "false", 5);
+      }
       break;
     case VAL_NIL:
-      printf("nil");
+      writeOutput(output, "nil", 3);
       break;
     case VAL_NUMBER:
-      printf("%g", AS_NUMBER(value));
+      writeOutput(output, number, formatNumber(AS_NUMBER(value), number));
+      break;
+    case VAL_INT:
+      writeOutput(output, number, formatInt(AS_INT(value), number));
+      break;
+    case VAL_OBJ:
+      writeObject(output, value);
+      break;
+    case VAL_UNDEFINED:
+      writeOutput(output, "<undefined>", 11);
       break;
   }
 }
 
+// print value straight to stdout (for debugging)
+void printValue(Value value) {
+  Output output;
+  initOutput(&output);
+  writeValue(&output, value);
+  flushOutput(&output);
+}
+
 // check if two values are equal
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (a.type != b.type) {
+    // ints and doubles are the same numbers to Lox
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return false;
+  }
   switch(a.type) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
+    case VAL_UNDEFINED: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
+    case VAL_OBJ:
+      // flat strings are interned so equal strings are the same object,
+      // only ropes need their contents compared
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      if (IS_ROPE(a) || IS_ROPE(b)) {
+        return IS_ANY_STRING(a) && IS_ANY_STRING(b) && stringsEqual(AS_OBJ(a), AS_OBJ(b));
+      }
+      return false;
     default: return false;
   }
 }
\ No newline at end of file
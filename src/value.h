@@ -2,12 +2,20 @@
 #define clox_value_h
 
 #include "common.h"
+#include "output.h"
+
+// heap allocated objects (defined in object.h)
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
 
 // types of values
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
-  VAL_NUMBER,
+  VAL_NUMBER, // double
+  VAL_INT, // number that fits in 32 bits (same numbers to Lox, just faster)
+  VAL_OBJ,
+  VAL_UNDEFINED, // sentinel for global slots that haven't been defined
 } ValueType;
 
 // object (tagged union) to hold values
@@ -18,6 +26,9 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    int64_t integer; // always in int32_t range, stored wide so it fills the union
+                     // (a narrower store followed by a full Value copy stalls store forwarding)
+    Obj* obj;
   } as;
 
 } Value;
@@ -25,16 +36,42 @@ typedef struct {
 // macros to check if Value is type
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_NUMBER(value) isNumber(value) // double or int
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 // macros to create C-type from Lox Value
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_NUMBER(value) asNumber(value) // as a double (whichever representation)
+#define AS_INT(value) ((int32_t) (value).as.integer)
+#define AS_DOUBLE(value) ((value).as.number)
+#define AS_OBJ(value) ((value).as.obj)
 
 // macros to create Lox Value from C-type
 #define BOOL_VAL(value) ((Value) {VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value) {VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value) {VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value) {VAL_INT, {.integer = value}})
+#define OBJ_VAL(object) ((Value) {VAL_OBJ, {.obj = (Obj*)object}})
+
+// check if value is a number (in either representation)
+// (VAL_NUMBER and VAL_INT are adjacent so this is a single compare)
+static inline bool isNumber(Value value) {
+  return (unsigned) (value.type - VAL_NUMBER) <= VAL_INT - VAL_NUMBER;
+}
+
+// get a number as a double (in either representation)
+static inline double asNumber(Value value) {
+  return value.type == VAL_INT ? (double) value.as.integer : value.as.number;
+}
+
+// check if value is "falsey" - nil or false
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
 
 // array to  hold Values
 typedef struct {
@@ -54,7 +91,10 @@ void writeValueArray(ValueArray* array, Value value);
 // destroy an array of Values
 void freeValueArray(ValueArray* array);
 
-// print value
+// write value as program output
+void writeValue(Output* output, Value value);
+
+// print value straight to stdout (for debugging)
 void printValue(Value value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,241 @@
+#include "memory.h"
+#include "verify.h"
+#include "vm.h"
+
+// depth of an offset that doesn't start an instruction
+#define NOT_INSTRUCTION -2
+
+// depth of an instruction no path has reached yet
+#define UNREACHED -1
+
+// check that a name operand is a string constant
+static const char* checkName(Chunk* chunk, uint32_t name) {
+  if (name >= (uint32_t) chunk->constants.count || !IS_STRING(chunk->constants.values[name])) {
+    return "Name operand is not a string constant.";
+  }
+  return NULL;
+}
+
+// check that an inline cache operand is in range
+static const char* checkCache(Chunk* chunk, uint32_t cache) {
+  if (cache >= (uint32_t) chunk->cacheCount) return "Inline cache index out of range.";
+  return NULL;
+}
+
+// check the operands that don't depend on the stack
+static const char* checkOperands(VM* vm, Chunk* chunk, Instruction* instruction) {
+  switch (instruction->opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      if (instruction->index >= (uint32_t) chunk->constants.count) return "Constant index out of range.";
+      return NULL;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      if (instruction->index >= (uint32_t) vm->globals.count) return "Global slot out of range.";
+      return NULL;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE: {
+      const char* problem = checkName(chunk, instruction->index);
+      return problem != NULL ? problem : checkCache(chunk, instruction->cache);
+    }
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+      return checkName(chunk, instruction->index);
+    default:
+      return NULL;
+  }
+}
+
+// values an instruction pops and pushes
+static void stackEffect(Instruction* instruction, int* pops, int* pushes) {
+  *pops = 0;
+  *pushes = 0;
+  switch (instruction->opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_CLASS:
+      *pushes = 1;
+      break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_RETURN:
+    case OP_MEMO_RETURN:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE_LONG:
+    case OP_POP_JUMP_IF_TRUE:
+    case OP_POP_JUMP_IF_TRUE_LONG:
+      *pops = 1;
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_TRUE_LONG:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case OP_SET_PROPERTY:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_METHOD:
+    case OP_GET_INDEX:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case OP_SET_INDEX:
+      *pops = 3;
+      *pushes = 1;
+      break;
+    case OP_ARRAY:
+      *pops = instruction->byte;
+      *pushes = 1;
+      break;
+    case OP_INHERIT:
+      *pops = 2;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      *pops = instruction->byte + 1;
+      *pushes = 1;
+      break;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      *pops = instruction->byte + 1;
+      *pushes = 1;
+      break;
+  }
+}
+
+// record that an instruction is reached with depth values on the stack
+// (queueing it the first time it is reached)
+static const char* reach(Chunk* chunk, int* depths, int* worklist, int* workCount,
+                         int target, int depth) {
+  if (target < 0 || target >= chunk->count) return "Execution runs off the end of the chunk.";
+  if (depths[target] == NOT_INSTRUCTION) return "Jump into the middle of an instruction.";
+  if (depths[target] == UNREACHED) {
+    depths[target] = depth;
+    worklist[(*workCount)++] = target;
+    return NULL;
+  }
+  if (depths[target] != depth) return "Stack depth differs between paths.";
+  return NULL;
+}
+
+// check a function's bytecode once, before it can run
+const char* verifyFunction(VM* vm, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0) return "Execution runs off the end of the chunk.";
+
+  // stack depth on entry to each instruction (counting the callee's slot)
+  int* depths = ALLOCATE(int, chunk->count);
+  int* worklist = ALLOCATE(int, chunk->count);
+  int workCount = 0;
+  const char* problem = NULL;
+
+  // decode every instruction, including unreachable ones, so jump targets
+  // can be checked against instruction boundaries
+  // (an OP_WIDE prefix and its instruction are one instruction)
+  for (int offset = 0; offset < chunk->count; offset++) depths[offset] = NOT_INSTRUCTION;
+  for (int offset = 0; offset < chunk->count && problem == NULL;) {
+    Instruction instruction;
+    if (!decodeInstruction(chunk, offset, &instruction)) {
+      problem = "Unknown opcode or operands running off the end of the chunk.";
+      break;
+    }
+    depths[offset] = UNREACHED;
+    problem = checkOperands(vm, chunk, &instruction);
+
+    // a module's top level finishes without a result, other functions
+    // always hand one back (a tail call returns the callee's)
+    bool returns = instruction.opcode == OP_RETURN || instruction.opcode == OP_TAIL_CALL ||
+                   instruction.opcode == OP_MEMO_RETURN;
+    if ((returns && function->module) || (instruction.opcode == OP_END_MODULE && !function->module)) {
+      problem = "Return doesn't match the kind of function.";
+    }
+    offset += instruction.length;
+  }
+
+  // follow every path from the entry, the callee and arguments are already there
+  int maxSlots = function->arity + 1;
+  if (problem == NULL) {
+    problem = reach(chunk, depths, worklist, &workCount, 0, maxSlots);
+  }
+
+  while (problem == NULL && workCount > 0) {
+    int offset = worklist[--workCount];
+    int depth = depths[offset];
+    Instruction instruction;
+    decodeInstruction(chunk, offset, &instruction);
+
+    // slot 0 holds the callee, only the frame's own values may be popped
+    int pops, pushes;
+    stackEffect(&instruction, &pops, &pushes);
+    if (depth - pops < 1) {
+      problem = "Stack underflow.";
+      break;
+    }
+    if ((instruction.opcode == OP_GET_LOCAL || instruction.opcode == OP_SET_LOCAL) &&
+        instruction.byte >= depth) {
+      problem = "Local slot out of range.";
+      break;
+    }
+
+    int after = depth - pops + pushes;
+    if (after > maxSlots) maxSlots = after;
+
+    int next = offset + instruction.length;
+    switch (instruction.opcode) {
+      case OP_RETURN:
+      case OP_MEMO_RETURN:
+      case OP_END_MODULE:
+        break;
+      case OP_JUMP:
+      case OP_JUMP_LONG:
+      case OP_LOOP:
+      case OP_LOOP_LONG:
+        problem = reach(chunk, depths, worklist, &workCount,
+                        next + instruction.jump, after);
+        break;
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_FALSE_LONG:
+      case OP_JUMP_IF_TRUE:
+      case OP_JUMP_IF_TRUE_LONG:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE_LONG:
+      case OP_POP_JUMP_IF_TRUE:
+      case OP_POP_JUMP_IF_TRUE_LONG:
+        problem = reach(chunk, depths, worklist, &workCount,
+                        next + instruction.jump, after);
+        if (problem == NULL) problem = reach(chunk, depths, worklist, &workCount, next, after);
+        break;
+      default:
+        problem = reach(chunk, depths, worklist, &workCount, next, after);
+        break;
+    }
+  }
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(int, worklist, chunk->count);
+  if (problem == NULL) function->maxSlots = maxSlots;
+  return problem;
+}
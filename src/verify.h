@@ -0,0 +1,19 @@
+#ifndef clox_verify_h
+#define clox_verify_h
+
+#include "object.h"
+
+// check a function's bytecode once, before it can run
+//
+// run() trusts the chunk completely, so everything it would otherwise have
+// to check on every instruction is checked here instead: opcodes are known,
+// operands are in bounds (constants, names, globals, inline caches, locals),
+// jumps land on instructions, the stack never drops into the callee's slot
+// and is equally deep on every path into an instruction, and execution
+// can't run off the end. the deepest the stack gets is recorded in
+// function->maxSlots so calls can make room for the whole frame up front.
+//
+// returns NULL if the function is safe to run, else what is wrong with it
+const char* verifyFunction(VM* vm, ObjFunction* function);
+
+#endif
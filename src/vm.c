@@ -1,18 +1,30 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include "array.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "map.h"
+#include "memo.h"
+#include "memory.h"
+#include "module.h"
+#include "object.h"
 #include "vm.h"
 
-// reset stack
+// reset stack (abandoning every fiber but the main one)
 static void resetStack(VM* vm) {
-  vm->stackTop = vm->stack;
+  resetScheduler(vm);
+  vm->memoEpoch++;
 }
 
 // runtime error
-static void runtimeError(VM* vm, const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
+  // so the error comes after whatever the program printed
+  flushOutput(&vm->output);
+
   // what the heck is this. a variadic function?
   va_list args;
   // sets args to the ... argument in the function
@@ -25,23 +37,143 @@ static void runtimeError(VM* vm, const char* format, ...) {
   // print new line
   fputs("\n", stderr);
 
-  // print line number of error
-  size_t instruction = vm->ip - vm->chunk->code - 1;
-  int line = vm->chunk->lines[instruction].line;
-  fprintf(stderr, "[line %d] in script\n", line);
+  // print stack trace (innermost call first)
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame* frame = &vm->frames[i];
+    ObjFunction* function = frame->function;
+    int instruction = (int) (frame->ip - function->chunk.code - 1);
+
+    // a frame under a module's top level is backed up to the instruction
+    // that loaded it (see loadGlobal)
+    if (i + 1 < vm->frameCount && vm->frames[i + 1].function->module) instruction++;
+    fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
+    if (function->name == NULL) {
+      fprintf(stderr, "script\n");
+    } else if (function->module) {
+      fprintf(stderr, "module \"%s\"\n", function->name->chars);
+    } else {
+      fprintf(stderr, "%s()\n", function->name->chars);
+    }
+  }
 
   // reset stack to empty
   resetStack(vm);
 }
 
+// processor time used by the program in seconds
+static bool clockNative(VM* vm, int argCount, Value* args) {
+  args[-1] = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+// define a global native function
+void defineNative(VM* vm, const char* name, NativeFn function, int arity) {
+  // keep both objects on the stack while allocating
+  push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity, AS_STRING(vm->stack[0]))));
+  int slot = resolveGlobal(vm, AS_STRING(vm->stack[0]));
+  vm->globals.values[slot] = vm->stack[1];
+  pop(vm);
+  pop(vm);
+}
+
+// add a native to a table of built in methods
+void defineMethod(VM* vm, Table* methods, const char* name, NativeFn function, int arity) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity, AS_STRING(vm->stackTop[-1]))));
+  tableSet(methods, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+  pop(vm);
+  pop(vm);
+}
+
 // create vm
 void initVM(VM* vm) {
-  resetStack(vm);
+  // no stack until the main fiber exists
+  vm->frames = NULL;
+  vm->frameCount = 0;
+  vm->frameCapacity = 0;
+  vm->stack = NULL;
+  vm->stackTop = NULL;
+  vm->stackLimit = NULL;
+  vm->fiber = NULL;
+  vm->mainFiber = NULL;
+  vm->scheduler.fibers = NULL;
+  vm->profiler = NULL;
+  vm->perf = NULL;
+
+  vm->compiler = NULL;
+  initGC(&vm->gc);
+  useHeap(vm);
+  initTable(&vm->strings);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalNames);
+  initValueArray(&vm->globals);
+  initTable(&vm->modules);
+  initTable(&vm->imports);
+  initTable(&vm->arrayMethods);
+  initTable(&vm->mapMethods);
+  initValueArray(&vm->memoized);
+  vm->memoEpoch = 1;
+
+  CacheStats noStats = {0};
+  vm->cacheStats = noStats;
+
+  initOutput(&vm->output);
+  vm->timeSlice = 0;
+  vm->optimize = false;
+  vm->maxNesting = NESTING_MAX;
+  vm->isolateThreads = 0;
+
+  // the main fiber's stack is needed before anything is allocated
+  vm->initString = NULL;
+  initScheduler(vm);
+
+  vm->initString = copyString(vm, "init", 4);
+
+  defineNative(vm, "clock", clockNative, 0);
+  defineFiberNatives(vm);
+  defineArrayNatives(vm);
+  defineMapNatives(vm);
+  defineModuleNatives(vm);
+  defineMemoNatives(vm);
+  initIsolates(vm);
 }
 
 // destroy vm
 void freeVM(VM* vm) {
+  flushOutput(&vm->output);
+  freeIsolates(vm);
+  freeProfiler(vm);
+  freePerfCounters(vm);
+  freeScheduler(vm);
+  useHeap(vm);
+  freeTable(&vm->strings);
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->globals);
+  freeTable(&vm->modules);
+  freeTable(&vm->imports);
+  freeTable(&vm->arrayMethods);
+  freeTable(&vm->mapMethods);
+  freeValueArray(&vm->memoized);
+  vm->initString = NULL;
+  freeObjects(vm);
+  useHeap(NULL);
+}
+
+// get slot for a global variable name (adding a new slot if needed)
+int resolveGlobal(VM* vm, ObjString* name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot)) return (int) AS_NUMBER(slot);
 
+  // keep name on the stack in case growing the arrays starts a collection
+  push(vm, OBJ_VAL(name));
+  int index = vm->globals.count;
+  writeValueArray(&vm->globals, UNDEFINED_VAL);
+  writeValueArray(&vm->globalNames, OBJ_VAL(name));
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+  pop(vm);
+  return index;
 }
 
 // push value onto stack
@@ -61,37 +193,436 @@ static Value peek(VM* vm, int distance) {
   return vm->stackTop[-1 - distance];
 }
 
-// check if value is "falsey" - nil or false
-static bool isFalsey(Value value) {
-  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+// grow the running fiber for a call needing slots more stack values
+// (kept out of line so call() stays small)
+static __attribute__((noinline)) bool makeRoom(VM* vm, int slots) {
+  if (vm->frameCount == vm->frameCapacity && !growFrames(vm)) return false;
+  if (vm->stackLimit - vm->stackTop < slots) growStack(vm, slots);
+  return true;
+}
+
+// push a frame for a call to function
+// the callee and its arguments are already on the stack
+static inline bool call(VM* vm, ObjFunction* function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+    return false;
+  }
+  if (function->memo != NULL && memoLookup(vm, function, argCount, true)) return true;
+
+  // fibers start with small stacks that grow as calls need them. the
+  // verifier worked out how deep the stack gets so the whole frame fits
+  // from here on and instructions never check for room.
+  int slots = function->maxSlots + STACK_RESERVE - argCount - 1;
+  if (vm->frameCount == vm->frameCapacity || vm->stackLimit - vm->stackTop < slots) {
+    if (!makeRoom(vm, slots)) return false;
+  }
+
+  CallFrame* frame = &vm->frames[vm->frameCount];
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  frame->slots = vm->stackTop - argCount - 1;
+
+  // the profiler's signal handler may look at the frame as soon as it is counted
+  SIGNAL_FENCE();
+  vm->frameCount++;
+  return true;
+}
+
+// a global instruction found its global undefined: start the module it was
+// imported from, if it hasn't been loaded yet (see module.h). the module's
+// top level is called with frame backed up to the instruction, which runs
+// again once the module ends. returns false once an error has been reported
+static __attribute__((noinline)) bool loadGlobal(VM* vm, CallFrame* frame, uint32_t index) {
+  ObjString* name = AS_STRING(vm->globalNames.values[index]);
+  ObjFunction* module;
+  if (!loadModule(vm, name, &module)) return false;
+  if (module == NULL) {
+    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+    return false;
+  }
+
+  // the operand is 16 bits unless the instruction had an OP_WIDE prefix.
+  // read as 32 bits, a 16 bit operand takes in its opcode (never 0) as the
+  // second byte, so it only reads back as index when it was the wide one
+  bool wide = frame->ip - frame->function->chunk.code >= 6 && readWideOperand(frame->ip - 4) == index;
+  frame->ip -= wide ? 6 : 3;
+
+  push(vm, OBJ_VAL(module));
+  return call(vm, module, 0);
+}
+
+// call a native function, leaving its result in place of the callee
+static bool callNative(VM* vm, ObjNative* native, int argCount) {
+  if (native->arity >= 0 && argCount != native->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+    return false;
+  }
+
+  // natives that switch fibers finish the call on the fiber they leave
+  Value* args = vm->stackTop - argCount;
+  ObjFiber* fiber = vm->fiber;
+  if (!native->function(vm, argCount, args)) return false;
+  if (vm->fiber == fiber) vm->stackTop = args;
+  return true;
+}
+
+// call any callable value
+static bool callValue(VM* vm, Value callee, int argCount) {
+  if (IS_OBJ(callee)) {
+    switch (OBJ_TYPE(callee)) {
+      case OBJ_BOUND_METHOD: {
+        // the receiver becomes slot 0 ("this") of the method
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        // the new instance replaces the class and becomes "this" of the initializer
+        ObjClass* klass = AS_CLASS(callee);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        Value initializer;
+        if (tableGet(&klass->methods, vm->initString, &initializer)) {
+          return call(vm, AS_FUNCTION(initializer), argCount);
+        } else if (argCount != 0) {
+          runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
+        return true;
+      }
+      case OBJ_FUNCTION: return call(vm, AS_FUNCTION(callee), argCount);
+      case OBJ_NATIVE: return callNative(vm, AS_NATIVE(callee), argCount);
+      default: break; // non-callable object
+    }
+  }
+  runtimeError(vm, "Can only call functions.");
+  return false;
+}
+
+// replace the running frame with a call to function (a tail call)
+// the callee and arguments slide down over the frame so the call stack doesn't grow
+static bool tailCall(VM* vm, CallFrame* frame, ObjFunction* function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+    return false;
+  }
+
+  // the new function may need a deeper frame than the one it replaces
+  if (vm->stackLimit - frame->slots < function->maxSlots + STACK_RESERVE) {
+    growStack(vm, function->maxSlots + STACK_RESERVE - argCount - 1);
+  }
+
+  Value* callee = vm->stackTop - argCount - 1;
+  memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+  vm->stackTop = frame->slots + argCount + 1;
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  return true;
+}
+
+// a tail call from or to a memoized function (see memo.h). the frame is
+// reused like any tail call, only the cache entry in its callee slot is
+// carried on, given up or reserved anew
+static __attribute__((noinline)) bool memoTailCall(VM* vm, CallFrame* frame, ObjFunction* function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+    return false;
+  }
+
+  Value entry = frame->slots[0];
+  bool reserved = IS_INT(entry) && frame->function->memo != NULL;
+  if (reserved && function == frame->function) {
+    // a hit is left on the stack for the return that follows to store
+    if (memoLookup(vm, function, argCount, false)) return true;
+    if (!tailCall(vm, frame, function, argCount)) return false;
+    frame->slots[0] = entry;
+    return true;
+  }
+
+  if (reserved) {
+    memoRelease(vm, frame->function, AS_INT(entry));
+    frame->slots[0] = OBJ_VAL(frame->function);
+  }
+  if (function->memo != NULL && memoLookup(vm, function, argCount, true)) return true;
+  return tailCall(vm, frame, function, argCount);
+}
+
+// find the cache entry for shape, NULL on a miss
+static inline CacheEntry* findEntry(InlineCache* cache, ObjShape* shape) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// record the result of a full lookup in a cache owned by function
+static void fillCache(VM* vm, ObjFunction* function, InlineCache* cache, CacheEntry* entry) {
+  if (cache->megamorphic) {
+    vm->cacheStats.megamorphic++;
+    return;
+  }
+  vm->cacheStats.misses++;
+
+  // too many shapes seen at this site, stop caching
+  if (cache->count == IC_ENTRIES) {
+    cache->megamorphic = true;
+    return;
+  }
+
+  cache->entries[cache->count++] = *entry;
+  writeBarrier(vm, (Obj*) function, OBJ_VAL(entry->shape));
+  if (entry->transition != NULL) writeBarrier(vm, (Obj*) function, OBJ_VAL(entry->transition));
+  if (entry->method != NULL) writeBarrier(vm, (Obj*) function, OBJ_VAL(entry->method));
+}
+
+// find property name of instance (a field or a method), using the cache when possible
+// returns false if the instance has no such property
+static inline bool lookupProperty(VM* vm, ObjFunction* function, InlineCache* cache,
+                                  ObjInstance* instance, ObjString* name, CacheEntry* result) {
+  CacheEntry* entry = findEntry(cache, instance->shape);
+  if (entry != NULL) {
+    vm->cacheStats.hits++;
+    *result = *entry;
+    return true;
+  }
+
+  // fields shadow methods
+  result->shape = instance->shape;
+  result->transition = NULL;
+  result->method = NULL;
+  result->slot = shapeSlot(instance->shape, name);
+  if (result->slot == -1) {
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) return false;
+    result->method = AS_FUNCTION(method);
+  }
+
+  fillCache(vm, function, cache, result);
+  return true;
+}
+
+// store value in field name of instance (adding the field if needed)
+// instance and value must be reachable since this allocates
+static void setProperty(VM* vm, ObjFunction* function, InlineCache* cache,
+                        ObjInstance* instance, ObjString* name, Value value) {
+  CacheEntry found;
+  CacheEntry* entry = findEntry(cache, instance->shape);
+  if (entry != NULL) {
+    vm->cacheStats.hits++;
+    found = *entry;
+  } else {
+    found.shape = instance->shape;
+    found.transition = NULL;
+    found.method = NULL;
+    found.slot = shapeSlot(instance->shape, name);
+    if (found.slot == -1) {
+      // new field
+      found.transition = shapeTransition(vm, instance->shape, name);
+      found.slot = found.transition->fieldCount - 1;
+    }
+    fillCache(vm, function, cache, &found);
+  }
+
+  if (found.transition != NULL) {
+    // store the value before switching shape so the collector never sees an unset field
+    reserveFields(instance, found.slot + 1);
+    instance->fields[found.slot] = value;
+    instance->shape = found.transition;
+    writeBarrier(vm, (Obj*) instance, OBJ_VAL(found.transition));
+  } else {
+    instance->fields[found.slot] = value;
+  }
+  writeBarrier(vm, (Obj*) instance, value);
+}
+
+// replace the receiver on top of the stack with method bound to it
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_FUNCTION(method));
+  vm->stackTop[-1] = OBJ_VAL(bound);
+  return true;
+}
+
+// element of array picked by index (a number), reports a runtime error
+// for anything else
+static inline bool arrayIndex(VM* vm, ObjArray* array, Value index, int* element) {
+  if (IS_INT(index) && (uint32_t) AS_INT(index) < (uint32_t) array->count) {
+    *element = AS_INT(index);
+    return true;
+  }
+
+  if (!IS_NUMBER(index)) {
+    runtimeError(vm, "Array index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < array->count)) {
+    runtimeError(vm, "Array index out of range.");
+    return false;
+  }
+  if (number != (int) number) {
+    runtimeError(vm, "Array index must be an integer.");
+    return false;
+  }
+  *element = (int) number;
+  return true;
+}
+
+// int multiply that also fails for -0 (0 times a negative number)
+// since only a double can hold it
+static inline bool mulOverflows(int32_t a, int32_t b, int32_t* result) {
+  if (__builtin_mul_overflow(a, b, result)) return true;
+  return *result == 0 && (a < 0 || b < 0);
+}
+
+// concatenate two strings on top of stack
+// this builds a rope so repeated concatenation doesn't copy the left operand
+static void concatenate(VM* vm) {
+  // operands stay on the stack until we are done allocating
+  Obj* b = AS_OBJ(peek(vm, 0));
+  Obj* a = AS_OBJ(peek(vm, 1));
+  Obj* result = concatenateStrings(vm, a, b);
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL(result));
 }
 
 // run code chunk
-static InterpretResult run(VM* vm) {
+// the interpreter loop, specialized below with and without counting the
+// bytecode instructions it executes (for --perf-counters)
+static inline __attribute__((always_inline)) InterpretResult runLoop(VM* vm, bool counting) {
+  // frame of the running function
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
+
+  uint64_t* executed = counting ? &vm->perf->bytecodes : NULL;
+
+  // ticks left in this time slice
+  uint64_t budget = vm->timeSlice == 0 ? UINT64_MAX : vm->timeSlice;
+
+  // the stack pointer and the value on top of the stack live in locals
+  // (registers) while instructions run, so arithmetic and comparisons work
+  // on the top value without going through memory. sp is one past the top
+  // like vm->stackTop but the top's own slot is stale: everything below it
+  // is in memory, the top is only in tos. a fiber's stack is never empty
+  // while it has frames (slot 0 holds the callee), so sp[-1] always exists.
+  Value* sp = vm->stackTop;
+  Value tos = sp[-1];
+
+  // SYNC: writes the top back so vm and the stack in memory are current.
+  // needed before anything else looks at the stack: calls, allocation (the
+  // collector marks the stack), runtime errors, yielding and tracing
+  #define SYNC() (sp[-1] = tos, vm->stackTop = sp)
+
+  // RELOAD: picks the stack up from vm again after something that may have
+  // changed it (or moved it, growing the stack reallocates it)
+  #define RELOAD() (sp = vm->stackTop, tos = sp[-1])
+
+  // PUSH: spills the old top to its slot and makes value the top
+  // (value is read after the spill so it may be a slot of the stack)
+  #define PUSH(value) (sp[-1] = tos, sp++, tos = (value))
+
+  // DROP: pops the top, the value under it is already in memory
+  #define DROP() (sp--, tos = sp[-1])
+
   // READ_BYTE: gets address of byte pointed at by ip, dereferences, 
   // and then advances the instruction pointer
-  #define READ_BYTE() (*(vm->ip)++)
+  #define READ_BYTE() (*frame->ip++)
   
-  // READ_CONSTANT 
-  #define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+  // READ_SHORT: reads a 16 bit operand
+  #define READ_SHORT() (frame->ip += 2, readShortOperand(frame->ip - 2))
+
+  // READ_WIDE: reads a 32 bit operand (after an OP_WIDE prefix)
+  #define READ_WIDE() (frame->ip += 4, readWideOperand(frame->ip - 4))
 
-  // BINARY_OP: performs binary op on stack
+  // NAME/CACHE: the name constant and inline cache at an index
+  #define NAME(index) AS_STRING(frame->function->chunk.constants.values[index])
+  #define CACHE(index) (&frame->function->chunk.caches[index])
+
+  // READ_STRING: reads a 16 bit constant index of a name
+  #define READ_STRING() NAME(READ_SHORT())
+
+  // READ_CACHE: reads a 16 bit inline cache index
+  #define READ_CACHE() CACHE(READ_SHORT())
+
+  // TICK: spends part of the time slice, only at loops and calls so
+  // straight line code never pays for it. everything run() needs to carry
+  // on later is in vm once the stack is synced.
+  #define TICK() \
+    do { \
+      if (--budget == 0) { \
+        SYNC(); \
+        return INTERPRET_YIELD; \
+      } \
+    } while (false)
+
+  // BINARY_OP: performs binary op on the top two values
+  // two doubles are handled first, mixed int/double operands are converted
   #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+      Value a = sp[-2]; \
+      if (IS_DOUBLE(tos) && IS_DOUBLE(a)) { \
+        sp--; \
+        tos = valueType(AS_DOUBLE(a) op AS_DOUBLE(tos)); \
+        break; \
+      } \
+      if (!IS_NUMBER(tos) || !IS_NUMBER(a)) { \
+        SYNC(); \
         runtimeError(vm, "Operands must be numbers."); \
         return INTERPRET_RUNTIME_ERROR; \
       } \
-      double b = AS_NUMBER(pop(vm)); \
-      double a = AS_NUMBER(pop(vm)); \
-      push(vm, valueType(a op b)); \
+      sp--; \
+      tos = valueType(AS_NUMBER(a) op AS_NUMBER(tos)); \
     } while (false)
 
+  // INT_OP: overflow checked int arithmetic, falling back to BINARY_OP
+  // for doubles (or when the result doesn't fit in 32 bits)
+  #define INT_OP(overflows, op) \
+    do { \
+      if (IS_INT(tos) && IS_INT(sp[-2])) { \
+        int32_t result; \
+        if (!overflows(AS_INT(sp[-2]), AS_INT(tos), &result)) { \
+          sp--; \
+          tos = INT_VAL(result); \
+          break; \
+        } \
+      } \
+      BINARY_OP(NUMBER_VAL, op); \
+    } while (false)
+
+  // COMPARE_OP: compare ints directly, anything else as doubles
+  #define COMPARE_OP(op) \
+    do { \
+      if (IS_INT(tos) && IS_INT(sp[-2])) { \
+        bool result = AS_INT(sp[-2]) op AS_INT(tos); \
+        sp--; \
+        tos = BOOL_VAL(result); \
+        break; \
+      } \
+      BINARY_OP(BOOL_VAL, op); \
+    } while (false)
+
+  // operands of the instructions OP_WIDE can prefix. their handlers are
+  // shared: OP_WIDE reads the wide operands and jumps into the handler
+  // just after the point where it reads its own
+  uint32_t index;
+  ObjString* name;
+  InlineCache* cache;
+  int argCount;
+
   // main loop to read all instructions in chunk
   for (;;) {
     #ifdef DEBUG_TRACE_EXECUTION
 
+    // keep program output in order with the trace
+    flushOutput(&vm->output);
+
     // show stack contents
+    SYNC();
     printf("          ");
     for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
       printf("[ ");
@@ -101,110 +632,686 @@ static InterpretResult run(VM* vm) {
     printf("\n");
 
     // show instruction
-    int offset = (int)(vm->ip - vm->chunk->code);
-    disassembleInstruction(vm->chunk, offset);
+    int offset = (int)(frame->ip - frame->function->chunk.code);
+    disassembleInstruction(&frame->function->chunk, offset);
     #endif
 
     // read next instruction
     uint8_t instruction = READ_BYTE();
+    if (counting) (*executed)++;
 
     // choose action
     switch(instruction) {
 
       // load constant
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(vm, constant);
-        //printf("\n");
+      case OP_CONSTANT:
+        index = READ_BYTE();
+      constant:
+        PUSH(frame->function->chunk.constants.values[index]);
+        break;
+      case OP_CONSTANT_LONG:
+        index = readLongOperand(frame->ip);
+        frame->ip += 3;
+        goto constant;
+
+      // literals
+      case OP_NIL: PUSH(NIL_VAL); break;
+      case OP_TRUE: PUSH(BOOL_VAL(true)); break;
+      case OP_FALSE: PUSH(BOOL_VAL(false)); break;
+
+      case OP_POP: DROP(); break;
+
+      // local variables live in the frame's window of the stack
+      // (the slot may be the top, which PUSH spills before reading it)
+      case OP_GET_LOCAL: {
+        uint8_t slot = READ_BYTE();
+        PUSH(frame->slots[slot]);
         break;
       }
-      case OP_CONSTANT_LONG: {
-        uint8_t byte1 = READ_BYTE();
-        uint8_t byte2 = READ_BYTE() << 8;
-        uint8_t byte3 = READ_BYTE() << 16;
-        uint32_t index = byte1 | byte2 | byte3;
-        Value constant = vm->chunk->constants.values[index];
-        push(vm, constant);
-        //printf("\n");
+      case OP_SET_LOCAL: {
+        uint8_t slot = READ_BYTE();
+        // assignment is an expression so leave value on the stack
+        frame->slots[slot] = tos;
         break;
       }
 
-      // literals
-      case OP_NIL: push(vm, NIL_VAL); break;
-      case OP_TRUE: push(vm, BOOL_VAL(true)); break;
-      case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+      // global variables
+      case OP_DEFINE_GLOBAL:
+        index = READ_SHORT();
+      defineGlobal:
+        vm->globals.values[index] = tos;
+        DROP();
+        break;
+      case OP_GET_GLOBAL:
+        index = READ_SHORT();
+      getGlobal: {
+        Value value = vm->globals.values[index];
+        if (IS_UNDEFINED(value)) {
+          SYNC();
+          if (!loadGlobal(vm, frame, index)) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm->frames[vm->frameCount - 1];
+          RELOAD();
+          break;
+        }
+        PUSH(value);
+        break;
+      }
+      case OP_SET_GLOBAL:
+        index = READ_SHORT();
+      setGlobal:
+        if (IS_UNDEFINED(vm->globals.values[index])) {
+          SYNC();
+          if (!loadGlobal(vm, frame, index)) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm->frames[vm->frameCount - 1];
+          RELOAD();
+          break;
+        }
+        // assignment is an expression so leave value on the stack
+        vm->globals.values[index] = tos;
+        break;
+
+      // properties
+      case OP_GET_PROPERTY:
+        name = READ_STRING();
+        cache = READ_CACHE();
+      getProperty: {
+        if (!IS_INSTANCE(tos)) {
+          SYNC();
+          runtimeError(vm, "Only instances have properties.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        // looking up (and filling the cache) doesn't allocate
+        ObjInstance* instance = AS_INSTANCE(tos);
+        CacheEntry found;
+        if (!lookupProperty(vm, frame->function, cache, instance, name, &found)) {
+          SYNC();
+          runtimeError(vm, "Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        // the instance stays on the stack while binding allocates
+        if (found.slot >= 0) {
+          tos = instance->fields[found.slot];
+        } else {
+          SYNC();
+          tos = OBJ_VAL(newBoundMethod(vm, tos, found.method));
+        }
+        break;
+      }
+      case OP_SET_PROPERTY:
+        name = READ_STRING();
+        cache = READ_CACHE();
+      setProperty: {
+        if (!IS_INSTANCE(sp[-2])) {
+          SYNC();
+          runtimeError(vm, "Only instances have fields.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        // the instance and value stay on the stack while a new field allocates
+        SYNC();
+        setProperty(vm, frame->function, cache, AS_INSTANCE(sp[-2]), name, tos);
+
+        // assignment is an expression so leave the value (not the instance) on the stack
+        sp--;
+        break;
+      }
+      case OP_GET_SUPER:
+        name = READ_STRING();
+      getSuper: {
+        ObjClass* superclass = frame->function->owner->superclass;
+        SYNC();
+        if (!bindMethod(vm, superclass, name)) return INTERPRET_RUNTIME_ERROR;
+        RELOAD();
+        break;
+      }
 
       // equality and comparisons
       case OP_EQUAL: {
-        Value b = pop(vm);
-        Value a = pop(vm);
-        push(vm, BOOL_VAL(valuesEqual(a, b)));
+        if (IS_INT(tos) && IS_INT(sp[-2])) {
+          bool equal = AS_INT(sp[-2]) == AS_INT(tos);
+          sp--;
+          tos = BOOL_VAL(equal);
+          break;
+        }
+
+        // comparing ropes flattens them so keep both on the stack
+        SYNC();
+        bool equal = valuesEqual(sp[-2], tos);
+        sp--;
+        tos = BOOL_VAL(equal);
         break;
       }
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+      case OP_GREATER: COMPARE_OP(>); break;
+      case OP_LESS: COMPARE_OP(<); break;
 
       // unary operations
       case OP_NEGATE: {
         // peek at top of stack
-        if (!IS_NUMBER(peek(vm, 0))) {
+        if (!IS_NUMBER(tos)) {
           // throw error
+          SYNC();
           runtimeError(vm, "Operand must be number");
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        // negate the current value and put it back on top
-        // push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm)))); 
-        // break;
-        
-        // instead of a push/pop combo, we will just modify the value in-place
-        *(vm->stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm->stackTop - 1))); 
+        // negate the top value where it is
+        if (IS_INT(tos) && AS_INT(tos) != 0 && AS_INT(tos) != INT32_MIN) {
+          tos = INT_VAL(-AS_INT(tos));
+        } else {
+          // -0 and -INT32_MIN are only representable as doubles
+          tos = NUMBER_VAL(-AS_NUMBER(tos));
+        }
         break;
       }
 
       // binary operations
-      case OP_ADD: BINARY_OP(NUMBER_VAL, +); break;
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
+      case OP_ADD: {
+        if (IS_NUMBER(tos) && IS_NUMBER(sp[-2])) {
+          INT_OP(__builtin_add_overflow, +);
+        } else if (IS_ANY_STRING(tos) && IS_ANY_STRING(sp[-2])) {
+          SYNC();
+          concatenate(vm);
+          RELOAD();
+        } else {
+          SYNC();
+          runtimeError(vm, "Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        break;
+      }
+      case OP_SUBTRACT: INT_OP(__builtin_sub_overflow, -); break;
+      case OP_MULTIPLY: INT_OP(mulOverflows, *); break;
       case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
 
       case OP_NOT:
-        push(vm, BOOL_VAL(isFalsey(pop(vm))));
+        tos = BOOL_VAL(isFalsey(tos));
         break;
 
-      // return value
+      case OP_PRINT:
+        // printing a rope flattens it
+        SYNC();
+        writeValue(&vm->output, tos);
+        writeLine(&vm->output);
+        DROP();
+        break;
+
+      // control flow
+      // (the 8 bit forms come first, each _LONG form takes a 16 bit offset,
+      // or a 32 bit one behind OP_WIDE)
+      case OP_JUMP: {
+        uint8_t offset = READ_BYTE();
+        frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_LONG: {
+        uint16_t offset = READ_SHORT();
+        frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_IF_FALSE: {
+        uint8_t offset = READ_BYTE();
+        if (isFalsey(tos)) frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_IF_FALSE_LONG: {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(tos)) frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_IF_TRUE: {
+        uint8_t offset = READ_BYTE();
+        if (!isFalsey(tos)) frame->ip += offset;
+        break;
+      }
+      case OP_JUMP_IF_TRUE_LONG: {
+        uint16_t offset = READ_SHORT();
+        if (!isFalsey(tos)) frame->ip += offset;
+        break;
+      }
+      case OP_POP_JUMP_IF_FALSE: {
+        uint8_t offset = READ_BYTE();
+        if (isFalsey(tos)) frame->ip += offset;
+        DROP();
+        break;
+      }
+      case OP_POP_JUMP_IF_FALSE_LONG: {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(tos)) frame->ip += offset;
+        DROP();
+        break;
+      }
+      case OP_POP_JUMP_IF_TRUE: {
+        uint8_t offset = READ_BYTE();
+        if (!isFalsey(tos)) frame->ip += offset;
+        DROP();
+        break;
+      }
+      case OP_POP_JUMP_IF_TRUE_LONG: {
+        uint16_t offset = READ_SHORT();
+        if (!isFalsey(tos)) frame->ip += offset;
+        DROP();
+        break;
+      }
+      case OP_LOOP: {
+        uint8_t offset = READ_BYTE();
+        frame->ip -= offset;
+        TICK();
+        break;
+      }
+      case OP_LOOP_LONG: {
+        uint16_t offset = READ_SHORT();
+        frame->ip -= offset;
+        TICK();
+        break;
+      }
+
+      // calls (the callee and arguments are read from memory, and a call
+      // may grow the stack, so they sync first and reload after)
+      case OP_CALL: {
+        argCount = READ_BYTE();
+        SYNC();
+        Value callee = sp[-argCount - 1];
+
+        // fast path for calls to lox functions
+        if (IS_FUNCTION(callee)) {
+          if (!call(vm, AS_FUNCTION(callee), argCount)) return INTERPRET_RUNTIME_ERROR;
+        } else if (!callValue(vm, callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm->frames[vm->frameCount - 1];
+        RELOAD();
+        TICK();
+        break;
+      }
+      case OP_TAIL_CALL: {
+        argCount = READ_BYTE();
+        SYNC();
+        Value callee = sp[-argCount - 1];
+
+        // lox functions reuse this frame. anything else is called normally
+        // and the OP_RETURN that always follows returns its result.
+        if (IS_FUNCTION(callee)) {
+          ObjFunction* function = AS_FUNCTION(callee);
+          if (function->memo == NULL && frame->function->memo == NULL) {
+            if (!tailCall(vm, frame, function, argCount)) return INTERPRET_RUNTIME_ERROR;
+          } else if (!memoTailCall(vm, frame, function, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        } else {
+          if (!callValue(vm, callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm->frames[vm->frameCount - 1];
+        }
+        RELOAD();
+        TICK();
+        break;
+      }
+
+      case OP_INVOKE:
+        name = READ_STRING();
+        argCount = READ_BYTE();
+        cache = READ_CACHE();
+      invoke: {
+        SYNC();
+        Value receiver = sp[-argCount - 1];
+        if (!IS_INSTANCE(receiver)) {
+          // arrays and maps have built in methods, the receiver is the native's callee slot
+          Value method;
+          Table* methods = IS_ARRAY(receiver) ? &vm->arrayMethods
+                         : IS_MAP(receiver) ? &vm->mapMethods : NULL;
+          if (methods == NULL) {
+            runtimeError(vm, "Only instances have methods.");
+            return INTERPRET_RUNTIME_ERROR;
+          } else if (!tableGet(methods, name, &method)) {
+            runtimeError(vm, "Undefined property '%s'.", name->chars);
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          if (!callNative(vm, AS_NATIVE(method), argCount)) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm->frames[vm->frameCount - 1];
+          RELOAD();
+          TICK();
+          break;
+        }
+
+        ObjInstance* instance = AS_INSTANCE(receiver);
+        CacheEntry found;
+        if (!lookupProperty(vm, frame->function, cache, instance, name, &found)) {
+          runtimeError(vm, "Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        if (found.slot >= 0) {
+          // calling a function stored in a field
+          sp[-argCount - 1] = instance->fields[found.slot];
+          if (!callValue(vm, sp[-argCount - 1], argCount)) return INTERPRET_RUNTIME_ERROR;
+        } else if (!call(vm, found.method, argCount)) {
+          // the receiver is already in slot 0 so no bound method is needed
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm->frames[vm->frameCount - 1];
+        RELOAD();
+        TICK();
+        break;
+      }
+      case OP_SUPER_INVOKE:
+        name = READ_STRING();
+        argCount = READ_BYTE();
+      superInvoke: {
+        ObjClass* superclass = frame->function->owner->superclass;
+        Value method;
+        SYNC();
+        if (!tableGet(&superclass->methods, name, &method)) {
+          runtimeError(vm, "Undefined property '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!call(vm, AS_FUNCTION(method), argCount)) return INTERPRET_RUNTIME_ERROR;
+        frame = &vm->frames[vm->frameCount - 1];
+        RELOAD();
+        TICK();
+        break;
+      }
+
       case OP_RETURN:
-        printValue(pop(vm));
-        printf("\n");
-        return INTERPRET_OK;
+      ret: {
+        Value result = tos;
+        vm->frameCount--;
+
+        // end of the fiber (the whole script for the main fiber)
+        if (vm->frameCount == 0) {
+          vm->stackTop = sp - 2;
+          if (vm->scheduler.fiberCount == 1) return INTERPRET_OK;
+
+          // run the other fibers, returning once they're all done
+          if (!finishFiber(vm, result)) return INTERPRET_RUNTIME_ERROR;
+          if (vm->frameCount == 0) return INTERPRET_OK;
+          frame = &vm->frames[vm->frameCount - 1];
+          RELOAD();
+          break;
+        }
+
+        // discard the callee's window and hand the result to the caller
+        // (the caller's values below it were synced by the call)
+        sp = frame->slots + 1;
+        tos = result;
+        frame = &vm->frames[vm->frameCount - 1];
+        break;
+      }
+
+      // classes (these allocate or change tables, which may allocate,
+      // so they work on the synced stack)
+      case OP_CLASS:
+        name = READ_STRING();
+      klass:
+        SYNC();
+        push(vm, OBJ_VAL(newClass(vm, name)));
+        RELOAD();
+        break;
+      case OP_INHERIT: {
+        SYNC();
+        Value superclass = peek(vm, 1);
+        if (!IS_CLASS(superclass)) {
+          runtimeError(vm, "Superclass must be a class.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        // copy inherited methods down so lookups never walk the class chain
+        ObjClass* subclass = AS_CLASS(peek(vm, 0));
+        subclass->superclass = AS_CLASS(superclass);
+        writeBarrier(vm, (Obj*) subclass, superclass);
+        Table* methods = &AS_CLASS(superclass)->methods;
+        for (int i = 0; i < methods->capacity; i++) {
+          Entry* entry = &methods->entries[i];
+          if (entry->key == NULL) continue;
+          tableSet(&subclass->methods, entry->key, entry->value);
+          writeBarrier(vm, (Obj*) subclass, OBJ_VAL(entry->key));
+          writeBarrier(vm, (Obj*) subclass, entry->value);
+        }
+        pop(vm);
+        pop(vm);
+        RELOAD();
+        break;
+      }
+      case OP_METHOD:
+        name = READ_STRING();
+      method: {
+        SYNC();
+        ObjFunction* method = AS_FUNCTION(peek(vm, 0));
+        ObjClass* klass = AS_CLASS(peek(vm, 1));
+        tableSet(&klass->methods, name, OBJ_VAL(method));
+        writeBarrier(vm, (Obj*) klass, OBJ_VAL(name));
+        writeBarrier(vm, (Obj*) klass, OBJ_VAL(method));
+
+        // super inside the method refers to this class's superclass.
+        // (if a class declaration runs more than once, its methods belong to the latest class)
+        method->owner = klass;
+        writeBarrier(vm, (Obj*) method, OBJ_VAL(klass));
+        pop(vm);
+        RELOAD();
+        break;
+      }
+
+      // arrays
+      case OP_ARRAY: {
+        int count = READ_BYTE();
+        SYNC();
+        Value* elements = vm->stackTop - count;
+        for (int i = 0; i < count; i++) {
+          if (!IS_NUMBER(elements[i])) {
+            runtimeError(vm, "Array elements must be numbers.");
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        }
+
+        ObjArray* array = newArray(vm, count);
+        for (int i = 0; i < count; i++) array->values[i] = AS_NUMBER(elements[i]);
+        vm->stackTop = elements;
+        push(vm, OBJ_VAL(array));
+        RELOAD();
+        break;
+      }
+      case OP_GET_INDEX: {
+        if (IS_MAP(sp[-2])) {
+          // a missing key reads as nil (a rope key may be flattened)
+          Value value;
+          SYNC();
+          if (!mapGet(vm, AS_MAP(sp[-2]), tos, &value)) value = NIL_VAL;
+          sp--;
+          tos = value;
+          break;
+        }
+        if (!IS_ARRAY(sp[-2])) {
+          SYNC();
+          runtimeError(vm, "Only arrays and maps can be indexed.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjArray* array = AS_ARRAY(sp[-2]);
+        int element;
+        SYNC();
+        if (!arrayIndex(vm, array, tos, &element)) return INTERPRET_RUNTIME_ERROR;
+        sp--;
+        tos = NUMBER_VAL(array->values[element]);
+        break;
+      }
+      case OP_SET_INDEX: {
+        if (IS_MAP(sp[-3])) {
+          // the map, key and value stay on the stack while the map grows
+          SYNC();
+          mapSet(vm, AS_MAP(sp[-3]), sp[-2], tos);
+          sp -= 2;
+          break;
+        }
+        if (!IS_ARRAY(sp[-3])) {
+          SYNC();
+          runtimeError(vm, "Only arrays and maps can be indexed.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjArray* array = AS_ARRAY(sp[-3]);
+        if (array->shared != NULL) {
+          SYNC();
+          runtimeError(vm, "Array is frozen.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        int element;
+        SYNC();
+        if (!arrayIndex(vm, array, sp[-2], &element)) return INTERPRET_RUNTIME_ERROR;
+        if (!IS_NUMBER(tos)) {
+          runtimeError(vm, "Array elements must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        array->values[element] = AS_NUMBER(tos);
+
+        // assignment is an expression so leave the value on the stack
+        sp -= 2;
+        break;
+      }
+
+      // end of a module's top level (see loadGlobal): the frame and its
+      // callee go, and the global instruction that loaded it runs again
+      case OP_END_MODULE:
+        vm->frameCount--;
+        sp = frame->slots;
+        tos = sp[-1];
+        frame = &vm->frames[vm->frameCount - 1];
+        break;
+
+      // return of a memoized function: a call that missed the cache left the
+      // entry it reserved in its callee slot (see memo.h)
+      case OP_MEMO_RETURN:
+        if (IS_INT(frame->slots[0])) {
+          SYNC();
+          memoStore(vm, frame->function, AS_INT(frame->slots[0]), tos);
+        }
+        goto ret;
+
+      // 32 bit operands for the instruction that follows
+      // (the verifier only lets it prefix these)
+      case OP_WIDE:
+        switch (READ_BYTE()) {
+          case OP_CONSTANT: index = READ_WIDE(); goto constant;
+          case OP_DEFINE_GLOBAL: index = READ_WIDE(); goto defineGlobal;
+          case OP_GET_GLOBAL: index = READ_WIDE(); goto getGlobal;
+          case OP_SET_GLOBAL: index = READ_WIDE(); goto setGlobal;
+          case OP_GET_PROPERTY:
+            name = NAME(READ_WIDE());
+            cache = CACHE(READ_WIDE());
+            goto getProperty;
+          case OP_SET_PROPERTY:
+            name = NAME(READ_WIDE());
+            cache = CACHE(READ_WIDE());
+            goto setProperty;
+          case OP_GET_SUPER: name = NAME(READ_WIDE()); goto getSuper;
+          case OP_INVOKE:
+            name = NAME(READ_WIDE());
+            argCount = READ_BYTE();
+            cache = CACHE(READ_WIDE());
+            goto invoke;
+          case OP_SUPER_INVOKE:
+            name = NAME(READ_WIDE());
+            argCount = READ_BYTE();
+            goto superInvoke;
+          case OP_CLASS: name = NAME(READ_WIDE()); goto klass;
+          case OP_METHOD: name = NAME(READ_WIDE()); goto method;
+
+          // jumps over more than 64KB of code
+          case OP_JUMP_LONG:
+            index = READ_WIDE();
+            frame->ip += index;
+            break;
+          case OP_JUMP_IF_FALSE_LONG:
+            index = READ_WIDE();
+            if (isFalsey(tos)) frame->ip += index;
+            break;
+          case OP_JUMP_IF_TRUE_LONG:
+            index = READ_WIDE();
+            if (!isFalsey(tos)) frame->ip += index;
+            break;
+          case OP_POP_JUMP_IF_FALSE_LONG:
+            index = READ_WIDE();
+            if (isFalsey(tos)) frame->ip += index;
+            DROP();
+            break;
+          case OP_POP_JUMP_IF_TRUE_LONG:
+            index = READ_WIDE();
+            if (!isFalsey(tos)) frame->ip += index;
+            DROP();
+            break;
+          case OP_LOOP_LONG:
+            index = READ_WIDE();
+            frame->ip -= index;
+            TICK();
+            break;
+          default: __builtin_unreachable();
+        }
+        break;
+
+      // the verifier only lets known opcodes through, so the dispatch
+      // doesn't need a range check
+      default:
+        __builtin_unreachable();
     }
   }
 
+  #undef SYNC
+  #undef RELOAD
+  #undef PUSH
+  #undef DROP
   #undef READ_BYTE
-  #undef READ_CONSTANT
+  #undef READ_SHORT
+  #undef READ_WIDE
+  #undef NAME
+  #undef CACHE
+  #undef READ_STRING
+  #undef READ_CACHE
+  #undef TICK
   #undef BINARY_OP
+  #undef INT_OP
+  #undef COMPARE_OP
+}
+
+// run with the perf counters going (kept apart so the usual loop has no
+// trace of them)
+static __attribute__((noinline)) InterpretResult runCounting(VM* vm) {
+  beginCounting(vm);
+  InterpretResult result = runLoop(vm, true);
+  endCounting(vm);
+  return result;
+}
+
+// run the vm until the script finishes, fails or yields
+static InterpretResult run(VM* vm) {
+  if (vm->perf != NULL) return runCounting(vm);
+  return runLoop(vm, false);
 }
 
-// interpret code chunk
+// interpret source code
 InterpretResult interpret(VM* vm, const char* source) {
-  // initialize chunk
-  Chunk chunk;
-  initChunk(&chunk);
+  useHeap(vm);
 
-  // compile source to bytecodes in chunk
-  if (!compile(vm, source, &chunk)) {
-    freeChunk(&chunk);
-    return INTERPRET_COMPILE_ERROR;
-  }
+  // drop whatever is left of a script that yielded
+  resetStack(vm);
 
-  // initialize chunk in VM
-  vm->chunk = &chunk;
-  vm->ip = vm->chunk->code;
+  // compile source to a function for the top level script
+  ObjFunction* function = compile(vm, source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  // the script sits in stack slot 0 like any other callee
+  push(vm, OBJ_VAL(function));
+  call(vm, function, 0);
 
   // run vm
   InterpretResult result = run(vm);
+  flushOutput(&vm->output);
+  return result;
+}
+
+// continue a script after interpret() or resume() returned INTERPRET_YIELD
+InterpretResult resume(VM* vm) {
+  // nothing left to run
+  if (vm->frameCount == 0) return INTERPRET_OK;
 
-  // free chunk
-  freeChunk(&chunk);
+  useHeap(vm);
+  InterpretResult result = run(vm);
+  flushOutput(&vm->output);
   return result;
-}
\ No newline at end of file
+}
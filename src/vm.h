@@ -2,28 +2,123 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "counters.h"
+#include "fiber.h"
+#include "isolate.h"
+#include "memory.h"
+#include "object.h"
+#include "output.h"
+#include "profile.h"
+#include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// deepest call stack a fiber can have
+#define FRAMES_MAX 64
 
-// VM definition
+// default for vm->maxNesting
+#define NESTING_MAX 256
+
+// stack slots kept free above every frame for values the runtime pushes
+// to keep them alive while it allocates
+#define STACK_RESERVE 8
+
+// inline cache statistics (for monitoring)
 typedef struct {
-  // pointer to current code chunk
-  Chunk* chunk;
-  
-  // current instruction pointer
-  uint8_t* ip;
-
-  // stack (array of values)
-  Value stack[STACK_MAX];
+  uint64_t hits; // lookups answered by a cache entry
+  uint64_t misses; // lookups that did a full lookup and filled an entry
+  uint64_t megamorphic; // full lookups at sites that gave up caching
+} CacheStats;
+
+// VM definition
+struct VM {
+  // call stack of the running fiber (frames[frameCount - 1] is running)
+  // these are the fiber's own arrays, switching fibers just swaps them
+  CallFrame* frames;
+  int frameCount;
+  int frameCapacity;
+
+  // value stack of the running fiber
+  Value* stack;
   Value* stackTop;
-} VM;
+  Value* stackLimit; // end of the stack's allocation
+
+  ObjFiber* fiber; // running fiber
+  ObjFiber* mainFiber; // runs the top level script
+  Scheduler scheduler;
+
+  // interned strings (only keys are used)
+  Table strings;
+
+  // global variables are resolved to slots at compile time
+  // (kept across interpret() calls so REPL lines share them)
+  Table globalSlots; // name -> slot index
+  ValueArray globalNames; // slot -> name (for error messages)
+  ValueArray globals; // slot -> value (UNDEFINED_VAL until defined)
+
+  // modules by source (see module.h)
+  Table modules; // source -> path until loaded, then its function (nil if it didn't compile)
+  Table imports; // exported name -> source of the module declaring it
+
+  // name of class initializers
+  ObjString* initString;
+
+  // built in methods of arrays (name -> native, see array.h)
+  Table arrayMethods;
+
+  // built in methods of maps (see map.h)
+  Table mapMethods;
+
+  // garbage collected heap
+  GC gc;
+
+  CacheStats cacheStats;
+
+  // program output (embedders can point its sink elsewhere)
+  Output output;
+
+  // loop iterations and calls one interpret() or resume() may run before
+  // it yields so a host can time slice scripts (0 for no limit)
+  uint64_t timeSlice;
+
+  // compile through the optimizing expression ir (see ir.h) rather than
+  // emitting bytecode as the source is parsed
+  bool optimize;
+
+  // deepest nesting of expressions, statements and functions the compiler
+  // accepts. the parser recurses on the native stack for every level, so
+  // this bounds the stack compiling can take (a couple of hundred bytes a
+  // level, but around 9KB for each nested function)
+  int maxNesting;
+
+  // functions memoize() was called on (see memo.h)
+  ValueArray memoized;
+
+  // changes whenever the stack is reset, so memo entries that calls which
+  // were abandoned had reserved can be taken again
+  uint64_t memoEpoch;
+
+  // isolates started from this vm (see isolate.h)
+  Isolates isolates;
+
+  // most threads running isolates at once (0 for no limit)
+  int isolateThreads;
+
+  // sampling profiler (NULL unless one was started)
+  Profiler* profiler;
+
+  // hardware counters around run() (NULL unless started)
+  PerfCounters* perf;
+
+  // compiler currently running (its objects are roots)
+  struct Compiler* compiler;
+};
 
 // interpret enums
 typedef enum {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
+  INTERPRET_RUNTIME_ERROR,
+  INTERPRET_YIELD // time slice used up, call resume() to continue
 } InterpretResult;
 
 // create and destroy VM
@@ -31,8 +126,25 @@ void initVM(VM* vm);
 void freeVM(VM* vm);
 
 // interpret code source
+// (a script that yielded and wasn't resumed to the end is abandoned)
 InterpretResult interpret(VM* vm, const char* source);
 
+// continue a script after interpret() or resume() returned INTERPRET_YIELD
+InterpretResult resume(VM* vm);
+
+// get slot for a global variable name (adding a new slot if needed)
+int resolveGlobal(VM* vm, ObjString* name);
+
+// report a runtime error with a stack trace and reset the stack
+void runtimeError(VM* vm, const char* format, ...);
+
+// define a global native function
+void defineNative(VM* vm, const char* name, NativeFn function, int arity);
+
+// add a native to a table of built in methods (like vm->arrayMethods)
+// the receiver is in the native's callee slot, args[-1]
+void defineMethod(VM* vm, Table* methods, const char* name, NativeFn function, int arity);
+
 // push/pop values onto stack
 void push(VM* vm, Value value);
 Value pop(VM* vm);
@@ -0,0 +1,105 @@
+#!/bin/sh
+# read() from a file, a pipe and a fifo whose writer only turns up later,
+# while another fiber keeps running, and two fibers waiting on one fifo
+#
+#   sh tests/fiber/read.sh build/clox-test
+
+clox=$1
+dir=$(mktemp -d)
+writer=
+trap 'rm -rf "$dir"; [ -z "$writer" ] || kill "$writer" 2>/dev/null' EXIT
+
+# read path to the end on one fiber, printing what it got and whether a
+# second fiber got to run meanwhile (only when a read had to wait)
+cat > "$dir/read.lox" <<'LOX'
+var done = false;
+fun counter() {
+  var yields = 0;
+  while (!done) {
+    yields = yields + 1;
+    yield();
+  }
+  return yields;
+}
+var counting = spawn(counter);
+
+var fd = open(path);
+var text = "";
+var chunk = read(fd);
+while (chunk != nil) {
+  text = text + chunk;
+  chunk = read(fd);
+}
+close(fd);
+done = true;
+print text;
+print join(counting) > 0;
+LOX
+
+# run the script on path, its output must be the lines given
+check() {
+  name=$1
+  shift
+  output=$("$clox" "$dir/script.lox" 2>&1)
+  status=$?
+  expected=$(printf '%s\n' "$@")
+  if [ $status -ne 0 ] || [ "$output" != "$expected" ]; then
+    echo "$name (exit $status):"
+    printf '%s\n' "$output" | head -n 5
+    exit 1
+  fi
+}
+script() {
+  { echo "var path = \"$1\";"; cat "$dir/read.lox"; } > "$dir/script.lox"
+}
+
+# a file
+printf 'from a file' > "$dir/file"
+script "$dir/file"
+check file "from a file" false
+
+# an empty file is at its end straight away
+: > "$dir/empty"
+script "$dir/empty"
+check "empty file" "" false
+
+# a pipe from the shell, written in two parts
+script /dev/stdin
+(printf 'from '; sleep 1; printf 'a pipe') | check pipe "from a pipe" true
+
+# a fifo nothing has opened for writing yet: it has to wait for the writer
+# instead of reading as empty
+mkfifo "$dir/fifo"
+script "$dir/fifo"
+(sleep 1; printf 'from a fifo' > "$dir/fifo") >/dev/null 2>&1 &
+writer=$!
+check "fifo with a late writer" "from a fifo" true
+wait
+
+# a fifo whose writer opens it and leaves without writing is at its end
+(sleep 1; : > "$dir/fifo") >/dev/null 2>&1 &
+writer=$!
+check "fifo with an empty writer" "" true
+wait
+
+# a second fiber waiting on the same fifo is an error, rather than never
+# being woken (which hung)
+cat > "$dir/script.lox" <<LOX
+var fd = open("$dir/fifo");
+fun reader() { return read(fd); }
+var a = spawn(reader);
+var b = spawn(reader);
+print join(a);
+print join(b);
+LOX
+(sleep 1; printf 'late' > "$dir/fifo") >/dev/null 2>&1 &
+writer=$!
+output=$(timeout 10 "$clox" "$dir/script.lox" 2>&1)
+status=$?
+kill "$writer" 2>/dev/null
+wait
+if [ $status -ne 70 ] || [ "${output#Another fiber is already reading file descriptor }" = "$output" ]; then
+  echo "two readers of a fifo (exit $status):"
+  printf '%s\n' "$output" | head -n 5
+  exit 1
+fi
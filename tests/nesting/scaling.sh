@@ -0,0 +1,68 @@
+#!/bin/sh
+# compiling parentheses and unary minus nested 10^4, 10^5 and 10^6 levels
+# deep stops at the nesting limit with one clean error, in time linear in
+# the size of the source. nesting up to a raised limit compiles and runs
+#
+#   sh tests/nesting/scaling.sh build/clox-test
+
+clox=$1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# write print <levels of form> 1; to file (form is paren or minus)
+generate() {
+  awk -v form="$1" -v levels="$2" 'BEGIN {
+    opening = form == "paren" ? "(" : "-"
+    closing = form == "paren" ? ")" : ""
+    printf "print "
+    for (i = 0; i < levels; i++) printf "%s", opening
+    printf "1"
+    for (i = 0; i < levels; i++) printf "%s", closing
+    print ";"
+  }' > "$3"
+}
+
+# microseconds the fastest of three runs took
+elapsed() {
+  best=
+  for run in 1 2 3; do
+    start=$(date +%s%N)
+    "$clox" "$@" > /dev/null 2>&1
+    took=$(( ($(date +%s%N) - start) / 1000 ))
+    if [ -z "$best" ] || [ "$took" -lt "$best" ]; then best=$took; fi
+  done
+  echo "$best"
+}
+
+for form in paren minus; do
+  # within the limit it compiles
+  generate $form 10000 "$dir/within.lox"
+  for mode in "" --optimize; do
+    output=$("$clox" --max-nesting=30000 $mode "$dir/within.lox" 2>&1)
+    if [ "$output" != 1 ]; then
+      echo "$form, 10^4 levels within the limit $mode: $output"
+      exit 1
+    fi
+  done
+
+  # past it there is one error, and ten times the levels take about ten
+  # times as long (quadratic growth would be a hundred)
+  previous=
+  for levels in 10000 100000 1000000; do
+    generate $form $levels "$dir/deep.lox"
+    "$clox" "$dir/deep.lox" > /dev/null 2> "$dir/stderr"
+    status=$?
+    if [ $status -ne 65 ] || [ "$(grep -c 'Code nested too deeply.' "$dir/stderr")" -ne 1 ]; then
+      echo "$form, $levels levels (exit $status):"
+      head -n 5 "$dir/stderr"
+      exit 1
+    fi
+
+    took=$(elapsed "$dir/deep.lox")
+    if [ -n "$previous" ] && [ "$took" -gt $((previous * 25)) ]; then
+      echo "$form: $levels levels took ${took}us, a tenth of them ${previous}us"
+      exit 1
+    fi
+    previous=$took
+  done
+done
@@ -0,0 +1,219 @@
+// number literals converted the way the compiler does (the digits the
+// scanner collected through decimalToDouble(), strtod() for the cases it
+// can't decide) must give exactly the double strtod() gives for the text.
+//
+//   build/number-test [count] [seed]
+//
+// runs every boundary case below and count (default 1000000) random ones.
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+#include "scanner.h"
+
+// longest literal generated: printf's 1100 fraction digits (enough for any
+// subnormal written out in full) after the 309 integer digits of DBL_MAX
+#define LITERAL_MAX 1500
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*, so a failure can be reproduced from its seed
+static uint64_t nextRandom(void) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545f4914f6cdd1dULL;
+}
+
+static int randomBelow(int bound) {
+  return (int) (nextRandom() % (uint64_t) bound);
+}
+
+static long checked = 0;
+static long fellBack = 0;
+static long undecided = 0; // decimalToDouble() gave up on the digits
+static long failures = 0;
+
+// convert text like number() in compiler.c does
+static double convert(const char* text, bool* slow) {
+  Scanner scanner;
+  initScanner(&scanner, text);
+  Token token = scanToken(&scanner);
+  if (token.type != TOKEN_NUMBER || token.length != (int) strlen(text)) {
+    fprintf(stderr, "not scanned as one number: %s\n", text);
+    exit(1);
+  }
+
+  double value;
+  *slow = token.number.truncated;
+  if (!*slow && !decimalToDouble(token.number.mantissa, token.number.exponent, &value)) {
+    undecided++;
+    *slow = true;
+  }
+  if (*slow) value = strtod(text, NULL);
+  return value;
+}
+
+static void check(const char* text) {
+  bool slow;
+  double value = convert(text, &slow);
+  double expected = strtod(text, NULL);
+
+  checked++;
+  if (slow) fellBack++;
+  if (memcmp(&value, &expected, sizeof(double)) != 0) {
+    if (failures++ < 10) {
+      fprintf(stderr, "%s\n  converted to %.17g, strtod gives %.17g\n", text, value, expected);
+    }
+  }
+}
+
+// write x (a non-negative finite value) out in full without an exponent,
+// like a literal has to be. a long double holds every double and the
+// midpoint between two neighbouring doubles exactly, and printf prints
+// them exactly
+static void checkExact(long double x) {
+  char text[LITERAL_MAX];
+  snprintf(text, sizeof(text), "%.1100Lf", x);
+
+  // trailing zeros of the fraction (and a bare point) only make it longer
+  char* end = text + strlen(text);
+  while (end[-1] == '0') end--;
+  if (end[-1] == '.') end--;
+  *end = '\0';
+  check(text);
+
+  // a one just past the last digit is just above a midpoint
+  if (strchr(text, '.') == NULL) strcat(text, ".");
+  strcat(text, "1");
+  check(text);
+}
+
+// random digits with the point somewhere in them, up to zeros zeros after
+// the point or appended to the integer part
+static void checkRandom(int digits, int zeros) {
+  char text[LITERAL_MAX];
+  int length = 0;
+
+  bool fraction = randomBelow(2) == 0;
+  if (fraction) {
+    text[length++] = '0';
+    text[length++] = '.';
+    for (int i = randomBelow(zeros + 1); i > 0; i--) text[length++] = '0';
+    for (int i = 0; i < digits; i++) text[length++] = (char) ('0' + randomBelow(10));
+  } else {
+    text[length++] = (char) ('1' + randomBelow(9));
+    for (int i = 1; i < digits; i++) text[length++] = (char) ('0' + randomBelow(10));
+    for (int i = randomBelow(zeros + 1); i > 0; i--) text[length++] = '0';
+
+    // maybe move part of it past a point
+    int point = randomBelow(length + 1);
+    if (point > 0 && point < length) {
+      memmove(text + point + 1, text + point, (size_t) (length - point));
+      text[point] = '.';
+      length++;
+    }
+  }
+  text[length] = '\0';
+  check(text);
+}
+
+// a random positive finite double, uniform over its bits
+static double randomDouble(void) {
+  for (;;) {
+    uint64_t bits = nextRandom() >> 1;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    if (isfinite(value) && value > 0) return value;
+  }
+}
+
+// a random double between 2^-60 and 2^60 to 17 significant digits, which
+// reads back as itself
+static void checkShortest(void) {
+  double value = ldexp(1.0 + (double) (nextRandom() >> 11) / 9007199254740992.0, randomBelow(121) - 60);
+  int precision = 16 - (int) floor(log10(value));
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", precision < 0 ? 0 : precision, value);
+  check(text);
+}
+
+static const char* boundaries[] = {
+  "0", "0.0", "1", "1.5", "0.1", "0.3", "123456.789",
+  // the largest integers a double holds exactly and the halfway cases past them
+  "9007199254740992", "9007199254740993", "9007199254740994", "9007199254740995",
+  "9007199254740993.0000000000000000001",
+  // 19 and 20 digit mantissas around the 64 bit limit
+  "9999999999999999999", "18446744073709551615", "18446744073709551616",
+  "99999999999999999999", "12345678901234567890", "1234567890123456789.5",
+  "0.1000000000000000055511151231257827021181583404541015625",
+  "0.1000000000000000055511151231257827021181583404541015624",
+  "0.1000000000000000055511151231257827021181583404541015626",
+  // Clinger's fast path limits
+  "10000000000000000000000", "100000000000000000000000", "0.0000000000000000000001",
+  "0.00000000000000000000001",
+  // overflow to infinity
+  "179769313486231570814527423731704356798070567525844996598917476803157260780028538760589558632766878171540458953514382464234321326889464182768467546703537516986049910576551282076245490090389328944075868508455133942304583236903222948165808559332123348274797826204144723168738177180919299881250404026184124858368",
+  "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497791",
+  "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497792",
+  "1000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
+};
+
+int main(int argc, char* argv[]) {
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+  if (argc > 2) state = strtoull(argv[2], NULL, 0) | 1;
+
+  for (size_t i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]); i++) {
+    check(boundaries[i]);
+  }
+
+  // the smallest subnormals, the largest one and the smallest normal, and
+  // powers of two (and so midpoints) over the whole range
+  checkExact(nextafter(0.0, 1.0));
+  checkExact(2 * nextafter(0.0, 1.0));
+  checkExact(nextafter(DBL_MIN, 0.0));
+  checkExact(DBL_MIN);
+  checkExact(DBL_MAX);
+  checkExact((long double) DBL_MAX + ldexpl(1.0L, 970)); // halfway to the next, which is infinity
+  for (int exponent = -1074; exponent <= 1023; exponent++) {
+    double power = ldexp(1.0, exponent);
+    checkExact(power);
+    checkExact(((long double) power + nextafter(power, INFINITY)) / 2);
+    checkExact(((long double) power + nextafter(power, 0.0)) / 2);
+  }
+  // below half the smallest subnormal rounds to 0, halfway to even (0)
+  checkExact((long double) nextafter(0.0, 1.0) / 2);
+
+  for (long i = 0; i < count; i++) {
+    switch (i % 5) {
+      case 0: checkRandom(1 + randomBelow(17), 30); break; // short, the fast paths
+      case 1: checkRandom(19 + randomBelow(2), 40); break; // 19 and 20 digits
+      case 2: checkRandom(1 + randomBelow(40), 340); break; // anything up to the range ends
+      case 3: checkShortest(); break;
+      case 4:
+        // a random double written out in full and the midpoint above it
+        // (every tenth time, they're long)
+        if (i % 50 == 4) {
+          double value = randomDouble();
+          checkExact(value);
+          checkExact(((long double) value + nextafter(value, INFINITY)) / 2);
+        } else {
+          checkRandom(15 + randomBelow(3), 300);
+        }
+        break;
+    }
+  }
+
+  printf("%ld literals checked against strtod, %ld fell back to it "
+         "(%ld too long, %ld undecided), %ld differed\n",
+         checked, fellBack, fellBack - undecided, undecided, failures);
+  if (undecided == 0 || fellBack == undecided) {
+    fprintf(stderr, "the strtod fallback wasn't taken for both reasons\n");
+    return 1;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+# run the tests against an interpreter built without the trace
+#
+#   sh tests/run.sh build/clox-test
+#
+# a .lox test states what it prints in comments, in order:
+#
+#   // expect: <line>                    a line of output
+#   // expect runtime error: <message>   the error it stops with
+#   // args: <options>                   options to run it with
+#
+# .lox tests run from the top of the tree, so paths in them (like scripts
+# for isolate()) start with tests/. scripts in deeper directories are only
+# run by the tests.
+#
+# a .sh test is run with the interpreter as its argument and passes when it
+# exits with 0 (it prints what went wrong otherwise).
+
+clox=${1:-build/clox-test}
+case $clox in
+  /*) ;;
+  *) clox=$(pwd)/$clox ;;
+esac
+cd "$(dirname "$0")/.." || exit 1
+tests=tests
+
+passed=0
+failed=0
+fail() {
+  failed=$((failed + 1))
+  echo "FAIL $1"
+  shift
+  for line in "$@"; do printf '%s\n' "$line" | sed 's/^/     /'; done
+}
+
+stderr=$(mktemp)
+trap 'rm -f "$stderr"' EXIT
+
+for test in "$tests"/*/*.lox; do
+  [ -f "$test" ] || continue
+  expected=$(sed -n 's|.*// expect: ||p' "$test")
+  error=$(sed -n 's|.*// expect runtime error: ||p' "$test")
+  args=$(sed -n 's|.*// args: ||p' "$test")
+
+  # shellcheck disable=SC2086
+  output=$("$clox" $args "$test" 2>"$stderr")
+  status=$?
+
+  if [ "$output" != "$expected" ]; then
+    fail "$test" "expected output:" "$expected" "got:" "$output"
+  elif [ -n "$error" ] && { [ $status -ne 70 ] || [ "$(head -n 1 "$stderr")" != "$error" ]; }; then
+    fail "$test" "expected runtime error: $error" "got (exit $status): $(head -n 1 "$stderr")"
+  elif [ -z "$error" ] && { [ $status -ne 0 ] || [ -s "$stderr" ]; }; then
+    fail "$test" "exit $status" "$(head -n 5 "$stderr")"
+  else
+    passed=$((passed + 1))
+  fi
+done
+
+for test in "$tests"/*/*.sh; do
+  [ -f "$test" ] || continue
+  if output=$(sh "$test" "$clox" 2>&1); then
+    passed=$((passed + 1))
+  else
+    fail "$test" "$output"
+  fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
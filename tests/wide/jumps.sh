@@ -0,0 +1,81 @@
+#!/bin/sh
+# generated scripts whose jumps and loops cross more than 64KB of code, and
+# a function with millions of number literals (past the 8, 16 and 24 bit
+# constant operands)
+#
+#   sh tests/wide/jumps.sh build/clox-test
+
+clox=$1
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+# run the script, its output must be the lines given
+check() {
+  output=$("$clox" "$script" 2>&1)
+  status=$?
+  expected=$(printf '%s\n' "$@")
+  if [ $status -ne 0 ] || [ "$output" != "$expected" ]; then
+    echo "$1 (exit $status)"
+    printf '%s\n' "$output" | head -n 5
+    exit 1
+  fi
+}
+
+# if and else bodies, and and/or operands, of about 200KB each
+awk 'BEGIN {
+  print "var taken = 0;"
+  for (branch = 0; branch < 2; branch++) {
+    print "if (" (branch == 0 ? "true" : "false") ") {"
+    print "  var x = 0;"
+    for (i = 0; i < 25000; i++) print "  x = x + 1;"
+    print "  taken = taken + x;"
+    print "} else {"
+    print "  var y = 0;"
+    for (i = 0; i < 25000; i++) print "  y = y + 2;"
+    print "  taken = taken + y;"
+    print "}"
+  }
+  print "print taken;"
+  for (op = 0; op < 2; op++) {
+    printf "print %s %s (0", op == 0 ? "false and" : "true or", ""
+    for (i = 0; i < 40000; i++) printf " + %d", i
+    print ");"
+  }
+}' > "$script"
+check 75000 false true
+
+# a while and a for loop, each with a body of about 200KB, run a few times
+awk 'BEGIN {
+  print "var n = 0;"
+  print "var total = 0;"
+  print "while (n < 3) {"
+  print "  var x = 0;"
+  for (i = 0; i < 25000; i++) print "  x = x + 1;"
+  print "  total = total + x;"
+  print "  n = n + 1;"
+  print "}"
+  print "for (var i = 0; i < 4; i = i + 1) {"
+  print "  if (i != 2) {"
+  print "    var y = 0;"
+  for (i = 0; i < 25000; i++) print "    y = y + 1;"
+  print "    total = total + y;"
+  print "  }"
+  print "}"
+  print "print total;"
+}' > "$script"
+check 150000
+
+# 2,000,000 distinct literals in a loop body of about 18MB, run twice
+awk 'BEGIN {
+  print "fun sum() {"
+  print "  var s = 0;"
+  print "  var round = 0;"
+  print "  while (round < 2) {"
+  for (i = 1; i <= 2000000; i++) print "    s = s + " i ";"
+  print "    round = round + 1;"
+  print "  }"
+  print "  return s;"
+  print "}"
+  print "print sum() == 4000002000000;"
+}' > "$script"
+check true